@@ -0,0 +1,229 @@
+/**
+ ******************************************************************************
+ * @file      json_lookup_bench.c
+ * @brief     Host benchmark: reads the values the firmware needs out of the
+ *            payloads it receives, with json_lookup (main/json_lookup.c) and
+ *            with cJSON, which it replaced. Both must find the same values.
+ *            Prints the time and the heap calls per payload:
+ *              json_lookup_bench [-n iterations]
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cJSON.h"
+#include "json_lookup.h"
+
+#define BENCH_MAX_TOKENS 128
+#define BENCH_MAX_PATH 4
+#define BENCH_MAX_LOOKUPS 4
+#define BENCH_STRING_LEN 256
+
+typedef enum {
+  BENCH_STRING,
+  BENCH_BOOL,
+  BENCH_UINT32,
+} bench_type_t;
+
+typedef struct {
+  bench_type_t type;
+  const char *path[BENCH_MAX_PATH];
+} bench_lookup_t;
+
+typedef struct {
+  const char *name;
+  const char *json;
+  bench_lookup_t lookups[BENCH_MAX_LOOKUPS];
+} bench_payload_t;
+
+/* What arrives on the OTA and command topics and from the shadow */
+static const bench_payload_t payloads[] = {
+    {"OTA command",
+     "{\"ota_url\":\"https://github.com/deanprince/smart-power-strip/"
+     "releases/download/v1.4.2/smart_power_strip.bin.gz\"}",
+     {{BENCH_STRING, {"ota_url"}}}},
+    {"scene command",
+     "{\"scene\":{\"mask\":15,\"state\":5}}",
+     {{BENCH_UINT32, {"scene", "mask"}}, {BENCH_UINT32, {"scene", "state"}}}},
+    {"shadow delta",
+     "{\"version\":1042,\"timestamp\":1700000000,\"state\":{\"relay_1\":true,"
+     "\"relay_3\":false},\"metadata\":{\"relay_1\":{\"timestamp\":"
+     "1700000000},\"relay_3\":{\"timestamp\":1700000000}}}",
+     {{BENCH_UINT32, {"version"}},
+      {BENCH_BOOL, {"state", "relay_1"}},
+      {BENCH_BOOL, {"state", "relay_3"}}}},
+    {"shadow get, 4 relays",
+     "{\"state\":{\"desired\":{\"relay_1\":true,\"relay_2\":false,"
+     "\"relay_3\":true,\"relay_4\":false},\"reported\":{\"relay_1\":true,"
+     "\"relay_2\":false,\"relay_3\":false,\"relay_4\":false},\"delta\":{"
+     "\"relay_3\":true}},\"metadata\":{\"desired\":{\"relay_1\":{"
+     "\"timestamp\":1700000000},\"relay_2\":{\"timestamp\":1700000000},"
+     "\"relay_3\":{\"timestamp\":1700000300},\"relay_4\":{\"timestamp\":"
+     "1700000000}},\"reported\":{\"relay_1\":{\"timestamp\":1700000000},"
+     "\"relay_2\":{\"timestamp\":1700000000},\"relay_3\":{\"timestamp\":"
+     "1700000000},\"relay_4\":{\"timestamp\":1700000000}}},\"version\":1043,"
+     "\"timestamp\":1700000301}",
+     {{BENCH_UINT32, {"version"}},
+      {BENCH_BOOL, {"state", "delta", "relay_3"}},
+      {BENCH_BOOL, {"state", "reported", "relay_3"}},
+      {BENCH_BOOL, {"state", "desired", "relay_4"}}}},
+};
+
+/* Heap calls made by cJSON, through its hooks */
+static unsigned long heap_calls;
+
+static void *bench_malloc(size_t size) {
+  heap_calls++;
+  return malloc(size);
+}
+
+static void bench_free(void *p) {
+  heap_calls++;
+  free(p);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* One value, as text, whichever parser found it */
+typedef struct {
+  bool found;
+  char text[BENCH_STRING_LEN];
+} bench_value_t;
+
+static void bench_json_lookup(const bench_payload_t *payload,
+                              bench_value_t *values) {
+  static jsmntok_t tokens[BENCH_MAX_TOKENS];
+  json_lookup_t doc;
+
+  memset(values, 0, sizeof(bench_value_t) * BENCH_MAX_LOOKUPS);
+  if (json_lookup_parse_tokens(&doc, tokens, BENCH_MAX_TOKENS, payload->json,
+                               strlen(payload->json)) != ESP_OK) {
+    return;
+  }
+  for (int i = 0; i < BENCH_MAX_LOOKUPS; i++) {
+    const bench_lookup_t *lookup = &payload->lookups[i];
+    int token = JSON_LOOKUP_ROOT;
+    bool flag;
+    uint32_t number;
+
+    for (int p = 0; p < BENCH_MAX_PATH && lookup->path[p] != NULL; p++) {
+      token = json_lookup_find(&doc, token, lookup->path[p]);
+    }
+    if (lookup->path[0] == NULL || token < 0) {
+      continue;
+    }
+    if (lookup->type == BENCH_STRING) {
+      values[i].found = json_lookup_string(&doc, token, values[i].text,
+                                           sizeof(values[i].text)) == ESP_OK;
+    } else if (lookup->type == BENCH_BOOL) {
+      values[i].found = json_lookup_bool(&doc, token, &flag) == ESP_OK;
+      strcpy(values[i].text, flag ? "true" : "false");
+    } else {
+      values[i].found = json_lookup_uint32(&doc, token, &number) == ESP_OK;
+      snprintf(values[i].text, sizeof(values[i].text), "%u",
+               (unsigned)number);
+    }
+  }
+}
+
+static void bench_cjson(const bench_payload_t *payload,
+                        bench_value_t *values) {
+  memset(values, 0, sizeof(bench_value_t) * BENCH_MAX_LOOKUPS);
+  cJSON *root = cJSON_ParseWithLength(payload->json, strlen(payload->json));
+  if (root == NULL) {
+    return;
+  }
+  for (int i = 0; i < BENCH_MAX_LOOKUPS; i++) {
+    const bench_lookup_t *lookup = &payload->lookups[i];
+    const cJSON *item = root;
+
+    for (int p = 0; p < BENCH_MAX_PATH && lookup->path[p] != NULL; p++) {
+      item = cJSON_GetObjectItemCaseSensitive(item, lookup->path[p]);
+    }
+    if (lookup->path[0] == NULL || item == NULL) {
+      continue;
+    }
+    if (lookup->type == BENCH_STRING && cJSON_IsString(item)) {
+      values[i].found = true;
+      snprintf(values[i].text, sizeof(values[i].text), "%s",
+               item->valuestring);
+    } else if (lookup->type == BENCH_BOOL && cJSON_IsBool(item)) {
+      values[i].found = true;
+      strcpy(values[i].text, cJSON_IsTrue(item) ? "true" : "false");
+    } else if (lookup->type == BENCH_UINT32 && cJSON_IsNumber(item)) {
+      values[i].found = true;
+      snprintf(values[i].text, sizeof(values[i].text), "%u",
+               (unsigned)item->valuedouble);
+    }
+  }
+  cJSON_Delete(root);
+}
+
+int main(int argc, char **argv) {
+  cJSON_Hooks hooks = {.malloc_fn = bench_malloc, .free_fn = bench_free};
+  unsigned iterations = 200000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt != 'n') {
+      fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+      return 2;
+    }
+    iterations = (unsigned)strtoul(optarg, NULL, 0);
+  }
+  if (iterations == 0) {
+    iterations = 1;
+  }
+  cJSON_InitHooks(&hooks);
+
+  int mismatches = 0;
+  printf("%-24s %12s %12s %8s %12s\n", "ns per payload", "json_lookup",
+         "cJSON", "speedup", "cJSON heap");
+  for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+    const bench_payload_t *payload = &payloads[p];
+    bench_value_t ours[BENCH_MAX_LOOKUPS];
+    bench_value_t theirs[BENCH_MAX_LOOKUPS];
+
+    bench_json_lookup(payload, ours);
+    bench_cjson(payload, theirs);
+    for (int i = 0; i < BENCH_MAX_LOOKUPS; i++) {
+      if (payload->lookups[i].path[0] != NULL &&
+          (!ours[i].found || !theirs[i].found ||
+           strcmp(ours[i].text, theirs[i].text) != 0)) {
+        fprintf(stderr, "%s: %s: json_lookup %s, cJSON %s\n", payload->name,
+                payload->lookups[i].path[0],
+                ours[i].found ? ours[i].text : "(none)",
+                theirs[i].found ? theirs[i].text : "(none)");
+        mismatches++;
+      }
+    }
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < iterations; i++) {
+      bench_json_lookup(payload, ours);
+    }
+    double ours_ns = (double)(now_ns() - start) / iterations;
+
+    heap_calls = 0;
+    start = now_ns();
+    for (unsigned i = 0; i < iterations; i++) {
+      bench_cjson(payload, theirs);
+    }
+    double theirs_ns = (double)(now_ns() - start) / iterations;
+
+    printf("%-24s %12.1f %12.1f %7.2fx %12.1f\n", payload->name, ours_ns,
+           theirs_ns, theirs_ns / ours_ns, (double)heap_calls / iterations);
+  }
+  return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,212 @@
+/**
+ ******************************************************************************
+ * @file      json_lookup_fuzz.c
+ * @brief     Fuzz target for main/json_lookup.c. Every document the
+ *            tokenizer accepts is walked member by member: tokens must lie
+ *            inside the input, skipping must move forward, and the value
+ *            readers must not read past their token. Built with cJSON, the
+ *            values json_lookup returns are also checked against cJSON's.
+ *            A mismatch aborts.
+ *
+ *            With -DSIM_FUZZ=ON (clang) this is a libFuzzer target:
+ *              json_lookup_fuzz -max_len=1024 corpus/
+ *            Otherwise it runs each file given, or stdin, once, which
+ *            replays a corpus and serves as an AFL harness:
+ *              afl-fuzz -i host/bench/json_corpus -o out -- json_lookup_fuzz @@
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_lookup.h"
+
+#if HAVE_CJSON
+#include "cJSON.h"
+#endif
+
+#define FUZZ_MAX_TOKENS 256
+#define FUZZ_MAX_KEY_LEN 64
+#define FUZZ_STRING_LEN 256
+
+#define FUZZ_CHECK(cond)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      abort();                                                                 \
+    }                                                                          \
+  } while (0)
+
+static jsmntok_t tokens[FUZZ_MAX_TOKENS];
+
+/**
+ * @brief Copies a key token out as a C string, if it is one json_lookup_find
+ * can be asked for: no escapes or NUL, which it compares raw.
+ */
+static bool fuzz_key(const json_lookup_t *doc, int token, char *key) {
+  const jsmntok_t *name = &doc->tokens[token];
+  size_t len = (size_t)(name->end - name->start);
+
+  if (name->type != JSMN_STRING || len >= FUZZ_MAX_KEY_LEN) {
+    return false;
+  }
+  memcpy(key, doc->json + name->start, len);
+  key[len] = '\0';
+  return strlen(key) == len && strchr(key, '\\') == NULL;
+}
+
+/**
+ * @brief Reads a value with every reader; they may refuse it but must stay
+ * inside its token and leave a terminated string.
+ */
+static void fuzz_read_value(const json_lookup_t *doc, int value) {
+  char buf[FUZZ_STRING_LEN];
+  bool flag;
+  uint32_t number;
+
+  memset(buf, 'x', sizeof(buf));
+  if (json_lookup_string(doc, value, buf, sizeof(buf)) == ESP_OK) {
+    FUZZ_CHECK(memchr(buf, '\0', sizeof(buf)) != NULL);
+  }
+  if (json_lookup_bool(doc, value, &flag) == ESP_OK) {
+    int len = doc->tokens[value].end - doc->tokens[value].start;
+    FUZZ_CHECK(len == (flag ? 4 : 5));
+  }
+  json_lookup_uint32(doc, value, &number);
+}
+
+#if HAVE_CJSON
+/**
+ * @brief The value json_lookup found for key against the one cJSON found.
+ * Only what json_lookup accepts is compared; it may refuse more than cJSON
+ * does (numbers that aren't plain unsigned integers, \u0000).
+ */
+static void fuzz_compare(const json_lookup_t *doc, int value,
+                         const cJSON *item) {
+  char buf[FUZZ_STRING_LEN];
+  bool flag;
+  uint32_t number;
+
+  FUZZ_CHECK(item != NULL);
+  if (json_lookup_string(doc, value, buf, sizeof(buf)) == ESP_OK) {
+    FUZZ_CHECK(cJSON_IsString(item));
+    FUZZ_CHECK(strcmp(buf, item->valuestring) == 0);
+  }
+  if (json_lookup_bool(doc, value, &flag) == ESP_OK) {
+    FUZZ_CHECK(cJSON_IsBool(item));
+    FUZZ_CHECK(flag == (bool)cJSON_IsTrue(item));
+  } else {
+    FUZZ_CHECK(!cJSON_IsBool(item));
+  }
+  if (json_lookup_uint32(doc, value, &number) == ESP_OK) {
+    FUZZ_CHECK(cJSON_IsNumber(item));
+    FUZZ_CHECK(item->valuedouble == (double)number);
+  }
+}
+#endif
+
+/**
+ * @brief Walks the members of the object at token, and of every object
+ * nested in it.
+ */
+static void fuzz_walk(const json_lookup_t *doc, int object, const void *ref,
+                      int depth) {
+  const jsmntok_t *parent = &doc->tokens[object];
+  int token = object + 1;
+
+  for (int i = 0; i < parent->size && token + 1 < doc->count; i++) {
+    char key[FUZZ_MAX_KEY_LEN];
+    int value = token + 1;
+    int next = json_lookup_skip(doc, value);
+
+    FUZZ_CHECK(next > value && next <= doc->count);
+    fuzz_read_value(doc, value);
+
+    if (!fuzz_key(doc, token, key)) {
+      /* cJSON matches decoded names, json_lookup raw ones: past this key
+       * the two may pick different members */
+      ref = NULL;
+      token = next;
+      continue;
+    }
+    /* The first member of that name wins, as in cJSON */
+    int found = json_lookup_find(doc, object, key);
+    FUZZ_CHECK(found > object && found <= value);
+
+    const void *child = NULL;
+#if HAVE_CJSON
+    if (ref != NULL && found == value) {
+      const cJSON *item = cJSON_GetObjectItemCaseSensitive(ref, key);
+      fuzz_compare(doc, value, item);
+      child = cJSON_IsObject(item) ? item : NULL;
+    }
+#endif
+    if (doc->tokens[value].type == JSMN_OBJECT && depth < 8) {
+      fuzz_walk(doc, value, child, depth + 1);
+    }
+    token = next;
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  json_lookup_t doc;
+
+  if (json_lookup_parse_tokens(&doc, tokens, FUZZ_MAX_TOKENS,
+                               (const char *)data, size) != ESP_OK) {
+    return 0;
+  }
+  for (int i = 0; i < doc.count; i++) {
+    FUZZ_CHECK(doc.tokens[i].start >= 0 &&
+               doc.tokens[i].start <= doc.tokens[i].end &&
+               (size_t)doc.tokens[i].end <= size);
+  }
+
+  const void *ref = NULL;
+#if HAVE_CJSON
+  cJSON *root = cJSON_ParseWithLength((const char *)data, size);
+  ref = cJSON_IsObject(root) ? root : NULL;
+#endif
+  fuzz_walk(&doc, JSON_LOOKUP_ROOT, ref, 0);
+#if HAVE_CJSON
+  cJSON_Delete(root);
+#endif
+  return 0;
+}
+
+#if !SIM_FUZZ
+static int fuzz_file(FILE *file, const char *name) {
+  static uint8_t data[1 << 16];
+  size_t size = fread(data, 1, sizeof(data), file);
+
+  if (ferror(file)) {
+    perror(name);
+    return 1;
+  }
+  LLVMFuzzerTestOneInput(data, size);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int failed = 0;
+
+  if (argc < 2) {
+    return fuzz_file(stdin, "stdin");
+  }
+  for (int i = 1; i < argc; i++) {
+    FILE *file = fopen(argv[i], "rb");
+    if (file == NULL) {
+      perror(argv[i]);
+      failed = 1;
+      continue;
+    }
+    failed |= fuzz_file(file, argv[i]);
+    fclose(file);
+  }
+  printf("%d inputs\n", argc - 1);
+  return failed;
+}
+#endif
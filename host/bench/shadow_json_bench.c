@@ -0,0 +1,234 @@
+/**
+ ******************************************************************************
+ * @file      shadow_json_bench.c
+ * @brief     Host benchmark: builds shadow update documents with the old
+ *            snprintf/strlen generate_json_object() (shadow_json_old.c) and
+ *            the current cursor based one (main/aws_custom_utils.c), and
+ *            patches the template the firmware publishes from, on payloads
+ *            the strip sends. Checks that old and new produce the same
+ *            bytes, then prints the time per document:
+ *              shadow_json_bench [-n iterations]
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aws_custom_utils.h"
+#include "aws_iot_shadow_json.h"
+#include "shadow_json_old.h"
+
+#define BENCH_MAX_FIELDS 16
+#define BENCH_DOC_PREFIX "{\"state\":{"
+
+typedef IoT_Error_t (*bench_add_t)(char *, size_t, uint8_t, jsonStruct_t **);
+
+typedef struct {
+  const char *name;
+  uint8_t reported_count;
+  uint8_t desired_count;
+  jsonStruct_t fields[BENCH_MAX_FIELDS];
+} bench_payload_t;
+
+static bool relay[BENCH_MAX_FIELDS];
+static uint32_t uptime_s = 86400 * 12 + 3600 * 5 + 17;
+static int32_t rssi = -67;
+static uint16_t reconnects = 3;
+static uint8_t outlets_on = 2;
+static char firmware[] = "1.4.2";
+
+/* What a delta ack, a switch storm report and a status report look like */
+static bench_payload_t payloads[] = {
+    {"4 relays, reported and desired",
+     4,
+     4,
+     {
+         {"relay_1", &relay[0], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_2", &relay[1], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_3", &relay[2], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_4", &relay[3], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+     }},
+    {"16 relays, reported",
+     16,
+     0,
+     {
+         {"relay_1", &relay[0], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_2", &relay[1], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_3", &relay[2], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_4", &relay[3], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_5", &relay[4], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_6", &relay[5], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_7", &relay[6], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_8", &relay[7], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_9", &relay[8], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_10", &relay[9], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_11", &relay[10], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_12", &relay[11], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_13", &relay[12], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_14", &relay[13], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_15", &relay[14], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"relay_16", &relay[15], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+     }},
+    {"status, mixed types, reported",
+     6,
+     0,
+     {
+         {"uptime", &uptime_s, sizeof(uptime_s), SHADOW_JSON_UINT32, NULL},
+         {"rssi", &rssi, sizeof(rssi), SHADOW_JSON_INT32, NULL},
+         {"reconnects", &reconnects, sizeof(reconnects), SHADOW_JSON_UINT16,
+          NULL},
+         {"outlets_on", &outlets_on, sizeof(outlets_on), SHADOW_JSON_UINT8,
+          NULL},
+         {"relay_1", &relay[0], sizeof(bool), SHADOW_JSON_BOOL, NULL},
+         {"firmware", firmware, sizeof(firmware), SHADOW_JSON_STRING, NULL},
+     }},
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Builds the state part of an update the way device_shadow.c did
+ * before templates: reported, then desired, into a document that already
+ * holds the opening braces.
+ */
+static IoT_Error_t bench_build(const bench_payload_t *payload,
+                               bench_add_t add_reported,
+                               bench_add_t add_desired, char *doc,
+                               size_t size) {
+  jsonStruct_t *handlers[BENCH_MAX_FIELDS];
+  IoT_Error_t rc = SUCCESS;
+
+  for (int i = 0; i < BENCH_MAX_FIELDS; i++) {
+    handlers[i] = (jsonStruct_t *)&payload->fields[i];
+  }
+  memcpy(doc, BENCH_DOC_PREFIX, sizeof(BENCH_DOC_PREFIX));
+  if (payload->reported_count > 0) {
+    rc = add_reported(doc, size, payload->reported_count, handlers);
+  }
+  /* Desired repeats the first fields, as a delta ack does */
+  if (rc == SUCCESS && payload->desired_count > 0) {
+    rc = add_desired(doc, size, payload->desired_count, handlers);
+  }
+  return rc;
+}
+
+/* Changes a value between documents, as consecutive updates do */
+static void bench_step(unsigned i) {
+  relay[i % BENCH_MAX_FIELDS] = !relay[i % BENCH_MAX_FIELDS];
+  uptime_s++;
+}
+
+static double bench_run(const bench_payload_t *payload,
+                        bench_add_t add_reported, bench_add_t add_desired,
+                        unsigned iterations) {
+  char doc[AWS_IOT_MQTT_TX_BUF_LEN];
+  uint64_t start = now_ns();
+
+  for (unsigned i = 0; i < iterations; i++) {
+    bench_step(i);
+    if (bench_build(payload, add_reported, add_desired, doc, sizeof(doc)) !=
+        SUCCESS) {
+      fprintf(stderr, "%s: document does not fit\n", payload->name);
+      exit(1);
+    }
+  }
+  return (double)(now_ns() - start) / iterations;
+}
+
+/**
+ * @brief Patches a template built once, which is what the firmware does for
+ * every update now; includes the client token the others leave out.
+ */
+static double bench_template(const bench_payload_t *payload,
+                             unsigned iterations) {
+  static char doc[AWS_IOT_MQTT_TX_BUF_LEN];
+  jsonStruct_t *handlers[BENCH_MAX_FIELDS];
+  shadow_template_t tmpl;
+
+  for (int i = 0; i < BENCH_MAX_FIELDS; i++) {
+    handlers[i] = (jsonStruct_t *)&payload->fields[i];
+  }
+  if (custom_aws_iot_shadow_template_build(
+          &tmpl, doc, sizeof(doc), payload->reported_count, handlers,
+          payload->desired_count, handlers) != SUCCESS) {
+    return 0;
+  }
+
+  uint64_t start = now_ns();
+  for (unsigned i = 0; i < iterations; i++) {
+    bench_step(i);
+    if (custom_aws_iot_shadow_template_patch(&tmpl) != SUCCESS) {
+      fprintf(stderr, "%s: template patch failed\n", payload->name);
+      exit(1);
+    }
+  }
+  return (double)(now_ns() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+  unsigned iterations = 200000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt != 'n') {
+      fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+      return 2;
+    }
+    iterations = (unsigned)strtoul(optarg, NULL, 0);
+  }
+  if (iterations == 0) {
+    iterations = 1;
+  }
+
+  int mismatches = 0;
+  printf("%-32s %10s %10s %8s %10s\n", "ns per document", "old", "new",
+         "speedup", "template");
+  for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+    const bench_payload_t *payload = &payloads[p];
+    char old_doc[AWS_IOT_MQTT_TX_BUF_LEN];
+    char new_doc[AWS_IOT_MQTT_TX_BUF_LEN];
+
+    /* Both writers have to agree byte for byte before timing means much */
+    for (unsigned i = 0; i < BENCH_MAX_FIELDS; i++) {
+      bench_step(i);
+      IoT_Error_t old_rc = bench_build(
+          payload, old_custom_aws_iot_shadow_add_reported,
+          old_custom_aws_iot_shadow_add_desired, old_doc, sizeof(old_doc));
+      IoT_Error_t new_rc = bench_build(
+          payload, custom_aws_iot_shadow_add_reported,
+          custom_aws_iot_shadow_add_desired, new_doc, sizeof(new_doc));
+      if (old_rc != new_rc || strcmp(old_doc, new_doc) != 0) {
+        fprintf(stderr, "%s: old %d %s\n%s: new %d %s\n", payload->name,
+                old_rc, old_doc, payload->name, new_rc, new_doc);
+        mismatches++;
+        break;
+      }
+    }
+
+    double old_ns = bench_run(payload, old_custom_aws_iot_shadow_add_reported,
+                              old_custom_aws_iot_shadow_add_desired,
+                              iterations);
+    double new_ns = bench_run(payload, custom_aws_iot_shadow_add_reported,
+                              custom_aws_iot_shadow_add_desired, iterations);
+    double template_ns = bench_template(payload, iterations);
+    printf("%-32s %10.1f %10.1f %7.2fx ", payload->name, old_ns, new_ns,
+           old_ns / new_ns);
+    /* Templates only take fixed width values, no strings */
+    if (template_ns > 0) {
+      printf("%10.1f\n", template_ns);
+    } else {
+      printf("%10s\n", "-");
+    }
+  }
+  return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "aws_custom_utils.h"
+
+IoT_Error_t old_custom_aws_iot_shadow_add_desired(char *pJsonDocument,
+                        size_t maxSizeOfJsonDocument,
+                        uint8_t count,
+                        jsonStruct_t **handler);
+IoT_Error_t old_custom_aws_iot_shadow_add_reported(char *pJsonDocument,
+                        size_t maxSizeOfJsonDocument,
+                        uint8_t count,
+                        jsonStruct_t **handler);
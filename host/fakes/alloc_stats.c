@@ -0,0 +1,56 @@
+/**
+ ******************************************************************************
+ * @file      alloc_stats.c
+ * @brief     Host simulation: heap accounting. The firmware and SDK objects
+ *            are linked with --wrap for malloc, calloc, realloc and free, so
+ *            every allocation they make is counted here before reaching the
+ *            real allocator (or the sanitizer's).
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sim.h"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static atomic_uint_fast64_t alloc_calls;
+static atomic_uint_fast64_t alloc_bytes;
+static atomic_uint_fast64_t free_calls;
+
+void *__wrap_malloc(size_t size) {
+  atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&alloc_bytes, nmemb * size, memory_order_relaxed);
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+  if (ptr != NULL) {
+    atomic_fetch_add_explicit(&free_calls, 1, memory_order_relaxed);
+  }
+  __real_free(ptr);
+}
+
+void sim_alloc_stats(sim_alloc_stats_t *stats) {
+  stats->alloc_calls = atomic_load(&alloc_calls);
+  stats->alloc_bytes = atomic_load(&alloc_bytes);
+  stats->free_calls = atomic_load(&free_calls);
+}
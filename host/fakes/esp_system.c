@@ -0,0 +1,98 @@
+/**
+ ******************************************************************************
+ * @file      esp_system.c
+ * @brief     Host simulation: logging, error names and system calls
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_app_desc.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TAG "sim"
+
+static const esp_app_desc_t app_desc = {
+    .magic_word = 0xABCD5432,
+    .version = "host-sim",
+    .project_name = "drivers",
+};
+
+/**
+ * @brief Prints a line in the same "L (ticks) TAG: message" shape as the
+ * target's console, one line at a time across threads.
+ */
+void sim_log_write(char level, const char *tag, const char *format, ...) {
+  va_list args;
+
+  flockfile(stdout);
+  printf("%c (%u) %s: ", level, (unsigned)xTaskGetTickCount(), tag);
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  putchar('\n');
+  funlockfile(stdout);
+  fflush(stdout);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:
+    return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NOT_SUPPORTED:
+    return "ESP_ERR_NOT_SUPPORTED";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_NVS_NOT_FOUND:
+    return "ESP_ERR_NVS_NOT_FOUND";
+  case ESP_ERR_NVS_READ_ONLY:
+    return "ESP_ERR_NVS_READ_ONLY";
+  case ESP_ERR_NVS_NOT_ENOUGH_SPACE:
+    return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+  case ESP_ERR_NVS_INVALID_NAME:
+    return "ESP_ERR_NVS_INVALID_NAME";
+  case ESP_ERR_NVS_INVALID_HANDLE:
+    return "ESP_ERR_NVS_INVALID_HANDLE";
+  case ESP_ERR_NVS_KEY_TOO_LONG:
+    return "ESP_ERR_NVS_KEY_TOO_LONG";
+  case ESP_ERR_NVS_INVALID_LENGTH:
+    return "ESP_ERR_NVS_INVALID_LENGTH";
+  case ESP_ERR_INVALID_RESPONSE:
+    return "ESP_ERR_INVALID_RESPONSE";
+  case ESP_ERR_INVALID_CRC:
+    return "ESP_ERR_INVALID_CRC";
+  case ESP_ERR_OTA_VALIDATE_FAILED:
+    return "ESP_ERR_OTA_VALIDATE_FAILED";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
+
+void esp_restart(void) {
+  ESP_LOGW(TAG, "esp_restart() called, ending the simulation");
+  exit(0);
+}
+
+uint32_t esp_get_free_heap_size(void) { return UINT32_MAX; }
+
+const esp_app_desc_t *esp_app_get_description(void) { return &app_desc; }
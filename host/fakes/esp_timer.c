@@ -0,0 +1,176 @@
+/**
+ ******************************************************************************
+ * @file      esp_timer.c
+ * @brief     Host simulation: high resolution timer and its callback task
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_timer.h"
+
+struct esp_timer {
+  esp_timer_cb_t callback;
+  void *arg;
+  const char *name;
+
+  bool armed;
+  int64_t alarm_us;
+  uint64_t period_us;
+  struct esp_timer *next;
+};
+
+static int64_t boot_us;
+
+/* Every timer, armed or not; the dispatcher scans them for the earliest */
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timers_cond;
+static struct esp_timer *timers;
+static pthread_once_t dispatcher_once = PTHREAD_ONCE_INIT;
+
+static int64_t monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+__attribute__((constructor)) static void esp_timer_boot(void) {
+  boot_us = monotonic_us();
+}
+
+int64_t esp_timer_get_time(void) { return monotonic_us() - boot_us; }
+
+/**
+ * @brief Runs due callbacks without the lock held, so they may start or
+ * stop timers, their own included.
+ */
+static void *esp_timer_dispatcher(void *arg) {
+  pthread_setname_np(pthread_self(), "esp_timer");
+  pthread_mutex_lock(&timers_lock);
+  for (;;) {
+    struct esp_timer *due = NULL;
+    for (struct esp_timer *timer = timers; timer != NULL; timer = timer->next) {
+      if (timer->armed && (due == NULL || timer->alarm_us < due->alarm_us)) {
+        due = timer;
+      }
+    }
+
+    if (due == NULL) {
+      pthread_cond_wait(&timers_cond, &timers_lock);
+      continue;
+    }
+    int64_t now = esp_timer_get_time();
+    if (due->alarm_us > now) {
+      int64_t wake = boot_us + due->alarm_us;
+      struct timespec deadline = {.tv_sec = wake / 1000000,
+                                  .tv_nsec = (wake % 1000000) * 1000};
+      pthread_cond_timedwait(&timers_cond, &timers_lock, &deadline);
+      continue;
+    }
+
+    if (due->period_us != 0) {
+      due->alarm_us += due->period_us;
+    } else {
+      due->armed = false;
+    }
+    esp_timer_cb_t callback = due->callback;
+    void *callback_arg = due->arg;
+    pthread_mutex_unlock(&timers_lock);
+    callback(callback_arg);
+    pthread_mutex_lock(&timers_lock);
+  }
+  return NULL;
+}
+
+static void esp_timer_init_dispatcher(void) {
+  pthread_condattr_t attr;
+  pthread_t thread;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timers_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_create(&thread, NULL, esp_timer_dispatcher, NULL);
+  pthread_detach(thread);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *out_handle) {
+  if (args == NULL || args->callback == NULL || out_handle == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  struct esp_timer *timer = calloc(1, sizeof(*timer));
+  if (timer == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  timer->callback = args->callback;
+  timer->arg = args->arg;
+  timer->name = args->name;
+
+  pthread_once(&dispatcher_once, esp_timer_init_dispatcher);
+  pthread_mutex_lock(&timers_lock);
+  timer->next = timers;
+  timers = timer;
+  pthread_mutex_unlock(&timers_lock);
+  *out_handle = timer;
+  return ESP_OK;
+}
+
+static esp_err_t esp_timer_arm(esp_timer_handle_t timer, uint64_t timeout_us,
+                               uint64_t period_us) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&timers_lock);
+  if (timer->armed) {
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    timer->armed = true;
+    timer->alarm_us = esp_timer_get_time() + (int64_t)timeout_us;
+    timer->period_us = period_us;
+    pthread_cond_signal(&timers_cond);
+  }
+  pthread_mutex_unlock(&timers_lock);
+  return err;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  return esp_timer_arm(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+  return esp_timer_arm(timer, period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&timers_lock);
+  if (!timer->armed) {
+    err = ESP_ERR_INVALID_STATE;
+  }
+  timer->armed = false;
+  pthread_mutex_unlock(&timers_lock);
+  return err;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+  pthread_mutex_lock(&timers_lock);
+  if (timer->armed) {
+    pthread_mutex_unlock(&timers_lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+  for (struct esp_timer **link = &timers; *link != NULL;
+       link = &(*link)->next) {
+    if (*link == timer) {
+      *link = timer->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&timers_lock);
+  free(timer);
+  return ESP_OK;
+}
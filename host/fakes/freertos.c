@@ -0,0 +1,469 @@
+/**
+ ******************************************************************************
+ * @file      freertos.c
+ * @brief     Host simulation: FreeRTOS tasks, notifications, event groups,
+ *            queues and mutexes on top of pthreads. Every task runs as a real thread, so the
+ *            firmware's locking and wake-ups are exercised under the same
+ *            races the scheduler allows on the target.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct sim_task {
+  pthread_t thread;
+  TaskFunction_t entry;
+  void *arg;
+  char name[16];
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notify_value;
+  bool notify_pending;
+  /* Deleted tasks stay listed, see vTaskDelete() */
+  struct sim_task *next_deleted;
+};
+
+struct sim_event_group {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  EventBits_t bits;
+};
+
+struct sim_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+  uint8_t *items;
+};
+
+struct sim_semaphore {
+  pthread_mutex_t lock;
+};
+
+/* Task running on the calling thread; created on demand for app_main */
+static __thread struct sim_task *current_task;
+static pthread_mutex_t deleted_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_task *deleted_tasks;
+
+/* Ticks count from process start, as they count from boot on the target */
+static uint64_t boot_ms;
+
+static uint64_t sim_monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+__attribute__((constructor)) static void sim_boot(void) {
+  boot_ms = sim_monotonic_ms();
+}
+
+/**
+ * @brief Initializes a condition variable that times out on the monotonic
+ * clock, the same clock ticks are counted on.
+ */
+static void sim_cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/**
+ * @brief Turns a tick timeout into an absolute monotonic deadline.
+ */
+static struct timespec sim_deadline(TickType_t ticks) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t ns = (uint64_t)ts.tv_nsec +
+                (uint64_t)ticks * (1000000000ULL / configTICK_RATE_HZ);
+  ts.tv_sec += ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  return ts;
+}
+
+/**
+ * @brief Waits on a condition for at most ticks; portMAX_DELAY waits forever.
+ * @retval false once the deadline has passed
+ */
+static bool sim_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock,
+                          const struct timespec *deadline) {
+  if (deadline == NULL) {
+    pthread_cond_wait(cond, lock);
+    return true;
+  }
+  return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+/**
+ * @brief Cleanup handler releasing a lock held across a cancellable wait.
+ */
+static void sim_unlock(void *lock) { pthread_mutex_unlock(lock); }
+
+static struct sim_task *sim_task_alloc(const char *name) {
+  struct sim_task *task = calloc(1, sizeof(*task));
+  if (task == NULL) {
+    return NULL;
+  }
+  strncpy(task->name, name, sizeof(task->name) - 1);
+  pthread_mutex_init(&task->lock, NULL);
+  sim_cond_init(&task->cond);
+  return task;
+}
+
+static void *sim_task_entry(void *arg) {
+  current_task = arg;
+  pthread_setname_np(pthread_self(), current_task->name);
+  current_task->entry(current_task->arg);
+
+  /* A FreeRTOS task must never return */
+  abort();
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name,
+                       uint32_t stack_depth, void *arg, UBaseType_t priority,
+                       TaskHandle_t *handle) {
+  (void)stack_depth;
+  (void)priority;
+
+  struct sim_task *t = sim_task_alloc(name);
+  if (t == NULL) {
+    return pdFAIL;
+  }
+  t->entry = task;
+  t->arg = arg;
+
+  /* Publish the handle first: the new task may be notified right away */
+  if (handle != NULL) {
+    *handle = t;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rc = pthread_create(&t->thread, &attr, sim_task_entry, t);
+  pthread_attr_destroy(&attr);
+
+  if (rc != 0) {
+    if (handle != NULL) {
+      *handle = NULL;
+    }
+    free(t);
+    return pdFAIL;
+  }
+  return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  if (current_task == NULL) {
+    current_task = sim_task_alloc("main");
+    current_task->thread = pthread_self();
+  }
+  return current_task;
+}
+
+/**
+ * @brief Deleting another task cancels its thread at the next blocking call,
+ * which is where a FreeRTOS task would be sitting when it is deleted. The
+ * task block is kept, since a stale handle may still be notified; a task
+ * deleting itself goes on a list so the leak checker doesnt report it.
+ */
+void vTaskDelete(TaskHandle_t task) {
+  if (task == NULL || task == current_task) {
+    if (current_task != NULL) {
+      pthread_mutex_lock(&deleted_lock);
+      current_task->next_deleted = deleted_tasks;
+      deleted_tasks = current_task;
+      pthread_mutex_unlock(&deleted_lock);
+    }
+    pthread_exit(NULL);
+  }
+  pthread_cancel(task->thread);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  struct timespec deadline = sim_deadline(ticks);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+         EINTR) {
+  }
+}
+
+TickType_t xTaskGetTickCount(void) {
+  uint64_t ms = sim_monotonic_ms() - boot_ms;
+  return (TickType_t)(ms * configTICK_RATE_HZ / 1000);
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value,
+                       eNotifyAction action) {
+  BaseType_t result = pdPASS;
+
+  pthread_mutex_lock(&task->lock);
+  switch (action) {
+  case eSetBits:
+    task->notify_value |= value;
+    break;
+  case eIncrement:
+    task->notify_value++;
+    break;
+  case eSetValueWithOverwrite:
+    task->notify_value = value;
+    break;
+  case eSetValueWithoutOverwrite:
+    if (task->notify_pending) {
+      result = pdFAIL;
+    } else {
+      task->notify_value = value;
+    }
+    break;
+  case eNoAction:
+    break;
+  }
+  if (result == pdPASS) {
+    task->notify_pending = true;
+    pthread_cond_broadcast(&task->cond);
+  }
+  pthread_mutex_unlock(&task->lock);
+
+  return result;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit,
+                           uint32_t *value, TickType_t ticks) {
+  struct sim_task *self = xTaskGetCurrentTaskHandle();
+  struct timespec deadline = sim_deadline(ticks);
+  BaseType_t result = pdFALSE;
+
+  pthread_mutex_lock(&self->lock);
+  pthread_cleanup_push(sim_unlock, &self->lock);
+  if (!self->notify_pending) {
+    self->notify_value &= ~clear_on_entry;
+    while (!self->notify_pending && ticks != 0 &&
+           sim_cond_wait(&self->cond, &self->lock,
+                         ticks == portMAX_DELAY ? NULL : &deadline)) {
+    }
+  }
+  if (value != NULL) {
+    *value = self->notify_value;
+  }
+  if (self->notify_pending) {
+    self->notify_value &= ~clear_on_exit;
+    self->notify_pending = false;
+    result = pdTRUE;
+  }
+  pthread_cleanup_pop(1);
+
+  return result;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks) {
+  struct sim_task *self = xTaskGetCurrentTaskHandle();
+  struct timespec deadline = sim_deadline(ticks);
+  uint32_t value;
+
+  pthread_mutex_lock(&self->lock);
+  pthread_cleanup_push(sim_unlock, &self->lock);
+  while (self->notify_value == 0 && ticks != 0 &&
+         sim_cond_wait(&self->cond, &self->lock,
+                       ticks == portMAX_DELAY ? NULL : &deadline)) {
+  }
+  value = self->notify_value;
+  if (value != 0) {
+    self->notify_value = clear_on_exit ? 0 : value - 1;
+  }
+  self->notify_pending = false;
+  pthread_cleanup_pop(1);
+
+  return value;
+}
+
+EventGroupHandle_t xEventGroupCreate(void) {
+  struct sim_event_group *group = calloc(1, sizeof(*group));
+  if (group == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&group->lock, NULL);
+  sim_cond_init(&group->cond);
+  return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+  pthread_mutex_destroy(&group->lock);
+  pthread_cond_destroy(&group->cond);
+  free(group);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+  pthread_mutex_lock(&group->lock);
+  group->bits |= bits;
+  EventBits_t result = group->bits;
+  pthread_cond_broadcast(&group->cond);
+  pthread_mutex_unlock(&group->lock);
+  return result;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+  pthread_mutex_lock(&group->lock);
+  EventBits_t result = group->bits;
+  group->bits &= ~bits;
+  pthread_mutex_unlock(&group->lock);
+  return result;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+  pthread_mutex_lock(&group->lock);
+  EventBits_t result = group->bits;
+  pthread_mutex_unlock(&group->lock);
+  return result;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits,
+                                BaseType_t clear_on_exit, BaseType_t wait_all,
+                                TickType_t ticks) {
+  struct timespec deadline = sim_deadline(ticks);
+  EventBits_t result;
+
+  pthread_mutex_lock(&group->lock);
+  pthread_cleanup_push(sim_unlock, &group->lock);
+  for (;;) {
+    EventBits_t set = group->bits & bits;
+    if (wait_all ? set == bits : set != 0) {
+      break;
+    }
+    if (ticks == 0 || !sim_cond_wait(&group->cond, &group->lock,
+                                     ticks == portMAX_DELAY ? NULL
+                                                            : &deadline)) {
+      break;
+    }
+  }
+  result = group->bits;
+  bool met = wait_all ? (result & bits) == bits : (result & bits) != 0;
+  if (met && clear_on_exit) {
+    group->bits &= ~bits;
+  }
+  pthread_cleanup_pop(1);
+
+  return result;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  struct sim_queue *queue = calloc(1, sizeof(*queue));
+  if (queue == NULL) {
+    return NULL;
+  }
+  queue->items = calloc(length, item_size);
+  if (queue->items == NULL) {
+    free(queue);
+    return NULL;
+  }
+  queue->length = length;
+  queue->item_size = item_size;
+  pthread_mutex_init(&queue->lock, NULL);
+  sim_cond_init(&queue->cond);
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->cond);
+  free(queue->items);
+  free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t ticks) {
+  struct timespec deadline = sim_deadline(ticks);
+  BaseType_t result = pdFALSE;
+
+  pthread_mutex_lock(&queue->lock);
+  pthread_cleanup_push(sim_unlock, &queue->lock);
+  while (queue->count == queue->length && ticks != 0 &&
+         sim_cond_wait(&queue->cond, &queue->lock,
+                       ticks == portMAX_DELAY ? NULL : &deadline)) {
+  }
+  if (queue->count < queue->length) {
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->cond);
+    result = pdTRUE;
+  }
+  pthread_cleanup_pop(1);
+
+  return result;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+  struct timespec deadline = sim_deadline(ticks);
+  BaseType_t result = pdFALSE;
+
+  pthread_mutex_lock(&queue->lock);
+  pthread_cleanup_push(sim_unlock, &queue->lock);
+  while (queue->count == 0 && ticks != 0 &&
+         sim_cond_wait(&queue->cond, &queue->lock,
+                       ticks == portMAX_DELAY ? NULL : &deadline)) {
+  }
+  if (queue->count > 0) {
+    memcpy(item, queue->items + queue->head * queue->item_size,
+           queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->cond);
+    result = pdTRUE;
+  }
+  pthread_cleanup_pop(1);
+
+  return result;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  struct sim_semaphore *semaphore = calloc(1, sizeof(*semaphore));
+  if (semaphore == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&semaphore->lock, NULL);
+  return semaphore;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+  pthread_mutex_destroy(&semaphore->lock);
+  free(semaphore);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  if (ticks == portMAX_DELAY) {
+    return pthread_mutex_lock(&semaphore->lock) == 0 ? pdTRUE : pdFALSE;
+  }
+
+  /* pthread_mutex_clocklock() would take the monotonic deadline directly,
+   * but a realtime one is portable and close enough for a fake */
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  uint64_t ns = (uint64_t)deadline.tv_nsec +
+                (uint64_t)ticks * (1000000000ULL / configTICK_RATE_HZ);
+  deadline.tv_sec += ns / 1000000000ULL;
+  deadline.tv_nsec = ns % 1000000000ULL;
+  return pthread_mutex_timedlock(&semaphore->lock, &deadline) == 0 ? pdTRUE
+                                                                   : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  return pthread_mutex_unlock(&semaphore->lock) == 0 ? pdTRUE : pdFALSE;
+}
@@ -0,0 +1,104 @@
+/**
+ ******************************************************************************
+ * @file      gpio.c
+ * @brief     Host simulation: GPIO output latch, written through the
+ *            driver or the output set/clear registers
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "soc/gpio_reg.h"
+#include "soc/soc.h"
+
+#define TAG "sim_gpio"
+
+static _Atomic uint64_t output_enable;
+static _Atomic uint64_t output_level;
+
+esp_err_t gpio_config(const gpio_config_t *config) {
+  if (config->pin_bit_mask >> GPIO_NUM_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (config->mode & GPIO_MODE_OUTPUT) {
+    atomic_fetch_or(&output_enable, config->pin_bit_mask);
+  }
+  ESP_LOGI(TAG, "outputs 0x%010" PRIx64 ", driving high 0x%010" PRIx64,
+           atomic_load(&output_enable),
+           atomic_load(&output_enable) & atomic_load(&output_level));
+  return ESP_OK;
+}
+
+/**
+ * @brief Applies one write to the output latch and logs, on one line, every
+ * pin it changed.
+ */
+static void sim_gpio_write(uint64_t set, uint64_t clear) {
+  uint64_t raised = set & ~atomic_fetch_or(&output_level, set);
+  uint64_t lowered = clear & atomic_fetch_and(&output_level, ~clear);
+  uint64_t changed = raised | lowered;
+
+  if (changed == 0) {
+    return;
+  }
+
+  /* As on the chip, a pin that isn't an output yet only latches the level
+   * and drives it once gpio_config() enables it */
+  uint64_t enabled = atomic_load(&output_enable);
+  char line[GPIO_NUM_MAX * sizeof(" 39 -> 1 (latched)")] = "";
+  size_t len = 0;
+  for (int pin = 0; pin < GPIO_NUM_MAX; pin++) {
+    if (changed >> pin & 1) {
+      len += snprintf(line + len, sizeof(line) - len, "%s%d -> %d%s",
+                      len == 0 ? "" : ", ", pin, (int)(set >> pin & 1),
+                      (enabled >> pin & 1) ? "" : " (latched)");
+    }
+  }
+  ESP_LOGI(TAG, "GPIO %s", line);
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+  if (gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  uint64_t bit = (uint64_t)1 << gpio_num;
+  sim_gpio_write(level ? bit : 0, level ? 0 : bit);
+  return ESP_OK;
+}
+
+/**
+ * @brief The W1TS/W1TC registers of both banks; a write to one of them
+ * switches all its pins at the same instant.
+ */
+void sim_reg_write(uint32_t reg, uint32_t value) {
+  switch (reg) {
+  case GPIO_OUT_W1TS_REG:
+    sim_gpio_write(value, 0);
+    break;
+  case GPIO_OUT_W1TC_REG:
+    sim_gpio_write(0, value);
+    break;
+  case GPIO_OUT1_W1TS_REG:
+    sim_gpio_write((uint64_t)value << 32, 0);
+    break;
+  case GPIO_OUT1_W1TC_REG:
+    sim_gpio_write(0, (uint64_t)value << 32);
+    break;
+  default:
+    ESP_LOGE(TAG, "write to unknown register 0x%08x", (unsigned)reg);
+    abort();
+  }
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+  if (gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) {
+    return 0;
+  }
+  return (atomic_load(&output_level) >> gpio_num) & 1;
+}
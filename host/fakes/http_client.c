@@ -0,0 +1,169 @@
+/**
+ ******************************************************************************
+ * @file      http_client.c
+ * @brief     Host simulation: HTTP client answered by a local stand-in
+ *            server. The path of the URL is served from $SIM_HTTP_ROOT (the
+ *            working directory by default), with Range requests. To test
+ *            resuming, $SIM_HTTP_DROP_BYTES drops every connection after
+ *            that many body bytes, or only the first $SIM_HTTP_DROPS of
+ *            them, and $SIM_HTTP_RATE limits each connection to that many
+ *            bytes per second. $SIM_HTTP_IGNORE_RANGE=1 answers every
+ *            request with the whole file, as a server without Range
+ *            support does.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "esp_http_client.h"
+#include "esp_log.h"
+
+#define TAG "sim_http"
+
+#define SIM_HTTP_PATH_MAX_LEN 512
+
+struct esp_http_client {
+  char path[SIM_HTTP_PATH_MAX_LEN];
+  long range_start;
+  FILE *file;
+  long file_size;
+  int status;
+  int64_t length;
+  uint64_t served;
+  uint64_t drop_bytes;
+  uint64_t rate;
+  bool ignore_range;
+};
+
+/* Connections dropped so far, against $SIM_HTTP_DROPS */
+static uint64_t sim_http_dropped;
+
+static uint64_t sim_http_env(const char *name) {
+  const char *value = getenv(name);
+  return value != NULL ? strtoull(value, NULL, 0) : 0;
+}
+
+esp_http_client_handle_t
+esp_http_client_init(const esp_http_client_config_t *config) {
+  const char *root = getenv("SIM_HTTP_ROOT");
+  const char *path = strstr(config->url, "://");
+
+  /* Skip the scheme and the host, keep the path */
+  path = path != NULL ? strchr(path + 3, '/') : NULL;
+  if (path == NULL) {
+    return NULL;
+  }
+
+  struct esp_http_client *client = calloc(1, sizeof(*client));
+  if (client == NULL) {
+    return NULL;
+  }
+  snprintf(client->path, sizeof(client->path), "%s%s",
+           root != NULL ? root : ".", path);
+  client->length = -1;
+  client->drop_bytes = sim_http_env("SIM_HTTP_DROP_BYTES");
+  client->rate = sim_http_env("SIM_HTTP_RATE");
+  client->ignore_range = sim_http_env("SIM_HTTP_IGNORE_RANGE") != 0;
+
+  uint64_t drops = sim_http_env("SIM_HTTP_DROPS");
+  if (drops > 0 && sim_http_dropped >= drops) {
+    client->drop_bytes = 0;
+  }
+  return client;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client,
+                                     const char *key, const char *value) {
+  if (strcasecmp(key, "Range") != 0 || client->ignore_range) {
+    return ESP_OK;
+  }
+  if (sscanf(value, "bytes=%ld-", &client->range_start) != 1) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client,
+                               int write_len) {
+  client->file = fopen(client->path, "rb");
+  if (client->file == NULL) {
+    client->status = 404;
+    client->length = 0;
+  } else {
+    fseek(client->file, 0, SEEK_END);
+    client->file_size = ftell(client->file);
+    if (client->range_start > client->file_size) {
+      client->status = 416;
+      client->length = 0;
+    } else {
+      client->status = client->range_start > 0 ? 206 : 200;
+      client->length = client->file_size - client->range_start;
+      fseek(client->file, client->range_start, SEEK_SET);
+    }
+  }
+  ESP_LOGI(TAG, "GET %s from %ld: %d", client->path, client->range_start,
+           client->status);
+  return ESP_OK;
+}
+
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client) {
+  return client->length;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) {
+  return client->status;
+}
+
+int64_t esp_http_client_get_content_length(esp_http_client_handle_t client) {
+  return client->length;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer,
+                         int len) {
+  if (client->file == NULL || client->status >= 300) {
+    return 0;
+  }
+  if (client->drop_bytes > 0) {
+    if (client->served >= client->drop_bytes) {
+      ESP_LOGW(TAG, "dropping the connection after %llu bytes",
+               (unsigned long long)client->served);
+      client->drop_bytes = 0;
+      sim_http_dropped++;
+      return -1;
+    }
+    if ((uint64_t)len > client->drop_bytes - client->served) {
+      len = (int)(client->drop_bytes - client->served);
+    }
+  }
+
+  size_t n = fread(buffer, 1, (size_t)len, client->file);
+  client->served += n;
+  if (client->rate > 0 && n > 0) {
+    usleep((useconds_t)(n * 1000000ULL / client->rate));
+  }
+  return (int)n;
+}
+
+bool esp_http_client_is_complete_data_received(
+    esp_http_client_handle_t client) {
+  return client->length >= 0 && client->served >= (uint64_t)client->length;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client) {
+  if (client->file != NULL) {
+    fclose(client->file);
+    client->file = NULL;
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client) {
+  esp_http_client_close(client);
+  free(client);
+  return ESP_OK;
+}
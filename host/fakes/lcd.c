@@ -0,0 +1,423 @@
+/**
+ ******************************************************************************
+ * @file      lcd.c
+ * @brief     Host simulation: I2C bus, SMBus and the LCD2004. An HD44780
+ *            model holds the two 40 character DDRAM lines, the address
+ *            counter and the display shift. The i2c-lcd1602 calls drive it
+ *            directly; raw command links are decoded the way the PCF8574
+ *            backpack would latch them. Each transfer takes the time it
+ *            would take on the bus, and whenever a visible row changes it
+ *            is logged.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "i2c-lcd1602.h"
+#include "smbus.h"
+
+#define TAG "sim_lcd"
+
+#define SIM_LCD_MAX_ROWS 4
+#define SIM_LCD_MAX_COLUMNS 40
+#define SIM_LCD_LINE_LEN 40
+
+/* PCF8574 pins: P0 RS, P2 E, P3 backlight, P4-P7 D4-D7 */
+#define SIM_LCD_RS_DATA 0x01
+#define SIM_LCD_ENABLE 0x04
+#define SIM_LCD_BACKLIGHT 0x08
+
+/* Bus clocks of one SMBus send byte: start, address, data, stop */
+#define SIM_SMBUS_BYTE_CLOCKS 20
+/* The component sends each nibble as three such writes and waits 50 us
+ * after each E pulse */
+#define SIM_COMPONENT_CHAR_CLOCKS (6 * SIM_SMBUS_BYTE_CLOCKS)
+#define SIM_COMPONENT_CHAR_DELAY_US 100
+
+static const uint8_t row_offsets[SIM_LCD_MAX_ROWS] = {0x00, 0x40, 0x14, 0x54};
+
+/* The HD44780 has one address counter, shared by every caller */
+static pthread_mutex_t lcd_lock = PTHREAD_MUTEX_INITIALIZER;
+static char ddram[2][SIM_LCD_LINE_LEN];
+static uint8_t address;
+static uint8_t shift;
+static const i2c_lcd1602_info_t *geometry;
+static char shown[SIM_LCD_MAX_ROWS][SIM_LCD_MAX_COLUMNS];
+
+/* PCF8574 outputs and the 4 bit interface's half received byte */
+static uint8_t expander;
+static bool low_nibble;
+static uint8_t high_nibble;
+
+static uint32_t clk_speed[2] = {100000, 100000};
+
+typedef enum {
+  SIM_I2C_START,
+  SIM_I2C_WRITE,
+  SIM_I2C_STOP,
+} sim_i2c_op_kind_t;
+
+struct sim_i2c_op {
+  sim_i2c_op_kind_t kind;
+  const uint8_t *data;
+  size_t len;
+  uint8_t byte;
+};
+
+struct sim_i2c_cmd {
+  bool heap;
+  size_t count;
+  size_t capacity;
+  struct sim_i2c_op ops[];
+};
+
+#define SIM_I2C_HEAP_OPS 16
+
+/**
+ * @brief Blocks for as long as the given number of clocks takes on a port.
+ */
+static void sim_bus_wait(i2c_port_t port, uint64_t clocks, uint64_t extra_us) {
+  usleep(clocks * 1000000 / clk_speed[port] + extra_us);
+}
+
+static char *sim_lcd_cell(uint8_t addr) {
+  return &ddram[addr >> 6 & 1][(addr & 0x3F) % SIM_LCD_LINE_LEN];
+}
+
+/**
+ * @brief Logs every visible row that differs from what was last logged.
+ */
+static void sim_lcd_refresh(void) {
+  if (geometry == NULL) {
+    return;
+  }
+  for (uint8_t row = 0; row < geometry->num_rows; row++) {
+    char line[SIM_LCD_MAX_COLUMNS];
+    uint8_t start = row_offsets[row] & 0x3F;
+    for (uint8_t col = 0; col < geometry->num_visible_columns; col++) {
+      line[col] = ddram[row_offsets[row] >> 6][(start + shift + col) %
+                                                SIM_LCD_LINE_LEN];
+    }
+    if (memcmp(line, shown[row], geometry->num_visible_columns) != 0) {
+      memcpy(shown[row], line, geometry->num_visible_columns);
+      ESP_LOGI(TAG, "row %u |%.*s|", row, geometry->num_visible_columns, line);
+    }
+  }
+}
+
+static void hd44780_command(uint8_t command) {
+  if (command & 0x80) {
+    /* Set DDRAM address */
+    address = command & 0x7F;
+  } else if (command & 0x60) {
+    /* Function set, CGRAM address: nothing the model shows */
+  } else if (command & 0x10) {
+    /* Cursor or display shift */
+    bool right = command & 0x04;
+    if (command & 0x08) {
+      shift = (shift + (right ? SIM_LCD_LINE_LEN - 1 : 1)) % SIM_LCD_LINE_LEN;
+    } else {
+      address = (address & 0x40) |
+                ((address & 0x3F) + (right ? 1 : SIM_LCD_LINE_LEN - 1)) %
+                    SIM_LCD_LINE_LEN;
+    }
+  } else if (command & 0x0C) {
+    /* Display control, entry mode */
+  } else if (command & 0x02) {
+    address = 0;
+    shift = 0;
+  } else if (command & 0x01) {
+    memset(ddram, ' ', sizeof(ddram));
+    address = 0;
+    shift = 0;
+  }
+}
+
+/**
+ * @brief Stores one character and advances the address counter, which runs
+ * from the end of one line on to the start of the other.
+ */
+static void hd44780_data(uint8_t chr) {
+  *sim_lcd_cell(address) = chr;
+  uint8_t index = (address & 0x3F) + 1;
+  if (index >= SIM_LCD_LINE_LEN) {
+    address = (address & 0x40) ^ 0x40;
+  } else {
+    address = (address & 0x40) | index;
+  }
+}
+
+/**
+ * @brief Feeds one expander write to the controller, which latches D4-D7 on
+ * the falling edge of E.
+ */
+static void pcf8574_write(uint8_t value) {
+  bool strobe = (expander & SIM_LCD_ENABLE) && !(value & SIM_LCD_ENABLE);
+  uint8_t latched = expander;
+  expander = value;
+  if (!strobe) {
+    return;
+  }
+
+  if (!low_nibble) {
+    high_nibble = latched & 0xF0;
+    low_nibble = true;
+    return;
+  }
+  low_nibble = false;
+  uint8_t byte = high_nibble | latched >> 4;
+  if (latched & SIM_LCD_RS_DATA) {
+    hd44780_data(byte);
+  } else {
+    hd44780_command(byte);
+  }
+}
+
+esp_err_t i2c_param_config(i2c_port_t i2c_num, const i2c_config_t *i2c_conf) {
+  ESP_LOGI(TAG, "I2C%d SDA %d SCL %d at %u Hz", i2c_num, i2c_conf->sda_io_num,
+           i2c_conf->scl_io_num, (unsigned)i2c_conf->master.clk_speed);
+  clk_speed[i2c_num] = i2c_conf->master.clk_speed;
+  return ESP_OK;
+}
+
+esp_err_t i2c_driver_install(i2c_port_t i2c_num, i2c_mode_t mode,
+                             size_t slv_rx_buf_len, size_t slv_tx_buf_len,
+                             int intr_alloc_flags) {
+  return ESP_OK;
+}
+
+i2c_cmd_handle_t i2c_cmd_link_create(void) {
+  struct sim_i2c_cmd *cmd =
+      calloc(1, sizeof(*cmd) + SIM_I2C_HEAP_OPS * sizeof(cmd->ops[0]));
+  if (cmd == NULL) {
+    return NULL;
+  }
+  cmd->heap = true;
+  cmd->capacity = SIM_I2C_HEAP_OPS;
+  return cmd;
+}
+
+i2c_cmd_handle_t i2c_cmd_link_create_static(uint8_t *buffer, uint32_t size) {
+  uintptr_t base = (uintptr_t)buffer;
+  uintptr_t aligned = (base + alignof(struct sim_i2c_cmd) - 1) &
+                      ~(uintptr_t)(alignof(struct sim_i2c_cmd) - 1);
+  if (buffer == NULL || base + size < aligned + sizeof(struct sim_i2c_cmd)) {
+    return NULL;
+  }
+
+  struct sim_i2c_cmd *cmd = (struct sim_i2c_cmd *)aligned;
+  cmd->heap = false;
+  cmd->count = 0;
+  cmd->capacity = (base + size - aligned - sizeof(*cmd)) / sizeof(cmd->ops[0]);
+  return cmd->capacity > 0 ? cmd : NULL;
+}
+
+void i2c_cmd_link_delete(i2c_cmd_handle_t cmd_handle) { free(cmd_handle); }
+
+void i2c_cmd_link_delete_static(i2c_cmd_handle_t cmd_handle) {}
+
+/**
+ * @brief Queues an operation. Like the IDF driver, written buffers are
+ * referenced, not copied, and must live until the link has been run.
+ */
+static esp_err_t sim_i2c_queue(i2c_cmd_handle_t cmd_handle,
+                               struct sim_i2c_op op) {
+  struct sim_i2c_cmd *cmd = cmd_handle;
+  if (cmd == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (cmd->count == cmd->capacity) {
+    return ESP_ERR_NO_MEM;
+  }
+  cmd->ops[cmd->count++] = op;
+  return ESP_OK;
+}
+
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd_handle) {
+  return sim_i2c_queue(cmd_handle, (struct sim_i2c_op){.kind = SIM_I2C_START});
+}
+
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd_handle, uint8_t data,
+                                bool ack_en) {
+  return sim_i2c_queue(cmd_handle, (struct sim_i2c_op){.kind = SIM_I2C_WRITE,
+                                                       .len = 1,
+                                                       .byte = data});
+}
+
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd_handle, const uint8_t *data,
+                           size_t data_len, bool ack_en) {
+  return sim_i2c_queue(cmd_handle, (struct sim_i2c_op){.kind = SIM_I2C_WRITE,
+                                                       .data = data,
+                                                       .len = data_len});
+}
+
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd_handle) {
+  return sim_i2c_queue(cmd_handle, (struct sim_i2c_op){.kind = SIM_I2C_STOP});
+}
+
+/**
+ * @brief Runs a command link against the backpack. The first byte after a
+ * start is the address; a write to anything but the LCD is not acked.
+ */
+esp_err_t i2c_master_cmd_begin(i2c_port_t i2c_num, i2c_cmd_handle_t cmd_handle,
+                               TickType_t ticks_to_wait) {
+  struct sim_i2c_cmd *cmd = cmd_handle;
+  esp_err_t err = ESP_OK;
+  uint64_t clocks = 0;
+  bool expect_address = false;
+  bool selected = false;
+
+  pthread_mutex_lock(&lcd_lock);
+  for (size_t i = 0; i < cmd->count && err == ESP_OK; i++) {
+    const struct sim_i2c_op *op = &cmd->ops[i];
+    switch (op->kind) {
+    case SIM_I2C_START:
+    case SIM_I2C_STOP:
+      clocks++;
+      expect_address = op->kind == SIM_I2C_START;
+      break;
+    case SIM_I2C_WRITE:
+      for (size_t n = 0; n < op->len; n++) {
+        uint8_t byte = op->data != NULL ? op->data[n] : op->byte;
+        clocks += 9;
+        if (expect_address) {
+          expect_address = false;
+          selected = geometry != NULL &&
+                     byte >> 1 == geometry->smbus_info->address &&
+                     !(byte & I2C_MASTER_READ);
+          if (!selected) {
+            err = ESP_FAIL;
+            break;
+          }
+        } else if (selected) {
+          pcf8574_write(byte);
+        }
+      }
+      break;
+    }
+  }
+  sim_lcd_refresh();
+  sim_bus_wait(i2c_num, clocks, 0);
+  pthread_mutex_unlock(&lcd_lock);
+
+  return err;
+}
+
+smbus_info_t *smbus_malloc(void) { return calloc(1, sizeof(smbus_info_t)); }
+
+esp_err_t smbus_init(smbus_info_t *smbus_info, i2c_port_t i2c_port,
+                     i2c_address_t address) {
+  smbus_info->i2c_port = i2c_port;
+  smbus_info->address = address;
+  smbus_info->init = true;
+  return ESP_OK;
+}
+
+esp_err_t smbus_set_timeout(smbus_info_t *smbus_info, TickType_t timeout) {
+  smbus_info->timeout = timeout;
+  return ESP_OK;
+}
+
+i2c_lcd1602_info_t *i2c_lcd1602_malloc(void) {
+  return calloc(1, sizeof(i2c_lcd1602_info_t));
+}
+
+esp_err_t i2c_lcd1602_init(i2c_lcd1602_info_t *i2c_lcd1602_info,
+                           smbus_info_t *smbus_info, bool backlight,
+                           uint8_t num_rows, uint8_t num_columns,
+                           uint8_t num_visible_columns) {
+  if (num_rows > SIM_LCD_MAX_ROWS || num_columns > SIM_LCD_MAX_COLUMNS ||
+      num_visible_columns > num_columns) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  i2c_lcd1602_info->smbus_info = smbus_info;
+  i2c_lcd1602_info->backlight_flag = backlight ? SIM_LCD_BACKLIGHT : 0;
+  i2c_lcd1602_info->num_rows = num_rows;
+  i2c_lcd1602_info->num_columns = num_columns;
+  i2c_lcd1602_info->num_visible_columns = num_visible_columns;
+  i2c_lcd1602_info->init = true;
+
+  pthread_mutex_lock(&lcd_lock);
+  geometry = i2c_lcd1602_info;
+  memset(shown, ' ', sizeof(shown));
+  pthread_mutex_unlock(&lcd_lock);
+
+  return i2c_lcd1602_reset(i2c_lcd1602_info);
+}
+
+/**
+ * @brief Sends one command through the component, as a series of separate
+ * SMBus writes.
+ */
+static esp_err_t sim_component_command(const i2c_lcd1602_info_t *info,
+                                       uint8_t command, bool data) {
+  if (info == NULL || !info->init) {
+    return ESP_FAIL;
+  }
+  pthread_mutex_lock(&lcd_lock);
+  if (data) {
+    hd44780_data(command);
+  } else {
+    hd44780_command(command);
+  }
+  sim_lcd_refresh();
+  sim_bus_wait(info->smbus_info->i2c_port, SIM_COMPONENT_CHAR_CLOCKS,
+               SIM_COMPONENT_CHAR_DELAY_US);
+  pthread_mutex_unlock(&lcd_lock);
+  return ESP_OK;
+}
+
+esp_err_t i2c_lcd1602_clear(const i2c_lcd1602_info_t *i2c_lcd1602_info) {
+  return sim_component_command(i2c_lcd1602_info, 0x01, false);
+}
+
+esp_err_t i2c_lcd1602_reset(const i2c_lcd1602_info_t *i2c_lcd1602_info) {
+  if (i2c_lcd1602_info == NULL || !i2c_lcd1602_info->init) {
+    return ESP_FAIL;
+  }
+  pthread_mutex_lock(&lcd_lock);
+  expander = i2c_lcd1602_info->backlight_flag;
+  low_nibble = false;
+  pthread_mutex_unlock(&lcd_lock);
+  return i2c_lcd1602_clear(i2c_lcd1602_info);
+}
+
+esp_err_t i2c_lcd1602_home(const i2c_lcd1602_info_t *i2c_lcd1602_info) {
+  return sim_component_command(i2c_lcd1602_info, 0x02, false);
+}
+
+esp_err_t i2c_lcd1602_move_cursor(const i2c_lcd1602_info_t *i2c_lcd1602_info,
+                                  uint8_t col, uint8_t row) {
+  if (i2c_lcd1602_info == NULL || !i2c_lcd1602_info->init) {
+    return ESP_FAIL;
+  }
+  if (col >= i2c_lcd1602_info->num_columns ||
+      row >= i2c_lcd1602_info->num_rows) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  return sim_component_command(i2c_lcd1602_info, 0x80 | (row_offsets[row] + col),
+                               false);
+}
+
+esp_err_t i2c_lcd1602_write_char(const i2c_lcd1602_info_t *i2c_lcd1602_info,
+                                 uint8_t chr) {
+  return sim_component_command(i2c_lcd1602_info, chr, true);
+}
+
+esp_err_t i2c_lcd1602_write_string(const i2c_lcd1602_info_t *i2c_lcd1602_info,
+                                   const char *string) {
+  for (const char *p = string; *p != '\0'; p++) {
+    esp_err_t err = i2c_lcd1602_write_char(i2c_lcd1602_info, (uint8_t)*p);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,120 @@
+/**
+ ******************************************************************************
+ * @file      miniz.c
+ * @brief     Host simulation: tinfl_decompress() on zlib's raw inflate. The
+ *            status codes follow tinfl, HAS_MORE_OUTPUT means the output
+ *            buffer filled up. Like the ROM's miniz 1.15, up to 4 bytes past
+ *            the end of the stream are read into m_bit_buf and counted as
+ *            consumed rather than handed back.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <string.h>
+
+#include "esp32/rom/miniz.h"
+
+#define SIM_TINFL_RUNNING 1
+#define SIM_TINFL_ENDED 2
+#define SIM_TINFL_FAILED 3
+
+/* zlib allocates its state and window once, at the start of a stream */
+static voidpf sim_tinfl_alloc(voidpf opaque, uInt items, uInt size) {
+  tinfl_decompressor *r = opaque;
+  size_t len = ((size_t)items * size + 15) & ~(size_t)15;
+  if (len > SIM_TINFL_ARENA_SIZE - r->arena_used) {
+    return Z_NULL;
+  }
+  voidpf p = r->arena + r->arena_used;
+  r->arena_used += len;
+  return p;
+}
+
+static void sim_tinfl_free(voidpf opaque, voidpf address) {
+  (void)opaque;
+  (void)address;
+}
+
+/*
+ * tinfl refills its bit buffer a byte at a time before it knows whether the
+ * stream ends, so the bits of the last partial byte and a varying number of
+ * whole bytes after it are left in the buffer. The count is derived from
+ * the stream length so that different images exercise different splits.
+ */
+static void sim_tinfl_read_ahead(tinfl_decompressor *r) {
+  mz_uint32 partial = r->stream.data_type & 7;
+  mz_uint32 n = (mz_uint32)(r->stream.total_in % 5);
+
+  if (n > (32 - partial) / 8) {
+    n = (32 - partial) / 8;
+  }
+  if (n > r->stream.avail_in) {
+    n = r->stream.avail_in;
+  }
+  r->m_num_bits = partial + 8 * n;
+  r->m_bit_buf = 0;
+  for (mz_uint32 i = 0; i < n; i++) {
+    r->m_bit_buf |= (mz_uint32)r->stream.next_in[i] << (partial + 8 * i);
+  }
+  r->stream.next_in += n;
+  r->stream.avail_in -= n;
+}
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r,
+                              const mz_uint8 *pIn_buf_next,
+                              size_t *pIn_buf_size, mz_uint8 *pOut_buf_start,
+                              mz_uint8 *pOut_buf_next, size_t *pOut_buf_size,
+                              const mz_uint32 decomp_flags) {
+  if (r->m_state == SIM_TINFL_FAILED) {
+    return TINFL_STATUS_FAILED;
+  }
+  if (r->m_state == SIM_TINFL_ENDED) {
+    *pIn_buf_size = 0;
+    *pOut_buf_size = 0;
+    return TINFL_STATUS_DONE;
+  }
+  if (r->m_state == 0) {
+    memset(&r->stream, 0, sizeof(r->stream));
+    r->stream.zalloc = sim_tinfl_alloc;
+    r->stream.zfree = sim_tinfl_free;
+    r->stream.opaque = r;
+    r->arena_used = 0;
+    r->m_num_bits = 0;
+    r->m_bit_buf = 0;
+    int window = (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) ? 15 : -15;
+    if (inflateInit2(&r->stream, window) != Z_OK) {
+      return TINFL_STATUS_FAILED;
+    }
+    r->m_state = SIM_TINFL_RUNNING;
+  }
+
+  r->stream.next_in = (Bytef *)pIn_buf_next;
+  r->stream.avail_in = (uInt)*pIn_buf_size;
+  r->stream.next_out = pOut_buf_next;
+  r->stream.avail_out = (uInt)*pOut_buf_size;
+
+  int rc = inflate(&r->stream, Z_NO_FLUSH);
+
+  if (rc == Z_STREAM_END) {
+    sim_tinfl_read_ahead(r);
+  }
+  *pIn_buf_size -= r->stream.avail_in;
+  *pOut_buf_size -= r->stream.avail_out;
+
+  if (rc == Z_STREAM_END) {
+    inflateEnd(&r->stream);
+    r->m_state = SIM_TINFL_ENDED;
+    return TINFL_STATUS_DONE;
+  }
+  if (rc != Z_OK && rc != Z_BUF_ERROR) {
+    inflateEnd(&r->stream);
+    r->m_state = SIM_TINFL_FAILED;
+    return TINFL_STATUS_FAILED;
+  }
+  if (r->stream.avail_out == 0) {
+    return TINFL_STATUS_HAS_MORE_OUTPUT;
+  }
+  return (decomp_flags & TINFL_FLAG_HAS_MORE_INPUT)
+             ? TINFL_STATUS_NEEDS_MORE_INPUT
+             : TINFL_STATUS_FAILED;
+}
@@ -0,0 +1,381 @@
+/**
+ ******************************************************************************
+ * @file      nvs_flash.c
+ * @brief     Host simulation: NVS flash partition. Values live in RAM and
+ *            every commit writes them all to a file, $SIM_NVS_FILE or
+ *            sim_nvs.bin in the working directory, so they survive a
+ *            restart of the simulator the way they survive a reboot.
+ *            $SIM_NVS_FAIL_COMMITS=<n> fails the first n commits, as a
+ *            worn or full partition would.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#define TAG "sim_nvs"
+
+#define SIM_NVS_MAX_ENTRIES 512
+#define SIM_NVS_MAX_HANDLES 16
+#define SIM_NVS_MAX_VALUE_LEN 4000
+
+typedef enum {
+  SIM_NVS_U8,
+  SIM_NVS_U32,
+  SIM_NVS_STR,
+  SIM_NVS_BLOB,
+} sim_nvs_type_t;
+
+typedef struct {
+  char space[NVS_KEY_NAME_MAX_SIZE];
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  uint8_t type;
+  uint32_t len;
+  uint8_t *data;
+} sim_nvs_entry_t;
+
+typedef struct {
+  bool open;
+  bool writable;
+  char space[NVS_KEY_NAME_MAX_SIZE];
+} sim_nvs_handle_t;
+
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_nvs_entry_t nvs_entries[SIM_NVS_MAX_ENTRIES];
+static int nvs_count;
+static sim_nvs_handle_t nvs_handles[SIM_NVS_MAX_HANDLES];
+static bool nvs_initialized;
+
+static const char *sim_nvs_path(void) {
+  const char *path = getenv("SIM_NVS_FILE");
+  return path != NULL ? path : "sim_nvs.bin";
+}
+
+static void sim_nvs_clear(void) {
+  for (int i = 0; i < nvs_count; i++) {
+    free(nvs_entries[i].data);
+  }
+  nvs_count = 0;
+}
+
+/**
+ * @brief Reads the file written by the last commit; a missing or damaged
+ * file reads as an erased partition.
+ */
+static void sim_nvs_load(void) {
+  FILE *file = fopen(sim_nvs_path(), "rb");
+  if (file == NULL) {
+    return;
+  }
+
+  sim_nvs_entry_t entry;
+  while (nvs_count < SIM_NVS_MAX_ENTRIES &&
+         fread(entry.space, sizeof(entry.space), 1, file) == 1 &&
+         fread(entry.key, sizeof(entry.key), 1, file) == 1 &&
+         fread(&entry.type, sizeof(entry.type), 1, file) == 1 &&
+         fread(&entry.len, sizeof(entry.len), 1, file) == 1 &&
+         entry.len <= SIM_NVS_MAX_VALUE_LEN) {
+    entry.data = malloc(entry.len ? entry.len : 1);
+    if (entry.data == NULL || fread(entry.data, 1, entry.len, file) != entry.len) {
+      free(entry.data);
+      break;
+    }
+    entry.space[sizeof(entry.space) - 1] = '\0';
+    entry.key[sizeof(entry.key) - 1] = '\0';
+    nvs_entries[nvs_count++] = entry;
+  }
+  fclose(file);
+  ESP_LOGI(TAG, "%d values read from %s", nvs_count, sim_nvs_path());
+}
+
+/**
+ * @brief Writes every value to a temporary file renamed over the old one,
+ * so a crash in the middle leaves the previous commit intact.
+ */
+static esp_err_t sim_nvs_save(void) {
+  char tmp_path[256];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", sim_nvs_path());
+
+  FILE *file = fopen(tmp_path, "wb");
+  if (file == NULL) {
+    return ESP_FAIL;
+  }
+  for (int i = 0; i < nvs_count; i++) {
+    sim_nvs_entry_t *entry = &nvs_entries[i];
+    fwrite(entry->space, sizeof(entry->space), 1, file);
+    fwrite(entry->key, sizeof(entry->key), 1, file);
+    fwrite(&entry->type, sizeof(entry->type), 1, file);
+    fwrite(&entry->len, sizeof(entry->len), 1, file);
+    fwrite(entry->data, 1, entry->len, file);
+  }
+  if (fclose(file) != 0 || rename(tmp_path, sim_nvs_path()) != 0) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void) {
+  pthread_mutex_lock(&nvs_lock);
+  if (!nvs_initialized) {
+    sim_nvs_load();
+    nvs_initialized = true;
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+  pthread_mutex_lock(&nvs_lock);
+  sim_nvs_clear();
+  nvs_initialized = false;
+  remove(sim_nvs_path());
+  pthread_mutex_unlock(&nvs_lock);
+  ESP_LOGW(TAG, "Partition erased");
+  return ESP_OK;
+}
+
+static sim_nvs_handle_t *sim_nvs_handle(nvs_handle_t handle) {
+  if (handle == 0 || handle > SIM_NVS_MAX_HANDLES ||
+      !nvs_handles[handle - 1].open) {
+    return NULL;
+  }
+  return &nvs_handles[handle - 1];
+}
+
+static sim_nvs_entry_t *sim_nvs_find(const char *space, const char *key) {
+  for (int i = 0; i < nvs_count; i++) {
+    if (strcmp(nvs_entries[i].space, space) == 0 &&
+        strcmp(nvs_entries[i].key, key) == 0) {
+      return &nvs_entries[i];
+    }
+  }
+  return NULL;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode,
+                   nvs_handle_t *out_handle) {
+  esp_err_t err = ESP_ERR_NVS_INVALID_HANDLE;
+
+  if (strlen(name) >= NVS_KEY_NAME_MAX_SIZE) {
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+  }
+
+  pthread_mutex_lock(&nvs_lock);
+  if (!nvs_initialized) {
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  /* As on the target, a namespace only exists once something was written */
+  bool exists = false;
+  for (int i = 0; i < nvs_count && !exists; i++) {
+    exists = strcmp(nvs_entries[i].space, name) == 0;
+  }
+  if (!exists && open_mode == NVS_READONLY) {
+    err = ESP_ERR_NVS_NOT_FOUND;
+  } else {
+    for (int i = 0; i < SIM_NVS_MAX_HANDLES; i++) {
+      if (!nvs_handles[i].open) {
+        nvs_handles[i].open = true;
+        nvs_handles[i].writable = open_mode == NVS_READWRITE;
+        strcpy(nvs_handles[i].space, name);
+        *out_handle = (nvs_handle_t)(i + 1);
+        err = ESP_OK;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return err;
+}
+
+void nvs_close(nvs_handle_t handle) {
+  pthread_mutex_lock(&nvs_lock);
+  sim_nvs_handle_t *h = sim_nvs_handle(handle);
+  if (h != NULL) {
+    h->open = false;
+  }
+  pthread_mutex_unlock(&nvs_lock);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  static int fail_commits = -1;
+  esp_err_t err;
+
+  pthread_mutex_lock(&nvs_lock);
+  if (fail_commits < 0) {
+    const char *fail = getenv("SIM_NVS_FAIL_COMMITS");
+    fail_commits = fail != NULL ? atoi(fail) : 0;
+  }
+  if (sim_nvs_handle(handle) == NULL) {
+    err = ESP_ERR_NVS_INVALID_HANDLE;
+  } else if (fail_commits > 0) {
+    fail_commits--;
+    ESP_LOGW(TAG, "Failing the commit, %d more to fail", fail_commits);
+    err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+  } else {
+    err = sim_nvs_save();
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return err;
+}
+
+static esp_err_t sim_nvs_set(nvs_handle_t handle, const char *key,
+                             sim_nvs_type_t type, const void *value,
+                             size_t len) {
+  esp_err_t err = ESP_OK;
+
+  if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+  }
+  if (len > SIM_NVS_MAX_VALUE_LEN) {
+    return ESP_ERR_NVS_INVALID_LENGTH;
+  }
+
+  pthread_mutex_lock(&nvs_lock);
+  sim_nvs_handle_t *h = sim_nvs_handle(handle);
+  if (h == NULL) {
+    err = ESP_ERR_NVS_INVALID_HANDLE;
+  } else if (!h->writable) {
+    err = ESP_ERR_NVS_READ_ONLY;
+  } else {
+    sim_nvs_entry_t *entry = sim_nvs_find(h->space, key);
+    uint8_t *data = malloc(len ? len : 1);
+    if (data == NULL) {
+      err = ESP_ERR_NO_MEM;
+    } else if (entry == NULL && nvs_count == SIM_NVS_MAX_ENTRIES) {
+      free(data);
+      err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    } else {
+      if (entry == NULL) {
+        entry = &nvs_entries[nvs_count++];
+        strcpy(entry->space, h->space);
+        strcpy(entry->key, key);
+      } else {
+        free(entry->data);
+      }
+      memcpy(data, value, len);
+      entry->type = type;
+      entry->len = (uint32_t)len;
+      entry->data = data;
+    }
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return err;
+}
+
+/**
+ * @brief Copies a value out. With out_value NULL only the length is
+ * returned, as the real nvs_get_blob() and nvs_get_str() do.
+ */
+static esp_err_t sim_nvs_get(nvs_handle_t handle, const char *key,
+                             sim_nvs_type_t type, void *out_value,
+                             size_t *len) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&nvs_lock);
+  sim_nvs_handle_t *h = sim_nvs_handle(handle);
+  sim_nvs_entry_t *entry = h != NULL ? sim_nvs_find(h->space, key) : NULL;
+  if (h == NULL) {
+    err = ESP_ERR_NVS_INVALID_HANDLE;
+  } else if (entry == NULL || entry->type != type) {
+    err = ESP_ERR_NVS_NOT_FOUND;
+  } else if (out_value == NULL) {
+    *len = entry->len;
+  } else if (*len < entry->len) {
+    err = ESP_ERR_NVS_INVALID_LENGTH;
+  } else {
+    memcpy(out_value, entry->data, entry->len);
+    *len = entry->len;
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return err;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+  esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+  pthread_mutex_lock(&nvs_lock);
+  sim_nvs_handle_t *h = sim_nvs_handle(handle);
+  if (h == NULL) {
+    err = ESP_ERR_NVS_INVALID_HANDLE;
+  } else if (!h->writable) {
+    err = ESP_ERR_NVS_READ_ONLY;
+  } else {
+    sim_nvs_entry_t *entry = sim_nvs_find(h->space, key);
+    if (entry != NULL) {
+      free(entry->data);
+      *entry = nvs_entries[--nvs_count];
+      err = ESP_OK;
+    }
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return err;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&nvs_lock);
+  sim_nvs_handle_t *h = sim_nvs_handle(handle);
+  if (h == NULL) {
+    err = ESP_ERR_NVS_INVALID_HANDLE;
+  } else if (!h->writable) {
+    err = ESP_ERR_NVS_READ_ONLY;
+  } else {
+    for (int i = nvs_count - 1; i >= 0; i--) {
+      if (strcmp(nvs_entries[i].space, h->space) == 0) {
+        free(nvs_entries[i].data);
+        nvs_entries[i] = nvs_entries[--nvs_count];
+      }
+    }
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return err;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value) {
+  return sim_nvs_set(handle, key, SIM_NVS_U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value) {
+  size_t len = sizeof(*out_value);
+  return sim_nvs_get(handle, key, SIM_NVS_U8, out_value, &len);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value) {
+  return sim_nvs_set(handle, key, SIM_NVS_U32, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key,
+                      uint32_t *out_value) {
+  size_t len = sizeof(*out_value);
+  return sim_nvs_get(handle, key, SIM_NVS_U32, out_value, &len);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value) {
+  return sim_nvs_set(handle, key, SIM_NVS_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value,
+                      size_t *length) {
+  return sim_nvs_get(handle, key, SIM_NVS_STR, out_value, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value,
+                       size_t length) {
+  return sim_nvs_set(handle, key, SIM_NVS_BLOB, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value,
+                       size_t *length) {
+  return sim_nvs_get(handle, key, SIM_NVS_BLOB, out_value, length);
+}
@@ -0,0 +1,200 @@
+/**
+ ******************************************************************************
+ * @file      ota_ops.c
+ * @brief     Host simulation: OTA slots. The update slot is written to a
+ *            file, $SIM_OTA_FILE or sim_ota_1.bin in the working directory,
+ *            so a downloaded image can be compared with the one served.
+ *            Erases and writes take as long as on a typical module's flash,
+ *            and writing a sector that wasn't erased since esp_ota_begin()
+ *            fails, where the target would silently corrupt the image.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+
+#define TAG "sim_ota"
+
+/* First byte of every app image */
+#define SIM_IMAGE_MAGIC 0xE9
+#define SIM_OTA_HANDLE 1
+#define SIM_OTA_SLOT_SIZE 0x190000
+#define SIM_OTA_SECTORS (SIM_OTA_SLOT_SIZE / SPI_FLASH_SEC_SIZE)
+/* Sector erase and page program times from a typical SPI NOR datasheet */
+#define SIM_FLASH_ERASE_US 40000
+#define SIM_FLASH_WRITE_NS_PER_BYTE 2000
+
+/* The two 1600K app slots of partition_update.csv */
+static const esp_partition_t ota_partitions[] = {
+    {.type = 0, .subtype = 0x10, .address = 0x20000, .size = SIM_OTA_SLOT_SIZE,
+     .label = "ota_0"},
+    {.type = 0, .subtype = 0x11, .address = 0x1b0000, .size = SIM_OTA_SLOT_SIZE,
+     .label = "ota_1"},
+};
+
+static pthread_mutex_t ota_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *ota_file;
+static uint32_t ota_written;
+static bool ota_invalid;
+/* esp_ota_write() erases as it goes only when opened for sequential writes */
+static bool ota_sequential;
+static bool ota_erased[SIM_OTA_SECTORS];
+
+static const char *sim_ota_path(void) {
+  const char *path = getenv("SIM_OTA_FILE");
+  return path != NULL ? path : "sim_ota_1.bin";
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void) {
+  return &ota_partitions[0];
+}
+
+const esp_partition_t *
+esp_ota_get_next_update_partition(const esp_partition_t *start_from) {
+  return &ota_partitions[1];
+}
+
+/**
+ * @brief Erases whole sectors of the update slot, taking the flash's time.
+ */
+static esp_err_t sim_ota_erase(size_t offset, size_t size) {
+  if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0 ||
+      offset + size > SIM_OTA_SLOT_SIZE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  for (size_t i = offset / SPI_FLASH_SEC_SIZE;
+       i < (offset + size) / SPI_FLASH_SEC_SIZE; i++) {
+    ota_erased[i] = true;
+    usleep(SIM_FLASH_ERASE_US);
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition,
+                                    size_t offset, size_t size) {
+  if (partition != &ota_partitions[1]) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  pthread_mutex_lock(&ota_lock);
+  esp_err_t err = sim_ota_erase(offset, size);
+  pthread_mutex_unlock(&ota_lock);
+  return err;
+}
+
+/**
+ * @brief Opens the slot as the target does: a known image size is erased
+ * up front, an unknown one erases the whole slot, and sequential writes
+ * leave erasing to esp_ota_write().
+ */
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size,
+                        esp_ota_handle_t *out_handle) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&ota_lock);
+  if (ota_file != NULL) {
+    err = ESP_ERR_INVALID_STATE;
+  } else if ((ota_file = fopen(sim_ota_path(), "wb")) == NULL) {
+    err = ESP_FAIL;
+  } else {
+    ota_written = 0;
+    ota_invalid = false;
+    ota_sequential = image_size == OTA_WITH_SEQUENTIAL_WRITES;
+    for (int i = 0; i < SIM_OTA_SECTORS; i++) {
+      ota_erased[i] = false;
+    }
+    if (image_size == 0 || image_size == OTA_SIZE_UNKNOWN) {
+      sim_ota_erase(0, SIM_OTA_SLOT_SIZE);
+    } else if (!ota_sequential) {
+      sim_ota_erase(0, (image_size + SPI_FLASH_SEC_SIZE - 1) &
+                           ~(SPI_FLASH_SEC_SIZE - 1));
+    }
+    *out_handle = SIM_OTA_HANDLE;
+  }
+  pthread_mutex_unlock(&ota_lock);
+  return err;
+}
+
+/**
+ * @brief Checks the image magic on the first write, as the target does, and
+ * keeps the slot's size limit.
+ */
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data,
+                        size_t size) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&ota_lock);
+  if (handle != SIM_OTA_HANDLE || ota_file == NULL) {
+    err = ESP_ERR_INVALID_ARG;
+  } else if (ota_written == 0 && size > 0 &&
+             ((const uint8_t *)data)[0] != SIM_IMAGE_MAGIC) {
+    ota_invalid = true;
+    err = ESP_ERR_OTA_VALIDATE_FAILED;
+  } else if (ota_written + size > SIM_OTA_SLOT_SIZE) {
+    err = ESP_ERR_INVALID_SIZE;
+  } else {
+    size_t first = ota_written / SPI_FLASH_SEC_SIZE;
+    size_t last = (ota_written + size - 1) / SPI_FLASH_SEC_SIZE;
+    for (size_t i = first; i <= last && size > 0 && err == ESP_OK; i++) {
+      if (ota_sequential && !ota_erased[i]) {
+        err = sim_ota_erase(i * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+      } else if (!ota_erased[i]) {
+        ESP_LOGE(TAG, "write to unerased sector at 0x%x",
+                 (unsigned)(i * SPI_FLASH_SEC_SIZE));
+        err = ESP_ERR_INVALID_STATE;
+      }
+    }
+    if (err == ESP_OK && fwrite(data, 1, size, ota_file) != size) {
+      err = ESP_FAIL;
+    }
+    if (err == ESP_OK) {
+      ota_written += (uint32_t)size;
+      usleep(size * SIM_FLASH_WRITE_NS_PER_BYTE / 1000);
+    }
+  }
+  pthread_mutex_unlock(&ota_lock);
+  return err;
+}
+
+static esp_err_t sim_ota_close(esp_ota_handle_t handle) {
+  if (handle != SIM_OTA_HANDLE || ota_file == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  fclose(ota_file);
+  ota_file = NULL;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+  pthread_mutex_lock(&ota_lock);
+  esp_err_t err = sim_ota_close(handle);
+  if (err == ESP_OK && (ota_written == 0 || ota_invalid)) {
+    err = ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  if (err == ESP_OK) {
+    ESP_LOGI(TAG, "%u byte image written to %s", (unsigned)ota_written,
+             sim_ota_path());
+  }
+  pthread_mutex_unlock(&ota_lock);
+  return err;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+  pthread_mutex_lock(&ota_lock);
+  esp_err_t err = sim_ota_close(handle);
+  pthread_mutex_unlock(&ota_lock);
+  return err;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+  ESP_LOGI(TAG, "next boot from %s", partition->label);
+  return ESP_OK;
+}
@@ -0,0 +1,21 @@
+/**
+ ******************************************************************************
+ * @file      sim.h
+ * @brief     Host simulation: hooks used by the simulator's own console
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+  uint64_t alloc_calls;
+  uint64_t alloc_bytes;
+  uint64_t free_calls;
+} sim_alloc_stats_t;
+
+/**
+ * @brief Heap calls made by the firmware and the SDK since start-up.
+ */
+void sim_alloc_stats(sim_alloc_stats_t *stats);
@@ -0,0 +1,42 @@
+/**
+ ******************************************************************************
+ * @file      sntp.c
+ * @brief     Host simulation: SNTP client
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stddef.h>
+
+#include "esp_log.h"
+#include "esp_sntp.h"
+
+#define TAG "sim_sntp"
+
+static sntp_sync_time_cb_t sync_cb;
+static const char *server_name;
+
+void sntp_setoperatingmode(sntp_operatingmode_t operating_mode) {}
+
+void sntp_setservername(unsigned char idx, const char *server) {
+  if (idx == 0) {
+    server_name = server;
+  }
+}
+
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t callback) {
+  sync_cb = callback;
+}
+
+void sntp_init(void) {
+  struct timeval now;
+
+  ESP_LOGI(TAG, "Using the host clock instead of %s",
+           server_name != NULL ? server_name : "(no server)");
+  if (sync_cb != NULL) {
+    gettimeofday(&now, NULL);
+    sync_cb(&now);
+  }
+}
+
+void sntp_stop(void) {}
@@ -0,0 +1,402 @@
+/**
+ ******************************************************************************
+ * @file      wifi.c
+ * @brief     Host simulation: default event loop, netif and Wi-Fi station.
+ *            Events are delivered one at a time from an event task, as the
+ *            IDF default loop does, so handlers may call back into the
+ *            driver. There is one access point, on channel $SIM_WIFI_CHANNEL
+ *            (default 6) with BSSID $SIM_WIFI_BSSID, and a connect takes
+ *            as long as its scan, association and DHCP exchange would.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+
+#define TAG "sim_wifi"
+
+#define SIM_EVENT_MAX_HANDLERS 8
+#define SIM_EVENT_QUEUE_LEN 16
+#define SIM_EVENT_DATA_MAX 64
+
+/* Air time of each step of a connect, from typical ESP32 traces */
+#define SIM_WIFI_CHANNELS 13
+#define SIM_WIFI_CHANNEL_SCAN_MS 120
+#define SIM_WIFI_PROBE_RESPONSE_MS 30
+#define SIM_WIFI_ASSOC_MS 100
+#define SIM_WIFI_DHCP_MS 600
+#define SIM_WIFI_DHCP_REBOOT_MS 100
+/* Where lwIP keeps the last lease with LWIP_DHCP_RESTORE_LAST_IP */
+#define SIM_DHCP_NAMESPACE "dhcp_state"
+#define SIM_DHCP_KEY "sta"
+
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+typedef struct {
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t handler;
+  void *arg;
+} sim_event_handler_t;
+
+typedef struct {
+  esp_event_base_t base;
+  int32_t id;
+  uint8_t data[SIM_EVENT_DATA_MAX];
+} sim_event_t;
+
+struct esp_netif_obj {
+  esp_netif_ip_info_t ip_info;
+  bool dhcpc_stopped;
+};
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static sim_event_handler_t handlers[SIM_EVENT_MAX_HANDLERS];
+static int handler_count;
+static sim_event_t queue[SIM_EVENT_QUEUE_LEN];
+static int queue_head;
+static int queue_len;
+
+static struct esp_netif_obj sta_netif;
+static wifi_config_t sta_config;
+static bool started;
+static bool associated;
+static pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool connecting;
+static uint8_t ap_bssid[6] = {0x24, 0x0a, 0xc4, 0x5a, 0x3e, 0x10};
+static uint8_t ap_channel = 6;
+
+/**
+ * @brief Default event loop task: pops events and runs matching handlers.
+ */
+static void sim_event_task(void *param) {
+  sim_event_t event;
+
+  for (;;) {
+    pthread_mutex_lock(&event_lock);
+    while (queue_len == 0) {
+      pthread_cond_wait(&event_cond, &event_lock);
+    }
+    event = queue[queue_head];
+    queue_head = (queue_head + 1) % SIM_EVENT_QUEUE_LEN;
+    queue_len--;
+    int count = handler_count;
+    pthread_mutex_unlock(&event_lock);
+
+    for (int i = 0; i < count; i++) {
+      if (handlers[i].base == event.base &&
+          (handlers[i].id == ESP_EVENT_ANY_ID || handlers[i].id == event.id)) {
+        handlers[i].handler(handlers[i].arg, event.base, event.id, event.data);
+      }
+    }
+  }
+}
+
+esp_err_t esp_event_loop_create_default(void) {
+  if (xTaskCreate(&sim_event_task, "sys_evt", 2048, NULL, 20, NULL) !=
+      pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t event_base,
+                                     int32_t event_id,
+                                     esp_event_handler_t event_handler,
+                                     void *event_handler_arg) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&event_lock);
+  if (handler_count == SIM_EVENT_MAX_HANDLERS) {
+    err = ESP_ERR_NO_MEM;
+  } else {
+    handlers[handler_count++] = (sim_event_handler_t){
+        event_base, event_id, event_handler, event_handler_arg};
+  }
+  pthread_mutex_unlock(&event_lock);
+
+  return err;
+}
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id,
+                         const void *event_data, size_t event_data_size,
+                         uint32_t ticks_to_wait) {
+  esp_err_t err = ESP_OK;
+  (void)ticks_to_wait;
+
+  if (event_data_size > SIM_EVENT_DATA_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  pthread_mutex_lock(&event_lock);
+  if (queue_len == SIM_EVENT_QUEUE_LEN) {
+    err = ESP_ERR_TIMEOUT;
+  } else {
+    sim_event_t *event = &queue[(queue_head + queue_len) % SIM_EVENT_QUEUE_LEN];
+    event->base = event_base;
+    event->id = event_id;
+    memset(event->data, 0, sizeof(event->data));
+    if (event_data != NULL) {
+      memcpy(event->data, event_data, event_data_size);
+    }
+    queue_len++;
+    pthread_cond_signal(&event_cond);
+  }
+  pthread_mutex_unlock(&event_lock);
+
+  return err;
+}
+
+esp_err_t esp_netif_init(void) { return ESP_OK; }
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void) {
+  /* 127.0.0.1, matching the broker the simulation talks to */
+  sta_netif.ip_info.ip.addr = 0x0100007f;
+  sta_netif.ip_info.netmask.addr = 0x000000ff;
+  return &sta_netif;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif,
+                                esp_netif_ip_info_t *ip_info) {
+  if (esp_netif == NULL || ip_info == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  *ip_info = esp_netif->ip_info;
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_set_ip_info(esp_netif_t *esp_netif,
+                                const esp_netif_ip_info_t *ip_info) {
+  if (esp_netif == NULL || ip_info == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  esp_netif->ip_info = *ip_info;
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_set_dns_info(esp_netif_t *esp_netif,
+                                 esp_netif_dns_type_t type,
+                                 esp_netif_dns_info_t *dns) {
+  return esp_netif != NULL && dns != NULL ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_netif_dhcpc_start(esp_netif_t *esp_netif) {
+  if (!esp_netif->dhcpc_stopped) {
+    return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED;
+  }
+  esp_netif->dhcpc_stopped = false;
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t *esp_netif) {
+  if (esp_netif->dhcpc_stopped) {
+    return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED;
+  }
+  esp_netif->dhcpc_stopped = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_str_to_ip4(const char *src, esp_ip4_addr_t *dst) {
+  unsigned a, b, c, d;
+  char end;
+  if (src == NULL || dst == NULL ||
+      sscanf(src, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) != 4 || a > 255 ||
+      b > 255 || c > 255 || d > 255) {
+    return ESP_ERR_ESP_NETIF_INVALID_PARAMS;
+  }
+  dst->addr = a | b << 8 | c << 16 | (uint32_t)d << 24;
+  return ESP_OK;
+}
+
+/**
+ * @brief Places the access point from $SIM_WIFI_CHANNEL and $SIM_WIFI_BSSID.
+ */
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+  const char *channel = getenv("SIM_WIFI_CHANNEL");
+  const char *bssid = getenv("SIM_WIFI_BSSID");
+  unsigned b[6];
+
+  if (channel != NULL && atoi(channel) >= 1 &&
+      atoi(channel) <= SIM_WIFI_CHANNELS) {
+    ap_channel = (uint8_t)atoi(channel);
+  }
+  if (bssid != NULL && sscanf(bssid, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2],
+                              &b[3], &b[4], &b[5]) == 6) {
+    for (int i = 0; i < 6; i++) {
+      ap_bssid[i] = (uint8_t)b[i];
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage) { return ESP_OK; }
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) { return ESP_OK; }
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf) {
+  sta_config = *conf;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+  started = true;
+  return esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0, 0);
+}
+
+/**
+ * @brief Scans as the driver would for this configuration.
+ * @retval how long the scan took, or -1 if the AP wasnt found
+ */
+static int sim_wifi_scan(const wifi_sta_config_t *config) {
+  bool match = !config->bssid_set ||
+               memcmp(config->bssid, ap_bssid, sizeof(ap_bssid)) == 0;
+
+  if (config->scan_method == WIFI_ALL_CHANNEL_SCAN) {
+    return match ? SIM_WIFI_CHANNELS * SIM_WIFI_CHANNEL_SCAN_MS : -1;
+  }
+
+  /* A fast scan starts on the configured channel and stops at the AP */
+  int first = config->channel > 0 ? config->channel - 1 : 0;
+  int ms = 0;
+  for (int i = 0; i < SIM_WIFI_CHANNELS; i++) {
+    int channel = (first + i) % SIM_WIFI_CHANNELS + 1;
+    if (match && channel == ap_channel) {
+      return ms + SIM_WIFI_PROBE_RESPONSE_MS;
+    }
+    ms += SIM_WIFI_CHANNEL_SCAN_MS;
+  }
+  return -1;
+}
+
+/**
+ * @brief Time to a DHCP lease. With LWIP_DHCP_RESTORE_LAST_IP the previous
+ * lease is requested straight away, skipping discover and offer.
+ */
+static int sim_wifi_dhcp(void) {
+  int ms = SIM_WIFI_DHCP_MS;
+#if CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+  nvs_handle_t nvs;
+  uint32_t last = 0;
+  if (nvs_open(SIM_DHCP_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+    if (nvs_get_u32(nvs, SIM_DHCP_KEY, &last) == ESP_OK &&
+        last == sta_netif.ip_info.ip.addr) {
+      ms = SIM_WIFI_DHCP_REBOOT_MS;
+    } else if (nvs_set_u32(nvs, SIM_DHCP_KEY, sta_netif.ip_info.ip.addr) ==
+               ESP_OK) {
+      nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+#endif
+  return ms;
+}
+
+static void sim_wifi_connect_task(void *param) {
+  wifi_sta_config_t config = sta_config.sta;
+  int scan_ms = sim_wifi_scan(&config);
+
+  if (scan_ms < 0) {
+    vTaskDelay(SIM_WIFI_CHANNELS * SIM_WIFI_CHANNEL_SCAN_MS / portTICK_PERIOD_MS);
+    ESP_LOGI(TAG, "no AP found");
+    wifi_event_sta_disconnected_t disconnected = {
+        .reason = WIFI_REASON_NO_AP_FOUND};
+    pthread_mutex_lock(&connect_lock);
+    connecting = false;
+    pthread_mutex_unlock(&connect_lock);
+    esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnected,
+                   sizeof(disconnected), 0);
+    vTaskDelete(NULL);
+  }
+
+  vTaskDelay((scan_ms + SIM_WIFI_ASSOC_MS) / portTICK_PERIOD_MS);
+  ESP_LOGI(TAG, "associated on channel %d after a %d ms scan", ap_channel,
+           scan_ms);
+  wifi_event_sta_connected_t connected = {0};
+  size_t ssid_len =
+      strnlen((const char *)config.ssid, sizeof(config.ssid));
+  memcpy(connected.ssid, config.ssid, ssid_len);
+  connected.ssid_len = ssid_len;
+  memcpy(connected.bssid, ap_bssid, sizeof(ap_bssid));
+  connected.channel = ap_channel;
+  associated = true;
+  esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &connected,
+                 sizeof(connected), 0);
+
+  /* With DHCP stopped the static address is up at once */
+  if (!sta_netif.dhcpc_stopped) {
+    vTaskDelay(sim_wifi_dhcp() / portTICK_PERIOD_MS);
+  }
+  ip_event_got_ip_t got_ip = {
+      .esp_netif = &sta_netif,
+      .ip_info = sta_netif.ip_info,
+  };
+  pthread_mutex_lock(&connect_lock);
+  connecting = false;
+  pthread_mutex_unlock(&connect_lock);
+  esp_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip, sizeof(got_ip), 0);
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Starts a connect in the background; its outcome arrives as events.
+ */
+esp_err_t esp_wifi_connect(void) {
+  if (!started) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  pthread_mutex_lock(&connect_lock);
+  bool busy = connecting;
+  connecting = true;
+  pthread_mutex_unlock(&connect_lock);
+  if (busy) {
+    return ESP_OK;
+  }
+
+  ESP_LOGI(TAG, "connecting to \"%s\"", (const char *)sta_config.sta.ssid);
+  if (xTaskCreate(&sim_wifi_connect_task, "sim_wifi_conn", 4096, NULL, 20,
+                  NULL) != pdPASS) {
+    pthread_mutex_lock(&connect_lock);
+    connecting = false;
+    pthread_mutex_unlock(&connect_lock);
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void) {
+  associated = false;
+  wifi_event_sta_disconnected_t disconnected = {
+      .reason = WIFI_REASON_ASSOC_LEAVE};
+  return esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnected,
+                        sizeof(disconnected), 0);
+}
+
+/**
+ * @brief Reports the AP the station is associated with, at a steady signal.
+ */
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info) {
+  if (!associated) {
+    return ESP_ERR_WIFI_NOT_CONNECT;
+  }
+  memset(ap_info, 0, sizeof(*ap_info));
+  memcpy(ap_info->ssid, sta_config.sta.ssid, sizeof(sta_config.sta.ssid));
+  memcpy(ap_info->bssid, ap_bssid, sizeof(ap_bssid));
+  ap_info->primary = ap_channel;
+  ap_info->rssi = -55;
+  return ESP_OK;
+}
@@ -0,0 +1,45 @@
+/**
+ ******************************************************************************
+ * @file      aws_iot_config.h
+ * @brief     Host simulation: AWS IoT SDK configuration for a local broker.
+ *            Endpoint, thing name and credentials come from the embedded
+ *            cloud_certs files exactly as on the target.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#ifndef AWS_IOT_MQTT_PORT
+#define AWS_IOT_MQTT_PORT 8883
+#endif
+
+/* MQTT PubSub */
+#define AWS_IOT_MQTT_TX_BUF_LEN 512
+#define AWS_IOT_MQTT_RX_BUF_LEN 512
+#define AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS                                    \
+  CONFIG_AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS
+
+/* Thing Shadow specific configs */
+#define SHADOW_MAX_SIZE_OF_RX_BUFFER (AWS_IOT_MQTT_RX_BUF_LEN + 1)
+#define MAX_SIZE_OF_UNIQUE_CLIENT_ID_BYTES 80
+#define MAX_SIZE_CLIENT_ID_WITH_SEQUENCE (MAX_SIZE_OF_UNIQUE_CLIENT_ID_BYTES + 10)
+#define MAX_SIZE_CLIENT_TOKEN_CLIENT_SEQUENCE                                  \
+  (MAX_SIZE_CLIENT_ID_WITH_SEQUENCE + 20)
+#define MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME 10
+#define MAX_THINGNAME_HANDLED_AT_ANY_GIVEN_TIME 10
+#define MAX_JSON_TOKEN_EXPECTED 120
+#define MAX_SHADOW_TOPIC_LENGTH_WITHOUT_THINGNAME 60
+#define MAX_SIZE_OF_THING_NAME 20
+#define MAX_SHADOW_TOPIC_LENGTH_BYTES                                          \
+  (MAX_SHADOW_TOPIC_LENGTH_WITHOUT_THINGNAME + MAX_SIZE_OF_THING_NAME)
+
+/* Auto Reconnect specific config */
+#define AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL 1000
+#define AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL 128000
+
+/* Don't report SDK metrics to a local broker */
+#define DISABLE_METRICS true
@@ -0,0 +1,63 @@
+/**
+ ******************************************************************************
+ * @file      miniz.h
+ * @brief     Host simulation: the ESP32 ROM's tinfl inflater, the subset the
+ *            firmware uses. Implemented on zlib, see fakes/miniz.c.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+typedef uint8_t mz_uint8;
+typedef uint32_t mz_uint32;
+
+#define TINFL_LZ_DICT_SIZE 32768
+
+enum {
+  TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+  TINFL_FLAG_HAS_MORE_INPUT = 2,
+  TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+  TINFL_FLAG_COMPUTE_ADLER32 = 8,
+};
+
+typedef enum {
+  TINFL_STATUS_BAD_PARAM = -3,
+  TINFL_STATUS_ADLER32_MISMATCH = -2,
+  TINFL_STATUS_FAILED = -1,
+  TINFL_STATUS_DONE = 0,
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+/*
+ * zlib keeps its own window, the caller's only receives the output. Its
+ * state lives in the arena, so like the ROM's a decompressor abandoned
+ * mid-stream holds no other memory.
+ */
+#define SIM_TINFL_ARENA_SIZE (48 * 1024)
+
+typedef struct {
+  mz_uint32 m_state;
+  /* Like the ROM's, may hold input read past the end of the stream */
+  mz_uint32 m_num_bits;
+  mz_uint32 m_bit_buf;
+  z_stream stream;
+  size_t arena_used;
+  _Alignas(16) mz_uint8 arena[SIM_TINFL_ARENA_SIZE];
+} tinfl_decompressor;
+
+#define tinfl_init(r)                                                          \
+  do {                                                                         \
+    (r)->m_state = 0;                                                          \
+  } while (0)
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r,
+                              const mz_uint8 *pIn_buf_next,
+                              size_t *pIn_buf_size, mz_uint8 *pOut_buf_start,
+                              mz_uint8 *pOut_buf_next, size_t *pOut_buf_size,
+                              const mz_uint32 decomp_flags);
@@ -0,0 +1,38 @@
+/**
+ ******************************************************************************
+ * @file      esp_http_client.h
+ * @brief     Host simulation: HTTP client. Requests are answered by a local
+ *            stand-in server, see fakes/http_client.c.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct esp_http_client *esp_http_client_handle_t;
+
+typedef struct {
+  const char *url;
+  const char *cert_pem;
+  int timeout_ms;
+  bool keep_alive_enable;
+} esp_http_client_config_t;
+
+esp_http_client_handle_t
+esp_http_client_init(const esp_http_client_config_t *config);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client,
+                                     const char *key, const char *value);
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len);
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client);
+int esp_http_client_get_status_code(esp_http_client_handle_t client);
+int64_t esp_http_client_get_content_length(esp_http_client_handle_t client);
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer,
+                         int len);
+bool esp_http_client_is_complete_data_received(
+    esp_http_client_handle_t client);
+esp_err_t esp_http_client_close(esp_http_client_handle_t client);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
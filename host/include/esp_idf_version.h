@@ -0,0 +1,7 @@
+#pragma once
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch)                               \
+  (((major) << 16) | ((minor) << 8) | (patch))
+
+/* The simulation follows the newest IDF API the firmware supports */
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(5, 0, 0)
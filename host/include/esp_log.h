@@ -0,0 +1,20 @@
+/**
+ ******************************************************************************
+ * @file      esp_log.h
+ * @brief     Host simulation: ESP-IDF logging to stdout
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdint.h>
+
+void sim_log_write(char level, const char *tag, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, format, ...) sim_log_write('E', tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) sim_log_write('W', tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) sim_log_write('I', tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) sim_log_write('D', tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) sim_log_write('V', tag, format, ##__VA_ARGS__)
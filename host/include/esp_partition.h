@@ -0,0 +1,24 @@
+/**
+ ******************************************************************************
+ * @file      esp_partition.h
+ * @brief     Host simulation: flash partitions
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct {
+  int type;
+  int subtype;
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition,
+                                    size_t offset, size_t size);
@@ -0,0 +1,18 @@
+/**
+ ******************************************************************************
+ * @file      esp_rom_crc.h
+ * @brief     Host simulation: ROM CRC routines, on zlib
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <zlib.h>
+
+/* Same convention as the ROM: start from 0, chain the previous result */
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf,
+                                        uint32_t len) {
+  return (uint32_t)crc32(crc, buf, len);
+}
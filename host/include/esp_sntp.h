@@ -0,0 +1,24 @@
+/**
+ ******************************************************************************
+ * @file      esp_sntp.h
+ * @brief     Host simulation: SNTP client. The host clock is already set, so
+ *            the sync notification comes as soon as the client starts.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <sys/time.h>
+
+typedef enum {
+  SNTP_OPMODE_POLL,
+  SNTP_OPMODE_LISTENONLY,
+} sntp_operatingmode_t;
+
+typedef void (*sntp_sync_time_cb_t)(struct timeval *tv);
+
+void sntp_setoperatingmode(sntp_operatingmode_t operating_mode);
+void sntp_setservername(unsigned char idx, const char *server);
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t callback);
+void sntp_init(void);
+void sntp_stop(void);
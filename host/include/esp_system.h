@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/* Ends the simulation process */
+void esp_restart(void) __attribute__((noreturn));
+uint32_t esp_get_free_heap_size(void);
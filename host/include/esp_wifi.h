@@ -0,0 +1,111 @@
+/**
+ ******************************************************************************
+ * @file      esp_wifi.h
+ * @brief     Host simulation: Wi-Fi station driver with one access point.
+ *            Connecting posts the same events the real driver would, after
+ *            the time a scan, association and DHCP take over the air.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_netif.h"
+
+#define ESP_ERR_WIFI_BASE 0x3000
+#define ESP_ERR_WIFI_NOT_CONNECT (ESP_ERR_WIFI_BASE + 15)
+
+extern esp_event_base_t const WIFI_EVENT;
+extern esp_event_base_t const IP_EVENT;
+
+typedef enum {
+  WIFI_EVENT_STA_START = 2,
+  WIFI_EVENT_STA_STOP = 3,
+  WIFI_EVENT_STA_CONNECTED = 4,
+  WIFI_EVENT_STA_DISCONNECTED = 5,
+} wifi_event_t;
+
+typedef enum {
+  IP_EVENT_STA_GOT_IP = 0,
+  IP_EVENT_STA_LOST_IP = 1,
+} ip_event_t;
+
+typedef struct {
+  int magic;
+} wifi_init_config_t;
+
+#define WIFI_INIT_CONFIG_DEFAULT()                                             \
+  { .magic = 0x1F2F3F4F }
+
+typedef enum { WIFI_STORAGE_FLASH, WIFI_STORAGE_RAM } wifi_storage_t;
+typedef enum { WIFI_MODE_NULL, WIFI_MODE_STA, WIFI_MODE_AP } wifi_mode_t;
+typedef enum { ESP_IF_WIFI_STA = 0, ESP_IF_WIFI_AP } wifi_interface_t;
+
+typedef enum { WIFI_FAST_SCAN = 0, WIFI_ALL_CHANNEL_SCAN } wifi_scan_method_t;
+
+typedef enum {
+  WIFI_CONNECT_AP_BY_SIGNAL = 0,
+  WIFI_CONNECT_AP_BY_SECURITY,
+} wifi_sort_method_t;
+
+typedef enum {
+  WIFI_REASON_AUTH_LEAVE = 3,
+  WIFI_REASON_ASSOC_LEAVE = 8,
+  WIFI_REASON_NO_AP_FOUND = 201,
+} wifi_err_reason_t;
+
+typedef struct {
+  uint8_t ssid[32];
+  uint8_t password[64];
+  wifi_scan_method_t scan_method;
+  bool bssid_set;
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint16_t listen_interval;
+  wifi_sort_method_t sort_method;
+} wifi_sta_config_t;
+
+typedef union {
+  wifi_sta_config_t sta;
+} wifi_config_t;
+
+typedef struct {
+  uint8_t ssid[32];
+  uint8_t ssid_len;
+  uint8_t bssid[6];
+  uint8_t channel;
+  int authmode;
+} wifi_event_sta_connected_t;
+
+typedef struct {
+  uint8_t ssid[32];
+  uint8_t ssid_len;
+  uint8_t bssid[6];
+  uint8_t reason;
+} wifi_event_sta_disconnected_t;
+
+typedef struct {
+  int if_index;
+  esp_netif_t *esp_netif;
+  esp_netif_ip_info_t ip_info;
+  bool ip_changed;
+} ip_event_got_ip_t;
+
+typedef struct {
+  uint8_t bssid[6];
+  uint8_t ssid[33];
+  uint8_t primary;
+  int8_t rssi;
+  int authmode;
+} wifi_ap_record_t;
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config);
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage);
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode);
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf);
+esp_err_t esp_wifi_start(void);
+esp_err_t esp_wifi_connect(void);
+esp_err_t esp_wifi_disconnect(void);
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info);
@@ -0,0 +1,45 @@
+/**
+ ******************************************************************************
+ * @file      FreeRTOS.h
+ * @brief     Host simulation: FreeRTOS kernel types on top of pthreads
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_bit_defs.h"
+#include "sdkconfig.h"
+
+typedef int32_t BaseType_t;
+typedef uint32_t UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+/* One tick per millisecond, as on the target */
+#define configTICK_RATE_HZ 1000
+#define configMAX_PRIORITIES 25
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define portTICK_RATE_MS portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)                                                      \
+  ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+
+#define tskIDLE_PRIORITY ((UBaseType_t)0)
+
+/* Critical sections are a plain mutex per spinlock */
+typedef struct {
+  pthread_mutex_t lock;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {PTHREAD_MUTEX_INITIALIZER}
+#define portENTER_CRITICAL(mux) pthread_mutex_lock(&(mux)->lock)
+#define portEXIT_CRITICAL(mux) pthread_mutex_unlock(&(mux)->lock)
@@ -0,0 +1,17 @@
+/**
+ ******************************************************************************
+ * @file      queue.h
+ * @brief     Host simulation: FreeRTOS queues, items copied in and out
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_queue *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+void vQueueDelete(QueueHandle_t queue);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
@@ -0,0 +1,17 @@
+/**
+ ******************************************************************************
+ * @file      semphr.h
+ * @brief     Host simulation: FreeRTOS mutexes
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_semaphore *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
@@ -0,0 +1,44 @@
+/**
+ ******************************************************************************
+ * @file      task.h
+ * @brief     Host simulation: FreeRTOS tasks and direct notifications
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+typedef enum {
+  eNoAction = 0,
+  eSetBits,
+  eIncrement,
+  eSetValueWithOverwrite,
+  eSetValueWithoutOverwrite,
+} eNotifyAction;
+
+/* Every task is a detached pthread; stack depth and priority are ignored */
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name,
+                       uint32_t stack_depth, void *arg, UBaseType_t priority,
+                       TaskHandle_t *handle);
+
+/* Both cores are simulated by the host's scheduler, the core is ignored */
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define xTaskCreatePinnedToCore(task, name, stack_depth, arg, priority,        \
+                                handle, core)                                  \
+  xTaskCreate((task), (name), (stack_depth), (arg), (priority), (handle))
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value,
+                       eNotifyAction action);
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit,
+                           uint32_t *value, TickType_t ticks);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks);
+
+#define xTaskNotifyGive(task) xTaskNotify((task), 0, eIncrement)
@@ -0,0 +1,42 @@
+/**
+ ******************************************************************************
+ * @file      i2c-lcd1602.h
+ * @brief     Host simulation: HD44780 LCD behind a PCF8574 backpack. The
+ *            fake keeps the controller's DDRAM in memory, fed either by
+ *            these calls or by raw expander writes over I2C, and logs every
+ *            visible row that changes.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "smbus.h"
+
+typedef struct {
+  bool init;
+  smbus_info_t *smbus_info;
+  uint8_t backlight_flag;
+  uint8_t num_rows;
+  uint8_t num_columns;
+  uint8_t num_visible_columns;
+  uint8_t display_control_flags;
+  uint8_t entry_mode_flags;
+} i2c_lcd1602_info_t;
+
+i2c_lcd1602_info_t *i2c_lcd1602_malloc(void);
+esp_err_t i2c_lcd1602_init(i2c_lcd1602_info_t *i2c_lcd1602_info,
+                           smbus_info_t *smbus_info, bool backlight,
+                           uint8_t num_rows, uint8_t num_columns,
+                           uint8_t num_visible_columns);
+esp_err_t i2c_lcd1602_reset(const i2c_lcd1602_info_t *i2c_lcd1602_info);
+esp_err_t i2c_lcd1602_clear(const i2c_lcd1602_info_t *i2c_lcd1602_info);
+esp_err_t i2c_lcd1602_home(const i2c_lcd1602_info_t *i2c_lcd1602_info);
+esp_err_t i2c_lcd1602_move_cursor(const i2c_lcd1602_info_t *i2c_lcd1602_info,
+                                  uint8_t col, uint8_t row);
+esp_err_t i2c_lcd1602_write_char(const i2c_lcd1602_info_t *i2c_lcd1602_info,
+                                 uint8_t chr);
+esp_err_t i2c_lcd1602_write_string(const i2c_lcd1602_info_t *i2c_lcd1602_info,
+                                   const char *string);
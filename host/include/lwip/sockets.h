@@ -0,0 +1,14 @@
+/**
+ ******************************************************************************
+ * @file      sockets.h
+ * @brief     Host simulation: lwIP's BSD socket API, which the host's own
+ *            sockets provide
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
@@ -0,0 +1,176 @@
+/**
+ ******************************************************************************
+ * @file      sdkconfig.h
+ * @brief     Host simulation: Kconfig values. Mirrors the defaults in
+ *            main/Kconfig.projbuild; any of them can be overridden with -D.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+/* From sdkconfig.defaults, for the esp-aws-iot component */
+#ifndef CONFIG_AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS
+#define CONFIG_AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS 10
+#endif
+
+#ifndef CONFIG_SHADOW_UPDATE_DEBOUNCE_MS
+#define CONFIG_SHADOW_UPDATE_DEBOUNCE_MS 50
+#endif
+
+#ifndef CONFIG_METRICS_PUBLISH_INTERVAL_S
+#define CONFIG_METRICS_PUBLISH_INTERVAL_S 300
+#endif
+
+#ifndef CONFIG_LCD_I2C_FAST_MODE
+#define CONFIG_LCD_I2C_FAST_MODE 0
+#endif
+
+#ifndef CONFIG_LCD_PAGE_INTERVAL_S
+#define CONFIG_LCD_PAGE_INTERVAL_S 5
+#endif
+
+#ifndef CONFIG_SCHEDULE_MAX_ENTRIES
+#define CONFIG_SCHEDULE_MAX_ENTRIES 256
+#endif
+
+#ifndef CONFIG_SCHEDULE_TIMEZONE
+#define CONFIG_SCHEDULE_TIMEZONE "UTC0"
+#endif
+
+#ifndef CONFIG_SCHEDULE_SNTP_SERVER
+#define CONFIG_SCHEDULE_SNTP_SERVER "pool.ntp.org"
+#endif
+
+#ifndef CONFIG_OTA_RESUME_ATTEMPTS
+#define CONFIG_OTA_RESUME_ATTEMPTS 8
+#endif
+
+#ifndef CONFIG_OTA_PROGRESS_INTERVAL_MS
+#define CONFIG_OTA_PROGRESS_INTERVAL_MS 1000
+#endif
+
+#ifndef CONFIG_OTA_PIPELINE_BUFFERS
+#define CONFIG_OTA_PIPELINE_BUFFERS 4
+#endif
+
+#ifndef CONFIG_OTA_WRITER_CORE
+#define CONFIG_OTA_WRITER_CORE -1
+#endif
+
+#ifndef CONFIG_WIFI_FAST_CONNECT
+#define CONFIG_WIFI_FAST_CONNECT 1
+#endif
+
+#ifndef CONFIG_WIFI_CONNECT_TIMEOUT_MS
+#define CONFIG_WIFI_CONNECT_TIMEOUT_MS 5000
+#endif
+
+#ifndef CONFIG_WIFI_STATIC_IP
+#define CONFIG_WIFI_STATIC_IP 0
+#endif
+
+#if CONFIG_WIFI_STATIC_IP
+#ifndef CONFIG_WIFI_STATIC_IP_ADDR
+#define CONFIG_WIFI_STATIC_IP_ADDR "192.168.1.50"
+#endif
+#ifndef CONFIG_WIFI_STATIC_NETMASK
+#define CONFIG_WIFI_STATIC_NETMASK "255.255.255.0"
+#endif
+#ifndef CONFIG_WIFI_STATIC_GATEWAY
+#define CONFIG_WIFI_STATIC_GATEWAY "192.168.1.1"
+#endif
+#ifndef CONFIG_WIFI_STATIC_DNS
+#define CONFIG_WIFI_STATIC_DNS "192.168.1.1"
+#endif
+#elif CONFIG_WIFI_FAST_CONNECT && !defined(CONFIG_LWIP_DHCP_RESTORE_LAST_IP)
+/* Selected by WIFI_FAST_CONNECT */
+#define CONFIG_LWIP_DHCP_RESTORE_LAST_IP 1
+#endif
+
+#ifndef CONFIG_CLOUD_TLS_SESSION_RESUMPTION
+#define CONFIG_CLOUD_TLS_SESSION_RESUMPTION 1
+#endif
+
+#ifndef CONFIG_LAN_CONTROL
+#define CONFIG_LAN_CONTROL 0
+#endif
+
+#if CONFIG_LAN_CONTROL && !defined(CONFIG_LAN_CONTROL_PORT)
+#define CONFIG_LAN_CONTROL_PORT 4210
+#endif
+
+#ifndef CONFIG_OUTLET_STORE_DELAY_MS
+#define CONFIG_OUTLET_STORE_DELAY_MS 1000
+#endif
+
+#ifndef CONFIG_OUTLET_JOURNAL_MAX_EVENTS
+#define CONFIG_OUTLET_JOURNAL_MAX_EVENTS 64
+#endif
+
+#ifndef CONFIG_OUTLET_COUNT
+#define CONFIG_OUTLET_COUNT 4
+#endif
+
+#ifndef CONFIG_OUTLET_1_GPIO
+#define CONFIG_OUTLET_1_GPIO 23
+#endif
+
+#ifndef CONFIG_OUTLET_2_GPIO
+#define CONFIG_OUTLET_2_GPIO 22
+#endif
+
+#ifndef CONFIG_OUTLET_3_GPIO
+#define CONFIG_OUTLET_3_GPIO 21
+#endif
+
+#ifndef CONFIG_OUTLET_4_GPIO
+#define CONFIG_OUTLET_4_GPIO 5
+#endif
+
+#ifndef CONFIG_OUTLET_5_GPIO
+#define CONFIG_OUTLET_5_GPIO 4
+#endif
+
+#ifndef CONFIG_OUTLET_6_GPIO
+#define CONFIG_OUTLET_6_GPIO 16
+#endif
+
+#ifndef CONFIG_OUTLET_7_GPIO
+#define CONFIG_OUTLET_7_GPIO 17
+#endif
+
+#ifndef CONFIG_OUTLET_8_GPIO
+#define CONFIG_OUTLET_8_GPIO 25
+#endif
+
+#ifndef CONFIG_OUTLET_9_GPIO
+#define CONFIG_OUTLET_9_GPIO 26
+#endif
+
+#ifndef CONFIG_OUTLET_10_GPIO
+#define CONFIG_OUTLET_10_GPIO 27
+#endif
+
+#ifndef CONFIG_OUTLET_11_GPIO
+#define CONFIG_OUTLET_11_GPIO 32
+#endif
+
+#ifndef CONFIG_OUTLET_12_GPIO
+#define CONFIG_OUTLET_12_GPIO 33
+#endif
+
+#ifndef CONFIG_OUTLET_13_GPIO
+#define CONFIG_OUTLET_13_GPIO 13
+#endif
+
+#ifndef CONFIG_OUTLET_14_GPIO
+#define CONFIG_OUTLET_14_GPIO 14
+#endif
+
+#ifndef CONFIG_OUTLET_15_GPIO
+#define CONFIG_OUTLET_15_GPIO 15
+#endif
+
+#ifndef CONFIG_OUTLET_16_GPIO
+#define CONFIG_OUTLET_16_GPIO 2
+#endif
@@ -0,0 +1,32 @@
+/**
+ ******************************************************************************
+ * @file      sim_tls_pem.h
+ * @brief     Host simulation: force-included into the SDK's Linux mbedTLS
+ *            port. That port loads credentials from files, while the
+ *            firmware hands it the embedded PEM text, so the two file
+ *            loaders are redirected to their in-memory counterparts.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <string.h>
+
+#include "mbedtls/pk.h"
+#include "mbedtls/x509_crt.h"
+
+static inline int sim_x509_crt_parse_pem(mbedtls_x509_crt *chain,
+                                         const char *pem) {
+  return mbedtls_x509_crt_parse(chain, (const unsigned char *)pem,
+                                strlen(pem) + 1);
+}
+
+static inline int sim_pk_parse_pem(mbedtls_pk_context *ctx, const char *pem,
+                                   const char *pwd) {
+  return mbedtls_pk_parse_key(ctx, (const unsigned char *)pem, strlen(pem) + 1,
+                              (const unsigned char *)pwd,
+                              pwd != NULL ? strlen(pwd) : 0);
+}
+
+#define mbedtls_x509_crt_parse_file sim_x509_crt_parse_pem
+#define mbedtls_pk_parse_keyfile sim_pk_parse_pem
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/i2c.h"
+
+typedef uint16_t i2c_address_t;
+
+typedef struct {
+  bool init;
+  i2c_port_t i2c_port;
+  i2c_address_t address;
+  TickType_t timeout;
+} smbus_info_t;
+
+smbus_info_t *smbus_malloc(void);
+esp_err_t smbus_init(smbus_info_t *smbus_info, i2c_port_t i2c_port,
+                     i2c_address_t address);
+esp_err_t smbus_set_timeout(smbus_info_t *smbus_info, TickType_t timeout);
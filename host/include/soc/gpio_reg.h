@@ -0,0 +1,15 @@
+/**
+ ******************************************************************************
+ * @file      gpio_reg.h
+ * @brief     Host simulation: GPIO output set/clear registers, at their
+ *            ESP32 addresses.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#define DR_REG_GPIO_BASE 0x3ff44000
+#define GPIO_OUT_W1TS_REG (DR_REG_GPIO_BASE + 0x0008)
+#define GPIO_OUT_W1TC_REG (DR_REG_GPIO_BASE + 0x000c)
+#define GPIO_OUT1_W1TS_REG (DR_REG_GPIO_BASE + 0x0014)
+#define GPIO_OUT1_W1TC_REG (DR_REG_GPIO_BASE + 0x0018)
@@ -0,0 +1,15 @@
+/**
+ ******************************************************************************
+ * @file      soc.h
+ * @brief     Host simulation: peripheral register access. Writes go to the
+ *            fake of the peripheral that owns the address.
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#include <stdint.h>
+
+void sim_reg_write(uint32_t reg, uint32_t value);
+
+#define REG_WRITE(_r, _v) sim_reg_write((uint32_t)(_r), (uint32_t)(_v))
@@ -0,0 +1,10 @@
+/**
+ ******************************************************************************
+ * @file      spi_flash_mmap.h
+ * @brief     Host simulation: flash geometry
+ *
+ ******************************************************************************
+ */
+#pragma once
+
+#define SPI_FLASH_SEC_SIZE 4096
@@ -0,0 +1,218 @@
+/**
+ ******************************************************************************
+ * @file      lan_loadgen.c
+ * @brief     Load generator for the local UDP control protocol of
+ *            lan_control.h. Keeps a number of requests in flight against a
+ *            strip or the simulator and reports requests per second and
+ *            the round trip time distribution:
+ *              lan_loadgen [-a addr] [-p port] [-n requests]
+ *                          [-c in flight] [-o get|set|toggle] [-m mask]
+ *            A request unanswered for a second counts as lost. Gets are
+ *            sent unless -o says otherwise, so a run doesnt switch relays.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lan_control.h"
+
+#define LOADGEN_TIMEOUT_US 1000000
+#define LOADGEN_MAX_IN_FLIGHT 256
+
+typedef struct {
+  uint16_t seq;
+  uint64_t sent_us;
+} loadgen_pending_t;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t count,
+                           double fraction) {
+  size_t index = (size_t)(fraction * (double)count);
+  return sorted[index < count ? index : count - 1];
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-a addr] [-p port] [-n requests] [-c in flight]"
+          " [-o get|set|toggle] [-m mask]\n",
+          name);
+  exit(2);
+}
+
+static void put_le16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+}
+
+int main(int argc, char **argv) {
+  const char *addr_text = "127.0.0.1";
+  unsigned port = 4210;
+  unsigned requests = 10000;
+  unsigned in_flight = 1;
+  uint8_t opcode = LAN_CONTROL_OP_GET;
+  unsigned mask = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "a:p:n:c:o:m:")) != -1) {
+    switch (opt) {
+    case 'a':
+      addr_text = optarg;
+      break;
+    case 'p':
+      port = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      requests = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      in_flight = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'o':
+      if (strcmp(optarg, "get") == 0) {
+        opcode = LAN_CONTROL_OP_GET;
+      } else if (strcmp(optarg, "set") == 0) {
+        opcode = LAN_CONTROL_OP_SET;
+      } else if (strcmp(optarg, "toggle") == 0) {
+        opcode = LAN_CONTROL_OP_TOGGLE;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 'm':
+      mask = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (requests == 0 || in_flight == 0 || in_flight > LOADGEN_MAX_IN_FLIGHT ||
+      port == 0 || port > 65535 || mask > 0xFFFF) {
+    usage(argv[0]);
+  }
+
+  struct sockaddr_in peer = {.sin_family = AF_INET, .sin_port = htons(port)};
+  if (inet_pton(AF_INET, addr_text, &peer.sin_addr) != 1) {
+    fprintf(stderr, "bad address %s\n", addr_text);
+    return 2;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&peer, sizeof(peer)) < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  uint32_t *rtt = malloc(requests * sizeof(*rtt));
+  if (rtt == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  loadgen_pending_t pending[LOADGEN_MAX_IN_FLIGHT];
+  unsigned pending_count = 0;
+  unsigned sent = 0;
+  unsigned received = 0;
+  unsigned lost = 0;
+  unsigned failed = 0;
+  uint64_t start_us = now_us();
+
+  while (received + lost < requests) {
+    /* Top the window up */
+    while (pending_count < in_flight && sent < requests) {
+      uint8_t msg[LAN_CONTROL_MSG_LEN] = {0};
+      uint16_t seq = (uint16_t)sent;
+
+      msg[LAN_CONTROL_OFF_MAGIC] = LAN_CONTROL_MAGIC;
+      msg[LAN_CONTROL_OFF_OPCODE] = opcode;
+      put_le16(msg + LAN_CONTROL_OFF_SEQ, seq);
+      put_le16(msg + LAN_CONTROL_OFF_MASK, (uint16_t)mask);
+      /* Set alternates between all on and all off */
+      put_le16(msg + LAN_CONTROL_OFF_VALUES, (sent & 1) ? 0 : (uint16_t)mask);
+      pending[pending_count] = (loadgen_pending_t){seq, now_us()};
+      if (send(fd, msg, sizeof(msg), 0) != (ssize_t)sizeof(msg)) {
+        perror("send");
+        return 1;
+      }
+      pending_count++;
+      sent++;
+    }
+
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, 50);
+    if (ready < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    uint64_t now = now_us();
+    if (ready > 0) {
+      uint8_t reply[LAN_CONTROL_MSG_LEN];
+      ssize_t len = recv(fd, reply, sizeof(reply), 0);
+      if (len == (ssize_t)sizeof(reply) &&
+          reply[LAN_CONTROL_OFF_MAGIC] == LAN_CONTROL_MAGIC &&
+          reply[LAN_CONTROL_OFF_OPCODE] == (opcode | LAN_CONTROL_REPLY)) {
+        uint16_t seq = (uint16_t)(reply[LAN_CONTROL_OFF_SEQ] |
+                                  reply[LAN_CONTROL_OFF_SEQ + 1] << 8);
+        for (unsigned i = 0; i < pending_count; i++) {
+          if (pending[i].seq == seq) {
+            rtt[received++] = (uint32_t)(now - pending[i].sent_us);
+            if (reply[LAN_CONTROL_OFF_STATUS] != LAN_CONTROL_OK) {
+              failed++;
+            }
+            pending[i] = pending[--pending_count];
+            break;
+          }
+        }
+      }
+    }
+
+    /* Late replies of requests counted as lost are ignored above */
+    for (unsigned i = 0; i < pending_count;) {
+      if (now - pending[i].sent_us > LOADGEN_TIMEOUT_US) {
+        lost++;
+        pending[i] = pending[--pending_count];
+      } else {
+        i++;
+      }
+    }
+  }
+
+  double seconds = (double)(now_us() - start_us) / 1e6;
+  printf("%u requests, %u in flight: %u answered, %u lost, %u failed\n",
+         requests, in_flight, received, lost, failed);
+  printf("%.0f requests/s over %.3f s\n", received / seconds, seconds);
+  if (received > 0) {
+    qsort(rtt, received, sizeof(*rtt), compare_u32);
+    printf("round trip us: min %" PRIu32 " p50 %" PRIu32 " p90 %" PRIu32
+           " p99 %" PRIu32 " p99.9 %" PRIu32 " max %" PRIu32 "\n",
+           rtt[0], percentile(rtt, received, 0.50),
+           percentile(rtt, received, 0.90), percentile(rtt, received, 0.99),
+           percentile(rtt, received, 0.999), rtt[received - 1]);
+  }
+
+  free(rtt);
+  close(fd);
+  return lost > 0 || failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+/**
+ ******************************************************************************
+ * @file      sim_main.c
+ * @brief     Host simulation entry point. Runs app_main() exactly as the
+ *            target would, then reads console commands from stdin that
+ *            stand in for the local buttons:
+ *              <outlet> <0|1>  switch an outlet locally
+ *              storm <count>   flip outlets round-robin, count times
+ *              scene <mask> <state>  switch the outlets in mask at once
+ *              page <n>        put LCD page n on the glass
+ *              schedule <id> [rule]  add or replace a schedule, or remove
+ *                              it when no rule is given
+ *              ota <url>       start a firmware upgrade, as a message on
+ *                              the OTA topic does
+ *              stats           CPU time and heap calls since the last stats,
+ *                              and the LCD bus time per frame
+ *              boot            print the boot timeline
+ *              quit            end the simulation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "boot.h"
+#include "lcd_bus.h"
+#include "lcd_display.h"
+#include "outlet_config.h"
+#include "output_driver.h"
+#include "schedule.h"
+#include "sim.h"
+#include "sub_pub_ota.h"
+
+#define TAG "sim"
+
+void app_main(void);
+
+static sim_alloc_stats_t last_alloc;
+static uint64_t last_cpu_us;
+
+static uint64_t process_cpu_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Prints the CPU time and heap traffic since the previous call, so a
+ * run of N updates can be divided down to a per-update cost.
+ */
+static void print_stats(void) {
+  sim_alloc_stats_t now;
+  sim_alloc_stats(&now);
+  uint64_t cpu_us = process_cpu_us();
+
+  ESP_LOGI(TAG,
+           "cpu %" PRIu64 " us, %" PRIu64 " allocs (%" PRIu64 " bytes), %" PRIu64
+           " frees",
+           cpu_us - last_cpu_us, now.alloc_calls - last_alloc.alloc_calls,
+           now.alloc_bytes - last_alloc.alloc_bytes,
+           now.free_calls - last_alloc.free_calls);
+
+  last_alloc = now;
+  last_cpu_us = cpu_us;
+
+  lcd_bus_stats_t bus;
+  lcd_bus_get_stats(&bus);
+  ESP_LOGI(TAG, "lcd %u frames, last %u bytes in %u us, max %u us",
+           (unsigned)bus.frames, (unsigned)bus.last_bytes,
+           (unsigned)bus.last_us, (unsigned)bus.max_us);
+}
+
+static void storm(unsigned count) {
+  for (unsigned i = 0; i < count; i++) {
+    unsigned short outlet = i % OUTLET_COUNT + 1;
+    app_driver_set_state(!app_driver_get_state(outlet), outlet);
+  }
+}
+
+int main(void) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  app_main();
+  print_stats();
+
+  char line[OTA_URL_MAX_LEN + 8];
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    unsigned outlet;
+    int mask;
+    int state;
+    unsigned value;
+    char id[SCHEDULE_ID_MAX_LEN + 1];
+    int rule;
+
+    if (sscanf(line, "storm %u", &value) == 1) {
+      storm(value);
+    } else if (sscanf(line, "scene %i %i", &mask, &state) == 2) {
+      if (app_driver_apply_mask(mask, state, true) != ESP_OK) {
+        ESP_LOGE(TAG, "bad scene mask 0x%x", mask);
+      }
+    } else if (sscanf(line, "page %u", &value) == 1) {
+      lcd_display_show_page(value);
+    } else if (sscanf(line, "schedule %7s %n", id, &rule) == 1) {
+      line[strcspn(line, "\n")] = '\0';
+      esp_err_t err = schedule_set(id, line + rule);
+      if (err != ESP_OK) {
+        ESP_LOGE(TAG, "bad schedule: %s", esp_err_to_name(err));
+      }
+    } else if (strncmp(line, "ota ", 4) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      esp_err_t err = ota_request(line + 4);
+      if (err != ESP_OK) {
+        ESP_LOGE(TAG, "upgrade not started: %s", esp_err_to_name(err));
+      }
+    } else if (sscanf(line, "%u %u", &outlet, &value) == 2) {
+      if (app_driver_set_state(value != 0, outlet) != ESP_OK) {
+        ESP_LOGE(TAG, "no outlet %u", outlet);
+      }
+    } else if (strncmp(line, "stats", 5) == 0) {
+      print_stats();
+    } else if (strncmp(line, "boot", 4) == 0) {
+      boot_timeline_log();
+    } else if (strncmp(line, "quit", 4) == 0) {
+      return 0;
+    } else if (line[0] != '\n') {
+      ESP_LOGE(TAG, "unknown command: %s", line);
+    }
+  }
+
+  /* Keep the tasks running when stdin is closed, e.g. under perf */
+  for (;;) {
+    pause();
+  }
+}
@@ -0,0 +1,117 @@
+#!/bin/sh
+# Measures TLS reconnects against a local broker, with session resumption
+# on and off. Each simulator connects through a proxy on 8883 that drops
+# every connection at once when told to; the handshake and reconnect times
+# the firmware logs are collected and their medians printed.
+#
+#   tls_resume_measure.sh <sim, resumption on> <sim, resumption off> [drops]
+#
+# Build the two simulators with -DSIM_TLS_SESSION_RESUMPTION=ON and OFF,
+# and run the broker on $BROKER_PORT (default 8884) instead of 8883.
+# Needs python3 for the proxy.
+set -eu
+
+sim_on=$1
+sim_off=$2
+drops=${3:-20}
+broker_port=${BROKER_PORT:-8884}
+dir=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null || true; rm -rf "$dir"' EXIT
+
+# Forwards 8883 to the broker; SIGUSR1 closes every open connection
+cat >"$dir/proxy.py" <<'EOF'
+import selectors, signal, socket, sys
+
+target = ("127.0.0.1", int(sys.argv[1]))
+sel = selectors.DefaultSelector()
+pairs = {}
+drop = False
+
+def on_usr1(signum, frame):
+    global drop
+    drop = True
+
+signal.signal(signal.SIGUSR1, on_usr1)
+server = socket.socket()
+server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+server.bind(("127.0.0.1", 8883))
+server.listen()
+sel.register(server, selectors.EVENT_READ)
+
+def close(sock):
+    peer = pairs.pop(sock, None)
+    for s in (sock, peer):
+        if s is not None:
+            pairs.pop(s, None)
+            sel.unregister(s)
+            s.close()
+
+while True:
+    try:
+        events = sel.select(timeout=0.1)
+    except InterruptedError:
+        events = []
+    if drop:
+        drop = False
+        for sock in list(pairs):
+            if sock in pairs:
+                close(sock)
+    for key, _ in events:
+        sock = key.fileobj
+        if sock is server:
+            client, _ = server.accept()
+            upstream = socket.create_connection(target)
+            pairs[client] = upstream
+            pairs[upstream] = client
+            sel.register(client, selectors.EVENT_READ)
+            sel.register(upstream, selectors.EVENT_READ)
+        elif sock in pairs:
+            data = sock.recv(65536)
+            if data:
+                pairs[sock].sendall(data)
+            else:
+                close(sock)
+EOF
+
+python3 "$dir/proxy.py" "$broker_port" &
+proxy=$!
+sleep 1
+
+# Prints the median of the numbers on stdin
+median() {
+  sort -n | awk '{ v[NR] = $1 } END { if (NR) print v[int((NR + 1) / 2)]; else print "-" }'
+}
+
+measure() {
+  name=$1
+  sim=$2
+  log=$dir/$name.txt
+
+  # The simulator keeps running after the end of its input
+  (cd "$dir" && SIM_NVS_FILE="$dir/$name.nvs" "$sim" </dev/null) >"$log" 2>&1 &
+  pid=$!
+  sleep 5
+  i=0
+  while [ $i -lt "$drops" ]; do
+    kill -USR1 $proxy
+    sleep 4
+    i=$((i + 1))
+  done
+  kill $pid
+  wait $pid 2>/dev/null || true
+
+  # The first handshake of the run is always full; only reconnects count
+  handshakes=$(grep "CLOUD_TLS: .* handshake" "$log" | tail -n +2)
+  printf '%-16s %8s %8s %10s %8s %8s %8s\n' "$name" \
+    "$(echo "$handshakes" | grep -c Resumed || true)" \
+    "$(echo "$handshakes" | grep -c Full || true)" \
+    "$(grep -o "Reconnected after [0-9]*" "$log" | awk '{ print $3 }' | median)" \
+    "$(echo "$handshakes" | sed -n 's/.*handshake \([0-9]*\) ms,.*/\1/p' | median)" \
+    "$(echo "$handshakes" | sed -n 's/.* \([0-9]*\) ms CPU.*/\1/p' | median)" \
+    "$(echo "$handshakes" | sed -n 's/.*TCP \([0-9]*\) ms.*/\1/p' | median)"
+}
+
+printf '%-16s %8s %8s %10s %8s %8s %8s\n' "median ms" resumed full \
+  reconnect wall CPU TCP
+measure resumption_on "$sim_on"
+measure resumption_off "$sim_off"
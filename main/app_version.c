@@ -0,0 +1,29 @@
+/**
+ ******************************************************************************
+ * @file      app_version.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Firmware Version Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include "esp_idf_version.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_app_desc.h"
+#else
+#include "esp_ota_ops.h"
+#endif
+
+#include "app_version.h"
+
+/**
+ * @brief The app description moved to esp_app_desc in IDF 5; older releases
+ *        still serve it from the OTA API.
+ */
+const char *firmware_version(void) {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  return esp_app_get_description()->version;
+#else
+  return esp_ota_get_app_description()->version;
+#endif
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+/* Version string of the running firmware image, from its app description */
+const char *firmware_version(void);
@@ -12,116 +12,184 @@
 #include "aws_custom_utils.h"
 #include <stdbool.h>
 #include "string.h"
+#include "aws_iot_shadow_json.h"
 
-#define OBJECT_NAME_STRING "\"%s\":{"
+/* Longest decimal form of a 32 bit integer including the sign */
+#define MAX_INT32_DIGITS 11
 
-static inline IoT_Error_t check_snprintf_ret_val(int32_t snPrintfReturn, size_t maxSizeOfJsonDocument) {
-	if(snPrintfReturn < 0) {
+/* Blank filler used to reserve template value slots */
+#define TEMPLATE_SLOT_FILLER "           "
+
+/**
+ * @brief Cursor over a JSON document buffer.
+ *
+ * The cursor always points at the terminating NUL of the document and
+ * remaining counts the bytes left from the cursor to the end of the buffer,
+ * so appending never needs to rescan the document with strlen.
+ */
+typedef struct {
+	char *pCursor;
+	size_t remaining;
+} json_writer_t;
+
+static IoT_Error_t json_writer_init(json_writer_t *pWriter, char *pJsonDocument, size_t maxSizeOfJsonDocument) {
+	size_t used;
+
+	if(pJsonDocument == NULL) {
+		return NULL_VALUE_ERROR;
+	}
+
+	/* The only scan of the document, everything after this is cursor arithmetic */
+	used = strnlen(pJsonDocument, maxSizeOfJsonDocument);
+	if(maxSizeOfJsonDocument - used <= 1) {
 		return SHADOW_JSON_ERROR;
-	} else if((size_t) snPrintfReturn >= maxSizeOfJsonDocument) {
+	}
+
+	pWriter->pCursor = pJsonDocument + used;
+	pWriter->remaining = maxSizeOfJsonDocument - used;
+	return SUCCESS;
+}
+
+static inline IoT_Error_t json_write_raw(json_writer_t *pWriter, const char *pSrc, size_t len) {
+	/* One byte is always kept back for the NUL terminator */
+	if(len >= pWriter->remaining) {
 		return SHADOW_JSON_BUFFER_TRUNCATED;
 	}
+	memcpy(pWriter->pCursor, pSrc, len);
+	pWriter->pCursor += len;
+	pWriter->remaining -= len;
+	*pWriter->pCursor = '\0';
 	return SUCCESS;
 }
 
-static IoT_Error_t convert_data_to_string(char *pStringBuffer, size_t maxSizeofStringBuffer, JsonPrimitiveType type,
-									   void *pData) {
-	int32_t snPrintfReturn = 0;
-	IoT_Error_t ret_val = SUCCESS;
+static inline IoT_Error_t json_write_char(json_writer_t *pWriter, char c) {
+	return json_write_raw(pWriter, &c, 1);
+}
+
+static IoT_Error_t json_write_quoted(json_writer_t *pWriter, const char *pStr) {
+	IoT_Error_t ret_val = json_write_char(pWriter, '"');
+	if(ret_val == SUCCESS) {
+		ret_val = json_write_raw(pWriter, pStr, strlen(pStr));
+	}
+	if(ret_val == SUCCESS) {
+		ret_val = json_write_char(pWriter, '"');
+	}
+	return ret_val;
+}
+
+static IoT_Error_t json_write_uint32(json_writer_t *pWriter, uint32_t value, bool negative) {
+	char digits[MAX_INT32_DIGITS];
+	char *pDigit = digits + sizeof(digits);
+
+	/* Emit digits back to front, no division by powers of ten needed */
+	do {
+		*--pDigit = (char)('0' + (value % 10));
+		value /= 10;
+	} while(value != 0);
+
+	if(negative) {
+		*--pDigit = '-';
+	}
+	return json_write_raw(pWriter, pDigit, (size_t)(digits + sizeof(digits) - pDigit));
+}
+
+static IoT_Error_t json_write_int32(json_writer_t *pWriter, int32_t value) {
+	/* Negate in unsigned space so INT32_MIN does not overflow */
+	if(value < 0) {
+		return json_write_uint32(pWriter, 0u - (uint32_t)value, true);
+	}
+	return json_write_uint32(pWriter, (uint32_t)value, false);
+}
 
-	if(maxSizeofStringBuffer == 0) {
+static IoT_Error_t json_write_real(json_writer_t *pWriter, double value) {
+	/* Floating point is rare in our shadow so it keeps the libc formatter */
+	int32_t snPrintfReturn = snprintf(pWriter->pCursor, pWriter->remaining, "%f", value);
+
+	if(snPrintfReturn < 0) {
 		return SHADOW_JSON_ERROR;
+	} else if((size_t) snPrintfReturn >= pWriter->remaining) {
+		return SHADOW_JSON_BUFFER_TRUNCATED;
 	}
+	pWriter->pCursor += snPrintfReturn;
+	pWriter->remaining -= (size_t) snPrintfReturn;
+	return SUCCESS;
+}
+
+static IoT_Error_t convert_data_to_string(json_writer_t *pWriter, JsonPrimitiveType type, void *pData) {
+	IoT_Error_t ret_val = SHADOW_JSON_ERROR;
 
 	if(type == SHADOW_JSON_INT32) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%li,", *(int32_t *) (pData));
+		ret_val = json_write_int32(pWriter, *(int32_t *) (pData));
 	} else if(type == SHADOW_JSON_INT16) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%hi,", *(int16_t *) (pData));
+		ret_val = json_write_int32(pWriter, *(int16_t *) (pData));
 	} else if(type == SHADOW_JSON_INT8) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%hhi,", *(int8_t *) (pData));
+		ret_val = json_write_int32(pWriter, *(int8_t *) (pData));
 	} else if(type == SHADOW_JSON_UINT32) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%lu,", *(uint32_t *) (pData));
+		ret_val = json_write_uint32(pWriter, *(uint32_t *) (pData), false);
 	} else if(type == SHADOW_JSON_UINT16) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%hu,", *(uint16_t *) (pData));
+		ret_val = json_write_uint32(pWriter, *(uint16_t *) (pData), false);
 	} else if(type == SHADOW_JSON_UINT8) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%hhu,", *(uint8_t *) (pData));
+		ret_val = json_write_uint32(pWriter, *(uint8_t *) (pData), false);
 	} else if(type == SHADOW_JSON_DOUBLE) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%f,", *(double *) (pData));
+		ret_val = json_write_real(pWriter, *(double *) (pData));
 	} else if(type == SHADOW_JSON_FLOAT) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%f,", *(float *) (pData));
+		ret_val = json_write_real(pWriter, *(float *) (pData));
 	} else if(type == SHADOW_JSON_BOOL) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%s,", *(bool *) (pData) ? "true" : "false");
+		ret_val = *(bool *) (pData) ? json_write_raw(pWriter, "true", 4) : json_write_raw(pWriter, "false", 5);
 	} else if(type == SHADOW_JSON_STRING) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "\"%s\",", (char *) (pData));
+		ret_val = json_write_quoted(pWriter, (char *) (pData));
 	} else if(type == SHADOW_JSON_OBJECT) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%s,", (char *) (pData));
+		ret_val = json_write_raw(pWriter, (char *) (pData), strlen((char *) (pData)));
 	}
 
-	ret_val = check_snprintf_ret_val(snPrintfReturn, maxSizeofStringBuffer);
-
+	if(ret_val == SUCCESS) {
+		ret_val = json_write_char(pWriter, ',');
+	}
 	return ret_val;
 }
 
 static IoT_Error_t generate_json_object(char *object_name, char *pJsonDocument, size_t maxSizeOfJsonDocument, uint8_t count, jsonStruct_t **handler) {
 	IoT_Error_t ret_val = SUCCESS;
-	size_t tempSize = 0;
-	int8_t i;
+	uint8_t i;
 	jsonStruct_t *pTemporary = NULL;
-	size_t remSizeOfJsonBuffer = maxSizeOfJsonDocument;
-	int32_t snPrintfReturn = 0;
+	json_writer_t writer;
 
-	if(pJsonDocument == NULL) {
-		return NULL_VALUE_ERROR;
+	ret_val = json_writer_init(&writer, pJsonDocument, maxSizeOfJsonDocument);
+	if(ret_val != SUCCESS) {
+		return ret_val;
 	}
 
-	tempSize = maxSizeOfJsonDocument - strlen(pJsonDocument);
-	if(tempSize <= 1) {
-		return SHADOW_JSON_ERROR;
+	ret_val = json_write_quoted(&writer, object_name);
+	if(ret_val == SUCCESS) {
+		ret_val = json_write_raw(&writer, ":{", 2);
 	}
-	remSizeOfJsonBuffer = tempSize;
-
-	snPrintfReturn = snprintf(pJsonDocument + strlen(pJsonDocument), remSizeOfJsonBuffer, OBJECT_NAME_STRING, object_name);
-	ret_val = check_snprintf_ret_val(snPrintfReturn, maxSizeOfJsonDocument);
-	if (ret_val != SUCCESS) {
+	if(ret_val != SUCCESS) {
 		return ret_val;
 	}
+
 	for(i = 0; i < count; i++) {
-		tempSize = maxSizeOfJsonDocument - strlen(pJsonDocument);
-		if(tempSize <= 1) {
-			return SHADOW_JSON_ERROR;
-		}
-		remSizeOfJsonBuffer = tempSize;
 		pTemporary = (jsonStruct_t *)handler[i];
-		if(pTemporary != NULL) {
-			snPrintfReturn = snprintf(pJsonDocument + strlen(pJsonDocument), remSizeOfJsonBuffer, "\"%s\":",
-									  pTemporary->pKey);
-			if (snPrintfReturn < 0) {
-				return NULL_VALUE_ERROR;
-			}
-			if(ret_val != SUCCESS) {
-				return ret_val;
-			}
-			if(pTemporary->pKey != NULL && pTemporary->pData != NULL) {				
-                ret_val = convert_data_to_string(pJsonDocument + strlen(pJsonDocument), remSizeOfJsonBuffer,
-											  pTemporary->type, pTemporary->pData);
-			} else {
-				return NULL_VALUE_ERROR;
-			}
-			if(ret_val != SUCCESS) {
-				return ret_val;
-			}
-		} else {
+		if(pTemporary == NULL || pTemporary->pKey == NULL || pTemporary->pData == NULL) {
 			return NULL_VALUE_ERROR;
 		}
+		ret_val = json_write_quoted(&writer, pTemporary->pKey);
+		if(ret_val == SUCCESS) {
+			ret_val = json_write_char(&writer, ':');
+		}
+		if(ret_val == SUCCESS) {
+			ret_val = convert_data_to_string(&writer, pTemporary->type, pTemporary->pData);
+		}
+		if(ret_val != SUCCESS) {
+			return ret_val;
+		}
 	}
 
-	snPrintfReturn = snprintf(pJsonDocument + strlen(pJsonDocument) - 1, remSizeOfJsonBuffer, "},");
-	ret_val = check_snprintf_ret_val(snPrintfReturn, maxSizeOfJsonDocument);
-	if (ret_val != SUCCESS) {
-		return ret_val;
-	}	
-
-	return ret_val;
+	/* Overwrite the trailing comma of the last field, if there is one */
+	if(count > 0) {
+		writer.pCursor--;
+		writer.remaining++;
+	}
+	return json_write_raw(&writer, "},", 2);
 }
 
 IoT_Error_t custom_aws_iot_shadow_add_desired(char *pJsonDocument,
@@ -138,4 +206,208 @@ IoT_Error_t custom_aws_iot_shadow_add_reported(char *pJsonDocument,
 						 jsonStruct_t **handler)
 {
 	return generate_json_object("reported", pJsonDocument, maxSizeOfJsonDocument, count, handler);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Fixed slot width for each value type a template can patch, 0 if the
+ * type has no bounded textual form (strings, objects, reals).
+ */
+static uint8_t template_slot_width(JsonPrimitiveType type) {
+	switch(type) {
+	case SHADOW_JSON_BOOL:
+		return 5;
+	case SHADOW_JSON_INT32:
+		return 11;
+	case SHADOW_JSON_UINT32:
+		return 10;
+	case SHADOW_JSON_INT16:
+		return 6;
+	case SHADOW_JSON_UINT16:
+		return 5;
+	case SHADOW_JSON_INT8:
+		return 4;
+	case SHADOW_JSON_UINT8:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+static IoT_Error_t template_add_object(shadow_template_t *pTemplate, json_writer_t *pWriter, const char *object_name,
+									   uint8_t count, jsonStruct_t **handler) {
+	IoT_Error_t ret_val;
+	jsonStruct_t *pTemporary = NULL;
+	shadow_template_slot_t *pSlot = NULL;
+	uint8_t width;
+	uint8_t i;
+
+	ret_val = json_write_quoted(pWriter, object_name);
+	if(ret_val == SUCCESS) {
+		ret_val = json_write_raw(pWriter, ":{", 2);
+	}
+
+	for(i = 0; i < count && ret_val == SUCCESS; i++) {
+		pTemporary = handler[i];
+		if(pTemporary == NULL || pTemporary->pKey == NULL || pTemporary->pData == NULL) {
+			return NULL_VALUE_ERROR;
+		}
+		width = template_slot_width(pTemporary->type);
+		if(width == 0 || pTemplate->slotCount >= SHADOW_TEMPLATE_MAX_SLOTS) {
+			return SHADOW_JSON_ERROR;
+		}
+
+		ret_val = json_write_quoted(pWriter, pTemporary->pKey);
+		if(ret_val == SUCCESS) {
+			ret_val = json_write_char(pWriter, ':');
+		}
+		if(ret_val == SUCCESS) {
+			pSlot = &pTemplate->slots[pTemplate->slotCount++];
+			pSlot->pHandler = pTemporary;
+			pSlot->offset = (uint16_t)(pWriter->pCursor - pTemplate->pJsonDocument);
+			pSlot->width = width;
+			ret_val = json_write_raw(pWriter, TEMPLATE_SLOT_FILLER, width);
+		}
+		if(ret_val == SUCCESS) {
+			ret_val = json_write_char(pWriter, ',');
+		}
+	}
+	if(ret_val != SUCCESS) {
+		return ret_val;
+	}
+
+	if(count > 0) {
+		pWriter->pCursor--;
+		pWriter->remaining++;
+	}
+	return json_write_raw(pWriter, "},", 2);
+}
+
+/**
+ * @brief Renders the skeleton of a shadow update document once. Every value
+ * gets a fixed width slot (padded with whitespace, which JSON ignores) so
+ * later updates only rewrite those bytes and the client token.
+ */
+IoT_Error_t custom_aws_iot_shadow_template_build(shadow_template_t *pTemplate,
+												 char *pJsonDocument,
+												 size_t maxSizeOfJsonDocument,
+												 uint8_t reported_count,
+												 jsonStruct_t **reported,
+												 uint8_t desired_count,
+												 jsonStruct_t **desired)
+{
+	IoT_Error_t ret_val;
+	json_writer_t writer;
+
+	if(pTemplate == NULL || pJsonDocument == NULL || maxSizeOfJsonDocument == 0) {
+		return NULL_VALUE_ERROR;
+	}
+	if(reported_count == 0 && desired_count == 0) {
+		return SHADOW_JSON_ERROR;
+	}
+
+	pTemplate->pJsonDocument = pJsonDocument;
+	pTemplate->maxSizeOfJsonDocument = maxSizeOfJsonDocument;
+	pTemplate->slotCount = 0;
+	pJsonDocument[0] = '\0';
+
+	ret_val = json_writer_init(&writer, pJsonDocument, maxSizeOfJsonDocument);
+	if(ret_val == SUCCESS) {
+		ret_val = json_write_raw(&writer, "{\"state\":{", 10);
+	}
+	if(ret_val == SUCCESS && reported_count > 0) {
+		ret_val = template_add_object(pTemplate, &writer, "reported", reported_count, reported);
+	}
+	if(ret_val == SUCCESS && desired_count > 0) {
+		ret_val = template_add_object(pTemplate, &writer, "desired", desired_count, desired);
+	}
+	if(ret_val != SUCCESS) {
+		return ret_val;
+	}
+
+	/* Same tail aws_iot_finalize_json_document() writes, minus the token */
+	writer.pCursor--;
+	writer.remaining++;
+	ret_val = json_write_raw(&writer, "}, \"clientToken\":\"", 18);
+	if(ret_val != SUCCESS) {
+		return ret_val;
+	}
+	pTemplate->clientTokenOffset = (uint16_t)(writer.pCursor - pJsonDocument);
+
+	/* Reserve the largest token plus the closing quote and brace up front */
+	if(writer.remaining <= MAX_SIZE_CLIENT_TOKEN_CLIENT_SEQUENCE + 2) {
+		return SHADOW_JSON_BUFFER_TRUNCATED;
+	}
+	return SUCCESS;
+}
+
+/**
+ * @brief Refreshes every value slot from its handler data and stamps a new
+ * client token, leaving the template ready to publish.
+ */
+IoT_Error_t custom_aws_iot_shadow_template_patch(shadow_template_t *pTemplate)
+{
+	IoT_Error_t ret_val;
+	shadow_template_slot_t *pSlot = NULL;
+	jsonStruct_t *pHandler = NULL;
+	char value[MAX_INT32_DIGITS + 1];
+	json_writer_t writer;
+	char *pToken = NULL;
+	size_t len;
+	uint8_t i;
+
+	if(pTemplate == NULL || pTemplate->pJsonDocument == NULL) {
+		return NULL_VALUE_ERROR;
+	}
+
+	for(i = 0; i < pTemplate->slotCount; i++) {
+		pSlot = &pTemplate->slots[i];
+		pHandler = pSlot->pHandler;
+
+		writer.pCursor = value;
+		writer.remaining = sizeof(value);
+		switch(pHandler->type) {
+		case SHADOW_JSON_BOOL:
+			ret_val = *(bool *) (pHandler->pData) ? json_write_raw(&writer, "true", 4) : json_write_raw(&writer, "false", 5);
+			break;
+		case SHADOW_JSON_INT32:
+			ret_val = json_write_int32(&writer, *(int32_t *) (pHandler->pData));
+			break;
+		case SHADOW_JSON_INT16:
+			ret_val = json_write_int32(&writer, *(int16_t *) (pHandler->pData));
+			break;
+		case SHADOW_JSON_INT8:
+			ret_val = json_write_int32(&writer, *(int8_t *) (pHandler->pData));
+			break;
+		case SHADOW_JSON_UINT32:
+			ret_val = json_write_uint32(&writer, *(uint32_t *) (pHandler->pData), false);
+			break;
+		case SHADOW_JSON_UINT16:
+			ret_val = json_write_uint32(&writer, *(uint16_t *) (pHandler->pData), false);
+			break;
+		case SHADOW_JSON_UINT8:
+			ret_val = json_write_uint32(&writer, *(uint8_t *) (pHandler->pData), false);
+			break;
+		default:
+			ret_val = SHADOW_JSON_ERROR;
+			break;
+		}
+		if(ret_val != SUCCESS) {
+			return ret_val;
+		}
+
+		len = (size_t)(writer.pCursor - value);
+		memcpy(pTemplate->pJsonDocument + pSlot->offset, value, len);
+		memset(pTemplate->pJsonDocument + pSlot->offset + len, ' ', pSlot->width - len);
+	}
+
+	pToken = pTemplate->pJsonDocument + pTemplate->clientTokenOffset;
+	ret_val = aws_iot_fill_with_client_token(pToken,
+			pTemplate->maxSizeOfJsonDocument - pTemplate->clientTokenOffset - 2);
+	if(ret_val != SUCCESS) {
+		return ret_val;
+	}
+
+	len = strlen(pToken);
+	memcpy(pToken + len, "\"}", 3);
+	return SUCCESS;
+}
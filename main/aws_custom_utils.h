@@ -3,6 +3,38 @@
 #include "stdint.h"
 #include "aws_iot_error.h"
 #include "aws_iot_shadow_json_data.h"
+#include "aws_iot_config.h"
+
+/* Upper bound on the fields a single document template can patch */
+#define SHADOW_TEMPLATE_MAX_SLOTS 32
+
+/* Widest value a template slot holds ("false" or a padded 32 bit integer) */
+#define SHADOW_TEMPLATE_MAX_VALUE_LEN 11
+
+/**
+ * Worst case size of a template document with `fields` entries spread over
+ * the reported and desired objects, each key at most `key_len` characters.
+ * Usable as an array size so the buffer is fixed at compile time.
+ */
+#define SHADOW_TEMPLATE_SIZE(fields, key_len)                                  \
+	(sizeof("{\"state\":{\"reported\":{},\"desired\":{}}, \"clientToken\":\"\"}") + \
+	 (fields) * ((key_len) + sizeof("\"\":,") + SHADOW_TEMPLATE_MAX_VALUE_LEN) +   \
+	 MAX_SIZE_CLIENT_TOKEN_CLIENT_SEQUENCE)
+
+typedef struct {
+	jsonStruct_t *pHandler;
+	uint16_t offset;
+	uint8_t width;
+} shadow_template_slot_t;
+
+/* Pre-rendered shadow update document with the value positions recorded */
+typedef struct {
+	char *pJsonDocument;
+	size_t maxSizeOfJsonDocument;
+	uint16_t clientTokenOffset;
+	uint8_t slotCount;
+	shadow_template_slot_t slots[SHADOW_TEMPLATE_MAX_SLOTS];
+} shadow_template_t;
 
 IoT_Error_t custom_aws_iot_shadow_add_desired(char *pJsonDocument,
                         size_t maxSizeOfJsonDocument,
@@ -11,4 +43,12 @@ IoT_Error_t custom_aws_iot_shadow_add_desired(char *pJsonDocument,
 IoT_Error_t custom_aws_iot_shadow_add_reported(char *pJsonDocument,
                         size_t maxSizeOfJsonDocument,
                         uint8_t count,
-                        jsonStruct_t **handler);
\ No newline at end of file
+                        jsonStruct_t **handler);
+IoT_Error_t custom_aws_iot_shadow_template_build(shadow_template_t *pTemplate,
+                        char *pJsonDocument,
+                        size_t maxSizeOfJsonDocument,
+                        uint8_t reported_count,
+                        jsonStruct_t **reported,
+                        uint8_t desired_count,
+                        jsonStruct_t **desired);
+IoT_Error_t custom_aws_iot_shadow_template_patch(shadow_template_t *pTemplate);
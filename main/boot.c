@@ -0,0 +1,281 @@
+/**
+ ******************************************************************************
+ * @file      boot.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Boot Stage Scheduler and Boot Timeline Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+#include "aws_iot_config.h"
+#include "aws_iot_mqtt_client_interface.h"
+
+#include "app_version.h"
+#include "boot.h"
+#include "cloud_connection.h"
+
+#define TAG "BOOT"
+
+/* The calling task plus this many minus one helper tasks run stages */
+#define BOOT_WORKERS 3
+#define BOOT_WORKER_STACK 4096
+#define BOOT_MAX_MARKS 4
+/* Fits the MQTT TX buffer with BOOT_MAX_STAGES short stage names */
+#define BOOT_PAYLOAD_MAX_LEN 480
+
+/**
+ * @brief thing name or device id
+ */
+extern const uint8_t deviceid_txt_start[] asm("_binary_deviceid_txt_start");
+extern const uint8_t deviceid_txt_end[] asm("_binary_deviceid_txt_end");
+
+/* Microseconds on esp_timer, which starts as the app starts */
+typedef struct {
+  const char *name;
+  int64_t start_us;
+  int64_t end_us;
+  int err;
+} boot_record_t;
+
+static const boot_stage_t *boot_stages;
+static uint32_t boot_all;
+static uint32_t boot_started;
+static EventGroupHandle_t boot_done;
+static boot_record_t boot_records[BOOT_MAX_STAGES];
+static boot_record_t boot_marks[BOOT_MAX_MARKS];
+static size_t boot_mark_count;
+static portMUX_TYPE boot_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* iotDevice/<thing name>/boot */
+static char boot_topic[sizeof("iotDevice//boot") + MAX_SIZE_OF_THING_NAME];
+
+static void boot_run_stage(int index) {
+  boot_record_t *record = &boot_records[index];
+
+  record->start_us = esp_timer_get_time();
+  record->err = boot_stages[index].run();
+  record->end_us = esp_timer_get_time();
+  if (record->err != ESP_OK) {
+    ESP_LOGE(TAG, "Stage %s failed: %s", record->name,
+             esp_err_to_name(record->err));
+  }
+  xEventGroupSetBits(boot_done, BOOT_AFTER(index));
+}
+
+/**
+ * @brief Runs stages whose dependencies are done until none is left to
+ * start. When every remaining stage waits on one that is still running,
+ * sleeps until any running stage finishes.
+ */
+static void boot_work(void) {
+  for (;;) {
+    EventBits_t done = xEventGroupGetBits(boot_done);
+    int next = -1;
+
+    portENTER_CRITICAL(&boot_lock);
+    for (int i = 0; BOOT_AFTER(i) & boot_all; i++) {
+      if (!(boot_started & BOOT_AFTER(i)) &&
+          (boot_stages[i].after & ~done) == 0) {
+        boot_started |= BOOT_AFTER(i);
+        next = i;
+        break;
+      }
+    }
+    uint32_t running = boot_started & ~done;
+    bool pending = boot_started != boot_all;
+    portEXIT_CRITICAL(&boot_lock);
+
+    if (next >= 0) {
+      boot_run_stage(next);
+    } else if (!pending) {
+      return;
+    } else {
+      xEventGroupWaitBits(boot_done, running, pdFALSE, pdFALSE,
+                          portMAX_DELAY);
+    }
+  }
+}
+
+static void boot_worker_task(void *param) {
+  boot_work();
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Runs the boot stages, each as soon as the stages it depends on are
+ * done, several at once on BOOT_WORKERS tasks. Returns when all are done.
+ * A stage may only depend on stages listed before it.
+ * @retval
+ *  - ESP_OK: every stage ran; stage errors are in the timeline
+ *  - ESP_ERR_INVALID_ARG: too many stages, or a forward dependency
+ *  - ESP_ERR_NO_MEM: failed
+ */
+esp_err_t boot_run(const boot_stage_t *stages, size_t count) {
+  if (count == 0 || count > BOOT_MAX_STAGES) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (stages[i].after & ~(BOOT_AFTER(i) - 1)) {
+      ESP_LOGE(TAG, "Stage %s depends on a later stage\n", stages[i].name);
+      return ESP_ERR_INVALID_ARG;
+    }
+  }
+
+  boot_done = xEventGroupCreate();
+  if (boot_done == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  for (size_t i = 0; i < count; i++) {
+    boot_records[i].name = stages[i].name;
+  }
+  boot_stages = stages;
+  boot_all = BOOT_AFTER(count) - 1;
+
+  /* Fewer workers only means less overlap */
+  for (int i = 1; i < BOOT_WORKERS; i++) {
+    if (xTaskCreate(&boot_worker_task, "boot_worker", BOOT_WORKER_STACK, NULL,
+                    tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+      ESP_LOGW(TAG, "Couldnt create boot worker %d", i);
+    }
+  }
+  boot_work();
+  xEventGroupWaitBits(boot_done, boot_all, pdFALSE, pdTRUE, portMAX_DELAY);
+
+  ESP_LOGI(TAG, "Boot stages done at %lld us",
+           (long long)esp_timer_get_time());
+  /* Logged again with cloud_ready, if the cloud ever connects */
+  boot_timeline_log();
+  return ESP_OK;
+}
+
+/**
+ * @brief Records a point in time on the boot timeline, such as the cloud
+ * connection becoming ready. The name must stay valid.
+ */
+void boot_mark(const char *name) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&boot_lock);
+  if (boot_mark_count < BOOT_MAX_MARKS) {
+    boot_marks[boot_mark_count++] =
+        (boot_record_t){.name = name, .start_us = now, .end_us = now};
+  }
+  portEXIT_CRITICAL(&boot_lock);
+}
+
+/**
+ * @brief Prints the boot timeline on the console.
+ */
+void boot_timeline_log(void) {
+  ESP_LOGI(TAG, "Boot timeline of %s (us since app start):",
+           firmware_version());
+  for (int i = 0; BOOT_AFTER(i) & boot_all; i++) {
+    const boot_record_t *r = &boot_records[i];
+    ESP_LOGI(TAG, "  %-12s %9lld .. %9lld  %9lld%s", r->name,
+             (long long)r->start_us, (long long)r->end_us,
+             (long long)(r->end_us - r->start_us),
+             r->err != ESP_OK ? "  failed" : "");
+  }
+  for (size_t i = 0; i < boot_mark_count; i++) {
+    ESP_LOGI(TAG, "  %-12s %9lld", boot_marks[i].name,
+             (long long)boot_marks[i].start_us);
+  }
+}
+
+/**
+ * @brief Publishes the timeline, e.g.
+ * {"fw":"1.2.0","stages":{"gpio":[210,260],"nvs":[215,18400],...,
+ *  "ip":[20100,240300,263]},"marks":{"cloud_ready":1420000}}
+ * with [start_us, end_us] per stage, and the error code of a failed one.
+ */
+static IoT_Error_t boot_publish(AWS_IoT_Client *mqttClient) {
+  char payload[BOOT_PAYLOAD_MAX_LEN];
+  int len;
+
+  len = snprintf(payload, sizeof(payload), "{\"fw\":\"%s\",\"stages\":{",
+                 firmware_version());
+  for (int i = 0; (BOOT_AFTER(i) & boot_all) && len < (int)sizeof(payload);
+       i++) {
+    const boot_record_t *r = &boot_records[i];
+    len += snprintf(payload + len, sizeof(payload) - len,
+                    "%s\"%s\":[%lld,%lld", i == 0 ? "" : ",", r->name,
+                    (long long)r->start_us, (long long)r->end_us);
+    if (r->err != ESP_OK && len < (int)sizeof(payload)) {
+      len += snprintf(payload + len, sizeof(payload) - len, ",%d", r->err);
+    }
+    if (len < (int)sizeof(payload)) {
+      len += snprintf(payload + len, sizeof(payload) - len, "]");
+    }
+  }
+  if (len < (int)sizeof(payload)) {
+    len += snprintf(payload + len, sizeof(payload) - len, "},\"marks\":{");
+  }
+  for (size_t i = 0; i < boot_mark_count && len < (int)sizeof(payload); i++) {
+    len += snprintf(payload + len, sizeof(payload) - len, "%s\"%s\":%lld",
+                    i == 0 ? "" : ",", boot_marks[i].name,
+                    (long long)boot_marks[i].start_us);
+  }
+  if (len < (int)sizeof(payload)) {
+    len += snprintf(payload + len, sizeof(payload) - len, "}}");
+  }
+  if (len >= (int)sizeof(payload)) {
+    return SHADOW_JSON_BUFFER_TRUNCATED;
+  }
+
+  IoT_Publish_Message_Params params = {
+      .qos = QOS0,
+      .isRetained = 0,
+      .payload = payload,
+      .payloadLen = (size_t)len,
+  };
+  return aws_iot_mqtt_publish(mqttClient, boot_topic,
+                              (uint16_t)strlen(boot_topic), &params);
+}
+
+/**
+ * @brief Registered after every other service, so this runs once they have
+ * all started: the cloud connection is ready. The timeline is best effort,
+ * a failed publish doesnt take the connection down.
+ */
+static IoT_Error_t boot_connected(AWS_IoT_Client *mqttClient) {
+  boot_mark("cloud_ready");
+  boot_timeline_log();
+
+  snprintf(boot_topic, sizeof(boot_topic), "iotDevice/%s/boot",
+           (const char *)deviceid_txt_start);
+  IoT_Error_t rc = boot_publish(mqttClient);
+  if (SUCCESS != rc) {
+    ESP_LOGW(TAG, "Publishing the boot timeline failed %d", rc);
+  }
+  return SUCCESS;
+}
+
+static const cloud_service_t boot_service = {
+    .name = "boot",
+    .connected = boot_connected,
+};
+
+/**
+ * @brief Registers the boot timeline report with the cloud connection. Call
+ * after every other service is registered.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+int boot_timeline_start(void) {
+  if (cloud_connection_register_service(&boot_service) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the boot timeline service\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define BOOT_MAX_STAGES 16
+
+/* Dependency mask entry: run after the stage with this index */
+#define BOOT_AFTER(stage) ((uint32_t)1 << (stage))
+
+typedef struct {
+  const char *name;
+  /* Returns ESP_OK or an error, which is recorded but doesnt stop the boot */
+  int (*run)(void);
+  /* BOOT_AFTER() bits of earlier stages this one needs finished */
+  uint32_t after;
+} boot_stage_t;
+
+esp_err_t boot_run(const boot_stage_t *stages, size_t count);
+void boot_mark(const char *name);
+void boot_timeline_log(void);
+int boot_timeline_start(void);
@@ -0,0 +1,439 @@
+/**
+ ******************************************************************************
+ * @file      cloud_connection.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Shared AWS IoT MQTT/TLS Connection Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "aws_iot_config.h"
+#include "aws_iot_log.h"
+#include "aws_iot_mqtt_client_interface.h"
+#include "aws_iot_shadow_interface.h"
+#include "aws_iot_version.h"
+
+#include "cloud_connection.h"
+#include "cloud_tls.h"
+#include "latency_probe.h"
+#include "wifi-connect.h"
+
+#define TAG "CONNECTION"
+
+_Static_assert(AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS >= CLOUD_MQTT_SUBSCRIPTIONS,
+               "Raise CONFIG_AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS, subscribing "
+               "would fail with MQTT_MAX_SUBSCRIPTIONS_REACHED_ERROR");
+
+/* Longest the cloud task sleeps with nothing to do, bounds keepalive pings */
+#define CLOUD_IDLE_WAIT_MS 5000
+/* Wake-up period while an ack or a reconnect is pending */
+#define CLOUD_BUSY_WAIT_MS 500
+/* Time given to the MQTT client to drain the socket once data is readable */
+#define CLOUD_YIELD_TIMEOUT_MS 100
+/* How often the socket watcher re-reads the socket and its stop flag */
+#define CLOUD_RX_WATCH_IDLE_MS 1000
+
+/* Sent by the socket watcher to the cloud task as it exits */
+#define CLOUD_EVENT_RX_WATCH_STOPPED (1u << 31)
+
+/**
+ * @brief thing name or device id
+ */
+extern const uint8_t deviceid_txt_start[] asm("_binary_deviceid_txt_start");
+extern const uint8_t deviceid_txt_end[] asm("_binary_deviceid_txt_end");
+
+/**
+ * @brief Device cert and private key
+ */
+extern const uint8_t
+    certificate_pem_crt_start[] asm("_binary_device_cert_start");
+extern const uint8_t certificate_pem_crt_end[] asm("_binary_device_cert_end");
+extern const uint8_t private_pem_key_start[] asm("_binary_device_key_start");
+extern const uint8_t private_pem_key_end[] asm("_binary_device_key_end");
+
+/**
+ * @brief Root Certificate
+ */
+extern const uint8_t aws_root_ca_pem_start[] asm("_binary_server_cert_start");
+extern const uint8_t aws_root_ca_pem_end[] asm("_binary_server_cert_end");
+
+/**
+ * @brief AWS IoT Endpoint specific to account and region
+ */
+extern const uint8_t endpoint_txt_start[] asm("_binary_endpoint_txt_start");
+extern const uint8_t endpoint_txt_end[] asm("_binary_endpoint_txt_end");
+
+typedef struct {
+  const char *topic;
+  pApplicationHandler_t handler;
+  void *data;
+} cloud_topic_t;
+
+/* The one MQTT client shared by the shadow and every other topic */
+static AWS_IoT_Client mqttClient;
+
+static const cloud_service_t *services[CLOUD_MAX_SERVICES];
+static uint8_t service_count;
+static cloud_topic_t topics[CLOUD_MAX_TOPICS];
+static uint8_t topic_count;
+
+static TaskHandle_t cloud_task;
+static TaskHandle_t rx_watch_task;
+/* The MQTT socket, published by the cloud task between yields (-1 while
+ * there is none), and the flag that has the watcher exit */
+static atomic_int rx_watch_fd = -1;
+static atomic_bool rx_watch_stop;
+
+/* Written by the cloud task only, read from anywhere */
+static volatile cloud_state_t cloud_state;
+
+/**
+ * @brief Registers a module driven by the cloud task. Must be called before
+ * cloud_start().
+ */
+esp_err_t cloud_connection_register_service(const cloud_service_t *service) {
+  if (service_count >= CLOUD_MAX_SERVICES) {
+    return ESP_ERR_NO_MEM;
+  }
+  services[service_count++] = service;
+  return ESP_OK;
+}
+
+/**
+ * @brief Registers a handler for a topic on the shared connection. The topic
+ * string must stay valid for the lifetime of the firmware. Must be called
+ * before cloud_start().
+ */
+esp_err_t cloud_connection_subscribe(const char *topic,
+                                     pApplicationHandler_t handler,
+                                     void *data) {
+  if (topic_count >= CLOUD_MAX_TOPICS) {
+    return ESP_ERR_NO_MEM;
+  }
+  topics[topic_count].topic = topic;
+  topics[topic_count].handler = handler;
+  topics[topic_count].data = data;
+  topic_count++;
+  return ESP_OK;
+}
+
+/**
+ * @brief Wakes the cloud task with the given CLOUD_EVENT_* bits. Safe to call
+ * from any task.
+ */
+void cloud_connection_notify(uint32_t events) {
+  if (cloud_task != NULL) {
+    xTaskNotify(cloud_task, events, eSetBits);
+  }
+}
+
+/**
+ * @brief Connection state of the cloud task, for display. Safe to call from
+ * any task.
+ */
+cloud_state_t cloud_connection_state(void) { return cloud_state; }
+
+const char *cloud_connection_state_name(cloud_state_t state) {
+  switch (state) {
+  case CLOUD_STATE_CONNECTING:
+    return "connecting";
+  case CLOUD_STATE_CONNECTED:
+    return "connected";
+  case CLOUD_STATE_RECONNECTING:
+    return "reconnecting";
+  case CLOUD_STATE_OFFLINE:
+  default:
+    return "offline";
+  }
+}
+
+/**
+ * @brief Disconnect Callback Handler. Reconnection is left to the SDK's
+ * auto reconnect, driven by the yield loop.
+ */
+static void disconnect_handler(AWS_IoT_Client *pClient, void *data) {
+  ESP_LOGW(TAG, "MQTT Disconnect");
+}
+
+/**
+ * @brief Blocks on the MQTT socket and wakes the cloud task when it becomes
+ * readable, so the cloud task never has to poll the connection. After each
+ * wake-up it waits for the cloud task to drain the socket. select() times
+ * out, so the stop flag is seen within CLOUD_RX_WATCH_IDLE_MS; the task ends
+ * itself, never from inside lwIP.
+ */
+static void cloud_rx_watch_task(void *param) {
+  while (!atomic_load(&rx_watch_stop)) {
+    /* The descriptor changes on every reconnect, so read it each time */
+    int fd = atomic_load(&rx_watch_fd);
+    if (fd < 0) {
+      vTaskDelay(CLOUD_RX_WATCH_IDLE_MS / portTICK_RATE_MS);
+      continue;
+    }
+
+    fd_set readset;
+    FD_ZERO(&readset);
+    FD_SET(fd, &readset);
+    struct timeval timeout = {.tv_sec = CLOUD_RX_WATCH_IDLE_MS / 1000,
+                              .tv_usec = CLOUD_RX_WATCH_IDLE_MS % 1000 * 1000};
+
+    /* A closed socket also reports readable, that is how we learn of drops */
+    if (select(fd + 1, &readset, NULL, NULL, &timeout) == 0 ||
+        atomic_load(&rx_watch_stop)) {
+      continue;
+    }
+
+    latency_probe_rx();
+    xTaskNotify(cloud_task, CLOUD_EVENT_MQTT_RX, eSetBits);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  xTaskNotify(cloud_task, CLOUD_EVENT_RX_WATCH_STOPPED, eSetBits);
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Has the socket watcher exit and waits until it has, before the
+ * socket is closed under it.
+ */
+static void cloud_rx_watch_stop(void) {
+  uint32_t events = 0;
+
+  atomic_store(&rx_watch_stop, true);
+  /* In case it waits for the socket to be drained */
+  xTaskNotifyGive(rx_watch_task);
+  while (!(events & CLOUD_EVENT_RX_WATCH_STOPPED)) {
+    xTaskNotifyWait(0, CLOUD_EVENT_RX_WATCH_STOPPED, &events, portMAX_DELAY);
+  }
+  rx_watch_task = NULL;
+}
+
+static bool cloud_awaiting_ack(void) {
+  for (int i = 0; i < service_count; i++) {
+    if (services[i]->awaiting_ack != NULL && services[i]->awaiting_ack()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static TickType_t cloud_next_deadline(void) {
+  TickType_t next = portMAX_DELAY;
+
+  for (int i = 0; i < service_count; i++) {
+    if (services[i]->deadline != NULL) {
+      TickType_t deadline = services[i]->deadline();
+      if (deadline < next) {
+        next = deadline;
+      }
+    }
+  }
+  return next;
+}
+
+/**
+ * @brief Cloud task: owns the only TLS session to AWS IoT and runs the single
+ * yield loop for the shadow and every subscribed topic.
+ */
+static void cloud_connection_task(void *param) {
+  IoT_Error_t rc = FAILURE;
+  int64_t reconnect_since = 0;
+
+  ESP_LOGI(TAG, "AWS IoT SDK Version %d.%d.%d-%s", VERSION_MAJOR, VERSION_MINOR,
+           VERSION_PATCH, VERSION_TAG);
+
+  /* The shadow client is a plain MQTT client plus the shadow topics */
+  ShadowInitParameters_t sp = ShadowInitParametersDefault;
+  sp.pHost = (char *)endpoint_txt_start;
+  sp.port = AWS_IOT_MQTT_PORT;
+  sp.pClientCRT = (const char *)certificate_pem_crt_start;
+  sp.pClientKey = (const char *)private_pem_key_start;
+  sp.pRootCA = (const char *)aws_root_ca_pem_start;
+  sp.enableAutoReconnect = false;
+  sp.disconnectHandler = disconnect_handler;
+
+  ESP_LOGI(TAG, "Shadow Init");
+  rc = aws_iot_shadow_init(&mqttClient, &sp);
+  if (SUCCESS != rc) {
+    ESP_LOGE(TAG, "Failed to initialize shadow %d", rc);
+    goto error;
+  }
+
+  /* Credentials are parsed once, while DHCP runs, for every (re)connect */
+  rc = cloud_tls_attach(&mqttClient.networkStack);
+  if (SUCCESS != rc) {
+    ESP_LOGE(TAG, "Failed to set up TLS %d", rc);
+    goto error;
+  }
+
+  ShadowConnectParameters_t scp = ShadowConnectParametersDefault;
+  scp.pMyThingName = (const char *)deviceid_txt_start;
+  scp.pMqttClientId = (const char *)deviceid_txt_start;
+  scp.mqttClientIdLen = (uint16_t)strlen((const char *)deviceid_txt_start);
+
+  /* The client is set up while DHCP runs; connecting needs the IP */
+  while (wifi_sta_wait_ip(CLOUD_IDLE_WAIT_MS) == ESP_ERR_TIMEOUT) {
+  }
+
+  ESP_LOGI(TAG, "Connecting to AWS Thing");
+  cloud_state = CLOUD_STATE_CONNECTING;
+  do {
+    rc = aws_iot_shadow_connect(&mqttClient, &scp);
+    if (SUCCESS != rc) {
+      ESP_LOGE(TAG, "Error (%d) connecting to %s: %d", rc, sp.pHost, sp.port);
+      vTaskDelay(1000 / portTICK_RATE_MS);
+    }
+  } while (SUCCESS != rc);
+
+  /*
+   * Enable Auto Reconnect functionality. Minimum and Maximum time of
+   * Exponential backoff are set in aws_iot_config.h
+   *  #AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL
+   *  #AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL
+   */
+  rc = aws_iot_shadow_set_autoreconnect_status(&mqttClient, true);
+  if (SUCCESS != rc) {
+    ESP_LOGE(TAG, "Unable to set Autoreconnect to true - %d", rc);
+    goto aws_error;
+  }
+
+  /* Topics are resubscribed by the SDK after every reconnect */
+  for (int i = 0; i < topic_count; i++) {
+    ESP_LOGI(TAG, "Subscribing to %s", topics[i].topic);
+    rc = aws_iot_mqtt_subscribe(&mqttClient, topics[i].topic,
+                                (uint16_t)strlen(topics[i].topic), QOS0,
+                                topics[i].handler, topics[i].data);
+    if (SUCCESS != rc) {
+      ESP_LOGE(TAG, "Error subscribing to %s: %d", topics[i].topic, rc);
+      goto aws_error;
+    }
+  }
+
+  for (int i = 0; i < service_count; i++) {
+    if (services[i]->connected == NULL) {
+      continue;
+    }
+    rc = services[i]->connected(&mqttClient);
+    if (SUCCESS != rc) {
+      ESP_LOGE(TAG, "Service %s failed to start %d", services[i]->name, rc);
+      goto aws_error;
+    }
+  }
+
+  atomic_store(&rx_watch_fd,
+               mqttClient.networkStack.tlsDataParams.server_fd.fd);
+  atomic_store(&rx_watch_stop, false);
+  if (xTaskCreate(&cloud_rx_watch_task, "cloud_rx_watch", 2048, NULL, 5,
+                  &rx_watch_task) != pdPASS) {
+    ESP_LOGE(TAG, "Couldnt create the socket watch task");
+    goto aws_error;
+  }
+
+  TickType_t last_yield = xTaskGetTickCount();
+  while (NETWORK_ATTEMPTING_RECONNECT == rc || NETWORK_RECONNECTED == rc ||
+         SUCCESS == rc) {
+    uint32_t events = 0;
+    TickType_t timer_wait =
+        (NETWORK_ATTEMPTING_RECONNECT == rc || cloud_awaiting_ack())
+            ? CLOUD_BUSY_WAIT_MS / portTICK_RATE_MS
+            : CLOUD_IDLE_WAIT_MS / portTICK_RATE_MS;
+    TickType_t since_yield = xTaskGetTickCount() - last_yield;
+    TickType_t yield_wait =
+        since_yield < timer_wait ? timer_wait - since_yield : 0;
+    /* Services can't publish until the client is back, don't spin on them */
+    TickType_t service_wait = NETWORK_ATTEMPTING_RECONNECT == rc
+                                  ? portMAX_DELAY
+                                  : cloud_next_deadline();
+
+    /* Sleep until an event arrives or the earliest timer is due */
+    xTaskNotifyWait(0, UINT32_MAX, &events,
+                    yield_wait < service_wait ? yield_wait : service_wait);
+
+    /*
+     * Yield for socket data, and for the keepalive/ack timers once the
+     * interval has passed since the last yield, however busy local events
+     * and service deadlines keep the loop. Otherwise those are handled
+     * right away.
+     */
+    if ((events & CLOUD_EVENT_MQTT_RX) ||
+        xTaskGetTickCount() - last_yield >= timer_wait) {
+      if (events & CLOUD_EVENT_MQTT_RX) {
+        latency_probe_receive();
+      }
+      rc = aws_iot_shadow_yield(&mqttClient, CLOUD_YIELD_TIMEOUT_MS);
+      last_yield = xTaskGetTickCount();
+      /* Yield is where the socket is closed and reopened */
+      atomic_store(&rx_watch_fd,
+                   NETWORK_ATTEMPTING_RECONNECT == rc
+                       ? -1
+                       : mqttClient.networkStack.tlsDataParams.server_fd.fd);
+      if (events & CLOUD_EVENT_MQTT_RX) {
+        xTaskNotifyGive(rx_watch_task);
+      }
+    }
+
+    bool reconnecting = NETWORK_ATTEMPTING_RECONNECT == rc;
+    if (reconnecting && reconnect_since == 0) {
+      reconnect_since = esp_timer_get_time();
+    } else if (NETWORK_RECONNECTED == rc && reconnect_since != 0) {
+      /* Includes the SDK's backoff before the first attempt */
+      ESP_LOGI(TAG, "Reconnected after %lld ms",
+               (long long)((esp_timer_get_time() - reconnect_since) / 1000));
+      reconnect_since = 0;
+    }
+    cloud_state =
+        reconnecting ? CLOUD_STATE_RECONNECTING : CLOUD_STATE_CONNECTED;
+    for (int i = 0; i < service_count; i++) {
+      if (services[i]->run == NULL) {
+        continue;
+      }
+      IoT_Error_t service_rc = services[i]->run(&mqttClient, events,
+                                                reconnecting);
+      if (SUCCESS != service_rc) {
+        rc = service_rc;
+      }
+    }
+  }
+
+  ESP_LOGE(TAG, "An error occured in the loop %d", rc);
+  cloud_rx_watch_stop();
+
+  /* aws error */
+aws_error:
+  ESP_LOGI(TAG, "Disconnecting");
+  rc = aws_iot_shadow_disconnect(&mqttClient);
+  if (SUCCESS != rc) {
+    ESP_LOGE(TAG, "Disconnect error %d", rc);
+  }
+error:
+  cloud_state = CLOUD_STATE_OFFLINE;
+  cloud_task = NULL;
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Creates the cloud task once every service and topic is registered.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+int cloud_start(void) {
+  BaseType_t cloud_begin = xTaskCreate(&cloud_connection_task, "cloud_task",
+                                       9216, NULL, 5, &cloud_task);
+  if (cloud_begin != pdPASS) {
+    ESP_LOGE(TAG, "Couldnt create a cloud task\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#include "aws_iot_error.h"
+#include "aws_iot_mqtt_client_interface.h"
+
+/* Events that wake the cloud task, see cloud_connection_notify() */
+#define CLOUD_EVENT_MQTT_RX (1 << 0)
+#define CLOUD_EVENT_LOCAL_CHANGE (1 << 1)
+
+#define CLOUD_MAX_SERVICES 6
+#define CLOUD_MAX_TOPICS 4
+
+/* Subscriptions the shadow holds at most: its delta topic, the update
+ * accepted/rejected pair it keeps, and the get pair while a get runs */
+#define CLOUD_SHADOW_SUBSCRIPTIONS 5
+/* Subscribe handlers the shared MQTT client needs, see sdkconfig.defaults */
+#define CLOUD_MQTT_SUBSCRIPTIONS (CLOUD_MAX_TOPICS + CLOUD_SHADOW_SUBSCRIPTIONS)
+
+typedef enum {
+  CLOUD_STATE_OFFLINE,
+  CLOUD_STATE_CONNECTING,
+  CLOUD_STATE_CONNECTED,
+  CLOUD_STATE_RECONNECTING,
+} cloud_state_t;
+
+/**
+ * @brief A module driven by the shared cloud task. Every hook is optional
+ * and runs on the cloud task, which owns the MQTT client.
+ */
+typedef struct {
+  const char *name;
+  /* Once after the first connect, to register deltas and send initial state */
+  IoT_Error_t (*connected)(AWS_IoT_Client *client);
+  /* After every wake-up, with the events that caused it */
+  IoT_Error_t (*run)(AWS_IoT_Client *client, uint32_t events,
+                     bool reconnecting);
+  /* Ticks until run() is needed without an event, portMAX_DELAY for never */
+  TickType_t (*deadline)(void);
+  /* True while the service waits on an ack that yield() has to time out */
+  bool (*awaiting_ack)(void);
+} cloud_service_t;
+
+esp_err_t cloud_connection_register_service(const cloud_service_t *service);
+esp_err_t cloud_connection_subscribe(const char *topic,
+                                     pApplicationHandler_t handler,
+                                     void *data);
+void cloud_connection_notify(uint32_t events);
+cloud_state_t cloud_connection_state(void);
+const char *cloud_connection_state_name(cloud_state_t state);
+int cloud_start(void);
@@ -0,0 +1,342 @@
+/**
+ ******************************************************************************
+ * @file      cloud_tls.c
+ * @author    Dean Prince Agbodjan
+ * @brief     TLS transport of the shared cloud connection. The SDK's port
+ *            parses the PEM credentials and frees every TLS context on each
+ *            (re)connect; here they are parsed once and the last session is
+ *            offered again, so a reconnect is an abbreviated handshake.
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/version.h"
+
+#include "aws_iot_config.h"
+
+#include "cloud_tls.h"
+
+#define TAG "CLOUD_TLS"
+
+/* Session fields became private in mbedTLS 3 */
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member
+#endif
+
+/*
+ * Read timeout left on the session after the handshake. The ESP32 port sets
+ * its own around every read; the Linux port relies on this one.
+ */
+#ifdef IOT_SSL_READ_TIMEOUT
+#define CLOUD_TLS_READ_TIMEOUT_MS IOT_SSL_READ_TIMEOUT
+#else
+#define CLOUD_TLS_READ_TIMEOUT_MS 10
+#endif
+
+#if defined(MBEDTLS_SSL_ALPN)
+/* AWS IoT takes MQTT on port 443 only with this protocol name */
+static const char *alpn_protocols[] = {"x-amzn-mqtt-ca", NULL};
+#endif
+
+/* Session of the last handshake, offered on the next connect */
+static mbedtls_ssl_session tls_session;
+static bool tls_session_valid;
+
+/* Time spent in the socket callbacks while handshaking is network wait */
+static bool tls_handshaking;
+static int64_t tls_io_us;
+
+static uint32_t full_count;
+static uint32_t resumed_count;
+
+static int cloud_tls_send(void *ctx, const unsigned char *buf, size_t len) {
+  if (!tls_handshaking) {
+    return mbedtls_net_send(ctx, buf, len);
+  }
+  int64_t start = esp_timer_get_time();
+  int ret = mbedtls_net_send(ctx, buf, len);
+  tls_io_us += esp_timer_get_time() - start;
+  return ret;
+}
+
+static int cloud_tls_recv_timeout(void *ctx, unsigned char *buf, size_t len,
+                                  uint32_t timeout) {
+  if (!tls_handshaking) {
+    return mbedtls_net_recv_timeout(ctx, buf, len, timeout);
+  }
+  int64_t start = esp_timer_get_time();
+  int ret = mbedtls_net_recv_timeout(ctx, buf, len, timeout);
+  tls_io_us += esp_timer_get_time() - start;
+  return ret;
+}
+
+static void cloud_tls_forget_session(void) {
+  mbedtls_ssl_session_free(&tls_session);
+  mbedtls_ssl_session_init(&tls_session);
+  tls_session_valid = false;
+}
+
+/**
+ * @brief Keeps the session just negotiated for the next connect. A resumed
+ * handshake carries over the master secret of the session it resumed.
+ * @retval True if the handshake resumed the offered session
+ */
+static bool cloud_tls_keep_session(mbedtls_ssl_context *ssl, bool offered) {
+  mbedtls_ssl_session session;
+  bool resumed = false;
+
+  mbedtls_ssl_session_init(&session);
+  if (mbedtls_ssl_get_session(ssl, &session) != 0) {
+    mbedtls_ssl_session_free(&session);
+    cloud_tls_forget_session();
+    return false;
+  }
+  if (offered) {
+    resumed = memcmp(session.MBEDTLS_PRIVATE(master),
+                     tls_session.MBEDTLS_PRIVATE(master),
+                     sizeof(session.MBEDTLS_PRIVATE(master))) == 0;
+  }
+  /* The copy owns its buffers now, hand them over to tls_session */
+  mbedtls_ssl_session_free(&tls_session);
+  tls_session = session;
+  tls_session_valid = true;
+  return resumed;
+}
+
+static int cloud_tls_parse_key(TLSDataParams *tls, const char *pem) {
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+  return mbedtls_pk_parse_key(&tls->pkey, (const unsigned char *)pem,
+                              strlen(pem) + 1, NULL, 0, mbedtls_ctr_drbg_random,
+                              &tls->ctr_drbg);
+#else
+  return mbedtls_pk_parse_key(&tls->pkey, (const unsigned char *)pem,
+                              strlen(pem) + 1, NULL, 0);
+#endif
+}
+
+static void cloud_tls_free(TLSDataParams *tls) {
+  mbedtls_net_free(&tls->server_fd);
+  mbedtls_ssl_free(&tls->ssl);
+  mbedtls_ssl_config_free(&tls->conf);
+  mbedtls_pk_free(&tls->pkey);
+  mbedtls_x509_crt_free(&tls->clicert);
+  mbedtls_x509_crt_free(&tls->cacert);
+  mbedtls_ctr_drbg_free(&tls->ctr_drbg);
+  mbedtls_entropy_free(&tls->entropy);
+}
+
+/**
+ * @brief Connects and handshakes, offering the previous session. Replaces
+ * the port's connect; the SDK calls it with NULL params, the credentials
+ * were fixed by cloud_tls_attach().
+ */
+static IoT_Error_t cloud_tls_connect(Network *network,
+                                     TLSConnectParams *params) {
+  TLSDataParams *tls = &network->tlsDataParams;
+  char port[8];
+  bool offered = false;
+  int ret;
+
+  params = &network->tlsConnectParams;
+  snprintf(port, sizeof(port), "%u", (unsigned)params->DestinationPort);
+
+  int64_t start = esp_timer_get_time();
+  ret = mbedtls_net_connect(&tls->server_fd, params->pDestinationURL, port,
+                            MBEDTLS_NET_PROTO_TCP);
+  if (ret != 0) {
+    ESP_LOGE(TAG, "Couldnt connect to %s:%s -0x%x", params->pDestinationURL,
+             port, -ret);
+    mbedtls_net_free(&tls->server_fd);
+    if (ret == MBEDTLS_ERR_NET_SOCKET_FAILED) {
+      return NETWORK_ERR_NET_SOCKET_FAILED;
+    }
+    if (ret == MBEDTLS_ERR_NET_UNKNOWN_HOST) {
+      return NETWORK_ERR_NET_UNKNOWN_HOST;
+    }
+    return NETWORK_ERR_NET_CONNECT_FAILED;
+  }
+  mbedtls_net_set_block(&tls->server_fd);
+
+  /* The context is reused, only the connection state is cleared */
+  ret = mbedtls_ssl_session_reset(&tls->ssl);
+  if (ret == 0) {
+    ret = mbedtls_ssl_set_hostname(&tls->ssl, params->pDestinationURL);
+  }
+  if (ret != 0) {
+    ESP_LOGE(TAG, "Couldnt reset the TLS context -0x%x", -ret);
+    mbedtls_net_free(&tls->server_fd);
+    return NETWORK_SSL_INIT_ERROR;
+  }
+  mbedtls_ssl_set_bio(&tls->ssl, &tls->server_fd, cloud_tls_send, NULL,
+                      cloud_tls_recv_timeout);
+  mbedtls_ssl_conf_read_timeout(&tls->conf, params->timeout_ms);
+#if CONFIG_CLOUD_TLS_SESSION_RESUMPTION
+  offered = tls_session_valid &&
+            mbedtls_ssl_set_session(&tls->ssl, &tls_session) == 0;
+#endif
+
+  int64_t handshake_start = esp_timer_get_time();
+  tls_io_us = 0;
+  tls_handshaking = true;
+  do {
+    ret = mbedtls_ssl_handshake(&tls->ssl);
+  } while (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+           ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+  tls_handshaking = false;
+  int64_t end = esp_timer_get_time();
+
+  if (ret == 0 && params->ServerVerificationFlag &&
+      mbedtls_ssl_get_verify_result(&tls->ssl) != 0) {
+    ret = MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+  }
+  if (ret != 0) {
+    ESP_LOGE(TAG, "Handshake failed -0x%x", -ret);
+    /* Don't offer a session the server may be choking on */
+    cloud_tls_forget_session();
+    mbedtls_net_free(&tls->server_fd);
+    return ret == MBEDTLS_ERR_SSL_TIMEOUT ? NETWORK_SSL_CONNECT_TIMEOUT_ERROR
+                                          : SSL_CONNECTION_ERROR;
+  }
+  mbedtls_ssl_conf_read_timeout(&tls->conf, CLOUD_TLS_READ_TIMEOUT_MS);
+
+  bool resumed = cloud_tls_keep_session(&tls->ssl, offered);
+  if (resumed) {
+    resumed_count++;
+  } else {
+    full_count++;
+  }
+  ESP_LOGI(TAG,
+           "%s handshake %lld ms, %lld ms CPU, TCP %lld ms (%u full, %u "
+           "resumed)",
+           resumed ? "Resumed" : "Full",
+           (long long)((end - handshake_start) / 1000),
+           (long long)((end - handshake_start - tls_io_us) / 1000),
+           (long long)((handshake_start - start) / 1000), (unsigned)full_count,
+           (unsigned)resumed_count);
+  return SUCCESS;
+}
+
+/**
+ * @brief Replaces the port's destroy, which frees the whole TLS context after
+ * every disconnect. Only the socket goes; credentials, configuration and the
+ * SSL context are kept for the next connect.
+ */
+static IoT_Error_t cloud_tls_destroy(Network *network) {
+  mbedtls_net_free(&network->tlsDataParams.server_fd);
+  return SUCCESS;
+}
+
+/**
+ * @brief Parses the credentials named in the network's connect parameters
+ * and sets up the TLS configuration once, then takes over connect and
+ * destroy. Call after aws_iot_shadow_init(); it doesn't need the network,
+ * so it can run while DHCP is still going.
+ */
+IoT_Error_t cloud_tls_attach(Network *network) {
+  TLSConnectParams *params = &network->tlsConnectParams;
+  TLSDataParams *tls = &network->tlsDataParams;
+  IoT_Error_t rc = SUCCESS;
+  int ret;
+
+  int64_t start = esp_timer_get_time();
+  mbedtls_entropy_init(&tls->entropy);
+  mbedtls_ctr_drbg_init(&tls->ctr_drbg);
+  mbedtls_x509_crt_init(&tls->cacert);
+  mbedtls_x509_crt_init(&tls->clicert);
+  mbedtls_pk_init(&tls->pkey);
+  mbedtls_ssl_config_init(&tls->conf);
+  mbedtls_ssl_init(&tls->ssl);
+  mbedtls_net_init(&tls->server_fd);
+  mbedtls_ssl_session_init(&tls_session);
+
+  ret = mbedtls_ctr_drbg_seed(&tls->ctr_drbg, mbedtls_entropy_func,
+                              &tls->entropy, (const unsigned char *)TAG,
+                              strlen(TAG));
+  if (ret != 0) {
+    rc = NETWORK_MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+    goto error;
+  }
+  ret = mbedtls_x509_crt_parse(&tls->cacert,
+                               (const unsigned char *)params->pRootCALocation,
+                               strlen(params->pRootCALocation) + 1);
+  if (ret < 0) {
+    rc = NETWORK_SSL_ROOT_CRT_PARSE_ERROR;
+    goto error;
+  }
+  ret = mbedtls_x509_crt_parse(
+      &tls->clicert, (const unsigned char *)params->pDeviceCertLocation,
+      strlen(params->pDeviceCertLocation) + 1);
+  if (ret != 0) {
+    rc = NETWORK_SSL_DEVICE_CRT_PARSE_ERROR;
+    goto error;
+  }
+  ret = cloud_tls_parse_key(tls, params->pDevicePrivateKeyLocation);
+  if (ret != 0) {
+    rc = NETWORK_PK_PRIVATE_KEY_PARSE_ERROR;
+    goto error;
+  }
+
+  ret = mbedtls_ssl_config_defaults(&tls->conf, MBEDTLS_SSL_IS_CLIENT,
+                                    MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ret != 0) {
+    rc = NETWORK_SSL_INIT_ERROR;
+    goto error;
+  }
+  mbedtls_ssl_conf_authmode(&tls->conf, params->ServerVerificationFlag
+                                            ? MBEDTLS_SSL_VERIFY_REQUIRED
+                                            : MBEDTLS_SSL_VERIFY_OPTIONAL);
+  mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &tls->ctr_drbg);
+  mbedtls_ssl_conf_ca_chain(&tls->conf, &tls->cacert, NULL);
+  ret = mbedtls_ssl_conf_own_cert(&tls->conf, &tls->clicert, &tls->pkey);
+  if (ret != 0) {
+    rc = NETWORK_SSL_CERT_ERROR;
+    goto error;
+  }
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+#if CONFIG_CLOUD_TLS_SESSION_RESUMPTION
+  mbedtls_ssl_conf_session_tickets(&tls->conf,
+                                   MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#else
+  mbedtls_ssl_conf_session_tickets(&tls->conf,
+                                   MBEDTLS_SSL_SESSION_TICKETS_DISABLED);
+#endif
+#endif
+#if defined(MBEDTLS_SSL_ALPN)
+  if (params->DestinationPort == 443) {
+    ret = mbedtls_ssl_conf_alpn_protocols(&tls->conf, alpn_protocols);
+    if (ret != 0) {
+      rc = NETWORK_SSL_INIT_ERROR;
+      goto error;
+    }
+  }
+#endif
+  ret = mbedtls_ssl_setup(&tls->ssl, &tls->conf);
+  if (ret != 0) {
+    rc = NETWORK_SSL_INIT_ERROR;
+    goto error;
+  }
+
+  network->connect = cloud_tls_connect;
+  network->destroy = cloud_tls_destroy;
+  ESP_LOGI(TAG, "Credentials parsed in %lld ms",
+           (long long)((esp_timer_get_time() - start) / 1000));
+  return SUCCESS;
+
+error:
+  ESP_LOGE(TAG, "Couldnt set up TLS %d: -0x%x", rc, -ret);
+  cloud_tls_free(tls);
+  return rc;
+}
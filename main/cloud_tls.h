@@ -0,0 +1,6 @@
+#pragma once
+
+#include "aws_iot_error.h"
+#include "network_interface.h"
+
+IoT_Error_t cloud_tls_attach(Network *network);
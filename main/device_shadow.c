@@ -13,6 +13,7 @@
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "sdkconfig.h"
 
 #include "aws_iot_config.h"
 #include "aws_iot_log.h"
@@ -21,16 +22,27 @@
 #include "aws_iot_version.h"
 
 #include "aws_custom_utils.h"
+#include "cloud_connection.h"
+#include "json_lookup.h"
+#include "latency_probe.h"
+#include "outlet_config.h"
+#include "outlet_journal.h"
+#include "outlet_state.h"
 #include "output_driver.h"
 
 #define TAG "CLOUD"
-#define MAX_LENGTH_OF_UPDATE_JSON_BUFFER 200
-#define MAX_DESIRED_PARAM 4
-#define MAX_REPORTED_PARAM 4
-#define NUM_OF_RELAYS 4
+#define SHADOW_TEMPLATE_CACHE_SIZE 4
+#define ALL_OUTLETS_MASK ((uint32_t)((1ULL << OUTLET_COUNT) - 1))
+
+#define OUTLET_KEY_ENTRY(n, gpio) "relay_" #n,
+
+/* Worst case document: every relay in both reported and desired */
+#define SHADOW_DOCUMENT_SIZE                                                   \
+  SHADOW_TEMPLATE_SIZE(2 * OUTLET_COUNT, OUTLET_KEY_MAX_LEN)
 
 /*
- * The Json Document in the cloud will be:
+ * The Json Document in the cloud will be, with one key per configured
+ * outlet (relay_1 .. relay_<CONFIG_OUTLET_COUNT>):
  * {
  *   "reported": {
  *      "relay_1": true,
@@ -59,80 +71,100 @@
 extern const uint8_t deviceid_txt_start[] asm("_binary_deviceid_txt_start");
 extern const uint8_t deviceid_txt_end[] asm("_binary_deviceid_txt_end");
 
-/**
- * @brief Device cert and private key
- */
-extern const uint8_t
-    certificate_pem_crt_start[] asm("_binary_device_cert_start");
-extern const uint8_t certificate_pem_crt_end[] asm("_binary_device_cert_end");
-extern const uint8_t private_pem_key_start[] asm("_binary_device_key_start");
-extern const uint8_t private_pem_key_end[] asm("_binary_device_key_end");
+/* Shadow key of each outlet */
+static const char *const output_keys[OUTLET_COUNT] = {
+    OUTLET_TABLE(OUTLET_KEY_ENTRY)};
 
 /**
- * @brief Root Certificate
+ * @brief Update coalescer. Relay changes are merged into one pending
+ * document while an update is in flight or the debounce window is open,
+ * so a burst of toggles costs a single publish.
  */
-extern const uint8_t aws_root_ca_pem_start[] asm("_binary_server_cert_start");
-extern const uint8_t aws_root_ca_pem_end[] asm("_binary_server_cert_end");
+static uint32_t seen_mask;
+static uint32_t pending_reported_mask;
+static uint32_t pending_desired_mask;
+static uint32_t inflight_reported_mask;
+static uint32_t inflight_desired_mask;
+static bool report_all;
+static TickType_t pending_since;
+static uint32_t publish_count;
+static uint32_t merged_count;
+
+/* Shadow fields, one per relay; the SDK writes delta values into pData */
+static bool output_state[OUTLET_COUNT];
+static jsonStruct_t output_handler[OUTLET_COUNT];
+
+/* Outlets named in the delta document being parsed, and their values */
+static uint32_t delta_mask;
+static uint32_t delta_values;
+static uint32_t delta_version;
 
 /**
- * @brief AWS IoT Endpoint specific to account and region
+ * @brief Version tracking. shadow_version is the newest shadow version whose
+ * relay values are applied, from a delta or from the full document fetched
+ * after every (re)connect. Deltas at or below it are stale and dropped.
  */
-extern const uint8_t endpoint_txt_start[] asm("_binary_endpoint_txt_start");
-extern const uint8_t endpoint_txt_end[] asm("_binary_endpoint_txt_end");
+static uint32_t shadow_version;
+static uint32_t stale_delta_count;
+static bool shadowGetInProgress;
+static bool shadow_get_due;
 
-static bool reported_state[4] = {false, false, false, false};
-unsigned short relay_number[4] = {1, 2, 3, 4};
+/* Updates published before the last get are settled by that get */
+static uint32_t shadow_epoch;
 
-/**
- * @brief Creating output state change callback
- */
-static bool output_changed_locally[4] = {false, false, false, false};
-static void output_state_change_callback_1(const char *pJsonString,
-                                           uint32_t JsonStringDataLen,
-                                           jsonStruct_t *pContext) {
-  if (pContext != NULL) {
-    bool state = *(bool *)(pContext->pData);
-    ESP_LOGI(TAG, "Delta - Output state changed to %s",
-             state ? "true" : "false");
-    app_driver_set_state(state, relay_number[0]);
-    output_changed_locally[0] = false;
-  }
-}
+/* $aws/things/<thing name>/shadow/delete/accepted */
+static char delete_topic[sizeof("$aws/things//shadow/delete/accepted") +
+                         MAX_SIZE_OF_THING_NAME];
 
-static void output_state_change_callback_2(const char *pJsonString,
-                                           uint32_t JsonStringDataLen,
-                                           jsonStruct_t *pContext) {
-  if (pContext != NULL) {
-    bool state = *(bool *)(pContext->pData);
-    ESP_LOGI(TAG, "Delta - Output state changed to %s",
-             state ? "true" : "false");
-    app_driver_set_state(state, relay_number[1]);
-    output_changed_locally[1] = false;
-  }
-}
+/* A full document needs as many tokens as the SDK parses it with */
+static jsmntok_t shadow_get_tokens[MAX_JSON_TOKEN_EXPECTED];
 
-static void output_state_change_callback_3(const char *pJsonString,
-                                           uint32_t JsonStringDataLen,
-                                           jsonStruct_t *pContext) {
+/**
+ * @brief Delta callback shared by every outlet. The outlet is recovered from
+ * the handler's position in output_handler[], so dispatch costs the same for
+ * any outlet count. The SDK calls it once per key of a delta document; the
+ * keys are only collected here and applied together by shadow_run().
+ */
+static void output_state_change_callback(const char *pJsonString,
+                                         uint32_t JsonStringDataLen,
+                                         jsonStruct_t *pContext) {
   if (pContext != NULL) {
+    int outlet = pContext - output_handler;
     bool state = *(bool *)(pContext->pData);
-    ESP_LOGI(TAG, "Delta - Output state changed to %s",
+    /* The SDK records the version before it dispatches the keys */
+    uint32_t version = aws_iot_shadow_get_last_received_version();
+    if (version <= shadow_version) {
+      stale_delta_count++;
+      ESP_LOGW(TAG, "Delta v%u for output %d not newer than v%u, %u dropped",
+               (unsigned)version, outlet + 1, (unsigned)shadow_version,
+               (unsigned)stale_delta_count);
+      return;
+    }
+    if (version > delta_version) {
+      delta_version = version;
+    }
+    ESP_LOGI(TAG, "Delta - Output %d state changed to %s", outlet + 1,
              state ? "true" : "false");
-    app_driver_set_state(state, relay_number[2]);
-    output_changed_locally[2] = false;
+    latency_probe_begin(outlet);
+    delta_mask |= OUTLET_BIT(outlet);
+    if (state) {
+      delta_values |= OUTLET_BIT(outlet);
+    } else {
+      delta_values &= ~OUTLET_BIT(outlet);
+    }
   }
 }
 
-static void output_state_change_callback_4(const char *pJsonString,
-                                           uint32_t JsonStringDataLen,
-                                           jsonStruct_t *pContext) {
-  if (pContext != NULL) {
-    bool state = *(bool *)(pContext->pData);
-    ESP_LOGI(TAG, "Delta - Output state changed to %s",
-             state ? "true" : "false");
-    app_driver_set_state(state, relay_number[3]);
-    output_changed_locally[3] = false;
+/**
+ * @brief Queues every relay for the next update, used whenever the cloud
+ * copy of the document is unknown.
+ */
+static void shadow_report_all(void) {
+  if (pending_reported_mask == 0) {
+    pending_since = xTaskGetTickCount();
   }
+  pending_reported_mask |= ALL_OUTLETS_MASK;
+  report_all = true;
 }
 
 /**
@@ -147,71 +179,108 @@ static void update_status_callback(const char *pThingName,
   IOT_UNUSED(pThingName);
   IOT_UNUSED(action);
   IOT_UNUSED(pReceivedJsonDocument);
-  IOT_UNUSED(pContextData);
 
+  if ((uint32_t)(uintptr_t)pContextData != shadow_epoch) {
+    /* Sent before a reconnect, the get since then already settled it */
+    latency_probe_drop(inflight_reported_mask);
+    return;
+  }
   shadowUpdateInProgress = false;
 
   if (SHADOW_ACK_TIMEOUT == status) {
     ESP_LOGE(TAG, "Update timed out");
+    /* The cloud may not have the document, fold it into the next one */
+    shadow_report_all();
+    pending_desired_mask |= inflight_desired_mask;
   } else if (SHADOW_ACK_REJECTED == status) {
     ESP_LOGE(TAG, "Update rejected");
+    latency_probe_drop(inflight_reported_mask);
   } else if (SHADOW_ACK_ACCEPTED == status) {
     ESP_LOGI(TAG, "Update accepted");
+    latency_probe_mark_mask(inflight_reported_mask, LATENCY_STAGE_ACK);
   }
 }
 
 /**
- * @brief Shadow update
+ * @brief Update document templates, keyed by the relays that go into
+ * "desired". "reported" always carries every relay, so the desired set is
+ * the only thing that changes the document layout.
  */
-static IoT_Error_t shadow_update(AWS_IoT_Client *mqttClient,
-                                 jsonStruct_t **reported_handles,
-                                 size_t reported_count,
-                                 jsonStruct_t **desired_handles,
-                                 size_t desired_count) {
-  IoT_Error_t rc = FAILURE;
-  char JsonDocumentBuffer[MAX_LENGTH_OF_UPDATE_JSON_BUFFER];
-  size_t sizeOfJsonDocumentBuffer =
-      sizeof(JsonDocumentBuffer) / sizeof(JsonDocumentBuffer[0]);
+typedef struct {
+  bool valid;
+  uint32_t desired_mask;
+  shadow_template_t tmpl;
+  char document[SHADOW_DOCUMENT_SIZE];
+} shadow_template_entry_t;
 
-  /* Initialize JSON document with null terminated string */
-  rc = aws_iot_shadow_init_json_document(JsonDocumentBuffer,
-                                         sizeOfJsonDocumentBuffer);
-  if (rc != SUCCESS) {
-    return rc;
-  }
+static shadow_template_entry_t template_cache[SHADOW_TEMPLATE_CACHE_SIZE];
+static uint8_t template_cache_next;
 
-  /* fill json document with the reported */
-  if (reported_count > 0) {
-    rc = custom_aws_iot_shadow_add_reported(JsonDocumentBuffer,
-                                            sizeOfJsonDocumentBuffer,
-                                            reported_count, reported_handles);
-    if (rc != SUCCESS) {
-      return rc;
+/**
+ * @brief Returns the template for a desired set, rendering it on first use
+ */
+static shadow_template_entry_t *shadow_template_get(jsonStruct_t *handlers,
+                                                    uint32_t desired_mask) {
+  jsonStruct_t *reported_handles[OUTLET_COUNT];
+  jsonStruct_t *desired_handles[OUTLET_COUNT];
+  uint8_t desired_count = 0;
+  shadow_template_entry_t *entry;
+  IoT_Error_t rc;
+
+  for (int i = 0; i < SHADOW_TEMPLATE_CACHE_SIZE; i++) {
+    if (template_cache[i].valid &&
+        template_cache[i].desired_mask == desired_mask) {
+      return &template_cache[i];
     }
   }
 
-  /* fill json document with the desired */
-  if (desired_count > 0) {
-    rc = custom_aws_iot_shadow_add_desired(JsonDocumentBuffer,
-                                           sizeOfJsonDocumentBuffer,
-                                           desired_count, desired_handles);
-    if (rc != SUCCESS) {
-      return rc;
+  /* Cache miss: recycle the oldest slot */
+  entry = &template_cache[template_cache_next];
+  template_cache_next = (template_cache_next + 1) % SHADOW_TEMPLATE_CACHE_SIZE;
+
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    reported_handles[i] = &handlers[i];
+    if (desired_mask & (1u << i)) {
+      desired_handles[desired_count++] = &handlers[i];
     }
   }
 
-  /* Finalize JSON file */
-  rc = aws_iot_finalize_json_document(JsonDocumentBuffer,
-                                      sizeOfJsonDocumentBuffer);
+  rc = custom_aws_iot_shadow_template_build(
+      &entry->tmpl, entry->document, sizeof(entry->document), OUTLET_COUNT,
+      reported_handles, desired_count, desired_handles);
+  if (rc != SUCCESS) {
+    ESP_LOGE(TAG, "Shadow template build failed %d", rc);
+    entry->valid = false;
+    return NULL;
+  }
+  entry->valid = true;
+  entry->desired_mask = desired_mask;
+  return entry;
+}
+
+/**
+ * @brief Shadow update
+ */
+static IoT_Error_t shadow_update(AWS_IoT_Client *mqttClient,
+                                 jsonStruct_t *handlers,
+                                 uint32_t desired_mask) {
+  IoT_Error_t rc = FAILURE;
+  shadow_template_entry_t *entry = shadow_template_get(handlers, desired_mask);
+
+  if (entry == NULL) {
+    return SHADOW_JSON_ERROR;
+  }
+
+  /* Only the value bytes and the client token change between updates */
+  rc = custom_aws_iot_shadow_template_patch(&entry->tmpl);
   if (rc != SUCCESS) {
     return rc;
   }
 
-  /* Finalizing the JSON file and update the shadow */
-  ESP_LOGI(TAG, "Updated Shadow: %s", JsonDocumentBuffer);
+  ESP_LOGI(TAG, "Updated Shadow: %s", entry->document);
   rc = aws_iot_shadow_update(mqttClient, (const char *)deviceid_txt_start,
-                             JsonDocumentBuffer, update_status_callback, NULL,
-                             4, true);
+                             entry->document, update_status_callback,
+                             (void *)(uintptr_t)shadow_epoch, 4, true);
   if (SUCCESS != rc) {
     return rc;
   }
@@ -220,183 +289,349 @@ static IoT_Error_t shadow_update(AWS_IoT_Client *mqttClient,
 }
 
 /**
- * @brief AWS IoT task: Create shadow connect and update data to AWS Device Shadow 
+ * @brief Folds relay changes since the last call into the pending document.
+ * Outlets changed by a local source also go into "desired".
  */
-void aws_iot_task(void *param) {
-  IoT_Error_t rc = FAILURE;
-  bool output_state[4] = {false, false, false, false};
-  AWS_IoT_Client mqttClient;
-
-  /* Create Shadow Parameter */
-  ShadowInitParameters_t sp = ShadowInitParametersDefault;
-  sp.pHost = (char *)endpoint_txt_start;
-  sp.port = AWS_IOT_MQTT_PORT;
-  sp.pClientCRT = (const char *)certificate_pem_crt_start;
-  sp.pClientKey = (const char *)private_pem_key_start;
-  sp.pRootCA = (const char *)aws_root_ca_pem_start;
-  sp.enableAutoReconnect = false;
-  sp.disconnectHandler = NULL;
-
-  /* Initialize shadow */
-  ESP_LOGI(TAG, "Shadow Init");
-  rc = aws_iot_shadow_init(&mqttClient, &sp);
-  if (SUCCESS != rc) {
-    ESP_LOGE(TAG, "Failed to initialize shadow %d", rc);
-    goto error;
+static void shadow_collect_changes(void) {
+  uint32_t local_changed;
+  uint32_t changed = outlet_state_sync(&seen_mask, &local_changed);
+
+  if (changed == 0) {
+    return;
   }
+  if (pending_reported_mask == 0) {
+    pending_since = xTaskGetTickCount();
+  } else {
+    merged_count++;
+  }
+  pending_reported_mask |= changed;
+  pending_desired_mask |= local_changed;
+}
 
-  /* Create shadow connect parameters */
-  ShadowConnectParameters_t scp = ShadowConnectParametersDefault;
-  scp.pMyThingName = (const char *)deviceid_txt_start;
-  scp.pMqttClientId = (const char *)deviceid_txt_start;
-  scp.mqttClientIdLen = (uint16_t)strlen((const char *)deviceid_txt_start);
+/**
+ * @brief True once the pending document may be sent
+ */
+static bool shadow_flush_due(void) {
+  TickType_t debounce = CONFIG_SHADOW_UPDATE_DEBOUNCE_MS / portTICK_RATE_MS;
 
-  /* Connecting to Thing */
-  ESP_LOGI(TAG, "Connecting to AWS Thing");
-  do {
-    rc = aws_iot_shadow_connect(&mqttClient, &scp);
-    if (SUCCESS != rc) {
-      ESP_LOGE(TAG, "Error (%d) connecting to %s: %d", rc, sp.pHost, sp.port);
-      vTaskDelay(1000 / portTICK_RATE_MS);
-    }
-  } while (SUCCESS != rc);
+  return pending_reported_mask != 0 && !shadowUpdateInProgress &&
+         !shadowGetInProgress &&
+         (TickType_t)(xTaskGetTickCount() - pending_since) >= debounce;
+}
 
-  /* enbable autoreconnect if a disconnection happens */
-  rc = aws_iot_shadow_set_autoreconnect_status(&mqttClient, true);
-  if (SUCCESS != rc) {
-    ESP_LOGE(TAG, "Unable to set Autorecoonect to true- %d", rc);
-    goto aws_error;
+/**
+ * @brief Publishes the pending document. Relays that toggled back to their
+ * last reported value cancel out and are not sent at all.
+ */
+static IoT_Error_t shadow_flush(AWS_IoT_Client *mqttClient,
+                                jsonStruct_t *handlers, bool *output_state) {
+  outlet_snapshot_t snapshot;
+
+  outlet_state_snapshot(&snapshot);
+  uint32_t reported_mask =
+      report_all ? ALL_OUTLETS_MASK : (seen_mask ^ snapshot.reported);
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    output_state[i] = (seen_mask & OUTLET_BIT(i)) != 0;
   }
+  uint32_t desired_mask = pending_desired_mask & reported_mask;
 
-  /* Creating a JSON structure for output */
-  jsonStruct_t output_handler[NUM_OF_RELAYS];
-  const char *output[NUM_OF_RELAYS] = {"relay_1", "relay_2", "relay_3",
-                                       "relay_4"};
+  pending_reported_mask = 0;
+  pending_desired_mask = 0;
+  if (reported_mask == 0) {
+    return SUCCESS;
+  }
 
-  output_handler[0].cb = output_state_change_callback_1;
-  output_handler[1].cb = output_state_change_callback_2;
-  output_handler[2].cb = output_state_change_callback_3;
-  output_handler[3].cb = output_state_change_callback_4;
+  IoT_Error_t rc = shadow_update(mqttClient, handlers, desired_mask);
+  if (rc != SUCCESS) {
+    return rc;
+  }
 
-  for (int i = 0; i < NUM_OF_RELAYS; i++) {
-    output_state[i] = app_driver_get_state(relay_number[i]);
-    output_handler[i].pData = &output_state[i];
-    output_handler[i].dataLength = sizeof(output_state[i]);
-    output_handler[i].type = SHADOW_JSON_BOOL;
-    output_handler[i].pKey = output[i];
+  report_all = false;
+  inflight_reported_mask = reported_mask;
+  inflight_desired_mask = desired_mask;
+  latency_probe_mark_mask(reported_mask, LATENCY_STAGE_PUBLISH);
+  outlet_state_set_reported(seen_mask);
+  publish_count++;
+  ESP_LOGI(TAG, "Shadow publishes %u, changes merged %u",
+           (unsigned)publish_count, (unsigned)merged_count);
+  return rc;
+}
 
-    rc = aws_iot_shadow_register_delta(&mqttClient, &output_handler[i]);
-    if (SUCCESS != rc) {
-      ESP_LOGE(TAG, "Shadow Register State Delta Error %d", rc);
-      goto aws_error;
-    }
+/**
+ * @brief Ticks until the debounce window of the pending document closes
+ */
+static TickType_t shadow_deadline(void) {
+  if (pending_reported_mask == 0 || shadowUpdateInProgress ||
+      shadowGetInProgress) {
+    return portMAX_DELAY;
   }
+  TickType_t debounce = CONFIG_SHADOW_UPDATE_DEBOUNCE_MS / portTICK_RATE_MS;
+  TickType_t elapsed = xTaskGetTickCount() - pending_since;
+  return elapsed >= debounce ? 0 : debounce - elapsed;
+}
 
-  /** 
-   * Dynamic memory allocation for desired state and reported state
-   * desired state
-   */
-  jsonStruct_t **desired_handles =
-      malloc(MAX_DESIRED_PARAM * sizeof(jsonStruct_t *));
-  if (desired_handles == NULL) {
-    ESP_LOGE(TAG, "Memory Allocation Failed");
-    goto aws_error;
-  }
+static bool shadow_awaiting_ack(void) {
+  return shadowUpdateInProgress || shadowGetInProgress;
+}
 
-  /* reported state */
-  jsonStruct_t **reported_handles =
-      malloc(MAX_REPORTED_PARAM * sizeof(jsonStruct_t *));
-  if (reported_handles == NULL) {
-    ESP_LOGE(TAG, "Memory Allocation Failed");
-    free(desired_handles);
-    goto aws_error;
+/**
+ * @brief Compares a full shadow document with the relays. Relays with a
+ * delta that differs from their state are switched, and only relays whose
+ * reported value differs from their state are published again. A relay
+ * switched locally while offline keeps its state and overrides desired.
+ * @retval
+ *  - ESP_OK: document applied, shadow_version is its version
+ *  - ESP_ERR_NO_MEM, ESP_ERR_INVALID_ARG: document not understood
+ */
+static esp_err_t shadow_reconcile(const char *document) {
+  json_lookup_t json;
+  uint32_t version;
+  uint32_t delta_keys = 0;
+  uint32_t cloud_desired = 0;
+  bool value;
+
+  esp_err_t err = json_lookup_parse_tokens(&json, shadow_get_tokens,
+                                           MAX_JSON_TOKEN_EXPECTED, document,
+                                           strlen(document));
+  if (err == ESP_OK) {
+    err = json_lookup_uint32(
+        &json, json_lookup_find(&json, JSON_LOOKUP_ROOT, "version"), &version);
+  }
+  if (err != ESP_OK) {
+    return err;
   }
+  /* A delta newer than the document may be waiting for shadow_run() */
+  uint32_t newest = delta_version > shadow_version ? delta_version
+                                                   : shadow_version;
+  bool stale = version < newest;
+  if (stale) {
+    ESP_LOGW(TAG, "Shadow v%u older than v%u, only diffing reported",
+             (unsigned)version, (unsigned)newest);
+  }
+
+  int state = json_lookup_find(&json, JSON_LOOKUP_ROOT, "state");
+  int reported = json_lookup_find(&json, state, "reported");
+  int delta = json_lookup_find(&json, state, "delta");
 
-  /**
-   *  Fill the allocated json memory block with data
-   * Report initial values once
-   */
-  size_t desired_count = 0, reported_count = 0;
+  /* Compare against local switches made up to now as well */
+  shadow_collect_changes();
 
-  for (int i = 0; i < NUM_OF_RELAYS; i++) {
-    reported_handles[reported_count++] = &output_handler[i];
+  /* Relays missing from reported are published */
+  uint32_t cloud_reported = ~seen_mask & ALL_OUTLETS_MASK;
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    if (json_lookup_bool(&json, json_lookup_find(&json, reported, output_keys[i]),
+                         &value) == ESP_OK) {
+      cloud_reported = value ? cloud_reported | OUTLET_BIT(i)
+                             : cloud_reported & ~OUTLET_BIT(i);
+    }
+    if (!stale &&
+        json_lookup_bool(&json, json_lookup_find(&json, delta, output_keys[i]),
+                         &value) == ESP_OK) {
+      delta_keys |= OUTLET_BIT(i);
+      cloud_desired |= value ? OUTLET_BIT(i) : 0;
+    }
   }
 
-  /* update device shadow */
-  rc = shadow_update(&mqttClient, reported_handles, reported_count,
-                     desired_handles, desired_count);
-  for (int i = 0; i < NUM_OF_RELAYS; i++) {
-    reported_state[i] = output_state[i];
+  uint32_t differs = delta_keys & (cloud_desired ^ seen_mask);
+  uint32_t conflict = differs & pending_desired_mask;
+
+  /* The document supersedes deltas collected before it, unless it is older
+   * than they are: then they stay and it only tells what was reported */
+  if (!stale) {
+    latency_probe_drop(delta_mask & ~(differs & ~conflict));
+    delta_mask = differs & ~conflict;
+    delta_values = cloud_desired & delta_mask;
+    delta_version = 0;
+    shadow_version = version;
   }
 
-  while (NETWORK_ATTEMPTING_RECONNECT == rc || NETWORK_RECONNECTED == rc ||
-         SUCCESS == rc) {
-    rc = aws_iot_shadow_yield(&mqttClient, 200);
-    if (NETWORK_ATTEMPTING_RECONNECT == rc || shadowUpdateInProgress) {
-      rc = aws_iot_shadow_yield(&mqttClient, 1000);
-      /* If the client is attempting to reconnect, or already waiting on a shadow update, we will skip the rest of the loop. */
-      continue;
+  /* Make the flush see a difference for the outlets to push into desired */
+  cloud_reported = (cloud_reported & ~conflict) | (~seen_mask & conflict);
+  outlet_state_set_reported(cloud_reported);
+  report_all = false;
+  if ((seen_mask ^ cloud_reported) != 0) {
+    if (pending_reported_mask == 0) {
+      pending_since = xTaskGetTickCount();
     }
+    pending_reported_mask |= seen_mask ^ cloud_reported;
+  }
+  ESP_LOGI(TAG, "Shadow v%u: apply 0x%04x, report 0x%04x, keep local 0x%04x",
+           (unsigned)version, (unsigned)delta_mask,
+           (unsigned)(seen_mask ^ cloud_reported), (unsigned)conflict);
+  return ESP_OK;
+}
 
-    desired_count = 0;
-    reported_count = 0;
-
-    /* 
-     * check output driver
-     * changed in this is a local change of state
-     */
-    for (int i = 0; i < NUM_OF_RELAYS; i++) {
-      output_state[i] = app_driver_get_state(relay_number[i]);
-      if (reported_state[i] != output_state[i]) {
-        reported_handles[reported_count++] = &output_handler[i];
-        if (output_changed_locally[i] == true) {
-          desired_handles[desired_count++] = &output_handler[i];
-        }
-        output_changed_locally[i] = true;
-        reported_state[i] = output_state[i];
-      }
-    }
+/**
+ * @brief Get status callback, the accepted document carries the whole
+ * shadow with its version.
+ */
+static void get_status_callback(const char *pThingName, ShadowActions_t action,
+                                Shadow_Ack_Status_t status,
+                                const char *pReceivedJsonDocument,
+                                void *pContextData) {
+  IOT_UNUSED(pThingName);
+  IOT_UNUSED(action);
+  IOT_UNUSED(pContextData);
 
-    if (reported_count > 0 || desired_count > 0) {
-      rc = shadow_update(&mqttClient, reported_handles, reported_count,
-                         desired_handles, desired_count);
-    }
+  shadowGetInProgress = false;
 
-    vTaskDelay(1000 / portTICK_RATE_MS);
+  if (SHADOW_ACK_ACCEPTED == status) {
+    esp_err_t err = shadow_reconcile(pReceivedJsonDocument);
+    if (err == ESP_OK) {
+      return;
+    }
+    ESP_LOGE(TAG, "Shadow document not understood: %s", esp_err_to_name(err));
+  } else if (SHADOW_ACK_REJECTED == status) {
+    /* Usually a shadow that does not exist yet */
+    ESP_LOGW(TAG, "Get rejected");
+    shadow_version = 0;
+    aws_iot_shadow_reset_last_received_version();
+  } else {
+    ESP_LOGE(TAG, "Get timed out");
   }
+  shadow_report_all();
+}
 
+/**
+ * @brief Fetches the whole shadow. Updates wait until it is compared with
+ * the relays, an update still awaiting its ack no longer holds them up.
+ */
+static IoT_Error_t shadow_get(AWS_IoT_Client *mqttClient) {
+  IoT_Error_t rc =
+      aws_iot_shadow_get(mqttClient, (const char *)deviceid_txt_start,
+                         get_status_callback, NULL, 4, false);
   if (SUCCESS != rc) {
-    ESP_LOGE(TAG, "An error occured in the loop %d", rc);
+    ESP_LOGE(TAG, "Shadow get failed %d, reporting every relay", rc);
+    shadow_report_all();
+    return rc;
   }
+  shadow_epoch++;
+  shadowUpdateInProgress = false;
+  shadowGetInProgress = true;
+  return rc;
+}
 
-  if (reported_handles) {
-    free(reported_handles);
+/**
+ * @brief The shadow was deleted. Versions start over when it is created
+ * again, so nothing applied so far may hold back the deltas to come.
+ */
+static void shadow_delete_handler(AWS_IoT_Client *pClient, char *topicName,
+                                  uint16_t topicNameLen,
+                                  IoT_Publish_Message_Params *params,
+                                  void *pData) {
+  ESP_LOGW(TAG, "Shadow deleted, reporting every relay");
+  shadow_version = 0;
+  delta_version = 0;
+  aws_iot_shadow_reset_last_received_version();
+  shadow_report_all();
+}
+
+/**
+ * @brief Output driver hook, wakes the cloud task as soon as relays change
+ */
+static void output_changed(uint32_t changed, uint32_t state) {
+  cloud_connection_notify(CLOUD_EVENT_LOCAL_CHANGE);
+}
+
+/**
+ * @brief Registers the relay deltas and reports the initial state once the
+ * shared connection is up.
+ */
+static IoT_Error_t shadow_connected(AWS_IoT_Client *mqttClient) {
+  IoT_Error_t rc = FAILURE;
+
+  seen_mask = outlet_state_current();
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    output_state[i] = (seen_mask & OUTLET_BIT(i)) != 0;
+    output_handler[i].cb = output_state_change_callback;
+    output_handler[i].pData = &output_state[i];
+    output_handler[i].dataLength = sizeof(output_state[i]);
+    output_handler[i].type = SHADOW_JSON_BOOL;
+    output_handler[i].pKey = output_keys[i];
+
+    rc = aws_iot_shadow_register_delta(mqttClient, &output_handler[i]);
+    if (SUCCESS != rc) {
+      ESP_LOGE(TAG, "Shadow Register State Delta Error %d", rc);
+      return rc;
+    }
   }
-  if (desired_handles) {
-    free(desired_handles);
+
+  /* Stale deltas are dropped by the SDK before they reach us as well */
+  aws_iot_shadow_enable_discard_old_delta_msgs();
+
+  /* Outlets switched locally while offline, before a reboot too, go into
+   * desired so it cant switch them back. Everything else is compared with
+   * the cloud copy first, and reported in full only if that is unknown. */
+  pending_reported_mask = 0;
+  pending_desired_mask = outlet_journal_net_changes();
+  if (shadow_get(mqttClient) == SUCCESS) {
+    return SUCCESS;
   }
+  return shadow_flush(mqttClient, output_handler, output_state);
+}
 
-  /* aws error */
-aws_error:
-  ESP_LOGI(TAG, "Disconnecting");
-  rc = aws_iot_shadow_disconnect(&mqttClient);
+/**
+ * @brief Runs on every wake-up of the cloud task
+ */
+static IoT_Error_t shadow_run(AWS_IoT_Client *mqttClient, uint32_t events,
+                              bool reconnecting) {
+  /* Every outlet of a delta document switches in one pass */
+  if (delta_mask != 0) {
+    app_driver_apply_mask(delta_mask, delta_values, false);
+    delta_mask = 0;
+    delta_values = 0;
+  }
+  if (delta_version > shadow_version) {
+    shadow_version = delta_version;
+  }
+  delta_version = 0;
 
-  if (SUCCESS != rc) {
-    ESP_LOGE(TAG, "Disconnect error %d", rc);
+  /* Changes are merged even while an update is in flight */
+  shadow_collect_changes();
+
+  /* While the client is reconnecting changes just stay pending, deltas
+   * missed meanwhile are picked up by one get once it is back */
+  if (reconnecting) {
+    shadow_get_due = true;
+    return SUCCESS;
+  }
+  if (shadow_get_due) {
+    shadow_get_due = false;
+    if (shadow_get(mqttClient) == SUCCESS) {
+      return SUCCESS;
+    }
+  }
+  if (!shadow_flush_due()) {
+    return SUCCESS;
   }
-error:
-  vTaskDelete(NULL);
+  return shadow_flush(mqttClient, output_handler, output_state);
 }
 
+static const cloud_service_t shadow_service = {
+    .name = "shadow",
+    .connected = shadow_connected,
+    .run = shadow_run,
+    .deadline = shadow_deadline,
+    .awaiting_ack = shadow_awaiting_ack,
+};
+
 /**
- * @brief This function handles the creation AWS Device Shadow Connection task.
+ * @brief Registers the AWS Device Shadow with the shared cloud connection,
+ * and the relay change listener that wakes it, once per boot.
  */
 int shadow_start(void) {
-  /* Create task*/
-  BaseType_t cloud_begin =
-      xTaskCreate(&aws_iot_task, "aws_iot_task", 9216, NULL, 5, NULL);
-  if (cloud_begin != pdPASS) {
-    ESP_LOGE(TAG, "Couldnt create a cloud task\n");
+  snprintf(delete_topic, sizeof(delete_topic),
+           "$aws/things/%s/shadow/delete/accepted",
+           (const char *)deviceid_txt_start);
+  if (cloud_connection_subscribe(delete_topic, shadow_delete_handler, NULL) !=
+      ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the shadow delete topic\n");
+    return ESP_FAIL;
   }
-  return ESP_OK;
-}
\ No newline at end of file
+  /* Relay changes wake the cloud task instead of being polled for */
+  if (app_driver_register_change_cb(output_changed) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the relay change listener\n");
+    return ESP_FAIL;
+  }
+  return cloud_connection_register_service(&shadow_service);
+}
@@ -0,0 +1,297 @@
+/**
+ ******************************************************************************
+ * @file      json_lookup.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Non-allocating JSON key lookup over jsmn tokens
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <string.h>
+
+#include "json_lookup.h"
+
+/**
+ * @brief Tokenizes a payload into the fixed token array of doc.
+ * @param [IN] doc: lookup context, owned by the caller
+ * @param [IN] json: payload, it must outlive every lookup on doc
+ * @param [IN] len: payload length, the payload need not be NUL terminated
+ * @retval
+ *  - ESP_OK: payload is a JSON object
+ *  - ESP_ERR_NO_MEM: more tokens than JSON_LOOKUP_MAX_TOKENS
+ *  - ESP_ERR_INVALID_ARG: malformed or not an object
+ */
+esp_err_t json_lookup_parse(json_lookup_t *doc, const char *json, size_t len) {
+  return json_lookup_parse_tokens(doc, doc->storage, JSON_LOOKUP_MAX_TOKENS,
+                                  json, len);
+}
+
+/**
+ * @brief Same as json_lookup_parse() with caller owned token storage, for
+ * documents larger than the command payloads, like a full shadow.
+ * @param [IN] tokens: token array, it must outlive every lookup on doc
+ * @param [IN] max_tokens: number of entries in tokens
+ */
+esp_err_t json_lookup_parse_tokens(json_lookup_t *doc, jsmntok_t *tokens,
+                                   unsigned max_tokens, const char *json,
+                                   size_t len) {
+  jsmn_parser parser;
+
+  doc->json = json;
+  doc->len = len;
+  doc->count = 0;
+  doc->tokens = tokens;
+
+  jsmn_init(&parser);
+  int count = jsmn_parse(&parser, json, len, tokens, max_tokens);
+  if (count == JSMN_ERROR_NOMEM) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (count < 1 || tokens[JSON_LOOKUP_ROOT].type != JSMN_OBJECT) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  doc->count = count;
+  return ESP_OK;
+}
+
+/**
+ * @brief Index of the first token past the value starting at token, which is
+ * the next key when walking the members of an object. Child tokens always
+ * lie inside their parent's byte range.
+ */
+int json_lookup_skip(const json_lookup_t *doc, int token) {
+  int end = doc->tokens[token].end;
+
+  token++;
+  while (token < doc->count && doc->tokens[token].start < end) {
+    token++;
+  }
+  return token;
+}
+
+/**
+ * @brief Finds a key among the direct members of an object.
+ * @param [IN] object: token index of the object, JSON_LOOKUP_ROOT for the top
+ * @param [IN] key: NUL terminated key
+ * @retval Token index of the value, or -1 if the key is absent
+ */
+int json_lookup_find(const json_lookup_t *doc, int object, const char *key) {
+  size_t key_len = strlen(key);
+
+  if (object < 0 || object >= doc->count ||
+      doc->tokens[object].type != JSMN_OBJECT) {
+    return -1;
+  }
+
+  int token = object + 1;
+  for (int i = 0; i < doc->tokens[object].size && token + 1 < doc->count;
+       i++) {
+    const jsmntok_t *name = &doc->tokens[token];
+    if (name->type == JSMN_STRING &&
+        (size_t)(name->end - name->start) == key_len &&
+        memcmp(doc->json + name->start, key, key_len) == 0) {
+      return token + 1;
+    }
+    token = json_lookup_skip(doc, token + 1);
+  }
+  return -1;
+}
+
+/**
+ * @brief Value of the 4 hex digits of a \u escape, or -1.
+ */
+static int32_t json_lookup_hex4(const char *src, const char *end) {
+  int32_t value = 0;
+
+  if (end - src < 4) {
+    return -1;
+  }
+  for (int i = 0; i < 4; i++) {
+    char c = src[i];
+    int digit = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                       : -1;
+    if (digit < 0) {
+      return -1;
+    }
+    value = value << 4 | digit;
+  }
+  return value;
+}
+
+/**
+ * @brief Encodes a code point as UTF-8.
+ * @retval number of bytes written to out, 1 to 4
+ */
+static size_t json_lookup_utf8(uint32_t code, char *out) {
+  if (code < 0x80) {
+    out[0] = (char)code;
+    return 1;
+  }
+  if (code < 0x800) {
+    out[0] = (char)(0xC0 | code >> 6);
+    out[1] = (char)(0x80 | (code & 0x3F));
+    return 2;
+  }
+  if (code < 0x10000) {
+    out[0] = (char)(0xE0 | code >> 12);
+    out[1] = (char)(0x80 | (code >> 6 & 0x3F));
+    out[2] = (char)(0x80 | (code & 0x3F));
+    return 3;
+  }
+  out[0] = (char)(0xF0 | code >> 18);
+  out[1] = (char)(0x80 | (code >> 12 & 0x3F));
+  out[2] = (char)(0x80 | (code >> 6 & 0x3F));
+  out[3] = (char)(0x80 | (code & 0x3F));
+  return 4;
+}
+
+/**
+ * @brief Decodes the \u escape at src, a surrogate pair taking two, and
+ * moves src past it.
+ * @retval the code point, or -1 if malformed, a lone surrogate or NUL
+ */
+static int32_t json_lookup_unicode(const char **src, const char *end) {
+  int32_t code = json_lookup_hex4(*src, end);
+
+  if (code < 0) {
+    return -1;
+  }
+  *src += 4;
+  if (code >= 0xD800 && code <= 0xDBFF) {
+    if (end - *src < 2 || (*src)[0] != '\\' || (*src)[1] != 'u') {
+      return -1;
+    }
+    int32_t low = json_lookup_hex4(*src + 2, end);
+    if (low < 0xDC00 || low > 0xDFFF) {
+      return -1;
+    }
+    *src += 6;
+    return 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+  }
+  /* A C string cant hold NUL */
+  if ((code >= 0xDC00 && code <= 0xDFFF) || code == 0) {
+    return -1;
+  }
+  return code;
+}
+
+/**
+ * @brief Copies a string value into buf, decoding its escapes; \uXXXX
+ * becomes UTF-8.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_ERR_INVALID_ARG: not a string, or a malformed escape or \u0000
+ *  - ESP_ERR_INVALID_SIZE: buf cannot hold the value and a NUL
+ */
+esp_err_t json_lookup_string(const json_lookup_t *doc, int token, char *buf,
+                             size_t buf_len) {
+  if (token < 0 || token >= doc->count ||
+      doc->tokens[token].type != JSMN_STRING || buf_len == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  const char *src = doc->json + doc->tokens[token].start;
+  const char *end = doc->json + doc->tokens[token].end;
+  size_t out = 0;
+
+  while (src < end) {
+    char utf8[4] = {*src++};
+    size_t n = 1;
+
+    if (utf8[0] == '\\') {
+      char c = src < end ? *src++ : '\0';
+      switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        utf8[0] = c;
+        break;
+      case 'b':
+        utf8[0] = '\b';
+        break;
+      case 'f':
+        utf8[0] = '\f';
+        break;
+      case 'n':
+        utf8[0] = '\n';
+        break;
+      case 'r':
+        utf8[0] = '\r';
+        break;
+      case 't':
+        utf8[0] = '\t';
+        break;
+      case 'u': {
+        int32_t code = json_lookup_unicode(&src, end);
+        if (code < 0) {
+          return ESP_ERR_INVALID_ARG;
+        }
+        n = json_lookup_utf8((uint32_t)code, utf8);
+        break;
+      }
+      default:
+        return ESP_ERR_INVALID_ARG;
+      }
+    }
+    if (out + n >= buf_len) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(buf + out, utf8, n);
+    out += n;
+  }
+  buf[out] = '\0';
+  return ESP_OK;
+}
+
+/**
+ * @brief Reads a literal true or false; anything else, such as "tru" or
+ * "falsey" that a lenient tokenizer lets through, is refused.
+ */
+esp_err_t json_lookup_bool(const json_lookup_t *doc, int token, bool *value) {
+  if (token < 0 || token >= doc->count ||
+      doc->tokens[token].type != JSMN_PRIMITIVE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  const char *src = doc->json + doc->tokens[token].start;
+  size_t len = (size_t)(doc->tokens[token].end - doc->tokens[token].start);
+  if (len == 4 && memcmp(src, "true", 4) == 0) {
+    *value = true;
+  } else if (len == 5 && memcmp(src, "false", 5) == 0) {
+    *value = false;
+  } else {
+    return ESP_ERR_INVALID_ARG;
+  }
+  return ESP_OK;
+}
+
+esp_err_t json_lookup_uint32(const json_lookup_t *doc, int token,
+                             uint32_t *value) {
+  if (token < 0 || token >= doc->count ||
+      doc->tokens[token].type != JSMN_PRIMITIVE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  const char *src = doc->json + doc->tokens[token].start;
+  const char *end = doc->json + doc->tokens[token].end;
+  uint32_t result = 0;
+
+  if (src == end) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  while (src < end) {
+    if (*src < '0' || *src > '9') {
+      return ESP_ERR_INVALID_ARG;
+    }
+    uint32_t digit = (uint32_t)(*src++ - '0');
+    if (result > (UINT32_MAX - digit) / 10) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    result = result * 10 + digit;
+  }
+  *value = result;
+  return ESP_OK;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "jsmn.h"
+
+/* Token budget per message, enough for the command payloads we accept */
+#define JSON_LOOKUP_MAX_TOKENS 48
+
+/* Token index of the top level object */
+#define JSON_LOOKUP_ROOT 0
+
+/**
+ * @brief Tokenized view of a JSON payload. Tokens only hold offsets into the
+ * caller's buffer, so parsing never allocates or copies. tokens points at
+ * storage unless the caller parsed into its own, larger array.
+ */
+typedef struct {
+  const char *json;
+  size_t len;
+  int count;
+  jsmntok_t *tokens;
+  jsmntok_t storage[JSON_LOOKUP_MAX_TOKENS];
+} json_lookup_t;
+
+esp_err_t json_lookup_parse(json_lookup_t *doc, const char *json, size_t len);
+esp_err_t json_lookup_parse_tokens(json_lookup_t *doc, jsmntok_t *tokens,
+                                   unsigned max_tokens, const char *json,
+                                   size_t len);
+int json_lookup_skip(const json_lookup_t *doc, int token);
+int json_lookup_find(const json_lookup_t *doc, int object, const char *key);
+esp_err_t json_lookup_string(const json_lookup_t *doc, int token, char *buf,
+                             size_t buf_len);
+esp_err_t json_lookup_bool(const json_lookup_t *doc, int token, bool *value);
+esp_err_t json_lookup_uint32(const json_lookup_t *doc, int token,
+                             uint32_t *value);
@@ -0,0 +1,198 @@
+/**
+ ******************************************************************************
+ * @file      lan_control.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Local UDP Control Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <errno.h>
+#include <stdbool.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+
+#include "lan_control.h"
+#include "outlet_state.h"
+#include "output_driver.h"
+
+#define TAG "LAN_CONTROL"
+
+#define ALL_OUTLETS_MASK ((uint32_t)((1ULL << OUTLET_COUNT) - 1))
+
+/* Back-off after a socket error, so a broken socket doesnt spin */
+#define LAN_CONTROL_ERROR_DELAY_MS 100
+/* Clients whose last sequence number is remembered */
+#define LAN_CONTROL_MAX_PEERS 8
+/* A client quiet for this long starts over with any sequence number */
+#define LAN_CONTROL_PEER_TIMEOUT_MS 10000
+
+typedef struct {
+  struct sockaddr_in addr;
+  uint16_t seq;
+  TickType_t seen;
+  bool used;
+} lan_control_peer_t;
+
+static int lan_socket = -1;
+static lan_control_peer_t peers[LAN_CONTROL_MAX_PEERS];
+
+static uint16_t get_le16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static void put_le16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+}
+
+/**
+ * @brief Runs a request through the same path as a shadow delta, as a local
+ * change, so the shadow reports it upstream.
+ */
+static uint8_t lan_control_apply(uint8_t opcode, uint32_t mask,
+                                 uint32_t values) {
+  if (mask & ~ALL_OUTLETS_MASK) {
+    return LAN_CONTROL_BAD_OUTLET;
+  }
+
+  switch (opcode) {
+  case LAN_CONTROL_OP_GET:
+    return LAN_CONTROL_OK;
+  case LAN_CONTROL_OP_SET:
+    app_driver_apply_mask(mask, values, true);
+    return LAN_CONTROL_OK;
+  case LAN_CONTROL_OP_TOGGLE:
+    app_driver_apply_mask(mask, ~outlet_state_current(), true);
+    return LAN_CONTROL_OK;
+  default:
+    return LAN_CONTROL_BAD_OPCODE;
+  }
+}
+
+/**
+ * @brief Tells whether a request is newer than the last one applied for the
+ * same client, and remembers it if so. A retransmitted or reordered request
+ * is answered without being applied again, so a lost reply cant make a
+ * toggle switch twice or an old set undo a newer one. The least recently
+ * seen client makes room for a new one.
+ */
+static bool lan_control_is_new(const struct sockaddr_in *addr, uint16_t seq) {
+  TickType_t now = xTaskGetTickCount();
+  lan_control_peer_t *slot = &peers[0];
+
+  for (int i = 0; i < LAN_CONTROL_MAX_PEERS; i++) {
+    lan_control_peer_t *peer = &peers[i];
+    if (peer->used &&
+        now - peer->seen >= pdMS_TO_TICKS(LAN_CONTROL_PEER_TIMEOUT_MS)) {
+      peer->used = false;
+    }
+    if (peer->used && peer->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+        peer->addr.sin_port == addr->sin_port) {
+      peer->seen = now;
+      /* Sequence numbers wrap, newer is ahead by less than half the range */
+      if ((int16_t)(seq - peer->seq) <= 0) {
+        return false;
+      }
+      peer->seq = seq;
+      return true;
+    }
+    /* Otherwise take a free slot, or the least recently seen client's */
+    if (slot->used && (!peer->used || now - peer->seen > now - slot->seen)) {
+      slot = peer;
+    }
+  }
+
+  *slot = (lan_control_peer_t){
+      .addr = *addr, .seq = seq, .seen = now, .used = true};
+  return true;
+}
+
+/**
+ * @brief Answers each request from the task that applied it, right after
+ * the relays switched.
+ */
+static void lan_control_task(void *param) {
+  /* One byte more than a request, so a longer datagram is seen as such */
+  uint8_t msg[LAN_CONTROL_MSG_LEN + 1];
+  struct sockaddr_in peer;
+
+  for (;;) {
+    socklen_t peer_len = sizeof(peer);
+    int len = recvfrom(lan_socket, msg, sizeof(msg), 0,
+                       (struct sockaddr *)&peer, &peer_len);
+    if (len < 0) {
+      ESP_LOGE(TAG, "Receive failed, errno %d", errno);
+      vTaskDelay(pdMS_TO_TICKS(LAN_CONTROL_ERROR_DELAY_MS));
+      continue;
+    }
+    if (len != LAN_CONTROL_MSG_LEN ||
+        msg[LAN_CONTROL_OFF_MAGIC] != LAN_CONTROL_MAGIC ||
+        (msg[LAN_CONTROL_OFF_OPCODE] & LAN_CONTROL_REPLY)) {
+      continue;
+    }
+
+    uint8_t opcode = msg[LAN_CONTROL_OFF_OPCODE];
+    uint8_t status = LAN_CONTROL_OK;
+    bool changes = opcode == LAN_CONTROL_OP_SET ||
+                   opcode == LAN_CONTROL_OP_TOGGLE;
+    /* A repeated change is answered with the state, as the first was */
+    if (!changes ||
+        lan_control_is_new(&peer, get_le16(msg + LAN_CONTROL_OFF_SEQ))) {
+      status = lan_control_apply(opcode, get_le16(msg + LAN_CONTROL_OFF_MASK),
+                                 get_le16(msg + LAN_CONTROL_OFF_VALUES));
+    }
+
+    /* Magic and sequence number stay as they came */
+    msg[LAN_CONTROL_OFF_OPCODE] |= LAN_CONTROL_REPLY;
+    msg[LAN_CONTROL_OFF_STATUS] = status;
+    msg[LAN_CONTROL_OFF_STATUS + 1] = 0;
+    put_le16(msg + LAN_CONTROL_OFF_STATE, (uint16_t)outlet_state_current());
+    if (sendto(lan_socket, msg, LAN_CONTROL_MSG_LEN, 0,
+               (struct sockaddr *)&peer, peer_len) < 0) {
+      ESP_LOGW(TAG, "Reply failed, errno %d", errno);
+    }
+  }
+}
+
+/**
+ * @brief Opens the UDP control port on every interface. Needs the network
+ * stack; requests are served as soon as there is an IP.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+int lan_control_start(void) {
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(CONFIG_LAN_CONTROL_PORT),
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+
+  lan_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (lan_socket < 0) {
+    ESP_LOGE(TAG, "Couldnt create the control socket\n");
+    return ESP_FAIL;
+  }
+  if (bind(lan_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ESP_LOGE(TAG, "Couldnt bind UDP port %d\n", CONFIG_LAN_CONTROL_PORT);
+    close(lan_socket);
+    lan_socket = -1;
+    return ESP_FAIL;
+  }
+
+  /* Same priority as the cloud task, so neither path waits on the other */
+  if (xTaskCreate(&lan_control_task, "lan_control", 3072, NULL, 5, NULL) !=
+      pdPASS) {
+    ESP_LOGE(TAG, "Couldnt create the LAN control task\n");
+    close(lan_socket);
+    lan_socket = -1;
+    return ESP_FAIL;
+  }
+  ESP_LOGI(TAG, "Listening on UDP port %d", CONFIG_LAN_CONTROL_PORT);
+  return ESP_OK;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Local control over UDP, one datagram each way of LAN_CONTROL_MSG_LEN
+ * bytes, integers little endian. Request:
+ *   0     LAN_CONTROL_MAGIC
+ *   1     opcode
+ *   2..3  sequence number, echoed in the reply
+ *   4..5  outlets to switch or toggle, bit n is outlet n + 1
+ *   6..7  new state of those outlets (LAN_CONTROL_OP_SET)
+ * Reply:
+ *   0     LAN_CONTROL_MAGIC
+ *   1     opcode | LAN_CONTROL_REPLY
+ *   2..3  sequence number of the request
+ *   4     status
+ *   5     0
+ *   6..7  state of every outlet once the request is applied
+ * Datagrams of another length or magic are dropped without a reply.
+ *
+ * A set or toggle is applied only if its sequence number is ahead of the
+ * last one applied for the same address and port (modulo 2^16), so a
+ * client retransmitting a request whose reply was lost gets the state
+ * back without the outlets switching again. A client quiet for 10 s may
+ * start over from any number.
+ */
+#define LAN_CONTROL_MSG_LEN 8
+#define LAN_CONTROL_MAGIC 0xB7
+#define LAN_CONTROL_REPLY 0x80
+
+#define LAN_CONTROL_OFF_MAGIC 0
+#define LAN_CONTROL_OFF_OPCODE 1
+#define LAN_CONTROL_OFF_SEQ 2
+#define LAN_CONTROL_OFF_MASK 4
+#define LAN_CONTROL_OFF_STATUS 4
+#define LAN_CONTROL_OFF_VALUES 6
+#define LAN_CONTROL_OFF_STATE 6
+
+typedef enum {
+  LAN_CONTROL_OP_GET = 0,
+  LAN_CONTROL_OP_SET = 1,
+  LAN_CONTROL_OP_TOGGLE = 2,
+} lan_control_op_t;
+
+typedef enum {
+  LAN_CONTROL_OK = 0,
+  LAN_CONTROL_BAD_OPCODE = 1,
+  LAN_CONTROL_BAD_OUTLET = 2,
+} lan_control_status_t;
+
+int lan_control_start(void);
@@ -0,0 +1,139 @@
+/**
+ ******************************************************************************
+ * @file      latency_probe.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Actuation Latency Probes and Histograms Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "latency_probe.h"
+#include "outlet_config.h"
+
+/**
+ * @brief One delta travelling through the pipeline. Stages are recorded in
+ * order only, so a delta that changed nothing (and never reached the
+ * driver) can't pick up the timings of a later, unrelated publish.
+ */
+typedef struct {
+  int64_t start_us;
+  uint8_t next_stage;
+} latency_trace_t;
+
+/* No delta in flight; RECEIVE is never expected once a trace is open */
+#define LATENCY_TRACE_IDLE LATENCY_STAGE_RECEIVE
+
+/*
+ * Everything below except rx_us is only touched from the cloud task: the
+ * delta callbacks, the driver calls they make and the shadow acks all run
+ * there. rx_us is written by the socket watcher, which then blocks until the
+ * cloud task has read the socket, so the two never overlap.
+ */
+static volatile int64_t rx_us;
+static latency_trace_t traces[OUTLET_COUNT];
+static latency_histogram_t histograms[LATENCY_STAGE_COUNT];
+
+static const char *const stage_names[LATENCY_STAGE_COUNT] = {
+    "receive", "parse", "dispatch", "gpio", "lcd", "publish", "ack",
+};
+
+/**
+ * @brief Adds one sample to a stage's histogram
+ */
+static void latency_record(latency_stage_t stage, int64_t latency_us) {
+  latency_histogram_t *h = &histograms[stage];
+  uint32_t us = latency_us < 0            ? 0
+                : latency_us > UINT32_MAX ? UINT32_MAX
+                                          : (uint32_t)latency_us;
+  uint32_t bucket = 0;
+
+  if (us >= LATENCY_BUCKET_MIN_US) {
+    bucket = 32 - __builtin_clz(us / LATENCY_BUCKET_MIN_US);
+    if (bucket >= LATENCY_BUCKET_COUNT) {
+      bucket = LATENCY_BUCKET_COUNT - 1;
+    }
+  }
+
+  h->buckets[bucket]++;
+  h->count++;
+  h->sum_us += us;
+  if (us > h->max_us) {
+    h->max_us = us;
+  }
+}
+
+/**
+ * @brief Stamps the moment the MQTT socket became readable. Called by the
+ * socket watcher before it wakes the cloud task.
+ */
+void latency_probe_rx(void) { rx_us = esp_timer_get_time(); }
+
+/**
+ * @brief Records how long the cloud task took to start reading the socket
+ */
+void latency_probe_receive(void) {
+  latency_record(LATENCY_STAGE_RECEIVE, esp_timer_get_time() - rx_us);
+}
+
+/**
+ * @brief Opens a trace for a delta just decoded for an outlet, replacing any
+ * trace the outlet still had open.
+ */
+void latency_probe_begin(int outlet) {
+  traces[outlet].start_us = rx_us;
+  traces[outlet].next_stage = LATENCY_STAGE_PARSE;
+  latency_probe_mark(outlet, LATENCY_STAGE_PARSE);
+}
+
+/**
+ * @brief Records a stage for an outlet's open trace. The ack closes it.
+ */
+void latency_probe_mark(int outlet, latency_stage_t stage) {
+  latency_trace_t *trace = &traces[outlet];
+
+  if (trace->next_stage != stage) {
+    return;
+  }
+  latency_record(stage, esp_timer_get_time() - trace->start_us);
+  trace->next_stage =
+      stage == LATENCY_STAGE_ACK ? LATENCY_TRACE_IDLE : stage + 1;
+}
+
+/**
+ * @brief latency_probe_mark() for every outlet in the mask
+ */
+void latency_probe_mark_mask(uint32_t mask, latency_stage_t stage) {
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    if (mask & (1u << i)) {
+      latency_probe_mark(i, stage);
+    }
+  }
+}
+
+/**
+ * @brief Abandons the open traces of the outlets in the mask
+ */
+void latency_probe_drop(uint32_t mask) {
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    if (mask & (1u << i)) {
+      traces[i].next_stage = LATENCY_TRACE_IDLE;
+    }
+  }
+}
+
+const latency_histogram_t *latency_probe_histogram(latency_stage_t stage) {
+  return &histograms[stage];
+}
+
+/**
+ * @brief Clears the histograms, open traces are kept
+ */
+void latency_probe_reset(void) { memset(histograms, 0, sizeof(histograms)); }
+
+const char *latency_probe_stage_name(latency_stage_t stage) {
+  return stage_names[stage];
+}
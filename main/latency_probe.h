@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Stages of the cloud-to-relay pipeline. Every stage is timed from the
+ * moment the MQTT socket became readable, so each histogram holds the
+ * latency accumulated up to and including that stage.
+ */
+typedef enum {
+  LATENCY_STAGE_RECEIVE,  /* cloud task starts reading the socket */
+  LATENCY_STAGE_PARSE,    /* delta for the outlet decoded */
+  LATENCY_STAGE_DISPATCH, /* output driver accepted the new state */
+  LATENCY_STAGE_GPIO,     /* relay pin written */
+  LATENCY_STAGE_LCD,      /* new state queued in the LCD framebuffer */
+  LATENCY_STAGE_PUBLISH,  /* reported state handed to MQTT */
+  LATENCY_STAGE_ACK,      /* shadow update accepted */
+  LATENCY_STAGE_COUNT,
+} latency_stage_t;
+
+/* Bucket 0 holds [0, MIN), bucket n holds [MIN << (n - 1), MIN << n) and the
+ * last bucket everything above */
+#define LATENCY_BUCKET_COUNT 16
+#define LATENCY_BUCKET_MIN_US 64
+
+typedef struct {
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t sum_us;
+  uint32_t buckets[LATENCY_BUCKET_COUNT];
+} latency_histogram_t;
+
+void latency_probe_rx(void);
+void latency_probe_receive(void);
+void latency_probe_begin(int outlet);
+void latency_probe_mark(int outlet, latency_stage_t stage);
+void latency_probe_mark_mask(uint32_t mask, latency_stage_t stage);
+void latency_probe_drop(uint32_t mask);
+const latency_histogram_t *latency_probe_histogram(latency_stage_t stage);
+void latency_probe_reset(void);
+const char *latency_probe_stage_name(latency_stage_t stage);
@@ -0,0 +1,196 @@
+/**
+ ******************************************************************************
+ * @file      lcd_bus.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Batched I2C Transfers to the LCD2004 Backpack
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdbool.h>
+
+#include "driver/i2c.h"
+#include "esp_idf_version.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#include "lcd_bus.h"
+#include "output_driver.h"
+
+#define TAG "LCD_BUS"
+
+/* PCF8574 pins: P0 RS, P1 RW, P2 E, P3 backlight, P4-P7 D4-D7 */
+#define LCD_BUS_RS_DATA 0x01
+#define LCD_BUS_ENABLE 0x04
+
+/* HD44780 Set DDRAM Address */
+#define LCD_BUS_SET_DDRAM_ADDR 0x80
+
+/* Each controller byte goes over as two nibbles, each strobed by E high
+ * then E low: four expander writes per byte. */
+#define LCD_BUS_BYTES_PER_CHAR 4
+
+/* Room for a full redraw: every row, one cursor move plus every cell */
+#define LCD_BUS_FRAME_MAX_LEN                                                  \
+  (LCD_NUM_ROWS * (LCD_NUM_VISIBLE_COLUMNS + 1) * LCD_BUS_BYTES_PER_CHAR)
+
+/* DDRAM address of column 0 on each row of a 4 line display */
+static const uint8_t row_offsets[] = {0x00, 0x40, 0x14, 0x54};
+
+static const i2c_lcd1602_info_t *bus_lcd;
+static uint8_t frame[LCD_BUS_FRAME_MAX_LEN];
+static size_t frame_len;
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+/* start, address, frame, stop */
+static uint8_t link_buf[I2C_LINK_RECOMMENDED_SIZE(1)];
+#endif
+
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static lcd_bus_stats_t stats;
+
+/**
+ * @brief Attaches the bus to an LCD already initialized in 4 bit mode by
+ * the i2c-lcd1602 component. The frame is sent to the same port and
+ * address, with the same backlight setting.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_ERR_INVALID_ARG: the LCD is not initialized
+ */
+esp_err_t lcd_bus_init(const i2c_lcd1602_info_t *lcd) {
+  if (lcd == NULL || !lcd->init || lcd->num_rows > sizeof(row_offsets)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  bus_lcd = lcd;
+  frame_len = 0;
+  return ESP_OK;
+}
+
+/**
+ * @brief Queues one byte for the controller. No delays are needed between
+ * bytes: the next E pulse is two expander writes away, at least 45 us even
+ * at 400 kHz, longer than the 37 us a write or address command takes.
+ */
+static esp_err_t lcd_bus_queue(uint8_t value, uint8_t rs) {
+  if (frame_len + LCD_BUS_BYTES_PER_CHAR > sizeof(frame)) {
+    esp_err_t err = lcd_bus_flush();
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+
+  uint8_t flags = bus_lcd->backlight_flag | rs;
+  uint8_t high = (value & 0xF0) | flags;
+  uint8_t low = (uint8_t)(value << 4) | flags;
+
+  frame[frame_len++] = high | LCD_BUS_ENABLE;
+  frame[frame_len++] = high;
+  frame[frame_len++] = low | LCD_BUS_ENABLE;
+  frame[frame_len++] = low;
+  return ESP_OK;
+}
+
+/**
+ * @brief Queues a command byte. Only commands that complete within 37 us
+ * may be batched, which rules out clear and home.
+ * @param [IN] HD44780 command
+ */
+esp_err_t lcd_bus_command(uint8_t command) { return lcd_bus_queue(command, 0); }
+
+/**
+ * @brief Queues a cursor move, addressed the same way as
+ * i2c_lcd1602_move_cursor().
+ * @param [IN] column
+ * @param [IN] row
+ */
+esp_err_t lcd_bus_move_cursor(uint8_t col, uint8_t row) {
+  if (row >= bus_lcd->num_rows || col >= bus_lcd->num_columns) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  return lcd_bus_command(LCD_BUS_SET_DDRAM_ADDR | (row_offsets[row] + col));
+}
+
+/**
+ * @brief Queues characters at the cursor.
+ * @param [IN] text, not necessarily NUL terminated
+ * @param [IN] number of characters
+ */
+esp_err_t lcd_bus_write(const char *text, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    esp_err_t err = lcd_bus_queue((uint8_t)text[i], LCD_BUS_RS_DATA);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+  return ESP_OK;
+}
+
+/**
+ * @brief Sends everything queued so far as a single I2C transaction: one
+ * start, one address byte, the whole frame, one stop. The frame is emptied
+ * whether or not the transfer succeeds.
+ * @retval
+ *  - ESP_OK: succeed, or nothing was queued
+ *  - error of the I2C driver otherwise
+ */
+esp_err_t lcd_bus_flush(void) {
+  if (frame_len == 0) {
+    return ESP_OK;
+  }
+
+  const smbus_info_t *smbus = bus_lcd->smbus_info;
+  int64_t start = esp_timer_get_time();
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+  i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(link_buf, sizeof(link_buf));
+#else
+  i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+#endif
+  if (cmd == NULL) {
+    frame_len = 0;
+    return ESP_ERR_NO_MEM;
+  }
+  i2c_master_start(cmd);
+  i2c_master_write_byte(cmd, smbus->address << 1 | I2C_MASTER_WRITE, true);
+  i2c_master_write(cmd, frame, frame_len, true);
+  i2c_master_stop(cmd);
+  esp_err_t err = i2c_master_cmd_begin(smbus->i2c_port, cmd, smbus->timeout);
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+  i2c_cmd_link_delete_static(cmd);
+#else
+  i2c_cmd_link_delete(cmd);
+#endif
+
+  uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+  uint32_t len = (uint32_t)frame_len;
+  frame_len = 0;
+
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Frame of %u bytes failed: %s", (unsigned)len,
+             esp_err_to_name(err));
+    return err;
+  }
+
+  portENTER_CRITICAL(&stats_lock);
+  stats.frames++;
+  stats.last_bytes = len;
+  stats.last_us = elapsed;
+  if (elapsed > stats.max_us) {
+    stats.max_us = elapsed;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+
+  ESP_LOGD(TAG, "Frame of %u bytes took %u us", (unsigned)len,
+           (unsigned)elapsed);
+  return ESP_OK;
+}
+
+/**
+ * @brief Copies the bus time statistics; safe from any task.
+ */
+void lcd_bus_get_stats(lcd_bus_stats_t *out) {
+  portENTER_CRITICAL(&stats_lock);
+  *out = stats;
+  portEXIT_CRITICAL(&stats_lock);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "i2c-lcd1602.h"
+
+/* Bus time of the frames sent so far */
+typedef struct {
+  uint32_t frames;
+  uint32_t last_bytes;
+  uint32_t last_us;
+  uint32_t max_us;
+} lcd_bus_stats_t;
+
+esp_err_t lcd_bus_init(const i2c_lcd1602_info_t *lcd);
+esp_err_t lcd_bus_command(uint8_t command);
+esp_err_t lcd_bus_move_cursor(uint8_t col, uint8_t row);
+esp_err_t lcd_bus_write(const char *text, size_t len);
+esp_err_t lcd_bus_flush(void);
+void lcd_bus_get_stats(lcd_bus_stats_t *stats);
@@ -0,0 +1,246 @@
+/**
+ ******************************************************************************
+ * @file      lcd_display.c
+ * @author    Dean Prince Agbodjan
+ * @brief     LCD Framebuffer and Display Task Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "lcd_bus.h"
+#include "lcd_display.h"
+#include "output_driver.h"
+
+#define TAG "DISPLAY"
+
+/* A cursor move costs as much bus time as one character, so changed runs
+ * this close together are sent as one write */
+#define LCD_DISPLAY_MERGE_GAP 1
+
+/* Wait before redrawing after a failed frame */
+#define LCD_DISPLAY_RETRY_MS 1000
+
+/* Only the visible columns are kept: on a 4 line HD44780 the rest of each
+ * 40 character DDRAM line is what rows 2 and 3 show */
+#define LCD_DISPLAY_COLUMNS LCD_NUM_VISIBLE_COLUMNS
+#define LCD_DISPLAY_ALL_CELLS (((uint32_t)1 << LCD_DISPLAY_COLUMNS) - 1)
+
+#if LCD_DISPLAY_COLUMNS > 31
+#error "lcd_display tracks dirty cells in one 32 bit word per row"
+#endif
+
+/*
+ * frame holds every page as the firmware wants it shown, glass what the LCD
+ * holds. Writers only touch frame, the dirty bits and shown_page, under
+ * frame_lock, and never the bus; the display task alone owns glass and the
+ * I2C transfers.
+ */
+static portMUX_TYPE frame_lock = portMUX_INITIALIZER_UNLOCKED;
+static char frame[LCD_PAGE_COUNT][LCD_NUM_ROWS][LCD_DISPLAY_COLUMNS];
+static uint32_t dirty[LCD_PAGE_COUNT][LCD_NUM_ROWS];
+static lcd_page_t shown_page;
+
+/* Page the glass was last drawn from, LCD_PAGE_COUNT when unknown */
+static lcd_page_t glass_page;
+static char glass[LCD_NUM_ROWS][LCD_DISPLAY_COLUMNS];
+
+static TaskHandle_t display_task;
+
+/**
+ * @brief Copies text into a page of the framebuffer and marks it dirty.
+ * @retval true if the page is the one shown
+ */
+static bool lcd_display_store(lcd_page_t page, uint8_t col, uint8_t row,
+                              const char *text) {
+  if (display_task == NULL || page >= LCD_PAGE_COUNT || row >= LCD_NUM_ROWS ||
+      col >= LCD_DISPLAY_COLUMNS) {
+    return false;
+  }
+
+  size_t len = strnlen(text, LCD_DISPLAY_COLUMNS - col);
+  if (len == 0) {
+    return false;
+  }
+
+  portENTER_CRITICAL(&frame_lock);
+  memcpy(&frame[page][row][col], text, len);
+  dirty[page][row] |= (((uint32_t)1 << len) - 1) << col;
+  bool visible = page == shown_page;
+  portEXIT_CRITICAL(&frame_lock);
+
+  return visible;
+}
+
+/**
+ * @brief Places text on a page of the framebuffer; the display task draws
+ * it if and when that page is shown. Text running past the last visible
+ * column is cut off. Safe to call from any task once lcd_display_start()
+ * has run.
+ * @param [IN] page
+ * @param [IN] column of the first character
+ * @param [IN] row
+ * @param [IN] text to show
+ */
+void lcd_display_write_page(lcd_page_t page, uint8_t col, uint8_t row,
+                            const char *text) {
+  if (lcd_display_store(page, col, row, text)) {
+    xTaskNotifyGive(display_task);
+  }
+}
+
+/**
+ * @brief Places text on the status page, see lcd_display_write_page().
+ */
+void lcd_display_write(uint8_t col, uint8_t row, const char *text) {
+  lcd_display_write_page(LCD_PAGE_STATUS, col, row, text);
+}
+
+/**
+ * @brief Places text on the status page without waking the display task,
+ * so several writes go out in one frame at the next lcd_display_refresh().
+ */
+void lcd_display_put(uint8_t col, uint8_t row, const char *text) {
+  lcd_display_store(LCD_PAGE_STATUS, col, row, text);
+}
+
+/**
+ * @brief Wakes the display task to draw what lcd_display_put() stored.
+ */
+void lcd_display_refresh(void) {
+  if (display_task != NULL) {
+    xTaskNotifyGive(display_task);
+  }
+}
+
+/**
+ * @brief Puts a page on the glass. Pages are kept rendered in RAM, so a
+ * flip only sends the cells that differ from the page before, as one bus
+ * frame.
+ * @param [IN] page
+ */
+void lcd_display_show_page(lcd_page_t page) {
+  if (display_task == NULL || page >= LCD_PAGE_COUNT) {
+    return;
+  }
+
+  portENTER_CRITICAL(&frame_lock);
+  bool changed = page != shown_page;
+  shown_page = page;
+  portEXIT_CRITICAL(&frame_lock);
+
+  if (changed) {
+    xTaskNotifyGive(display_task);
+  }
+}
+
+/**
+ * @brief Queues the cells of one row that differ from the glass on the bus
+ * frame, one cursor move and string write per run of changes.
+ */
+static void lcd_display_flush_row(uint8_t row, const char *cells,
+                                  uint32_t candidates) {
+  int col = 0;
+
+  while (col < LCD_DISPLAY_COLUMNS) {
+    /* Find the next changed cell */
+    while (col < LCD_DISPLAY_COLUMNS &&
+           (!(candidates >> col & 1) || cells[col] == glass[row][col])) {
+      col++;
+    }
+    if (col == LCD_DISPLAY_COLUMNS) {
+      return;
+    }
+
+    /* Extend the run while changes keep coming within the merge gap */
+    int start = col;
+    int end = col + 1;
+    for (col = end;
+         col < LCD_DISPLAY_COLUMNS && col <= end + LCD_DISPLAY_MERGE_GAP;
+         col++) {
+      if ((candidates >> col & 1) && cells[col] != glass[row][col]) {
+        end = col + 1;
+      }
+    }
+
+    int len = end - start;
+    lcd_bus_move_cursor(start, row);
+    lcd_bus_write(&cells[start], len);
+    memcpy(&glass[row][start], &cells[start], len);
+    col = end;
+  }
+}
+
+/**
+ * @brief Display task: waits for framebuffer writes or page flips, then
+ * copies the dirty rows of the shown page out under the lock and sends
+ * them, without holding it, as one bus frame. After a flip, or a failed
+ * frame, every cell is a candidate.
+ */
+static void lcd_display_task(void *param) {
+  char cells[LCD_DISPLAY_COLUMNS];
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    /* A flip during the pass notifies again and is drawn by the next one */
+    lcd_page_t page = LCD_PAGE_STATUS;
+    bool redraw = false;
+
+    for (uint8_t row = 0; row < LCD_NUM_ROWS; row++) {
+      portENTER_CRITICAL(&frame_lock);
+      if (row == 0) {
+        page = shown_page;
+        redraw = page != glass_page;
+      }
+      uint32_t candidates = redraw ? LCD_DISPLAY_ALL_CELLS : dirty[page][row];
+      dirty[page][row] = 0;
+      memcpy(cells, frame[page][row], sizeof(cells));
+      portEXIT_CRITICAL(&frame_lock);
+
+      if (candidates != 0) {
+        lcd_display_flush_row(row, cells, candidates);
+      }
+    }
+    glass_page = page;
+
+    if (lcd_bus_flush() != ESP_OK) {
+      memset(glass, 0, sizeof(glass));
+      glass_page = LCD_PAGE_COUNT;
+      vTaskDelay(LCD_DISPLAY_RETRY_MS / portTICK_RATE_MS);
+      xTaskNotifyGive(display_task);
+    }
+  }
+}
+
+/**
+ * @brief Starts the display task on an LCD that was just reset (blank).
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+esp_err_t lcd_display_start(const i2c_lcd1602_info_t *lcd) {
+  esp_err_t err = lcd_bus_init(lcd);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt attach the LCD bus\n");
+    return err;
+  }
+  memset(frame, ' ', sizeof(frame));
+  memset(glass, ' ', sizeof(glass));
+  shown_page = LCD_PAGE_STATUS;
+  glass_page = LCD_PAGE_STATUS;
+
+  /* Below every control-path task: the glass may lag, the relays may not */
+  if (xTaskCreate(&lcd_display_task, "lcd_display", 2048, NULL,
+                  tskIDLE_PRIORITY + 1, &display_task) != pdPASS) {
+    ESP_LOGE(TAG, "Couldnt create the display task\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "i2c-lcd1602.h"
+
+/* Screens kept rendered in the framebuffer, one of them on the glass */
+typedef enum {
+  LCD_PAGE_STATUS,
+  LCD_PAGE_NETWORK,
+  LCD_PAGE_SYSTEM,
+  LCD_PAGE_OUTLETS,
+  LCD_PAGE_COUNT,
+} lcd_page_t;
+
+void lcd_display_write(uint8_t col, uint8_t row, const char *text);
+void lcd_display_write_page(lcd_page_t page, uint8_t col, uint8_t row,
+                            const char *text);
+void lcd_display_put(uint8_t col, uint8_t row, const char *text);
+void lcd_display_refresh(void);
+void lcd_display_show_page(lcd_page_t page);
+esp_err_t lcd_display_start(const i2c_lcd1602_info_t *lcd);
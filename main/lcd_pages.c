@@ -0,0 +1,168 @@
+/**
+ ******************************************************************************
+ * @file      lcd_pages.c
+ * @author    Dean Prince Agbodjan
+ * @brief     LCD Information Pages Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include "app_version.h"
+#include "cloud_connection.h"
+#include "lcd_display.h"
+#include "lcd_pages.h"
+#include "outlet_state.h"
+#include "output_driver.h"
+#include "wifi-connect.h"
+
+#define TAG "LCD_PAGES"
+
+/* Pages on the glass are refreshed this often while they are shown */
+#define LCD_PAGES_REFRESH_MS 1000
+
+/**
+ * @brief Writes a whole row of a page, blank padded so nothing of the
+ * previous text is left behind.
+ */
+static void lcd_pages_line(lcd_page_t page, uint8_t row, const char *format,
+                           ...) {
+  char line[LCD_NUM_VISIBLE_COLUMNS + 1];
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  for (int i = len < 0 ? 0 : len; i < LCD_NUM_VISIBLE_COLUMNS; i++) {
+    line[i] = ' ';
+  }
+  line[LCD_NUM_VISIBLE_COLUMNS] = '\0';
+  lcd_display_write_page(page, 0, row, line);
+}
+
+/**
+ * @brief IP address, signal strength and MQTT connection state.
+ */
+static void lcd_pages_render_network(void) {
+  esp_netif_ip_info_t ip_info = {0};
+  wifi_ap_record_t ap;
+
+  lcd_pages_line(LCD_PAGE_NETWORK, 0, "NETWORK");
+  if (esp_netif != NULL &&
+      esp_netif_get_ip_info(esp_netif, &ip_info) == ESP_OK &&
+      ip_info.ip.addr != 0) {
+    lcd_pages_line(LCD_PAGE_NETWORK, 1, "IP " IPSTR, IP2STR(&ip_info.ip));
+  } else {
+    lcd_pages_line(LCD_PAGE_NETWORK, 1, "IP --");
+  }
+  if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+    lcd_pages_line(LCD_PAGE_NETWORK, 2, "RSSI %d dBm", ap.rssi);
+  } else {
+    lcd_pages_line(LCD_PAGE_NETWORK, 2, "RSSI --");
+  }
+  lcd_pages_line(LCD_PAGE_NETWORK, 3, "MQTT %s",
+                 cloud_connection_state_name(cloud_connection_state()));
+}
+
+/**
+ * @brief Firmware version, uptime and free heap.
+ */
+static void lcd_pages_render_system(void) {
+  uint32_t up_s = (uint32_t)(esp_timer_get_time() / 1000000);
+
+  lcd_pages_line(LCD_PAGE_SYSTEM, 0, "SYSTEM");
+  lcd_pages_line(LCD_PAGE_SYSTEM, 1, "FW %s", firmware_version());
+  lcd_pages_line(LCD_PAGE_SYSTEM, 2, "UP %ud %02u:%02u:%02u",
+                 (unsigned)(up_s / 86400), (unsigned)(up_s / 3600 % 24),
+                 (unsigned)(up_s / 60 % 60), (unsigned)(up_s % 60));
+  lcd_pages_line(LCD_PAGE_SYSTEM, 3, "HEAP %u B",
+                 (unsigned)esp_get_free_heap_size());
+}
+
+/**
+ * @brief Number of switches of each outlet since boot, laid out in the same
+ * cells as the status page.
+ */
+static void lcd_pages_render_outlets(void) {
+  char rows[LCD_NUM_ROWS][LCD_NUM_VISIBLE_COLUMNS + 1];
+
+  /* Compose whole rows first, so the glass never shows a half drawn page */
+  memset(rows, ' ', sizeof(rows));
+#if OUTLET_LCD_WIDE
+  memcpy(rows[0], "SWITCH COUNT", strlen("SWITCH COUNT"));
+#endif
+
+  for (int n = 1; n <= OUTLET_COUNT; n++) {
+    uint32_t count = outlet_state_switch_count(n - 1);
+    char cell[sizeof("L16 99999")];
+#if OUTLET_LCD_WIDE
+    int len = snprintf(cell, sizeof(cell), "L%d %5u", n,
+                       (unsigned)(count > 99999 ? 99999 : count));
+#else
+    /* "n=cc", '=' tells it apart from the "n:v" cells of the status page */
+    int len = snprintf(cell, sizeof(cell), "%c=%-2u", OUTLET_LCD_LABEL_CHAR(n),
+                       (unsigned)(count > 99 ? 99 : count));
+#endif
+    memcpy(&rows[OUTLET_LCD_ROW(n)][OUTLET_LCD_LABEL_COL(n)], cell, len);
+  }
+
+  for (uint8_t row = 0; row < LCD_NUM_ROWS; row++) {
+    rows[row][LCD_NUM_VISIBLE_COLUMNS] = '\0';
+    lcd_display_write_page(LCD_PAGE_OUTLETS, 0, row, rows[row]);
+  }
+}
+
+/**
+ * @brief Rotates the glass through the pages. Every page is kept rendered
+ * in the framebuffer and refreshed each second, whether it is shown or not,
+ * so a flip is one bus frame and only a shown page costs bus time.
+ */
+static void lcd_pages_task(void *param) {
+  const uint32_t refreshes =
+      CONFIG_LCD_PAGE_INTERVAL_S * 1000 / LCD_PAGES_REFRESH_MS;
+  lcd_page_t page = LCD_PAGE_STATUS;
+
+  for (;;) {
+    for (uint32_t i = 0; i < refreshes; i++) {
+      lcd_pages_render_network();
+      lcd_pages_render_system();
+      lcd_pages_render_outlets();
+      if (i == 0) {
+        lcd_display_show_page(page);
+      }
+      vTaskDelay(LCD_PAGES_REFRESH_MS / portTICK_RATE_MS);
+    }
+    page = (page + 1) % LCD_PAGE_COUNT;
+  }
+}
+
+/**
+ * @brief Starts rotating the LCD through the information pages.
+ * @retval
+ *  - ESP_OK: succeed, or rotation is disabled
+ *  - ESP_FAIL: failed
+ */
+int lcd_pages_start(void) {
+  if (CONFIG_LCD_PAGE_INTERVAL_S == 0) {
+    return ESP_OK;
+  }
+  if (xTaskCreate(&lcd_pages_task, "lcd_pages", 2560, NULL,
+                  tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+    ESP_LOGE(TAG, "Couldnt create the LCD pages task\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int lcd_pages_start(void);
@@ -16,8 +16,17 @@
 #include "nvs_flash.h"
 
 #include "wifi-connect.h"
+#include "boot.h"
+#include "cloud_connection.h"
 #include "device_shadow.h"
+#include "lan_control.h"
+#include "lcd_pages.h"
+#include "metrics.h"
+#include "outlet_command.h"
+#include "outlet_journal.h"
+#include "outlet_store.h"
 #include "output_driver.h"
+#include "schedule.h"
 #include "sub_pub_ota.h"
 
 
@@ -25,31 +34,23 @@
 #define SSID_1      "drover_ap"
 #define PASS        "dje83ke3"
 
+enum {
+  BOOT_NVS,
+  BOOT_GPIO,
+  BOOT_LCD,
+  BOOT_WIFI,
+  BOOT_SERVICES,
+  BOOT_CLOUD,
+  BOOT_IP,
+};
+
 /**
- * @brief Setting up and connecting WiFi STA
+ * @brief Initialize the flash
  */
-void wifi_sta_setup(void) {
-  wifi_drivers();
-
-  esp_err_t wifi_sta_callback = wifi_sta_connect(SSID_1, PASS);
-
-  if (wifi_sta_callback == 0) {
-    ESP_LOGI(TAG, "CONNECTED");
-  }
-}
-
-void app_main(void) {
-
-  /* Initializing GPIOs connecting the relay */
-  gpio_init();
-
-  /* Initializing lcd 20x04 screen */
-  lcd2004();
-
-  /* Initialize the flash */
+static int boot_nvs(void) {
   esp_err_t nvs_results = nvs_flash_init();
   if (nvs_results == ESP_ERR_NVS_NO_FREE_PAGES ||
-      ESP_ERR_NVS_NEW_VERSION_FOUND) {
+      nvs_results == ESP_ERR_NVS_NEW_VERSION_FOUND) {
     nvs_results = nvs_flash_erase();
     nvs_results |= nvs_flash_init();
   }
@@ -57,13 +58,112 @@ void app_main(void) {
   if (nvs_results != ESP_OK) {
     ESP_LOGE(TAG, "NVS init error");
   }
+  return nvs_results;
+}
 
-  /* Initializing Wifi driver and connecting WIFI STA */
-  wifi_sta_setup();
+/**
+ * @brief Initializing GPIOs connecting the relay, in the state they were in
+ * before the reset
+ */
+static int boot_gpio(void) {
+  gpio_init();
 
-  /* Begin task that connect to AWS Device Shadow */
-  shadow_start();
+  /* Relay changes from here on are kept for the next boot */
+  return outlet_store_start();
+}
 
-  /* Begin task responsible for ota */
-  ota_start();
+/**
+ * @brief Initializing lcd 20x04 screen and cycling it through the status
+ * and information pages
+ */
+static int boot_lcd(void) {
+  lcd2004();
+  return lcd_pages_start();
+}
+
+/**
+ * @brief Initializing Wifi driver and starting to connect WIFI STA
+ */
+static int boot_wifi(void) {
+  wifi_drivers();
+  return wifi_sta_begin(SSID_1, PASS);
+}
+
+/**
+ * @brief Registers every module driven by the cloud connection
+ */
+static int boot_services(void) {
+  int err = ESP_OK;
+
+  /* Register the AWS Device Shadow with the cloud connection */
+  err |= shadow_start();
+
+  /* Record relay changes while offline, uploaded once the cloud is back */
+  err |= outlet_journal_start();
+
+  /* Register the OTA topic with the cloud connection, downloads run on the
+   * OTA task */
+  err |= ota_start();
+
+  /* Register the outlet command (scene) topic with the cloud connection */
+  err |= outlet_command_start();
+
+  /* Run the outlet schedules locally, configured through the shadow */
+  err |= schedule_start();
+
+  /* Publish the actuation latency histograms periodically */
+  err |= metrics_start();
+
+#if CONFIG_LAN_CONTROL
+  /* Switch outlets from the LAN, reported to the shadow as local changes */
+  err |= lan_control_start();
+#endif
+
+  /* Last, so the timeline is published once every service has started */
+  err |= boot_timeline_start();
+  return err != ESP_OK ? ESP_FAIL : ESP_OK;
+}
+
+/**
+ * @brief Waits for the IP, for the timeline; the cloud task waits on its own
+ */
+static int boot_ip(void) {
+  esp_err_t err = wifi_sta_wait_ip(CONFIG_WIFI_CONNECT_TIMEOUT_MS);
+  if (err == ESP_OK) {
+    ESP_LOGI(TAG, "CONNECTED");
+  } else {
+    ESP_LOGW(TAG, "No IP after %d ms, the cloud connects once it is up",
+             CONFIG_WIFI_CONNECT_TIMEOUT_MS);
+  }
+  return err;
+}
+
+/*
+ * Start-up, as a dependency graph: each stage starts as soon as the stages
+ * it needs are done, so the LCD is drawn while Wi-Fi associates and the
+ * cloud task sets up the MQTT client while DHCP runs.
+ */
+static const boot_stage_t boot_stages[] = {
+    [BOOT_NVS] = {"nvs", boot_nvs, 0},
+    /* Restores the outlets from NVS, before anything can switch them */
+    [BOOT_GPIO] = {"gpio", boot_gpio, BOOT_AFTER(BOOT_NVS)},
+    [BOOT_LCD] = {"lcd", boot_lcd, BOOT_AFTER(BOOT_GPIO)},
+    /* Its events only mark the link on the LCD; wifi_status() keeps the last
+     * one for the LCD stage to draw if they arrive first. Nothing on the
+     * network starts before the outlets are restored. */
+    [BOOT_WIFI] = {"wifi", boot_wifi,
+                   BOOT_AFTER(BOOT_NVS) | BOOT_AFTER(BOOT_GPIO)},
+    /* SNTP needs the network stack, brought up by the wifi stage */
+    [BOOT_SERVICES] = {"services", boot_services,
+                       BOOT_AFTER(BOOT_GPIO) | BOOT_AFTER(BOOT_WIFI)},
+    /* Connects once the IP is up */
+    [BOOT_CLOUD] = {"cloud", cloud_start, BOOT_AFTER(BOOT_SERVICES)},
+    [BOOT_IP] = {"ip", boot_ip, BOOT_AFTER(BOOT_WIFI)},
+};
+
+void app_main(void) {
+  if (boot_run(boot_stages, sizeof(boot_stages) / sizeof(boot_stages[0])) !=
+      ESP_OK) {
+    ESP_LOGE(TAG, "Boot failed");
+  }
 }
@@ -0,0 +1,149 @@
+/**
+ ******************************************************************************
+ * @file      metrics.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Field Metrics Publishing Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include "aws_iot_config.h"
+#include "aws_iot_mqtt_client_interface.h"
+
+#include "app_version.h"
+#include "cloud_connection.h"
+#include "latency_probe.h"
+#include "metrics.h"
+
+#define TAG "METRICS"
+
+/* One stage per message keeps every payload inside the MQTT TX buffer */
+#define METRICS_PAYLOAD_MAX_LEN 384
+
+/**
+ * @brief thing name or device id
+ */
+extern const uint8_t deviceid_txt_start[] asm("_binary_deviceid_txt_start");
+extern const uint8_t deviceid_txt_end[] asm("_binary_deviceid_txt_end");
+
+/* iotDevice/<thing name>/metrics */
+static char metrics_topic[sizeof("iotDevice//metrics") + MAX_SIZE_OF_THING_NAME];
+static TickType_t last_publish;
+
+/**
+ * @brief Publishes one stage's latency histogram, e.g.
+ * {"fw":"1.2.0","stage":"gpio","count":3,"sum_us":912,"max_us":402,
+ *  "bucket_min_us":64,"buckets":[0,1,1,0,1,0,...]}
+ */
+static IoT_Error_t metrics_publish_stage(AWS_IoT_Client *mqttClient,
+                                         latency_stage_t stage) {
+  const latency_histogram_t *h = latency_probe_histogram(stage);
+  char payload[METRICS_PAYLOAD_MAX_LEN];
+  int len;
+
+  len = snprintf(payload, sizeof(payload),
+                 "{\"fw\":\"%s\",\"stage\":\"%s\",\"count\":%u,"
+                 "\"sum_us\":%llu,\"max_us\":%u,\"bucket_min_us\":%d,"
+                 "\"buckets\":[",
+                 firmware_version(), latency_probe_stage_name(stage),
+                 (unsigned)h->count, (unsigned long long)h->sum_us,
+                 (unsigned)h->max_us, LATENCY_BUCKET_MIN_US);
+  for (int i = 0; i < LATENCY_BUCKET_COUNT && len < (int)sizeof(payload);
+       i++) {
+    len += snprintf(payload + len, sizeof(payload) - len, "%s%u",
+                    i == 0 ? "" : ",", (unsigned)h->buckets[i]);
+  }
+  if (len < (int)sizeof(payload)) {
+    len += snprintf(payload + len, sizeof(payload) - len, "]}");
+  }
+  if (len >= (int)sizeof(payload)) {
+    return SHADOW_JSON_BUFFER_TRUNCATED;
+  }
+
+  IoT_Publish_Message_Params params = {
+      .qos = QOS0,
+      .isRetained = 0,
+      .payload = payload,
+      .payloadLen = (size_t)len,
+  };
+  return aws_iot_mqtt_publish(mqttClient, metrics_topic,
+                              (uint16_t)strlen(metrics_topic), &params);
+}
+
+static IoT_Error_t metrics_connected(AWS_IoT_Client *mqttClient) {
+  snprintf(metrics_topic, sizeof(metrics_topic), "iotDevice/%s/metrics",
+           (const char *)deviceid_txt_start);
+  last_publish = xTaskGetTickCount();
+  return SUCCESS;
+}
+
+/**
+ * @brief Publishes every stage that saw samples once the interval is up.
+ * Metrics are best effort: the histograms start over after every attempt,
+ * so a retry can't count samples twice, and a failed publish never takes
+ * the shared connection down.
+ */
+static IoT_Error_t metrics_run(AWS_IoT_Client *mqttClient, uint32_t events,
+                               bool reconnecting) {
+  TickType_t interval = CONFIG_METRICS_PUBLISH_INTERVAL_S * 1000 /
+                        portTICK_RATE_MS;
+
+  if (reconnecting ||
+      (TickType_t)(xTaskGetTickCount() - last_publish) < interval) {
+    return SUCCESS;
+  }
+  last_publish = xTaskGetTickCount();
+
+  for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+    if (latency_probe_histogram(stage)->count == 0) {
+      continue;
+    }
+    IoT_Error_t rc = metrics_publish_stage(mqttClient, stage);
+    if (SUCCESS != rc) {
+      ESP_LOGW(TAG, "Publishing %s latency failed %d",
+               latency_probe_stage_name(stage), rc);
+      break;
+    }
+  }
+  latency_probe_reset();
+  return SUCCESS;
+}
+
+static TickType_t metrics_deadline(void) {
+  TickType_t interval = CONFIG_METRICS_PUBLISH_INTERVAL_S * 1000 /
+                        portTICK_RATE_MS;
+  TickType_t elapsed = xTaskGetTickCount() - last_publish;
+  return elapsed >= interval ? 0 : interval - elapsed;
+}
+
+static const cloud_service_t metrics_service = {
+    .name = "metrics",
+    .connected = metrics_connected,
+    .run = metrics_run,
+    .deadline = metrics_deadline,
+};
+
+/**
+ * @brief Registers the periodic metrics publish with the cloud connection.
+ * @retval
+ *  - ESP_OK: succeed, or metrics are disabled
+ *  - ESP_FAIL: failed
+ */
+int metrics_start(void) {
+  if (CONFIG_METRICS_PUBLISH_INTERVAL_S == 0) {
+    return ESP_OK;
+  }
+  if (cloud_connection_register_service(&metrics_service) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the metrics service\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
@@ -1,19 +1,55 @@
 /**
  ******************************************************************************
- * @file      device_shadow.c
+ * @file      ota.c
  * @author    Dean Prince Agbodjan
  * @brief     New Firmware OTA and upgrade implementation
  *
  ******************************************************************************
  */
 /* Header Files */
-#include "esp_https_ota.h"
-#include <esp_idf_version.h>
-#include <esp_log.h>
-#include <sdkconfig.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "esp_http_client.h"
+#include "esp_idf_version.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "spi_flash_mmap.h"
+#else
+#include "esp_spi_flash.h"
+#endif
+
+#include "aws_iot_config.h"
+#include "aws_iot_mqtt_client_interface.h"
+
+#include "cloud_connection.h"
+#include "ota_gzip.h"
 #include "sub_pub_ota.h"
 
+#define TAG "OTA"
+
+/* One flash sector per read, so every esp_ota_write() fills a whole sector */
+#define OTA_CHUNK_LEN 4096
+/* How far the writer erases ahead of the image while it waits for data */
+#define OTA_ERASE_AHEAD (64 * 1024)
+#define OTA_HTTP_TIMEOUT_MS 10000
+/* Delay before the first resume, doubled after every attempt without data */
+#define OTA_RETRY_MIN_MS 500
+#define OTA_RETRY_MAX_MS 8000
+/* How long the final report may take to go out before the restart */
+#define OTA_RESTART_GRACE_MS 3000
+#define OTA_PAYLOAD_MAX_LEN 320
+
 /**
  * @brief Github Server Certificate
  */
@@ -23,24 +59,718 @@ extern const uint8_t
     upgrade_server_cert_pem_end[] asm("_binary_github_server_cert_end");
 
 /**
- * @brief This function handles firmware download in HTTPS and upgrade
+ * @brief thing name or device id
+ */
+extern const uint8_t deviceid_txt_start[] asm("_binary_deviceid_txt_start");
+extern const uint8_t deviceid_txt_end[] asm("_binary_deviceid_txt_end");
+
+typedef enum {
+  OTA_STATE_IDLE,
+  OTA_STATE_STARTING,
+  OTA_STATE_DOWNLOADING,
+  OTA_STATE_RESUMING,
+  OTA_STATE_DONE,
+  OTA_STATE_FAILED,
+} ota_state_t;
+
+/* What the OTA task last reported, published by the cloud task */
+typedef struct {
+  ota_state_t state;
+  uint32_t bytes;
+  int32_t total;
+  uint32_t written;
+  uint32_t bps;
+  uint32_t avg_bps;
+  /* Throughput of each stage while busy, the slower one sets the pace */
+  uint32_t net_bps;
+  uint32_t flash_bps;
+  uint32_t resumes;
+  esp_err_t error;
+} ota_progress_t;
+
+/* One buffer of the ring between the network and the flash writer */
+typedef struct {
+  uint32_t len;
+  uint8_t data[OTA_CHUNK_LEN];
+} ota_block_t;
+
+/*
+ * One download, carried across the connections it takes. The OTA task
+ * receives into free blocks and queues them full; the writer task stores
+ * them in the OTA slot and hands them back. Each side owns its own fields.
+ */
+typedef struct {
+  const char *url;
+  const esp_partition_t *partition;
+  esp_ota_handle_t handle;
+  ota_block_t *blocks;
+  QueueHandle_t free_blocks;
+  /* Full blocks, then NULL once the download is over */
+  QueueHandle_t full_blocks;
+  TaskHandle_t owner;
+  /* First error of the writer; the network side stops when it sees one */
+  _Atomic esp_err_t write_err;
+
+  /* Network side: bytes of the download so far */
+  uint32_t received;
+  int32_t total;
+  uint32_t resumes;
+  int64_t net_us;
+  int64_t net_wait_us;
+  int64_t started_us;
+  int64_t sample_us;
+  uint32_t sample_bytes;
+
+  /* Writer side: download bytes stored, the image they inflated to, and
+   * how much of the slot is erased */
+  uint32_t stored;
+  uint32_t written;
+  uint32_t erased;
+  ota_gzip_t *gz;
+  int64_t flash_us;
+  int64_t flash_wait_us;
+} ota_download_t;
+
+static TaskHandle_t ota_task;
+static char ota_url[OTA_URL_MAX_LEN];
+
+static portMUX_TYPE ota_lock = portMUX_INITIALIZER_UNLOCKED;
+static ota_progress_t ota_progress;
+/* Bumped on every report; the cloud task publishes until it catches up */
+static uint32_t ota_progress_seq;
+static uint32_t ota_published_seq;
+static ota_state_t ota_published_state;
+static TickType_t ota_last_publish;
+
+/* iotDevice/<thing name>/ota */
+static char ota_progress_topic[sizeof("iotDevice//ota") +
+                               MAX_SIZE_OF_THING_NAME];
+
+static const char *ota_state_name(ota_state_t state) {
+  switch (state) {
+  case OTA_STATE_STARTING:
+    return "starting";
+  case OTA_STATE_DOWNLOADING:
+    return "downloading";
+  case OTA_STATE_RESUMING:
+    return "resuming";
+  case OTA_STATE_DONE:
+    return "done";
+  case OTA_STATE_FAILED:
+    return "failed";
+  case OTA_STATE_IDLE:
+  default:
+    return "idle";
+  }
+}
+
+/**
+ * @brief Records the download's progress for the cloud task. Chunks only
+ * update the numbers; a change of state also wakes the cloud task, so it is
+ * reported without waiting for the next progress interval.
+ */
+static void ota_report(ota_download_t *dl, ota_state_t state,
+                       esp_err_t error) {
+  int64_t now = esp_timer_get_time();
+  int64_t sample_us = now - dl->sample_us;
+  int64_t total_us = now - dl->started_us;
+  bool changed;
+
+  portENTER_CRITICAL(&ota_lock);
+  changed = ota_progress.state != state;
+  ota_progress.state = state;
+  ota_progress.bytes = dl->received;
+  ota_progress.total = dl->total;
+  ota_progress.resumes = dl->resumes;
+  ota_progress.error = error;
+  if (sample_us >= CONFIG_OTA_PROGRESS_INTERVAL_MS * 1000LL) {
+    ota_progress.bps = (uint32_t)((dl->received - dl->sample_bytes) *
+                                  1000000LL / sample_us);
+  }
+  if (total_us > 0) {
+    ota_progress.avg_bps = (uint32_t)(dl->received * 1000000LL / total_us);
+  }
+  if (dl->net_us > 0) {
+    ota_progress.net_bps = (uint32_t)(dl->received * 1000000LL / dl->net_us);
+  }
+  ota_progress_seq++;
+  portEXIT_CRITICAL(&ota_lock);
+
+  if (sample_us >= CONFIG_OTA_PROGRESS_INTERVAL_MS * 1000LL) {
+    dl->sample_us = now;
+    dl->sample_bytes = dl->received;
+  }
+  if (changed) {
+    cloud_connection_notify(CLOUD_EVENT_LOCAL_CHANGE);
+  }
+}
+
+/**
+ * @brief Records the writer's progress for the cloud task.
+ */
+static void ota_report_written(const ota_download_t *dl) {
+  portENTER_CRITICAL(&ota_lock);
+  ota_progress.written = dl->written;
+  if (dl->flash_us > 0) {
+    ota_progress.flash_bps =
+        (uint32_t)(dl->written * 1000000LL / dl->flash_us);
+  }
+  ota_progress_seq++;
+  portEXIT_CRITICAL(&ota_lock);
+}
+
+/**
+ * @brief Erases the OTA slot up to `end`, rounded up to whole sectors.
+ */
+static esp_err_t ota_erase_to(ota_download_t *dl, uint32_t end) {
+  if (end > dl->partition->size) {
+    end = dl->partition->size;
+  }
+  if (dl->erased >= end) {
+    return ESP_OK;
+  }
+
+  uint32_t len = (end - dl->erased + SPI_FLASH_SEC_SIZE - 1) &
+                 ~(SPI_FLASH_SEC_SIZE - 1);
+  esp_err_t err = esp_partition_erase_range(dl->partition, dl->erased, len);
+  if (err == ESP_OK) {
+    dl->erased += len;
+  }
+  return err;
+}
+
+static esp_err_t ota_write_slot(const uint8_t *data, size_t len, void *arg) {
+  ota_download_t *dl = arg;
+
+  /* Normally already done while the writer was waiting for this data */
+  esp_err_t err = ota_erase_to(dl, dl->written + (uint32_t)len);
+  if (err == ESP_OK) {
+    err = esp_ota_write(dl->handle, data, len);
+  }
+  if (err == ESP_OK) {
+    dl->written += (uint32_t)len;
+  }
+  return err;
+}
+
+/**
+ * @brief Writes the next piece of the download into the OTA slot. The first
+ * byte tells a gzip image from a plain one; gzip is inflated on the way, so
+ * the slot always receives the plain image.
+ */
+static esp_err_t ota_store(ota_download_t *dl, const uint8_t *data,
+                           size_t len) {
+  if (dl->stored == 0 && ota_gzip_detect(data[0])) {
+    dl->gz = ota_gzip_create(ota_write_slot, dl);
+    if (dl->gz == NULL) {
+      return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Compressed image, inflating into %s", dl->partition->label);
+  }
+
+  esp_err_t err = dl->gz != NULL ? ota_gzip_feed(dl->gz, data, len)
+                                 : ota_write_slot(data, len, dl);
+  if (err == ESP_OK) {
+    dl->stored += (uint32_t)len;
+  }
+  return err;
+}
+
+/**
+ * @brief Flash writer task: stores the blocks the OTA task receives, so TLS
+ * reads carry on while a sector is erased or written. Whenever no block is
+ * waiting it erases the next sector, up to OTA_ERASE_AHEAD past the image,
+ * so the writes themselves rarely wait for an erase. Blocks keep being
+ * recycled after an error, the OTA task sees write_err and stops.
+ */
+static void ota_writer_task(void *param) {
+  ota_download_t *dl = param;
+  ota_block_t *block;
+
+  for (;;) {
+    if (xQueueReceive(dl->full_blocks, &block, 0) != pdTRUE) {
+      if (atomic_load(&dl->write_err) == ESP_OK &&
+          dl->erased < dl->written + OTA_ERASE_AHEAD &&
+          dl->erased < dl->partition->size) {
+        int64_t start = esp_timer_get_time();
+        esp_err_t err = ota_erase_to(dl, dl->erased + SPI_FLASH_SEC_SIZE);
+        dl->flash_us += esp_timer_get_time() - start;
+        if (err != ESP_OK) {
+          atomic_store(&dl->write_err, err);
+        }
+        continue;
+      }
+      int64_t start = esp_timer_get_time();
+      xQueueReceive(dl->full_blocks, &block, portMAX_DELAY);
+      dl->flash_wait_us += esp_timer_get_time() - start;
+    }
+    if (block == NULL) {
+      break;
+    }
+
+    if (atomic_load(&dl->write_err) == ESP_OK) {
+      int64_t start = esp_timer_get_time();
+      esp_err_t err = ota_store(dl, block->data, block->len);
+      dl->flash_us += esp_timer_get_time() - start;
+      if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Writing the image failed: %s", esp_err_to_name(err));
+        atomic_store(&dl->write_err, err);
+      }
+      ota_report_written(dl);
+    }
+    xQueueSend(dl->free_blocks, &block, portMAX_DELAY);
+  }
+
+  xTaskNotifyGive(dl->owner);
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Streams the image over one HTTP connection into the writer's ring,
+ * starting at dl->received. A server that ignores the Range header sends the
+ * whole image again, and the part already received is skipped.
+ * @retval
+ *  - ESP_OK: the image is complete
+ *  - ESP_FAIL: the connection failed or dropped, worth resuming
+ *  - others: the download can't succeed, e.g. the image is refused
+ */
+static esp_err_t ota_fetch(ota_download_t *dl) {
+  esp_http_client_config_t config = {
+      .url = dl->url,
+      .cert_pem = (char *)upgrade_server_cert_pem_start,
+      .timeout_ms = OTA_HTTP_TIMEOUT_MS,
+      .keep_alive_enable = true,
+  };
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  if (client == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  if (dl->received > 0) {
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%u-", (unsigned)dl->received);
+    esp_http_client_set_header(client, "Range", range);
+  }
+
+  esp_err_t err = esp_http_client_open(client, 0);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Couldnt connect: %s", esp_err_to_name(err));
+    esp_http_client_cleanup(client);
+    return ESP_FAIL;
+  }
+
+  int64_t length = esp_http_client_fetch_headers(client);
+  int status = esp_http_client_get_status_code(client);
+  uint32_t skip = 0;
+
+  if (length < 0) {
+    err = ESP_FAIL;
+  } else if (status == 206 && dl->received > 0) {
+    dl->total = (int32_t)(dl->received + length);
+  } else if (status == 200) {
+    skip = dl->received;
+    dl->total = length > 0 ? (int32_t)length : -1;
+  } else {
+    ESP_LOGE(TAG, "Server answered %d", status);
+    err = status >= 500 ? ESP_FAIL : ESP_ERR_INVALID_RESPONSE;
+  }
+  if (err == ESP_OK && dl->total > (int32_t)dl->partition->size) {
+    ESP_LOGE(TAG, "Image of %d bytes doesnt fit %s", dl->total,
+             dl->partition->label);
+    err = ESP_ERR_INVALID_SIZE;
+  }
+
+  while (err == ESP_OK) {
+    ota_block_t *block;
+    int64_t start = esp_timer_get_time();
+    xQueueReceive(dl->free_blocks, &block, portMAX_DELAY);
+    int64_t got = esp_timer_get_time();
+    dl->net_wait_us += got - start;
+
+    err = atomic_load(&dl->write_err);
+    if (err != ESP_OK) {
+      xQueueSend(dl->free_blocks, &block, portMAX_DELAY);
+      break;
+    }
+
+    int len =
+        esp_http_client_read(client, (char *)block->data, sizeof(block->data));
+    dl->net_us += esp_timer_get_time() - got;
+    if (len <= 0) {
+      xQueueSend(dl->free_blocks, &block, portMAX_DELAY);
+      if (len < 0 || (!esp_http_client_is_complete_data_received(client) &&
+                      (dl->total < 0 || dl->received < (uint32_t)dl->total))) {
+        err = ESP_FAIL;
+      }
+      break;
+    }
+
+    if (skip > 0) {
+      uint32_t n = skip < (uint32_t)len ? skip : (uint32_t)len;
+      skip -= n;
+      len -= (int)n;
+      memmove(block->data, block->data + n, (size_t)len);
+      if (len == 0) {
+        xQueueSend(dl->free_blocks, &block, portMAX_DELAY);
+        continue;
+      }
+    }
+
+    block->len = (uint32_t)len;
+    xQueueSend(dl->full_blocks, &block, portMAX_DELAY);
+    dl->received += (uint32_t)len;
+    ota_report(dl, OTA_STATE_DOWNLOADING, ESP_OK);
+  }
+
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+  return err;
+}
+
+/**
+ * @brief Creates the ring of blocks and the writer task for a download.
+ */
+static esp_err_t ota_pipeline_start(ota_download_t *dl) {
+  dl->blocks = malloc(CONFIG_OTA_PIPELINE_BUFFERS * sizeof(ota_block_t));
+  dl->free_blocks =
+      xQueueCreate(CONFIG_OTA_PIPELINE_BUFFERS, sizeof(ota_block_t *));
+  /* Room for every block plus the end marker */
+  dl->full_blocks =
+      xQueueCreate(CONFIG_OTA_PIPELINE_BUFFERS + 1, sizeof(ota_block_t *));
+  if (dl->blocks == NULL || dl->free_blocks == NULL ||
+      dl->full_blocks == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  for (int i = 0; i < CONFIG_OTA_PIPELINE_BUFFERS; i++) {
+    ota_block_t *block = &dl->blocks[i];
+    xQueueSend(dl->free_blocks, &block, 0);
+  }
+
+  dl->owner = xTaskGetCurrentTaskHandle();
+#if defined(CONFIG_OTA_WRITER_CORE) && CONFIG_OTA_WRITER_CORE >= 0
+  BaseType_t created =
+      xTaskCreatePinnedToCore(&ota_writer_task, "ota_writer", 4096, dl, 4,
+                              NULL, CONFIG_OTA_WRITER_CORE);
+#else
+  BaseType_t created =
+      xTaskCreate(&ota_writer_task, "ota_writer", 4096, dl, 4, NULL);
+#endif
+  return created == pdPASS ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+/**
+ * @brief Lets the writer drain the ring and waits for it to exit.
+ */
+static void ota_pipeline_stop(ota_download_t *dl) {
+  ota_block_t *end = NULL;
+  xQueueSend(dl->full_blocks, &end, portMAX_DELAY);
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+static void ota_pipeline_free(ota_download_t *dl) {
+  if (dl->free_blocks != NULL) {
+    vQueueDelete(dl->free_blocks);
+  }
+  if (dl->full_blocks != NULL) {
+    vQueueDelete(dl->full_blocks);
+  }
+  free(dl->blocks);
+  ota_gzip_destroy(dl->gz);
+}
+
+/**
+ * @brief This function handles firmware download in HTTPS and upgrade. The
+ * OTA slot stays open while the connection is retried, so a drop resumes
+ * from the last received byte with an HTTP Range request instead of
+ * starting over. Gives up after CONFIG_OTA_RESUME_ATTEMPTS attempts in a row
+ * that brought no data. Runs on the OTA task, with the flash writes on the
+ * writer task.
  */
 esp_err_t do_firmware_upgrade(const char *url) {
   if (!url) {
     return ESP_FAIL;
   }
-  esp_http_client_config_t config = {
+
+  ota_download_t dl = {
       .url = url,
-      .cert_pem = (char *)upgrade_server_cert_pem_start,
+      .partition = esp_ota_get_next_update_partition(NULL),
+      .total = -1,
+      .started_us = esp_timer_get_time(),
   };
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-  esp_https_ota_config_t ota_config = {
-      .http_config = &config,
+  dl.sample_us = dl.started_us;
+  if (dl.partition == NULL) {
+    ESP_LOGE(TAG, "No OTA partition to write");
+    ota_report(&dl, OTA_STATE_FAILED, ESP_ERR_NOT_FOUND);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  /*
+   * With a size, esp_ota_begin() erases that much up front and
+   * esp_ota_write() never erases. Asking for one byte erases one sector and
+   * leaves the rest to the writer, which erases ahead of the data.
+   */
+  esp_err_t err = esp_ota_begin(dl.partition, 1, &dl.handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt open %s: %s", dl.partition->label,
+             esp_err_to_name(err));
+    ota_report(&dl, OTA_STATE_FAILED, err);
+    return err;
+  }
+  dl.erased = SPI_FLASH_SEC_SIZE;
+
+  err = ota_pipeline_start(&dl);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt start the flash writer\n");
+    ota_pipeline_free(&dl);
+    esp_ota_abort(dl.handle);
+    ota_report(&dl, OTA_STATE_FAILED, err);
+    return err;
+  }
+  ESP_LOGI(TAG, "Writing %s from %s", dl.partition->label, url);
+
+  int failures = 0;
+  for (;;) {
+    uint32_t before = dl.received;
+    err = ota_fetch(&dl);
+    if (err != ESP_FAIL) {
+      break;
+    }
+
+    failures = dl.received > before ? 1 : failures + 1;
+    if (failures > CONFIG_OTA_RESUME_ATTEMPTS) {
+      ESP_LOGE(TAG, "Giving up after %d attempts without data", failures);
+      err = ESP_ERR_TIMEOUT;
+      break;
+    }
+
+    int delay_ms = OTA_RETRY_MIN_MS << (failures - 1);
+    if (delay_ms > OTA_RETRY_MAX_MS || delay_ms <= 0) {
+      delay_ms = OTA_RETRY_MAX_MS;
+    }
+    dl.resumes++;
+    ESP_LOGW(TAG, "Connection lost at %u bytes, resuming in %d ms",
+             (unsigned)dl.received, delay_ms);
+    ota_report(&dl, OTA_STATE_RESUMING, ESP_OK);
+    vTaskDelay(delay_ms / portTICK_RATE_MS);
+  }
+
+  ota_pipeline_stop(&dl);
+  if (atomic_load(&dl.write_err) != ESP_OK) {
+    err = atomic_load(&dl.write_err);
+  }
+  if (err == ESP_OK && dl.gz != NULL) {
+    err = ota_gzip_finish(dl.gz);
+  }
+  ota_pipeline_free(&dl);
+  if (err != ESP_OK) {
+    esp_ota_abort(dl.handle);
+    ota_report(&dl, OTA_STATE_FAILED, err);
+    return err;
+  }
+
+  /* Checks the image before the bootloader is pointed at it */
+  err = esp_ota_end(dl.handle);
+  if (err == ESP_OK) {
+    err = esp_ota_set_boot_partition(dl.partition);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Image rejected: %s", esp_err_to_name(err));
+    ota_report(&dl, OTA_STATE_FAILED, err);
+    return err;
+  }
+
+  ESP_LOGI(TAG, "%u bytes in %lld ms for a %u byte image, %u resumes",
+           (unsigned)dl.received,
+           (long long)((esp_timer_get_time() - dl.started_us) / 1000),
+           (unsigned)dl.written, (unsigned)dl.resumes);
+  ESP_LOGI(TAG,
+           "Network %lld ms busy, %lld ms waiting for buffers; "
+           "flash %lld ms busy, %lld ms waiting for data",
+           (long long)(dl.net_us / 1000), (long long)(dl.net_wait_us / 1000),
+           (long long)(dl.flash_us / 1000),
+           (long long)(dl.flash_wait_us / 1000));
+  ota_report(&dl, OTA_STATE_DONE, ESP_OK);
+  return ESP_OK;
+}
+
+/**
+ * @brief OTA task: runs one upgrade per request, so a download never holds
+ * up the cloud task's yield loop. Restarts into the new image once the final
+ * report is out.
+ */
+static void ota_upgrade_task(void *param) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    if (do_firmware_upgrade(ota_url) != ESP_OK) {
+      continue;
+    }
+
+    TickType_t start = xTaskGetTickCount();
+    uint32_t seq;
+    do {
+      vTaskDelay(100 / portTICK_RATE_MS);
+      portENTER_CRITICAL(&ota_lock);
+      seq = ota_progress_seq - ota_published_seq;
+      portEXIT_CRITICAL(&ota_lock);
+    } while (seq != 0 && (TickType_t)(xTaskGetTickCount() - start) <
+                             OTA_RESTART_GRACE_MS / portTICK_RATE_MS);
+
+    /* Restart after sucessful firmware download */
+    esp_restart();
+  }
+}
+
+/**
+ * @brief Hands a firmware URL to the OTA task. Returns at once, the
+ * download is reported on iotDevice/<thing name>/ota.
+ * @retval
+ *  - ESP_OK: the upgrade has started
+ *  - ESP_ERR_INVALID_STATE: an upgrade is already running
+ *  - ESP_ERR_INVALID_SIZE: the URL is too long
+ */
+esp_err_t ota_request(const char *url) {
+  if (ota_task == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (strlen(url) >= sizeof(ota_url)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  portENTER_CRITICAL(&ota_lock);
+  bool busy = ota_progress.state != OTA_STATE_IDLE &&
+              ota_progress.state != OTA_STATE_FAILED;
+  if (!busy) {
+    strcpy(ota_url, url);
+    ota_progress = (ota_progress_t){.state = OTA_STATE_STARTING, .total = -1};
+    ota_progress_seq++;
+  }
+  portEXIT_CRITICAL(&ota_lock);
+
+  if (busy) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xTaskNotifyGive(ota_task);
+  cloud_connection_notify(CLOUD_EVENT_LOCAL_CHANGE);
+  return ESP_OK;
+}
+
+static IoT_Error_t ota_connected(AWS_IoT_Client *mqttClient) {
+  snprintf(ota_progress_topic, sizeof(ota_progress_topic), "iotDevice/%s/ota",
+           (const char *)deviceid_txt_start);
+  return SUCCESS;
+}
+
+/**
+ * @brief Publishes the download's progress, e.g.
+ * {"state":"downloading","bytes":524288,"total":1048576,"written":917504,
+ *  "bps":91022,"avg_bps":87381,"net_bps":163840,"flash_bps":96420,
+ *  "resumes":1}
+ * bytes and total count the download, written the image in the OTA slot,
+ * which is larger for a compressed image. net_bps and flash_bps are each
+ * stage's rate while busy; the download can't run faster than the lower.
+ * State changes go out at once, progress at most every
+ * CONFIG_OTA_PROGRESS_INTERVAL_MS. Progress is best effort, a failed publish
+ * is retried with the next report and never takes the connection down.
+ */
+static IoT_Error_t ota_run(AWS_IoT_Client *mqttClient, uint32_t events,
+                           bool reconnecting) {
+  TickType_t interval = CONFIG_OTA_PROGRESS_INTERVAL_MS / portTICK_RATE_MS;
+  ota_progress_t progress;
+  uint32_t seq;
+
+  if (reconnecting) {
+    return SUCCESS;
+  }
+
+  portENTER_CRITICAL(&ota_lock);
+  progress = ota_progress;
+  seq = ota_progress_seq;
+  portEXIT_CRITICAL(&ota_lock);
+
+  if (seq == ota_published_seq ||
+      (progress.state == ota_published_state &&
+       (TickType_t)(xTaskGetTickCount() - ota_last_publish) < interval)) {
+    return SUCCESS;
+  }
+
+  char payload[OTA_PAYLOAD_MAX_LEN];
+  int len = snprintf(payload, sizeof(payload),
+                     "{\"state\":\"%s\",\"bytes\":%u,\"total\":%d,"
+                     "\"written\":%u,\"bps\":%u,\"avg_bps\":%u,"
+                     "\"net_bps\":%u,\"flash_bps\":%u,\"resumes\":%u",
+                     ota_state_name(progress.state), (unsigned)progress.bytes,
+                     (int)progress.total, (unsigned)progress.written,
+                     (unsigned)progress.bps,
+                     (unsigned)progress.avg_bps, (unsigned)progress.net_bps,
+                     (unsigned)progress.flash_bps, (unsigned)progress.resumes);
+  if (progress.state == OTA_STATE_FAILED) {
+    len += snprintf(payload + len, sizeof(payload) - len, ",\"error\":\"%s\"",
+                    esp_err_to_name(progress.error));
+  }
+  len += snprintf(payload + len, sizeof(payload) - len, "}");
+
+  IoT_Publish_Message_Params params = {
+      .qos = QOS0,
+      .isRetained = 0,
+      .payload = payload,
+      .payloadLen = (size_t)len,
   };
+  ota_last_publish = xTaskGetTickCount();
+  IoT_Error_t rc =
+      aws_iot_mqtt_publish(mqttClient, ota_progress_topic,
+                           (uint16_t)strlen(ota_progress_topic), &params);
+  if (SUCCESS != rc) {
+    ESP_LOGW(TAG, "Publishing OTA progress failed %d", rc);
+    return SUCCESS;
+  }
 
-  /* HTTP firrmware upgrade */
-  return esp_https_ota(&ota_config);
-#else
-  return esp_https_ota(&config);
-#endif
-}
\ No newline at end of file
+  ota_published_state = progress.state;
+  portENTER_CRITICAL(&ota_lock);
+  ota_published_seq = seq;
+  portEXIT_CRITICAL(&ota_lock);
+  return SUCCESS;
+}
+
+static TickType_t ota_deadline(void) {
+  TickType_t interval = CONFIG_OTA_PROGRESS_INTERVAL_MS / portTICK_RATE_MS;
+  bool pending;
+
+  portENTER_CRITICAL(&ota_lock);
+  pending = ota_progress_seq != ota_published_seq;
+  portEXIT_CRITICAL(&ota_lock);
+
+  if (!pending) {
+    return portMAX_DELAY;
+  }
+  TickType_t elapsed = xTaskGetTickCount() - ota_last_publish;
+  return elapsed >= interval ? 0 : interval - elapsed;
+}
+
+static const cloud_service_t ota_service = {
+    .name = "ota",
+    .connected = ota_connected,
+    .run = ota_run,
+    .deadline = ota_deadline,
+};
+
+/**
+ * @brief Creates the OTA task and registers its progress reports on the
+ * shared cloud connection. Must be called before cloud_start().
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+int ota_task_start(void) {
+  if (cloud_connection_register_service(&ota_service) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the OTA service\n");
+    return ESP_FAIL;
+  }
+  /* Below the cloud task, so MQTT keeps flowing during a download */
+  if (xTaskCreate(&ota_upgrade_task, "ota_task", 8192, NULL, 4, &ota_task) !=
+      pdPASS) {
+    ESP_LOGE(TAG, "Couldnt create the OTA task\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
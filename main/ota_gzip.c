@@ -0,0 +1,289 @@
+/**
+ ******************************************************************************
+ * @file      ota_gzip.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Streaming gzip decoder for compressed firmware images
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp32/rom/miniz.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "ota_gzip.h"
+
+#define TAG "OTA_GZIP"
+
+/* RFC 1952 member header */
+#define OTA_GZIP_ID1 0x1f
+#define OTA_GZIP_ID2 0x8b
+#define OTA_GZIP_DEFLATE 8
+#define OTA_GZIP_FHCRC 0x02
+#define OTA_GZIP_FEXTRA 0x04
+#define OTA_GZIP_FNAME 0x08
+#define OTA_GZIP_FCOMMENT 0x10
+#define OTA_GZIP_HEADER_LEN 10
+#define OTA_GZIP_TRAILER_LEN 8
+
+typedef enum {
+  OTA_GZIP_HEADER,
+  OTA_GZIP_EXTRA_LEN,
+  OTA_GZIP_EXTRA,
+  OTA_GZIP_NAME,
+  OTA_GZIP_COMMENT,
+  OTA_GZIP_HCRC,
+  OTA_GZIP_BODY,
+  OTA_GZIP_TRAILER,
+  OTA_GZIP_DONE,
+} ota_gzip_stage_t;
+
+/**
+ * @brief Decoder state. The ROM inflater writes into the 32K window, which
+ * doubles as the output buffer: every piece it produces is handed to the
+ * sink before the window wraps over it. Around 43K in all, whatever the
+ * image size.
+ */
+struct ota_gzip {
+  tinfl_decompressor inflator;
+  uint8_t window[TINFL_LZ_DICT_SIZE];
+  size_t window_pos;
+  ota_gzip_stage_t stage;
+  uint8_t flags;
+  /* Fixed-size header and trailer fields are gathered across reads */
+  uint8_t field[OTA_GZIP_HEADER_LEN];
+  size_t field_len;
+  size_t skip;
+  uint32_t crc;
+  uint32_t size;
+  ota_gzip_sink_t sink;
+  void *arg;
+};
+
+/**
+ * @brief True when an image starting with this byte is gzip compressed. A
+ * plain app image starts with 0xE9.
+ */
+bool ota_gzip_detect(uint8_t first_byte) { return first_byte == OTA_GZIP_ID1; }
+
+ota_gzip_t *ota_gzip_create(ota_gzip_sink_t sink, void *arg) {
+  ota_gzip_t *gz = malloc(sizeof(*gz));
+  if (gz == NULL) {
+    return NULL;
+  }
+  tinfl_init(&gz->inflator);
+  gz->window_pos = 0;
+  gz->stage = OTA_GZIP_HEADER;
+  gz->flags = 0;
+  gz->field_len = 0;
+  gz->skip = 0;
+  gz->crc = 0;
+  gz->size = 0;
+  gz->sink = sink;
+  gz->arg = arg;
+  return gz;
+}
+
+void ota_gzip_destroy(ota_gzip_t *gz) { free(gz); }
+
+/**
+ * @brief Gathers a field of `need` bytes that may be split over reads.
+ * @retval true once the whole field is in gz->field
+ */
+static bool ota_gzip_collect(ota_gzip_t *gz, const uint8_t **data,
+                             size_t *len, size_t need) {
+  size_t n = need - gz->field_len;
+  if (n > *len) {
+    n = *len;
+  }
+  memcpy(gz->field + gz->field_len, *data, n);
+  gz->field_len += n;
+  *data += n;
+  *len -= n;
+  if (gz->field_len < need) {
+    return false;
+  }
+  gz->field_len = 0;
+  return true;
+}
+
+/* Optional header fields come in this order, each flagged in FLG */
+static ota_gzip_stage_t ota_gzip_next_field(ota_gzip_t *gz) {
+  static const struct {
+    uint8_t flag;
+    ota_gzip_stage_t stage;
+  } fields[] = {
+      {OTA_GZIP_FEXTRA, OTA_GZIP_EXTRA_LEN},
+      {OTA_GZIP_FNAME, OTA_GZIP_NAME},
+      {OTA_GZIP_FCOMMENT, OTA_GZIP_COMMENT},
+      {OTA_GZIP_FHCRC, OTA_GZIP_HCRC},
+  };
+
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    if (gz->flags & fields[i].flag) {
+      gz->flags &= ~fields[i].flag;
+      return fields[i].stage;
+    }
+  }
+  return OTA_GZIP_BODY;
+}
+
+/**
+ * @brief Moves the whole bytes left in the inflater's bit buffer into the
+ * trailer field. The ROM's tinfl (miniz 1.15) reads up to 4 bytes ahead
+ * and counts them as consumed even when the deflate stream ends before
+ * them, so the trailer can start inside the bit buffer.
+ */
+static void ota_gzip_take_readahead(ota_gzip_t *gz) {
+  uint32_t bits = gz->inflator.m_num_bits;
+  uint32_t buf = gz->inflator.m_bit_buf >> (bits & 7);
+
+  for (bits &= ~7u; bits > 0 && gz->field_len < OTA_GZIP_TRAILER_LEN;
+       bits -= 8) {
+    gz->field[gz->field_len++] = (uint8_t)buf;
+    buf >>= 8;
+  }
+}
+
+/**
+ * @brief Runs the inflater over the input until it needs more, passing
+ * everything it produces to the sink.
+ */
+static esp_err_t ota_gzip_inflate(ota_gzip_t *gz, const uint8_t **data,
+                                  size_t *len) {
+  tinfl_status status;
+
+  do {
+    size_t in_len = *len;
+    size_t out_len = TINFL_LZ_DICT_SIZE - gz->window_pos;
+    status = tinfl_decompress(&gz->inflator, *data, &in_len, gz->window,
+                              gz->window + gz->window_pos, &out_len,
+                              TINFL_FLAG_HAS_MORE_INPUT);
+    *data += in_len;
+    *len -= in_len;
+
+    if (out_len > 0) {
+      const uint8_t *out = gz->window + gz->window_pos;
+      gz->crc = esp_rom_crc32_le(gz->crc, out, out_len);
+      gz->size += (uint32_t)out_len;
+      gz->window_pos = (gz->window_pos + out_len) & (TINFL_LZ_DICT_SIZE - 1);
+      esp_err_t err = gz->sink(out, out_len, gz->arg);
+      if (err != ESP_OK) {
+        return err;
+      }
+    }
+  } while (status == TINFL_STATUS_HAS_MORE_OUTPUT ||
+           (status == TINFL_STATUS_NEEDS_MORE_INPUT && *len > 0));
+
+  if (status == TINFL_STATUS_DONE) {
+    ota_gzip_take_readahead(gz);
+    gz->stage = OTA_GZIP_TRAILER;
+  } else if (status < TINFL_STATUS_DONE) {
+    ESP_LOGE(TAG, "Corrupt deflate stream (%d) after %u bytes", status,
+             (unsigned)gz->size);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  return ESP_OK;
+}
+
+/**
+ * @brief Decodes the next piece of the compressed image. Pieces may be cut
+ * anywhere, including inside the header and trailer.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_ERR_INVALID_RESPONSE: not a gzip image, or a corrupt one
+ *  - ESP_ERR_INVALID_CRC: the image doesnt match its checksum or size
+ *  - others: the sink failed
+ */
+esp_err_t ota_gzip_feed(ota_gzip_t *gz, const uint8_t *data, size_t len) {
+  esp_err_t err = ESP_OK;
+
+  while (len > 0 && err == ESP_OK) {
+    switch (gz->stage) {
+    case OTA_GZIP_HEADER:
+      if (ota_gzip_collect(gz, &data, &len, OTA_GZIP_HEADER_LEN)) {
+        if (gz->field[0] != OTA_GZIP_ID1 || gz->field[1] != OTA_GZIP_ID2 ||
+            gz->field[2] != OTA_GZIP_DEFLATE) {
+          ESP_LOGE(TAG, "Not a gzip image");
+          return ESP_ERR_INVALID_RESPONSE;
+        }
+        gz->flags = gz->field[3];
+        gz->stage = ota_gzip_next_field(gz);
+      }
+      break;
+
+    case OTA_GZIP_EXTRA_LEN:
+      if (ota_gzip_collect(gz, &data, &len, 2)) {
+        gz->skip = gz->field[0] | (gz->field[1] << 8);
+        gz->stage = OTA_GZIP_EXTRA;
+      }
+      break;
+
+    case OTA_GZIP_EXTRA: {
+      size_t n = gz->skip < len ? gz->skip : len;
+      gz->skip -= n;
+      data += n;
+      len -= n;
+      if (gz->skip == 0) {
+        gz->stage = ota_gzip_next_field(gz);
+      }
+      break;
+    }
+
+    case OTA_GZIP_NAME:
+    case OTA_GZIP_COMMENT: {
+      /* Zero terminated */
+      const uint8_t *end = memchr(data, 0, len);
+      size_t n = end != NULL ? (size_t)(end - data) + 1 : len;
+      data += n;
+      len -= n;
+      if (end != NULL) {
+        gz->stage = ota_gzip_next_field(gz);
+      }
+      break;
+    }
+
+    case OTA_GZIP_HCRC:
+      if (ota_gzip_collect(gz, &data, &len, 2)) {
+        gz->stage = OTA_GZIP_BODY;
+      }
+      break;
+
+    case OTA_GZIP_BODY:
+      err = ota_gzip_inflate(gz, &data, &len);
+      break;
+
+    case OTA_GZIP_TRAILER:
+      if (ota_gzip_collect(gz, &data, &len, OTA_GZIP_TRAILER_LEN)) {
+        const uint8_t *f = gz->field;
+        uint32_t crc = f[0] | f[1] << 8 | f[2] << 16 | (uint32_t)f[3] << 24;
+        uint32_t size = f[4] | f[5] << 8 | f[6] << 16 | (uint32_t)f[7] << 24;
+        if (crc != gz->crc || size != gz->size) {
+          ESP_LOGE(TAG, "Image doesnt match its checksum");
+          return ESP_ERR_INVALID_CRC;
+        }
+        gz->stage = OTA_GZIP_DONE;
+      }
+      break;
+
+    case OTA_GZIP_DONE:
+    default:
+      ESP_LOGE(TAG, "%u bytes after the end of the image", (unsigned)len);
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+  }
+  return err;
+}
+
+/**
+ * @brief Checks that the whole image, trailer included, was decoded.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_ERR_INVALID_SIZE: the image is truncated
+ */
+esp_err_t ota_gzip_finish(const ota_gzip_t *gz) {
+  return gz->stage == OTA_GZIP_DONE ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
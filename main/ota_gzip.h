@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/* Receives the inflated image in order, in pieces of up to 32K */
+typedef esp_err_t (*ota_gzip_sink_t)(const uint8_t *data, size_t len,
+                                     void *arg);
+
+typedef struct ota_gzip ota_gzip_t;
+
+bool ota_gzip_detect(uint8_t first_byte);
+ota_gzip_t *ota_gzip_create(ota_gzip_sink_t sink, void *arg);
+esp_err_t ota_gzip_feed(ota_gzip_t *gz, const uint8_t *data, size_t len);
+esp_err_t ota_gzip_finish(const ota_gzip_t *gz);
+void ota_gzip_destroy(ota_gzip_t *gz);
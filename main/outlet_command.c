@@ -0,0 +1,97 @@
+/**
+ ******************************************************************************
+ * @file      outlet_command.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Outlet Command Topic Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdio.h>
+
+#include "esp_log.h"
+
+#include "aws_iot_config.h"
+#include "aws_iot_mqtt_client_interface.h"
+
+#include "cloud_connection.h"
+#include "json_lookup.h"
+#include "outlet_command.h"
+#include "output_driver.h"
+
+#define TAG "COMMAND"
+
+/**
+ * @brief thing name or device id
+ */
+extern const uint8_t deviceid_txt_start[] asm("_binary_deviceid_txt_start");
+extern const uint8_t deviceid_txt_end[] asm("_binary_deviceid_txt_end");
+
+/* iotDevice/<thing name>/command */
+static char command_topic[sizeof("iotDevice//command") + MAX_SIZE_OF_THING_NAME];
+
+/**
+ * @brief Applies a scene, switching every outlet it names at once:
+ * {"scene":{"mask":13,"state":9}} turns outlets 1 and 4 on and outlet 3
+ * off, bit n being outlet n + 1. The change is local, so it goes into the
+ * shadow's desired state with the next report.
+ */
+static void outlet_command_scene(const json_lookup_t *json, int scene) {
+  uint32_t mask;
+  uint32_t state;
+
+  if (json_lookup_uint32(json, json_lookup_find(json, scene, "mask"), &mask) !=
+          ESP_OK ||
+      json_lookup_uint32(json, json_lookup_find(json, scene, "state"),
+                         &state) != ESP_OK) {
+    ESP_LOGE(TAG, "Scene needs a numeric mask and state");
+    return;
+  }
+
+  esp_err_t err = app_driver_apply_mask(mask, state, true);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Scene mask 0x%x: %s", (unsigned)mask, esp_err_to_name(err));
+  }
+}
+
+/**
+ * @brief Command topic handler, runs on the cloud task
+ */
+static void outlet_command_handler(AWS_IoT_Client *pClient, char *topicName,
+                                   uint16_t topicNameLen,
+                                   IoT_Publish_Message_Params *params,
+                                   void *pData) {
+  json_lookup_t json;
+
+  esp_err_t err = json_lookup_parse(&json, (const char *)params->payload,
+                                    params->payloadLen);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Invalid JSON payload: %s", esp_err_to_name(err));
+    return;
+  }
+
+  int scene = json_lookup_find(&json, JSON_LOOKUP_ROOT, "scene");
+  if (scene < 0) {
+    ESP_LOGW(TAG, "Unknown command %.*s", (int)params->payloadLen,
+             (const char *)params->payload);
+    return;
+  }
+  outlet_command_scene(&json, scene);
+}
+
+/**
+ * @brief Subscribes the outlet command topic on the shared cloud connection.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+int outlet_command_start(void) {
+  snprintf(command_topic, sizeof(command_topic), "iotDevice/%s/command",
+           (const char *)deviceid_txt_start);
+  if (cloud_connection_subscribe(command_topic, outlet_command_handler,
+                                 NULL) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the command topic\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
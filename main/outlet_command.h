@@ -0,0 +1,3 @@
+#pragma once
+
+int outlet_command_start(void);
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+/*
+ * Compile time outlet registry. Everything that depends on the number of
+ * outlets (GPIO map, shadow keys, LCD positions, delta handlers) is expanded
+ * from OUTLET_TABLE(X), which calls X(number, gpio) once per outlet in
+ * order, numbers starting at 1.
+ */
+#define OUTLET_COUNT CONFIG_OUTLET_COUNT
+
+#if OUTLET_COUNT < 1 || OUTLET_COUNT > 16
+#error "CONFIG_OUTLET_COUNT must be between 1 and 16"
+#endif
+
+#if OUTLET_COUNT >= 2
+#define OUTLET_TABLE_2(X) X(2, CONFIG_OUTLET_2_GPIO)
+#else
+#define OUTLET_TABLE_2(X)
+#endif
+#if OUTLET_COUNT >= 3
+#define OUTLET_TABLE_3(X) X(3, CONFIG_OUTLET_3_GPIO)
+#else
+#define OUTLET_TABLE_3(X)
+#endif
+#if OUTLET_COUNT >= 4
+#define OUTLET_TABLE_4(X) X(4, CONFIG_OUTLET_4_GPIO)
+#else
+#define OUTLET_TABLE_4(X)
+#endif
+#if OUTLET_COUNT >= 5
+#define OUTLET_TABLE_5(X) X(5, CONFIG_OUTLET_5_GPIO)
+#else
+#define OUTLET_TABLE_5(X)
+#endif
+#if OUTLET_COUNT >= 6
+#define OUTLET_TABLE_6(X) X(6, CONFIG_OUTLET_6_GPIO)
+#else
+#define OUTLET_TABLE_6(X)
+#endif
+#if OUTLET_COUNT >= 7
+#define OUTLET_TABLE_7(X) X(7, CONFIG_OUTLET_7_GPIO)
+#else
+#define OUTLET_TABLE_7(X)
+#endif
+#if OUTLET_COUNT >= 8
+#define OUTLET_TABLE_8(X) X(8, CONFIG_OUTLET_8_GPIO)
+#else
+#define OUTLET_TABLE_8(X)
+#endif
+#if OUTLET_COUNT >= 9
+#define OUTLET_TABLE_9(X) X(9, CONFIG_OUTLET_9_GPIO)
+#else
+#define OUTLET_TABLE_9(X)
+#endif
+#if OUTLET_COUNT >= 10
+#define OUTLET_TABLE_10(X) X(10, CONFIG_OUTLET_10_GPIO)
+#else
+#define OUTLET_TABLE_10(X)
+#endif
+#if OUTLET_COUNT >= 11
+#define OUTLET_TABLE_11(X) X(11, CONFIG_OUTLET_11_GPIO)
+#else
+#define OUTLET_TABLE_11(X)
+#endif
+#if OUTLET_COUNT >= 12
+#define OUTLET_TABLE_12(X) X(12, CONFIG_OUTLET_12_GPIO)
+#else
+#define OUTLET_TABLE_12(X)
+#endif
+#if OUTLET_COUNT >= 13
+#define OUTLET_TABLE_13(X) X(13, CONFIG_OUTLET_13_GPIO)
+#else
+#define OUTLET_TABLE_13(X)
+#endif
+#if OUTLET_COUNT >= 14
+#define OUTLET_TABLE_14(X) X(14, CONFIG_OUTLET_14_GPIO)
+#else
+#define OUTLET_TABLE_14(X)
+#endif
+#if OUTLET_COUNT >= 15
+#define OUTLET_TABLE_15(X) X(15, CONFIG_OUTLET_15_GPIO)
+#else
+#define OUTLET_TABLE_15(X)
+#endif
+#if OUTLET_COUNT >= 16
+#define OUTLET_TABLE_16(X) X(16, CONFIG_OUTLET_16_GPIO)
+#else
+#define OUTLET_TABLE_16(X)
+#endif
+
+#define OUTLET_TABLE(X)                                                        \
+  X(1, CONFIG_OUTLET_1_GPIO)                                                   \
+  OUTLET_TABLE_2(X)                                                            \
+  OUTLET_TABLE_3(X)                                                            \
+  OUTLET_TABLE_4(X)                                                            \
+  OUTLET_TABLE_5(X)                                                            \
+  OUTLET_TABLE_6(X)                                                            \
+  OUTLET_TABLE_7(X)                                                            \
+  OUTLET_TABLE_8(X)                                                            \
+  OUTLET_TABLE_9(X)                                                            \
+  OUTLET_TABLE_10(X)                                                           \
+  OUTLET_TABLE_11(X)                                                           \
+  OUTLET_TABLE_12(X)                                                           \
+  OUTLET_TABLE_13(X)                                                           \
+  OUTLET_TABLE_14(X)                                                           \
+  OUTLET_TABLE_15(X)                                                           \
+  OUTLET_TABLE_16(X)
+
+/* Longest shadow key, "relay_N" */
+#define OUTLET_KEY_MAX_LEN (OUTLET_COUNT > 9 ? 8 : 7)
+
+/*
+ * LCD layout on the 20 visible columns. Up to four outlets keep the wide
+ * "LOAD n: v" cells under the title row. More outlets switch to compact
+ * "n:v" cells, 4 columns wide, that use all four rows and skip the last
+ * cell of row 0 where the Wi-Fi indicator lives. Outlets 10..16 are
+ * labelled A..G.
+ */
+#if OUTLET_COUNT <= 4
+#define OUTLET_LCD_WIDE 1
+#define OUTLET_LCD_LABEL_COL(n) ((((n) - 1) / 2) * 10)
+#define OUTLET_LCD_VALUE_COL(n) (OUTLET_LCD_LABEL_COL(n) + 8)
+#define OUTLET_LCD_ROW(n) (1 + ((n) - 1) % 2)
+#else
+#define OUTLET_LCD_WIDE 0
+#define OUTLET_LCD_SLOT(n) ((n) - 1 + ((n) > 4))
+#define OUTLET_LCD_LABEL_COL(n) ((OUTLET_LCD_SLOT(n) % 5) * 4)
+#define OUTLET_LCD_VALUE_COL(n) (OUTLET_LCD_LABEL_COL(n) + 2)
+#define OUTLET_LCD_ROW(n) (OUTLET_LCD_SLOT(n) / 5)
+#endif
+#define OUTLET_LCD_LABEL_CHAR(n) ((n) < 10 ? '0' + (n) : 'A' + (n) - 10)
@@ -0,0 +1,424 @@
+/**
+ ******************************************************************************
+ * @file      outlet_journal.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Offline Outlet Event Journal Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+
+#include "aws_iot_config.h"
+#include "aws_iot_mqtt_client_interface.h"
+
+#include "cloud_connection.h"
+#include "outlet_journal.h"
+#include "outlet_state.h"
+#include "outlet_store.h"
+#include "output_driver.h"
+
+#define TAG "JOURNAL"
+
+/* Saved next to the outlet state, by the outlet store task */
+#define JOURNAL_NVS_NAMESPACE "outlets"
+#define JOURNAL_NVS_KEY "journal"
+/* Counts boots, to tell uptime events of different boots apart */
+#define JOURNAL_NVS_BOOT_KEY "boot"
+
+/* The wall clock is taken as set once it is past 2020-01-01 */
+#define JOURNAL_CLOCK_VALID 1577836800
+/* Fits the MQTT TX buffer with the topic */
+#define JOURNAL_PAYLOAD_MAX_LEN 448
+
+/* The event time counts from that boot, the wall clock wasnt set yet */
+#define JOURNAL_UPTIME 0x1
+
+/**
+ * @brief thing name or device id
+ */
+extern const uint8_t deviceid_txt_start[] asm("_binary_deviceid_txt_start");
+extern const uint8_t deviceid_txt_end[] asm("_binary_deviceid_txt_end");
+
+typedef struct {
+  uint32_t sec;
+  uint16_t ms;
+  uint16_t flags;
+  uint16_t changed;
+  uint16_t state;
+  /* Low bits of the boot counter when it happened */
+  uint16_t boot;
+  uint16_t reserved;
+} journal_event_t;
+
+/* Kept in NVS as is, up to the last event. Images written before events
+ * had a boot number have another length and are dropped on load. */
+typedef struct {
+  uint16_t count;
+  /* State each touched outlet had before its first event */
+  uint16_t origin;
+  /* Outlets changed by any event, dropped ones included */
+  uint16_t touched;
+  uint16_t reserved;
+  /* Oldest events dropped to make room */
+  uint32_t dropped;
+  journal_event_t events[CONFIG_OUTLET_JOURNAL_MAX_EVENTS];
+} journal_image_t;
+
+#define JOURNAL_IMAGE_LEN(count)                                               \
+  (offsetof(journal_image_t, events) + (count) * sizeof(journal_event_t))
+
+static SemaphoreHandle_t journal_lock;
+static journal_image_t journal;
+/* Sequence number of events[0], so an upload drops only what it sent */
+static uint32_t journal_first_seq;
+static bool journal_changed_since_save;
+/* This boot's number, from JOURNAL_NVS_BOOT_KEY */
+static uint32_t journal_boot;
+
+/* Owned by the outlet store task */
+static journal_image_t journal_save_copy;
+
+/* Set while the connection is down, the journal goes up once it is back */
+static bool upload_due;
+
+/* iotDevice/<thing name>/events */
+static char journal_topic[sizeof("iotDevice//events") + MAX_SIZE_OF_THING_NAME];
+
+static uint64_t journal_event_ms(const journal_event_t *event) {
+  return (uint64_t)event->sec * 1000 + event->ms;
+}
+
+/**
+ * @brief Relay change listener. Records the change while the cloud
+ * connection is down, with the time it happened.
+ */
+static void journal_outlets_changed(uint32_t changed, uint32_t state) {
+  if (cloud_connection_state() == CLOUD_STATE_CONNECTED) {
+    return;
+  }
+
+  journal_event_t event = {.changed = (uint16_t)changed,
+                           .state = (uint16_t)state,
+                           .boot = (uint16_t)journal_boot};
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (now.tv_sec >= JOURNAL_CLOCK_VALID) {
+    event.sec = (uint32_t)now.tv_sec;
+    event.ms = (uint16_t)(now.tv_usec / 1000);
+  } else {
+    int64_t uptime_ms = esp_timer_get_time() / 1000;
+    event.sec = (uint32_t)(uptime_ms / 1000);
+    event.ms = (uint16_t)(uptime_ms % 1000);
+    event.flags = JOURNAL_UPTIME;
+  }
+
+  xSemaphoreTake(journal_lock, portMAX_DELAY);
+  uint32_t first = changed & ~journal.touched;
+  journal.origin = (journal.origin & ~first) | ((state ^ changed) & first);
+  journal.touched |= changed;
+  if (journal.count == CONFIG_OUTLET_JOURNAL_MAX_EVENTS) {
+    memmove(&journal.events[0], &journal.events[1],
+            (journal.count - 1) * sizeof(journal.events[0]));
+    journal.count--;
+    journal.dropped++;
+    journal_first_seq++;
+  }
+  journal.events[journal.count++] = event;
+  journal_changed_since_save = true;
+  xSemaphoreGive(journal_lock);
+  /* The outlet store task, woken by the same change, saves it */
+}
+
+/**
+ * @brief Outlets whose journaled changes didnt cancel out: the only ones
+ * the shadow needs to hear about as local changes.
+ */
+uint32_t outlet_journal_net_changes(void) {
+  if (journal_lock == NULL) {
+    return 0;
+  }
+  xSemaphoreTake(journal_lock, portMAX_DELAY);
+  uint32_t net = (journal.origin ^ outlet_state_current()) & journal.touched;
+  xSemaphoreGive(journal_lock);
+  return net;
+}
+
+/**
+ * @brief True when the journal changed since it was last saved
+ */
+bool outlet_journal_dirty(void) {
+  if (journal_lock == NULL) {
+    return false;
+  }
+  xSemaphoreTake(journal_lock, portMAX_DELAY);
+  bool dirty = journal_changed_since_save;
+  xSemaphoreGive(journal_lock);
+  return dirty;
+}
+
+/**
+ * @brief Writes the journal into an open handle on the "outlets" namespace,
+ * or erases it once empty. Called by the outlet store task, which commits.
+ */
+esp_err_t outlet_journal_save(nvs_handle_t nvs) {
+  esp_err_t err;
+
+  xSemaphoreTake(journal_lock, portMAX_DELAY);
+  memcpy(&journal_save_copy, &journal, JOURNAL_IMAGE_LEN(journal.count));
+  journal_changed_since_save = false;
+  xSemaphoreGive(journal_lock);
+
+  if (journal_save_copy.count == 0) {
+    err = nvs_erase_key(nvs, JOURNAL_NVS_KEY);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+      err = ESP_OK;
+    }
+  } else {
+    err = nvs_set_blob(nvs, JOURNAL_NVS_KEY, &journal_save_copy,
+                       JOURNAL_IMAGE_LEN(journal_save_copy.count));
+  }
+
+  if (err != ESP_OK) {
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    journal_changed_since_save = true;
+    xSemaphoreGive(journal_lock);
+  }
+  return err;
+}
+
+/**
+ * @brief Counts this boot in NVS. Without NVS every boot is boot 0, and
+ * uptime events of different boots can share a message, as they used to.
+ */
+static void journal_count_boot(void) {
+  nvs_handle_t nvs;
+  esp_err_t err;
+
+  if (nvs_open(JOURNAL_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+    ESP_LOGW(TAG, "Couldnt open NVS to count the boot");
+    return;
+  }
+  err = nvs_get_u32(nvs, JOURNAL_NVS_BOOT_KEY, &journal_boot);
+  if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+    journal_boot = err == ESP_OK ? journal_boot + 1 : 0;
+    err = nvs_set_u32(nvs, JOURNAL_NVS_BOOT_KEY, journal_boot);
+  }
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Couldnt count the boot %d", err);
+  }
+}
+
+/**
+ * @brief Reads back the events of earlier boots that never got uploaded
+ */
+static void journal_load(void) {
+  nvs_handle_t nvs;
+  size_t len = sizeof(journal);
+
+  if (nvs_open(JOURNAL_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+    return;
+  }
+  esp_err_t err = nvs_get_blob(nvs, JOURNAL_NVS_KEY, &journal, &len);
+  nvs_close(nvs);
+
+  if (err == ESP_ERR_NVS_NOT_FOUND) {
+    return;
+  }
+  if (err != ESP_OK || len < JOURNAL_IMAGE_LEN(0) ||
+      journal.count > CONFIG_OUTLET_JOURNAL_MAX_EVENTS ||
+      len != JOURNAL_IMAGE_LEN(journal.count)) {
+    ESP_LOGW(TAG, "Dropping the stored journal");
+    memset(&journal, 0, sizeof(journal));
+    journal_changed_since_save = true;
+    return;
+  }
+  ESP_LOGI(TAG, "%u events from earlier boots, %u dropped",
+           (unsigned)journal.count, (unsigned)journal.dropped);
+}
+
+/**
+ * @brief Renders as many events from the head as fit one message, e.g.
+ * {"clock":"unix","t0":1700000000123,"dropped":0,
+ *  "events":[[0,1,1],[350,4,5]]}
+ * with [ms after t0, outlets changed, state after] per event. A message
+ * holds events of one clock and in time order only, and uptime events of
+ * one boot only, which it names with "boot":<n> after the clock.
+ * @retval Number of events in the message
+ */
+static size_t journal_format(char *payload, size_t size, int *len_out) {
+  const journal_event_t *head = &journal.events[0];
+  uint64_t t0 = journal_event_ms(head);
+  uint64_t last = t0;
+  size_t count = 0;
+  int len;
+
+  if (head->flags & JOURNAL_UPTIME) {
+    len = snprintf(payload, size, "{\"clock\":\"uptime\",\"boot\":%u,",
+                   (unsigned)head->boot);
+  } else {
+    len = snprintf(payload, size, "{\"clock\":\"unix\",");
+  }
+  len += snprintf(payload + len, size - len,
+                  "\"t0\":%llu,\"dropped\":%u,\"events\":[",
+                  (unsigned long long)t0, (unsigned)journal.dropped);
+  for (; count < journal.count && len < (int)size; count++) {
+    const journal_event_t *event = &journal.events[count];
+    uint64_t t = journal_event_ms(event);
+    if (event->flags != head->flags || t < last) {
+      break;
+    }
+    /* Uptimes of two boots dont compare, even when they happen to rise */
+    if ((event->flags & JOURNAL_UPTIME) && event->boot != head->boot) {
+      break;
+    }
+
+    /* Leave room for the closing brackets */
+    int n = snprintf(payload + len, size - len, "%s[%llu,%u,%u]",
+                     count == 0 ? "" : ",", (unsigned long long)(t - t0),
+                     (unsigned)event->changed, (unsigned)event->state);
+    if (len + n + 2 >= (int)size) {
+      break;
+    }
+    len += n;
+    last = t;
+  }
+  len += snprintf(payload + len, size - len, "]}");
+
+  *len_out = len;
+  return count;
+}
+
+/**
+ * @brief Publishes the journal in as few messages as the TX buffer allows,
+ * and forgets each event once its message is out. Whatever fails stays for
+ * the next reconnect.
+ */
+static void journal_upload(AWS_IoT_Client *mqttClient) {
+  char payload[JOURNAL_PAYLOAD_MAX_LEN];
+  unsigned messages = 0;
+  unsigned sent = 0;
+
+  for (;;) {
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    if (journal.count == 0) {
+      xSemaphoreGive(journal_lock);
+      break;
+    }
+    int len;
+    uint32_t seq = journal_first_seq;
+    size_t count = journal_format(payload, sizeof(payload), &len);
+    xSemaphoreGive(journal_lock);
+    if (count == 0) {
+      break;
+    }
+
+    /* Acked, so a message lost on the way keeps its events */
+    IoT_Publish_Message_Params params = {
+        .qos = QOS1,
+        .isRetained = 0,
+        .payload = payload,
+        .payloadLen = (size_t)len,
+    };
+    IoT_Error_t rc = aws_iot_mqtt_publish(mqttClient, journal_topic,
+                                          (uint16_t)strlen(journal_topic),
+                                          &params);
+    if (SUCCESS != rc) {
+      ESP_LOGW(TAG, "Publishing the journal failed %d", rc);
+      break;
+    }
+    messages++;
+    sent += count;
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    size_t done = seq + count - journal_first_seq;
+    if (done > journal.count) {
+      done = journal.count;
+    }
+    memmove(&journal.events[0], &journal.events[done],
+            (journal.count - done) * sizeof(journal.events[0]));
+    journal.count -= done;
+    journal_first_seq += done;
+    journal.dropped = 0;
+    if (journal.count == 0) {
+      journal.origin = 0;
+      journal.touched = 0;
+    }
+    journal_changed_since_save = true;
+    xSemaphoreGive(journal_lock);
+  }
+
+  if (messages > 0) {
+    ESP_LOGI(TAG, "%u events uploaded in %u messages", sent, messages);
+    outlet_store_flush();
+  }
+}
+
+/**
+ * @brief Registered after the shadow, which has taken the net changes by
+ * the time this runs.
+ */
+static IoT_Error_t journal_connected(AWS_IoT_Client *mqttClient) {
+  snprintf(journal_topic, sizeof(journal_topic), "iotDevice/%s/events",
+           (const char *)deviceid_txt_start);
+  journal_upload(mqttClient);
+  return SUCCESS;
+}
+
+static IoT_Error_t journal_run(AWS_IoT_Client *mqttClient, uint32_t events,
+                               bool reconnecting) {
+  if (reconnecting) {
+    upload_due = true;
+  } else if (upload_due) {
+    upload_due = false;
+    journal_upload(mqttClient);
+  }
+  return SUCCESS;
+}
+
+static const cloud_service_t journal_service = {
+    .name = "journal",
+    .connected = journal_connected,
+    .run = journal_run,
+};
+
+/**
+ * @brief Loads the journal left by earlier boots, starts recording relay
+ * changes made while the cloud is unreachable and registers the upload with
+ * the cloud connection. Needs NVS; call after shadow_start().
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+int outlet_journal_start(void) {
+  journal_lock = xSemaphoreCreateMutex();
+  if (journal_lock == NULL) {
+    ESP_LOGE(TAG, "Couldnt create the journal lock\n");
+    return ESP_FAIL;
+  }
+  journal_count_boot();
+  journal_load();
+
+  if (app_driver_register_change_cb(journal_outlets_changed) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the relay change listener\n");
+    return ESP_FAIL;
+  }
+  if (cloud_connection_register_service(&journal_service) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the journal service\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
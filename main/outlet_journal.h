@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "nvs.h"
+
+int outlet_journal_start(void);
+uint32_t outlet_journal_net_changes(void);
+bool outlet_journal_dirty(void);
+esp_err_t outlet_journal_save(nvs_handle_t nvs);
@@ -0,0 +1,141 @@
+/**
+ ******************************************************************************
+ * @file      outlet_state.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Lock-free Outlet State Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdatomic.h>
+
+#include "outlet_state.h"
+
+/* Local-change flags live in the upper half of the packed word */
+#define LOCAL_SHIFT 16
+#define STATE_BITS 0xFFFFu
+
+/*
+ * Bits 0..15 hold the on/off state of each outlet, bits 16..31 flag outlets
+ * whose last change came from a local source (anything but a shadow delta).
+ * Writers update it with compare-and-swap, readers with a single load, so
+ * no reader ever sees half of a multi-outlet change.
+ */
+static _Atomic uint32_t outlet_word;
+
+/* Values last published to the shadow */
+static _Atomic uint32_t outlet_reported;
+
+/* Changes of each outlet since boot */
+static _Atomic uint32_t switch_count[OUTLET_COUNT];
+
+/**
+ * @brief Sets several outlets at once; readers see all of them change
+ * together.
+ * @param [IN] mask: outlets to set, bit n is outlet n + 1
+ * @param [IN] values: new state of the outlets in mask
+ * @param [IN] local: true unless the change comes from the shadow
+ * @retval Mask of the outlets that changed state
+ */
+uint32_t outlet_state_set_mask(uint32_t mask, uint32_t values, bool local) {
+  uint32_t old = atomic_load(&outlet_word);
+  uint32_t changed;
+  uint32_t desired;
+
+  mask &= STATE_BITS;
+  do {
+    changed = (old ^ values) & mask;
+    if (changed == 0) {
+      return 0;
+    }
+    desired = (old & ~(changed | (changed << LOCAL_SHIFT))) |
+              (values & changed);
+    if (local) {
+      desired |= changed << LOCAL_SHIFT;
+    }
+  } while (!atomic_compare_exchange_weak(&outlet_word, &old, desired));
+
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    if (changed & OUTLET_BIT(i)) {
+      atomic_fetch_add(&switch_count[i], 1);
+    }
+  }
+  return changed;
+}
+
+/**
+ * @brief Sets one outlet.
+ * @param [IN] index: outlet index, 0 to OUTLET_COUNT - 1
+ * @param [IN] on: new state
+ * @param [IN] local: true unless the change comes from the shadow
+ * @retval true if the outlet changed state
+ */
+bool outlet_state_set(int index, bool on, bool local) {
+  uint32_t bit = OUTLET_BIT(index);
+  return outlet_state_set_mask(bit, on ? bit : 0, local) != 0;
+}
+
+/**
+ * @brief Sets every outlet at boot, before anything else reads the state.
+ * Unlike a change it isn't counted as a switch or flagged local.
+ * @param [IN] state: bit n is outlet n + 1
+ */
+void outlet_state_restore(uint32_t state) {
+  atomic_store(&outlet_word, state & STATE_BITS);
+}
+
+bool outlet_state_get(int index) {
+  return (atomic_load(&outlet_word) & OUTLET_BIT(index)) != 0;
+}
+
+/**
+ * @brief On/off state of every outlet as one mask
+ */
+uint32_t outlet_state_current(void) {
+  return atomic_load(&outlet_word) & STATE_BITS;
+}
+
+void outlet_state_snapshot(outlet_snapshot_t *snapshot) {
+  uint32_t word = atomic_load(&outlet_word);
+
+  snapshot->state = word & STATE_BITS;
+  snapshot->local = word >> LOCAL_SHIFT;
+  snapshot->reported = atomic_load(&outlet_reported);
+}
+
+/**
+ * @brief Atomically reads the outlets that changed since *seen and claims
+ * their local-change flags, so a flag is never consumed for a change the
+ * caller has not seen yet.
+ * @param [IN/OUT] seen: last state the caller processed, updated to now
+ * @param [OUT] local_changed: changed outlets whose change was local
+ * @retval Mask of outlets that changed
+ */
+uint32_t outlet_state_sync(uint32_t *seen, uint32_t *local_changed) {
+  uint32_t old = atomic_load(&outlet_word);
+  uint32_t changed;
+
+  do {
+    changed = (old & STATE_BITS) ^ *seen;
+    if (changed == 0) {
+      *local_changed = 0;
+      return 0;
+    }
+  } while (!atomic_compare_exchange_weak(
+      &outlet_word, &old, old & ~(changed << LOCAL_SHIFT)));
+
+  *seen = old & STATE_BITS;
+  *local_changed = (old >> LOCAL_SHIFT) & changed;
+  return changed;
+}
+
+/**
+ * @brief Number of times an outlet changed state since boot
+ */
+uint32_t outlet_state_switch_count(int index) {
+  return atomic_load(&switch_count[index]);
+}
+
+void outlet_state_set_reported(uint32_t reported) {
+  atomic_store(&outlet_reported, reported);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "outlet_config.h"
+
+/* Current state and local-change flags share one 32 bit word */
+#if OUTLET_COUNT > 16
+#error "outlet_state packs at most 16 outlets per word"
+#endif
+
+#define OUTLET_BIT(index) (1u << (index))
+
+/**
+ * @brief Coherent view of every outlet, bit n describes outlet n + 1.
+ * state and local always come from the same instant; reported is owned by
+ * the shadow and only changes when an update is published.
+ */
+typedef struct {
+  uint32_t state;
+  uint32_t local;
+  uint32_t reported;
+} outlet_snapshot_t;
+
+bool outlet_state_set(int index, bool on, bool local);
+uint32_t outlet_state_set_mask(uint32_t mask, uint32_t values, bool local);
+void outlet_state_restore(uint32_t state);
+bool outlet_state_get(int index);
+uint32_t outlet_state_current(void);
+void outlet_state_snapshot(outlet_snapshot_t *snapshot);
+uint32_t outlet_state_sync(uint32_t *seen, uint32_t *local_changed);
+void outlet_state_set_reported(uint32_t reported);
+uint32_t outlet_state_switch_count(int index);
@@ -0,0 +1,183 @@
+/**
+ ******************************************************************************
+ * @file      outlet_store.c
+ * @author    Dean Prince Agbodjan
+ * @brief     Persistent Outlet State Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+
+#include "outlet_journal.h"
+#include "outlet_state.h"
+#include "outlet_store.h"
+#include "output_driver.h"
+
+#define TAG "OUTLET_STORE"
+
+#define OUTLET_STORE_NVS_NAMESPACE "outlets"
+#define OUTLET_STORE_NVS_KEY "state"
+
+/* Wait before retrying a failed save, doubled per failure up to the max */
+#define OUTLET_STORE_RETRY_MIN_MS 1000
+#define OUTLET_STORE_RETRY_MAX_MS 60000
+
+static TaskHandle_t store_task;
+
+/* Value in flash, owned by the store task once it runs */
+static uint32_t stored_state;
+static bool stored_valid;
+
+/* Relay changes since the last commit, and commits since boot */
+static _Atomic uint32_t store_changes;
+static _Atomic uint32_t store_commits;
+
+/**
+ * @brief Reads the outlet state saved before the last reset. Needs NVS.
+ * @param [OUT] state: bit n is outlet n + 1
+ * @retval
+ *  - ESP_OK: state is valid
+ *  - ESP_ERR_NVS_NOT_FOUND: nothing was ever saved
+ *  - others: NVS errors
+ */
+esp_err_t outlet_store_load(uint32_t *state) {
+  nvs_handle_t nvs;
+
+  esp_err_t err = nvs_open(OUTLET_STORE_NVS_NAMESPACE, NVS_READONLY, &nvs);
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = nvs_get_u32(nvs, OUTLET_STORE_NVS_KEY, state);
+  nvs_close(nvs);
+
+  if (err == ESP_OK) {
+    stored_state = *state;
+    stored_valid = true;
+  }
+  return err;
+}
+
+/**
+ * @brief Writes the state if it changed and the offline journal if it did,
+ * in one commit.
+ */
+static esp_err_t outlet_store_save(uint32_t state, bool journal) {
+  nvs_handle_t nvs;
+
+  esp_err_t err = nvs_open(OUTLET_STORE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err != ESP_OK) {
+    return err;
+  }
+  if (!stored_valid || state != stored_state) {
+    err = nvs_set_u32(nvs, OUTLET_STORE_NVS_KEY, state);
+  }
+  if (err == ESP_OK && journal) {
+    err = outlet_journal_save(nvs);
+  }
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  return err;
+}
+
+/**
+ * @brief Waits for the first change of a burst, lets the burst settle for
+ * CONFIG_OUTLET_STORE_DELAY_MS and then saves whatever state it left, in
+ * one commit, with the offline journal. Bursts that end where they started
+ * are not written at all. A failed save is retried after a backoff, or
+ * sooner if the outlets change again.
+ */
+static void outlet_store_task(void *param) {
+  TickType_t retry_wait = portMAX_DELAY;
+  uint32_t retry_ms = OUTLET_STORE_RETRY_MIN_MS;
+
+  for (;;) {
+    if (ulTaskNotifyTake(pdTRUE, retry_wait) != 0) {
+      vTaskDelay(pdMS_TO_TICKS(CONFIG_OUTLET_STORE_DELAY_MS));
+      /* Changes made during the delay are in the state read below */
+      ulTaskNotifyTake(pdTRUE, 0);
+    }
+
+    uint32_t state = outlet_state_current();
+    uint32_t changes = atomic_exchange(&store_changes, 0);
+    bool journal = outlet_journal_dirty();
+    if (stored_valid && state == stored_state && !journal) {
+      ESP_LOGD(TAG, "%u changes undone, nothing to save", (unsigned)changes);
+      retry_wait = portMAX_DELAY;
+      retry_ms = OUTLET_STORE_RETRY_MIN_MS;
+      continue;
+    }
+
+    esp_err_t err = outlet_store_save(state, journal);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Saving the outlet state failed: %s, retrying in %u ms",
+               esp_err_to_name(err), (unsigned)retry_ms);
+      /* Counted in the commit that finally saves them */
+      atomic_fetch_add(&store_changes, changes);
+      retry_wait = pdMS_TO_TICKS(retry_ms);
+      retry_ms = retry_ms * 2 < OUTLET_STORE_RETRY_MAX_MS
+                     ? retry_ms * 2
+                     : OUTLET_STORE_RETRY_MAX_MS;
+      continue;
+    }
+    retry_wait = portMAX_DELAY;
+    retry_ms = OUTLET_STORE_RETRY_MIN_MS;
+    stored_state = state;
+    stored_valid = true;
+    atomic_fetch_add(&store_commits, 1);
+    ESP_LOGI(TAG, "Outlet state 0x%04x%s saved, %u changes in one commit",
+             (unsigned)state, journal ? " and journal" : "",
+             (unsigned)changes);
+  }
+}
+
+static void outlet_store_changed(uint32_t changed, uint32_t state) {
+  atomic_fetch_add(&store_changes, 1);
+  xTaskNotifyGive(store_task);
+}
+
+/**
+ * @brief Has the store task save the offline journal, which changes without
+ * a relay change once it is uploaded
+ */
+void outlet_store_flush(void) {
+  if (store_task != NULL) {
+    xTaskNotifyGive(store_task);
+  }
+}
+
+/**
+ * @brief Number of outlet state commits since boot
+ */
+uint32_t outlet_store_commit_count(void) {
+  return atomic_load(&store_commits);
+}
+
+/**
+ * @brief Saves every relay change from now on, so gpio_init() can restore
+ * the outlets after a reset. Call after gpio_init().
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+int outlet_store_start(void) {
+  if (xTaskCreate(&outlet_store_task, "outlet_store", 2048, NULL,
+                  tskIDLE_PRIORITY + 1, &store_task) != pdPASS) {
+    ESP_LOGE(TAG, "Couldnt create the outlet store task\n");
+    return ESP_FAIL;
+  }
+  if (app_driver_register_change_cb(outlet_store_changed) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the relay change listener\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+esp_err_t outlet_store_load(uint32_t *state);
+int outlet_store_start(void);
+void outlet_store_flush(void);
+uint32_t outlet_store_commit_count(void);
@@ -7,18 +7,65 @@
  ******************************************************************************
  */
 /* Header Files */
+#include <stdatomic.h>
+#include <stdio.h>
+
 #include "esp_system.h"
+#include "soc/gpio_reg.h"
+#include "soc/soc.h"
 #include <driver/gpio.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
+#include "boot.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "latency_probe.h"
+#include "lcd_display.h"
+#include "nvs.h"
+#include "outlet_config.h"
+#include "outlet_state.h"
+#include "outlet_store.h"
 #include "output_driver.h"
 
+#define TAG "OUTPUT_DRIVER"
+
+#define ALL_OUTLETS_MASK ((uint32_t)((1ULL << OUTLET_COUNT) - 1))
+
+#define OUTLET_GPIO_ENTRY(n, gpio) gpio,
+/* GPIO 1 and 3 carry the UART0 console, 6-11 run the SPI flash, 20, 24 and
+ * 28-31 dont exist on the ESP32, and the LCD bus has its own pins */
+#define OUTLET_GPIO_USABLE(gpio)                                               \
+  ((gpio) != 1 && (gpio) != 3 && ((gpio) < 6 || (gpio) > 11) &&               \
+   (gpio) != 20 && (gpio) != 24 && ((gpio) < 28 || (gpio) > 31) &&            \
+   (gpio) != I2C_MASTER_SDA_IO && (gpio) != I2C_MASTER_SCL_IO)
+#define OUTLET_GPIO_CHECK(n, gpio)                                             \
+  _Static_assert(OUTLET_GPIO_USABLE(gpio), #gpio " cant drive a relay");
+#define OUTLET_LCD_ENTRY(n, gpio)                                              \
+  {OUTLET_LCD_LABEL_COL(n), OUTLET_LCD_VALUE_COL(n), OUTLET_LCD_ROW(n)},
+
+/* Where an outlet is drawn on the LCD */
+typedef struct {
+  uint8_t label_col;
+  uint8_t value_col;
+  uint8_t row;
+} outlet_lcd_pos_t;
+
 /* Relay GPIOs */
-unsigned int relay[] = {23, 22, 21, 5};
+static const unsigned int relay[OUTLET_COUNT] = {OUTLET_TABLE(OUTLET_GPIO_ENTRY)};
+OUTLET_TABLE(OUTLET_GPIO_CHECK)
 
-static bool r_output_state[4];
+/* LCD cell of each outlet */
+static const outlet_lcd_pos_t outlet_lcd[OUTLET_COUNT] = {
+    OUTLET_TABLE(OUTLET_LCD_ENTRY)};
+
+/* Listeners notified on every relay change. Relays can switch while boot
+ * stages still register listeners: the count is published after the entry
+ * it covers, so a reader never calls a slot that isnt written yet. */
+static app_driver_change_cb_t change_cbs[APP_DRIVER_MAX_CHANGE_CBS];
+static atomic_int change_cb_count;
+/* Last wifi_status(), for lcd2004() to draw if Wi-Fi got there first */
+static volatile int wifi_connected;
 
 /* I2C variables */
 smbus_info_t *smbus_info;
@@ -42,7 +89,8 @@ static void i2c_master_init(void) {
 }
 
 /**
- * @brief Initializes I2C and SMBus and display info on lcd screen
+ * @brief Initializes I2C and SMBus, starts the display task and draws the
+ * status screen into its framebuffer
  */
 void lcd2004(void) {
 
@@ -68,26 +116,32 @@ void lcd2004(void) {
   /* lcd reset */
   ESP_ERROR_CHECK(i2c_lcd1602_reset(lcd_info));
 
+  /* From here on only the display task talks to the LCD */
+  ESP_ERROR_CHECK(lcd_display_start(lcd_info));
+
   /* Write Info on LCD */
-  i2c_lcd1602_move_cursor(lcd_info, 3, 0);
-  i2c_lcd1602_write_string(lcd_info, "LOAD STATUS");
-
-  i2c_lcd1602_move_cursor(lcd_info, 0, 1);
-  i2c_lcd1602_write_string(lcd_info, "LOAD 1: ");
-  i2c_lcd1602_move_cursor(lcd_info, 8, 1);
-  i2c_lcd1602_write_string(lcd_info, "0");
-  i2c_lcd1602_move_cursor(lcd_info, 0, 2);
-  i2c_lcd1602_write_string(lcd_info, "LOAD 2: ");
-  i2c_lcd1602_move_cursor(lcd_info, 8, 2);
-  i2c_lcd1602_write_string(lcd_info, "0");
-  i2c_lcd1602_move_cursor(lcd_info, 10, 1);
-  i2c_lcd1602_write_string(lcd_info, "LOAD 3: ");
-  i2c_lcd1602_move_cursor(lcd_info, 18, 1);
-  i2c_lcd1602_write_string(lcd_info, "0");
-  i2c_lcd1602_move_cursor(lcd_info, 10, 2);
-  i2c_lcd1602_write_string(lcd_info, "LOAD 4: ");
-  i2c_lcd1602_move_cursor(lcd_info, 18, 2);
-  i2c_lcd1602_write_string(lcd_info, "0");
+#if OUTLET_LCD_WIDE
+  lcd_display_write(3, 0, "LOAD STATUS");
+#endif
+
+  /* Outlets restored by gpio_init() show their state from the start */
+  uint32_t state = outlet_state_current();
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    char label[sizeof("LOAD 1: ")];
+#if OUTLET_LCD_WIDE
+    snprintf(label, sizeof(label), "LOAD %d: ", i + 1);
+#else
+    snprintf(label, sizeof(label), "%c:", OUTLET_LCD_LABEL_CHAR(i + 1));
+#endif
+    lcd_display_write(outlet_lcd[i].label_col, outlet_lcd[i].row, label);
+    lcd_display_write(outlet_lcd[i].value_col, outlet_lcd[i].row,
+                      (state & OUTLET_BIT(i)) ? "1" : "0");
+  }
+
+  /* Wi-Fi starts alongside the LCD and may have connected already */
+  if (wifi_connected) {
+    lcd_display_write(19, 0, "C");
+  }
 }
 
 /**
@@ -98,136 +152,207 @@ void lcd2004(void) {
  */
 void wifi_status(int status) {
 
+  wifi_connected = status;
+
   if (status == 1) {
-    i2c_lcd1602_move_cursor(lcd_info, 19, 0);
-    i2c_lcd1602_write_string(lcd_info, "C");
+    lcd_display_write(19, 0, "C");
   }
 
   else if (status == 0) {
-    i2c_lcd1602_move_cursor(lcd_info, 19, 0);
-    i2c_lcd1602_write_string(lcd_info, " ");
+    lcd_display_write(19, 0, " ");
+  }
+}
+
+/**
+ *@brief Drives the relays in mask to the levels in levels with one write to
+ * the set and one to the clear register, so they all switch at the same
+ * instant. Relays on GPIO 32 and 33 sit in the second bank and are written
+ * right after.
+ *@param [IN] outlets to drive, bit n is outlet n + 1
+ *@param [IN] levels of those outlets
+ */
+static void change_output_states(uint32_t mask, uint32_t levels) {
+  uint32_t set[2] = {0, 0};
+  uint32_t clear[2] = {0, 0};
+
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    if (!(mask & OUTLET_BIT(i))) {
+      continue;
+    }
+    uint32_t *bank = (levels & OUTLET_BIT(i)) ? set : clear;
+    bank[relay[i] / 32] |= 1u << (relay[i] % 32);
+  }
+
+  if (set[0] != 0) {
+    REG_WRITE(GPIO_OUT_W1TS_REG, set[0]);
+  }
+  if (clear[0] != 0) {
+    REG_WRITE(GPIO_OUT_W1TC_REG, clear[0]);
+  }
+  if (set[1] != 0) {
+    REG_WRITE(GPIO_OUT1_W1TS_REG, set[1]);
+  }
+  if (clear[1] != 0) {
+    REG_WRITE(GPIO_OUT1_W1TC_REG, clear[1]);
   }
 }
 
 /**
- *@brief This functions handle change in relay state.
- *@param [IN] pointer to an unsigned int
- *@param [IN] pointer to a bool
+ *@brief Drives relays to the state held in the shared outlet word. Two
+ * tasks switching the same outlet may write the pins out of order, so the
+ * levels are re-checked and rewritten until they match the latest state.
+ *@retval Levels applied to the outlets in mask
  */
-static void change_output_state(unsigned int *relay_pin, bool *set) {
-  gpio_set_level(*relay_pin, (*set));
+static uint32_t sync_output_states(uint32_t mask) {
+  uint32_t levels = outlet_state_current() & mask;
+  uint32_t applied;
+
+  do {
+    applied = levels;
+    change_output_states(mask, applied);
+    levels = outlet_state_current() & mask;
+  } while (levels != applied);
+
+  return applied;
 }
 
 /**
- *@brief Configures and set as output GPIOs connected to relays 
+ *@brief Configures and set as output GPIOs connected to relays, restoring
+ * the outlet state saved before the last reset. Needs NVS.
  */
 void gpio_init() {
+  uint64_t pin_bit_mask = 0;
+  uint32_t saved;
+
+  esp_err_t err = outlet_store_load(&saved);
+  if (err == ESP_OK) {
+    outlet_state_restore(saved & ALL_OUTLETS_MASK);
+  } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+    ESP_LOGW(TAG, "Outlet state not restored: %s", esp_err_to_name(err));
+  }
+
+  /* Latch the levels before the pins turn into outputs, so a relay that was
+   * on doesnt drop out for a moment */
+  change_output_states(ALL_OUTLETS_MASK, outlet_state_current());
+
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    pin_bit_mask |= (uint64_t)1 << relay[i];
+  }
 
   gpio_config_t io_config_1 = {
       .mode = GPIO_MODE_OUTPUT,
       .pull_up_en = 0,
       .pull_down_en = 1,
-      .pin_bit_mask = (((uint64_t)1 << relay[0]) | ((uint64_t)1 << relay[1]) |
-                       ((uint64_t)1 << relay[2]) | ((uint64_t)1 << relay[3])),
+      .pin_bit_mask = pin_bit_mask,
   };
 
   gpio_config(&io_config_1);
+
+  /* Time to correct outputs, on the boot timeline */
+  boot_mark("outputs");
+  ESP_LOGI(TAG, "Outlets 0x%04x driven at %lld us",
+           (unsigned)outlet_state_current(), (long long)esp_timer_get_time());
 }
 
-/** 
- * @brief Update Relay status on LCD scren and changes output state. 
- * @param [IN] state in bool
- * @param [IN] GPIO number
- * @retval Returns ESP_OK if successful
+/**
+ * @brief Switches several outlets in one pass: one state change, one GPIO
+ * write, one LCD refresh and one change notification, however many outlets
+ * are in mask.
+ * @param [IN] outlets to switch, bit n is outlet n + 1
+ * @param [IN] new state of the outlets in mask
+ * @param [IN] true for local sources, false when applying a shadow delta
+ * @retval Returns ESP_OK if successful, ESP_ERR_INVALID_ARG for an unknown outlet
  */
-int app_driver_set_state(bool state, unsigned short relay_no) {
-  switch (relay_no) {
-  case 1:
-    if (r_output_state[0] != state) {
-      r_output_state[0] = state;
-      int display = state;
-      /* Change relay state */
-      change_output_state(&relay[0], &r_output_state[0]);
-
-      if (display == 0) {
-        /* Update data on the lcd screen */
-        i2c_lcd1602_move_cursor(lcd_info, 8, 1);
-        i2c_lcd1602_write_string(lcd_info, "0");
-      }
-
-      else if (display == 1) {
-        i2c_lcd1602_move_cursor(lcd_info, 8, 1);
-        i2c_lcd1602_write_string(lcd_info, "1");
-      }
-    }
+int app_driver_apply_mask(uint32_t mask, uint32_t values, bool local) {
+  if (mask & ~ALL_OUTLETS_MASK) {
+    return ESP_ERR_INVALID_ARG;
+  }
 
-    break;
+  uint32_t changed = outlet_state_set_mask(mask, values, local);
+  if (changed == 0) {
+    return ESP_OK;
+  }
 
-  case 2:
+  /* Only shadow deltas are traced, and those arrive on the cloud task */
+  if (!local) {
+    latency_probe_mark_mask(changed, LATENCY_STAGE_DISPATCH);
+  }
 
-    if (r_output_state[1] != state) {
-      r_output_state[1] = state;
-      int display = state;
-      change_output_state(&relay[1], &r_output_state[1]);
-      if (display == 0) {
-        i2c_lcd1602_move_cursor(lcd_info, 8, 2);
-        i2c_lcd1602_write_string(lcd_info, "0");
-      }
+  /* Change relay states */
+  uint32_t levels = sync_output_states(changed);
+  if (!local) {
+    latency_probe_mark_mask(changed, LATENCY_STAGE_GPIO);
+  }
 
-      else if (display == 1) {
-        i2c_lcd1602_move_cursor(lcd_info, 8, 2);
-        i2c_lcd1602_write_string(lcd_info, "1");
-      }
-    }
-    break;
-
-  case 3:
-
-    if (r_output_state[2] != state) {
-      r_output_state[2] = state;
-      int display = state;
-      change_output_state(&relay[2], &r_output_state[2]);
-      if (display == 0) {
-        i2c_lcd1602_move_cursor(lcd_info, 18, 1);
-        i2c_lcd1602_write_string(lcd_info, "0");
-      }
-
-      else if (display == 1) {
-        i2c_lcd1602_move_cursor(lcd_info, 18, 1);
-        i2c_lcd1602_write_string(lcd_info, "1");
-      }
+  /* Update data on the lcd screen, drawn by the display task in one frame */
+  for (int i = 0; i < OUTLET_COUNT; i++) {
+    if (changed & OUTLET_BIT(i)) {
+      lcd_display_put(outlet_lcd[i].value_col, outlet_lcd[i].row,
+                      (levels & OUTLET_BIT(i)) ? "1" : "0");
     }
-    break;
-
-  case 4:
-
-    if (r_output_state[3] != state) {
-      r_output_state[3] = state;
-      int display = state;
-      change_output_state(&relay[3], &r_output_state[3]);
-      if (display == 0) {
-        i2c_lcd1602_move_cursor(lcd_info, 18, 2);
-        i2c_lcd1602_write_string(lcd_info, "0");
-      }
-
-      else if (display == 1) {
-        i2c_lcd1602_move_cursor(lcd_info, 18, 2);
-        i2c_lcd1602_write_string(lcd_info, "1");
-      }
-    }
-    break;
-  default:
-    break;
+  }
+  lcd_display_refresh();
+  if (!local) {
+    latency_probe_mark_mask(changed, LATENCY_STAGE_LCD);
+  }
+
+  int cb_count = atomic_load_explicit(&change_cb_count, memory_order_acquire);
+  for (int i = 0; i < cb_count; i++) {
+    change_cbs[i](changed, levels);
   }
 
   return ESP_OK;
 }
 
+/** 
+ * @brief Update Relay status on LCD scren and changes output state. 
+ * @param [IN] state in bool
+ * @param [IN] outlet number, 1 to OUTLET_COUNT
+ * @param [IN] true for local sources, false when applying a shadow delta
+ * @retval Returns ESP_OK if successful, ESP_ERR_INVALID_ARG for an unknown outlet
+ */
+int app_driver_apply_state(bool state, unsigned short relay_no, bool local) {
+  if (relay_no < 1 || relay_no > OUTLET_COUNT) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  uint32_t bit = OUTLET_BIT(relay_no - 1);
+  return app_driver_apply_mask(bit, state ? bit : 0, local);
+}
+
+/** 
+ * @brief Changes an outlet from a local source (anything but the shadow).
+ * @param [IN] state in bool
+ * @param [IN] outlet number, 1 to OUTLET_COUNT
+ * @retval Returns ESP_OK if successful, ESP_ERR_INVALID_ARG for an unknown outlet
+ */
+int app_driver_set_state(bool state, unsigned short relay_no) {
+  return app_driver_apply_state(state, relay_no, true);
+}
+
 /**
  * @brief Get the current state of the GPIO/relay.
  * @param [IN] Relay(GPIO) number
  */
 bool app_driver_get_state(unsigned short relay_pin) {
-  relay_pin -= 1;
-  return r_output_state[relay_pin];
+  if (relay_pin < 1 || relay_pin > OUTLET_COUNT) {
+    return false;
+  }
+  return outlet_state_get(relay_pin - 1);
+}
+
+/**
+ * @brief Adds a listener told about every relay change. Listeners are never
+ * removed. Call from the boot stages only, one at a time.
+ * @param [IN] callback
+ * @retval Returns ESP_OK if successful, ESP_ERR_NO_MEM when the table is full
+ */
+int app_driver_register_change_cb(app_driver_change_cb_t cb) {
+  int count = atomic_load_explicit(&change_cb_count, memory_order_relaxed);
+  if (count == APP_DRIVER_MAX_CHANGE_CBS) {
+    return ESP_ERR_NO_MEM;
+  }
+  change_cbs[count] = cb;
+  atomic_store_explicit(&change_cb_count, count + 1, memory_order_release);
+  return ESP_OK;
 }
@@ -5,8 +5,10 @@
 #include "rom/uart.h"
 #include "smbus.h"
 #include "i2c-lcd1602.h"
+#include "sdkconfig.h"
 
-// LCD2004
+// LCD2004. The controller has two 40 character lines; rows 2 and 3 are
+// the second halves of lines 0 and 1, so nothing lies off screen.
 #define LCD_NUM_ROWS                    4
 #define LCD_NUM_COLUMNS                 40
 #define LCD_NUM_VISIBLE_COLUMNS         20
@@ -14,13 +16,26 @@
 #define I2C_MASTER_NUM I2C_NUM_0
 #define I2C_MASTER_TX_BUF_LEN           0 // disabled
 #define I2C_MASTER_RX_BUF_LEN           0 // disabled
+#if CONFIG_LCD_I2C_FAST_MODE
+#define I2C_MASTER_FREQ_HZ              400000
+#else
 #define I2C_MASTER_FREQ_HZ              100000
+#endif
 #define I2C_MASTER_SDA_IO               18
 #define I2C_MASTER_SCL_IO               19
 #define CONFIG_LCD1602_I2C_ADDRESS      0x27
 
+/* Called after relays actually change state, once per batch: bit n of
+ * changed and state is outlet n + 1 */
+typedef void (*app_driver_change_cb_t)(uint32_t changed, uint32_t state);
+
+#define APP_DRIVER_MAX_CHANGE_CBS 6
+
 void gpio_init(void);
 int app_driver_set_state(bool state, unsigned short relay_no);
+int app_driver_apply_state(bool state, unsigned short relay_no, bool local);
+int app_driver_apply_mask(uint32_t mask, uint32_t values, bool local);
 bool app_driver_get_state(unsigned short relay_pin);
+int app_driver_register_change_cb(app_driver_change_cb_t cb);
 void wifi_status(int status);
 void lcd2004(void);
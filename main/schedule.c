@@ -0,0 +1,1106 @@
+/**
+ ******************************************************************************
+ * @file      schedule.c
+ * @author    Dean Prince Agbodjan
+ * @brief     On-device Outlet Schedules Implementation
+ *
+ ******************************************************************************
+ */
+/* Header Files */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "esp_idf_version.h"
+#include "esp_log.h"
+#include "esp_sntp.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+
+#include "aws_iot_config.h"
+#include "aws_iot_shadow_interface.h"
+
+#include "cloud_connection.h"
+#include "json_lookup.h"
+#include "outlet_config.h"
+#include "outlet_state.h"
+#include "output_driver.h"
+#include "schedule.h"
+
+#define TAG "SCHEDULE"
+
+/* Shadow key holding the schedules, one member per entry */
+#define SCHEDULE_SHADOW_KEY "schedules"
+
+/* One wheel tick per second. The slot count is prime, so deadlines falling
+ * on whole minutes spread over every slot instead of a quarter of them. */
+#define SCHEDULE_TICK_US 1000000
+#define SCHEDULE_WHEEL_SLOTS 251
+#define SCHEDULE_NIL UINT16_MAX
+
+/* Longest countdown, 30 days */
+#define SCHEDULE_COUNTDOWN_MAX_S (30 * 24 * 3600)
+
+/* Each step of the cron search moves to the next candidate month, day,
+ * hour or minute; rules that match nothing for years run out of steps */
+#define SCHEDULE_CRON_MAX_STEPS 4096
+
+/* The wall clock is taken as set once it is past 2020-01-01 */
+#define SCHEDULE_CLOCK_VALID 1577836800
+
+/* Entries are persisted in fixed pages of records, so adding or removing
+ * one entry rewrites one small blob */
+#define SCHEDULE_NVS_NAMESPACE "schedule"
+#define SCHEDULE_PAGE_ENTRIES 8
+#define SCHEDULE_PAGE_COUNT                                                    \
+  ((CONFIG_SCHEDULE_MAX_ENTRIES + SCHEDULE_PAGE_ENTRIES - 1) /                 \
+   SCHEDULE_PAGE_ENTRIES)
+
+/* Room left in the report for the closing braces and the client token */
+#define SCHEDULE_REPORT_TAIL_LEN 48
+
+/* A delta holding every entry: the object, and a key and value each */
+#define SCHEDULE_DELTA_TOKENS (1 + 2 * CONFIG_SCHEDULE_MAX_ENTRIES)
+
+/* Delta members turned down, kept until the cloud has been told */
+#define SCHEDULE_MAX_REJECTS 8
+/* Few enough that a reject report always fits one document */
+#define SCHEDULE_REJECTS_PER_REPORT 4
+#define SCHEDULE_ERRORS_KEY "schedule_errors"
+
+/**
+ * @brief thing name or device id
+ */
+extern const uint8_t deviceid_txt_start[] asm("_binary_deviceid_txt_start");
+extern const uint8_t deviceid_txt_end[] asm("_binary_deviceid_txt_end");
+
+/* Persisted form: id and rule exactly as the shadow holds them */
+typedef struct {
+  char id[SCHEDULE_ID_MAX_LEN + 1];
+  char spec[SCHEDULE_SPEC_MAX_LEN + 1];
+} schedule_record_t;
+
+typedef enum {
+  SCHEDULE_CRON,
+  SCHEDULE_COUNTDOWN,
+} schedule_kind_t;
+
+/* Cron fields as bitmaps, bit n set when value n matches */
+typedef struct {
+  uint64_t minutes;
+  uint32_t hours;
+  uint32_t days;
+  uint16_t months;
+  uint8_t weekdays;
+  bool any_day;
+  bool any_weekday;
+} schedule_cron_t;
+
+typedef struct {
+  uint8_t outlet;
+  bool state;
+  schedule_kind_t kind;
+  union {
+    schedule_cron_t cron;
+    uint32_t after_s;
+  };
+} schedule_rule_t;
+
+/**
+ * @brief An entry slot. A removed entry keeps its slot with an empty spec
+ * until the removal has been reported to the shadow.
+ */
+typedef struct {
+  schedule_record_t record;
+  schedule_rule_t rule;
+  bool used;
+  bool report;
+  bool inflight;
+
+  /* Wheel links, valid while armed */
+  bool armed;
+  uint16_t next;
+  uint16_t prev;
+  uint32_t expires;
+  /* Wall clock time a cron entry is armed for */
+  time_t at;
+} schedule_entry_t;
+
+static schedule_entry_t entries[CONFIG_SCHEDULE_MAX_ENTRIES];
+
+/**
+ * @brief Hashed timer wheel. An entry due at tick t sits in slot
+ * t % SCHEDULE_WHEEL_SLOTS however far away t is, so arming and
+ * disarming are O(1) and a tick only looks at one slot, holding on average
+ * the armed entries over the slot count.
+ */
+static uint16_t wheel[SCHEDULE_WHEEL_SLOTS];
+static uint32_t wheel_now;
+static int64_t wheel_turned_us;
+static uint32_t armed_count;
+static esp_timer_handle_t wheel_timer;
+
+static SemaphoreHandle_t schedule_lock;
+static uint32_t dirty_pages[(SCHEDULE_PAGE_COUNT + 31) / 32];
+
+/* Shadow side: the delta handler and the report of applied entries */
+static jsonStruct_t schedule_handler;
+static bool report_pending;
+static bool report_in_progress;
+static char report_document[AWS_IOT_MQTT_TX_BUF_LEN];
+static jsmntok_t delta_tokens[SCHEDULE_DELTA_TOKENS];
+
+/**
+ * @brief A delta member that was turned down. Its desired value is cleared,
+ * so the cloud stops redelivering it, and the reason is reported under
+ * "schedule_errors". reason is NULL once the id has been accepted since,
+ * which clears the reported error.
+ */
+typedef struct {
+  char id[SCHEDULE_ID_MAX_LEN + 1];
+  const char *reason;
+  bool report;
+  bool inflight;
+} schedule_reject_t;
+
+static schedule_reject_t rejects[SCHEDULE_MAX_REJECTS];
+static bool reject_pending;
+
+/**
+ * @brief Parses one cron field into a bitmap: '*', n or a-b, each with an
+ * optional /step, and comma separated lists of those.
+ */
+static bool schedule_parse_field(const char *field, int min, int max,
+                                 uint64_t *bits) {
+  const char *p = field;
+  char *end;
+
+  *bits = 0;
+  for (;;) {
+    long lo;
+    long hi;
+    long step = 1;
+
+    if (*p == '*') {
+      lo = min;
+      hi = max;
+      p++;
+    } else {
+      if (!isdigit((unsigned char)*p)) {
+        return false;
+      }
+      lo = hi = strtol(p, &end, 10);
+      p = end;
+      if (*p == '-') {
+        if (!isdigit((unsigned char)p[1])) {
+          return false;
+        }
+        hi = strtol(p + 1, &end, 10);
+        p = end;
+      }
+    }
+    if (*p == '/') {
+      if (!isdigit((unsigned char)p[1])) {
+        return false;
+      }
+      step = strtol(p + 1, &end, 10);
+      p = end;
+      /* "5/15" counts from 5 to the end of the range */
+      if (lo == hi) {
+        hi = max;
+      }
+    }
+    if (lo < min || hi > max || lo > hi || step < 1) {
+      return false;
+    }
+    for (long v = lo; v <= hi; v += step) {
+      *bits |= 1ULL << v;
+    }
+
+    if (*p == '\0') {
+      return true;
+    }
+    if (*p++ != ',') {
+      return false;
+    }
+  }
+}
+
+/**
+ * @brief Parses a rule, "<outlet> <on|off> <when>" where when is either
+ * "+<seconds>", a countdown, or five cron fields "min hour day month weekday":
+ *  - "2 off +900": outlet 2 turns off 15 minutes after it was turned on
+ *  - "1 on 30 6 * * 1-5": outlet 1 turns on at 06:30 on weekdays
+ */
+static esp_err_t schedule_parse(const char *spec, schedule_rule_t *rule) {
+  char buf[SCHEDULE_SPEC_MAX_LEN + 1];
+  char *fields[7];
+  int count = 0;
+  char *save;
+  char *end;
+
+  if (strlen(spec) >= sizeof(buf)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  strcpy(buf, spec);
+  for (char *field = strtok_r(buf, " ", &save); field != NULL;
+       field = strtok_r(NULL, " ", &save)) {
+    if (count == 7) {
+      return ESP_ERR_INVALID_ARG;
+    }
+    fields[count++] = field;
+  }
+  if (count != 3 && count != 7) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  long outlet = strtol(fields[0], &end, 10);
+  if (*end != '\0' || outlet < 1 || outlet > OUTLET_COUNT) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  rule->outlet = (uint8_t)(outlet - 1);
+
+  if (strcmp(fields[1], "on") == 0) {
+    rule->state = true;
+  } else if (strcmp(fields[1], "off") == 0) {
+    rule->state = false;
+  } else {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if (count == 3) {
+    if (fields[2][0] != '+' || !isdigit((unsigned char)fields[2][1])) {
+      return ESP_ERR_INVALID_ARG;
+    }
+    unsigned long after = strtoul(fields[2] + 1, &end, 10);
+    if (*end != '\0' || after < 1 || after > SCHEDULE_COUNTDOWN_MAX_S) {
+      return ESP_ERR_INVALID_ARG;
+    }
+    rule->kind = SCHEDULE_COUNTDOWN;
+    rule->after_s = (uint32_t)after;
+    return ESP_OK;
+  }
+
+  schedule_cron_t *cron = &rule->cron;
+  uint64_t hours;
+  uint64_t days;
+  uint64_t months;
+  uint64_t weekdays;
+  if (!schedule_parse_field(fields[2], 0, 59, &cron->minutes) ||
+      !schedule_parse_field(fields[3], 0, 23, &hours) ||
+      !schedule_parse_field(fields[4], 1, 31, &days) ||
+      !schedule_parse_field(fields[5], 1, 12, &months) ||
+      !schedule_parse_field(fields[6], 0, 7, &weekdays)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  cron->hours = (uint32_t)hours;
+  cron->days = (uint32_t)days;
+  cron->months = (uint16_t)months;
+  /* Sunday is both 0 and 7 */
+  cron->weekdays = (uint8_t)((weekdays | weekdays >> 7) & 0x7F);
+  cron->any_day = fields[4][0] == '*';
+  cron->any_weekday = fields[6][0] == '*';
+  rule->kind = SCHEDULE_CRON;
+  return ESP_OK;
+}
+
+static int schedule_next_bit(uint64_t bits, int from) {
+  bits >>= from;
+  return bits == 0 ? -1 : from + __builtin_ctzll(bits);
+}
+
+/**
+ * @brief As in cron, when both day fields are restricted either may match.
+ */
+static bool schedule_day_matches(const schedule_cron_t *cron,
+                                 const struct tm *tm) {
+  bool day = cron->days >> tm->tm_mday & 1;
+  bool weekday = cron->weekdays >> tm->tm_wday & 1;
+
+  if (cron->any_day || cron->any_weekday) {
+    return day && weekday;
+  }
+  return day || weekday;
+}
+
+/**
+ * @brief First whole minute strictly after `after` matching a cron rule, in
+ * local time.
+ * @retval false if the rule does not match within the search horizon
+ */
+static bool schedule_cron_next(const schedule_cron_t *cron, time_t after,
+                               time_t *next) {
+  struct tm tm;
+
+  localtime_r(&after, &tm);
+  tm.tm_sec = 0;
+  tm.tm_min++;
+
+  for (int step = 0; step < SCHEDULE_CRON_MAX_STEPS; step++) {
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+
+    if (!(cron->months >> (tm.tm_mon + 1) & 1)) {
+      tm.tm_mon++;
+      tm.tm_mday = 1;
+      tm.tm_hour = 0;
+      tm.tm_min = 0;
+      continue;
+    }
+    int hour = schedule_next_bit(cron->hours, tm.tm_hour);
+    if (!schedule_day_matches(cron, &tm) || hour < 0) {
+      tm.tm_mday++;
+      tm.tm_hour = 0;
+      tm.tm_min = 0;
+      continue;
+    }
+    if (hour != tm.tm_hour) {
+      tm.tm_hour = hour;
+      tm.tm_min = 0;
+      continue;
+    }
+    int minute = schedule_next_bit(cron->minutes, tm.tm_min);
+    if (minute < 0) {
+      tm.tm_hour++;
+      tm.tm_min = 0;
+      continue;
+    }
+    if (minute != tm.tm_min) {
+      tm.tm_min = minute;
+      continue;
+    }
+    /* The repeated hour when clocks go back can map to a past time */
+    if (t <= after) {
+      tm.tm_min++;
+      continue;
+    }
+    *next = t;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Arms an entry for the first tick at least delay_us from now. Ticks
+ * are counted from the last one, so entries due at the same instant share a
+ * tick whenever they were armed.
+ */
+static void schedule_wheel_insert(uint16_t index, int64_t delay_us) {
+  schedule_entry_t *entry = &entries[index];
+  int64_t now = esp_timer_get_time();
+
+  if (armed_count == 0) {
+    wheel_turned_us = now;
+  }
+  int64_t ticks =
+      (now - wheel_turned_us + delay_us + SCHEDULE_TICK_US - 1) /
+      SCHEDULE_TICK_US;
+  entry->expires = wheel_now + (uint32_t)(ticks < 1 ? 1 : ticks);
+  uint16_t *head = &wheel[entry->expires % SCHEDULE_WHEEL_SLOTS];
+  entry->prev = SCHEDULE_NIL;
+  entry->next = *head;
+  if (*head != SCHEDULE_NIL) {
+    entries[*head].prev = index;
+  }
+  *head = index;
+  entry->armed = true;
+
+  /* The wheel only turns while something is armed */
+  if (armed_count++ == 0) {
+    esp_timer_start_periodic(wheel_timer, SCHEDULE_TICK_US);
+  }
+}
+
+static void schedule_wheel_remove(uint16_t index) {
+  schedule_entry_t *entry = &entries[index];
+
+  if (!entry->armed) {
+    return;
+  }
+  if (entry->prev != SCHEDULE_NIL) {
+    entries[entry->prev].next = entry->next;
+  } else {
+    wheel[entry->expires % SCHEDULE_WHEEL_SLOTS] = entry->next;
+  }
+  if (entry->next != SCHEDULE_NIL) {
+    entries[entry->next].prev = entry->prev;
+  }
+  entry->armed = false;
+
+  if (--armed_count == 0) {
+    esp_timer_stop(wheel_timer);
+  }
+}
+
+/**
+ * @brief Arms a cron entry for its next occurrence after `after`. Nothing
+ * is armed until the wall clock has been set.
+ */
+static void schedule_arm_cron(uint16_t index, time_t after) {
+  schedule_entry_t *entry = &entries[index];
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  if (now.tv_sec < SCHEDULE_CLOCK_VALID ||
+      !schedule_cron_next(&entry->rule.cron, after, &entry->at)) {
+    return;
+  }
+  schedule_wheel_insert(index, ((int64_t)entry->at - now.tv_sec) * 1000000 -
+                                   now.tv_usec);
+}
+
+/**
+ * @brief (Re)arms an entry from scratch. A countdown runs while its outlet
+ * is in the other state than the one the entry switches it to.
+ */
+static void schedule_arm(uint16_t index) {
+  schedule_entry_t *entry = &entries[index];
+
+  schedule_wheel_remove(index);
+  if (entry->record.spec[0] == '\0') {
+    return;
+  }
+  if (entry->rule.kind == SCHEDULE_CRON) {
+    schedule_arm_cron(index, time(NULL));
+  } else if (outlet_state_get(entry->rule.outlet) != entry->rule.state) {
+    schedule_wheel_insert(index, (int64_t)entry->rule.after_s * 1000000);
+  }
+}
+
+/**
+ * @brief Wheel tick, on the esp_timer task. Everything due is switched with
+ * a single app_driver_apply_mask(), after the lock is released since the
+ * change comes back through schedule_outlets_changed().
+ */
+static void schedule_tick(void *arg) {
+  uint32_t mask = 0;
+  uint32_t values = 0;
+
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  wheel_now++;
+  wheel_turned_us += SCHEDULE_TICK_US;
+  uint16_t index = wheel[wheel_now % SCHEDULE_WHEEL_SLOTS];
+  while (index != SCHEDULE_NIL) {
+    schedule_entry_t *entry = &entries[index];
+    uint16_t next = entry->next;
+
+    /* Entries due on a later turn of the wheel stay put */
+    if (entry->expires == wheel_now) {
+      uint32_t bit = OUTLET_BIT(entry->rule.outlet);
+      mask |= bit;
+      if (entry->rule.state) {
+        values |= bit;
+      } else {
+        values &= ~bit;
+      }
+      ESP_LOGI(TAG, "%s: outlet %d %s", entry->record.id,
+               entry->rule.outlet + 1, entry->rule.state ? "on" : "off");
+
+      schedule_wheel_remove(index);
+      if (entry->rule.kind == SCHEDULE_CRON) {
+        schedule_arm_cron(index, entry->at);
+      }
+    }
+    index = next;
+  }
+  xSemaphoreGive(schedule_lock);
+
+  if (mask != 0) {
+    app_driver_apply_mask(mask, values, true);
+  }
+}
+
+/**
+ * @brief Relay change hook. Turning an outlet to the other state starts or
+ * restarts its countdowns, turning it to the entry's state stops them.
+ */
+static void schedule_outlets_changed(uint32_t changed, uint32_t state) {
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  for (uint16_t i = 0; i < CONFIG_SCHEDULE_MAX_ENTRIES; i++) {
+    schedule_entry_t *entry = &entries[i];
+    if (entry->used && entry->record.spec[0] != '\0' &&
+        entry->rule.kind == SCHEDULE_COUNTDOWN &&
+        (changed & OUTLET_BIT(entry->rule.outlet))) {
+      schedule_arm(i);
+    }
+  }
+  xSemaphoreGive(schedule_lock);
+}
+
+/**
+ * @brief SNTP hook. Cron entries are armed on the first sync and re-armed on
+ * later ones, which may have moved the clock.
+ */
+static void schedule_time_synced(struct timeval *tv) {
+  ESP_LOGI(TAG, "Clock set");
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  for (uint16_t i = 0; i < CONFIG_SCHEDULE_MAX_ENTRIES; i++) {
+    if (entries[i].used && entries[i].rule.kind == SCHEDULE_CRON) {
+      schedule_arm(i);
+    }
+  }
+  xSemaphoreGive(schedule_lock);
+}
+
+static void schedule_mark_dirty(uint16_t index) {
+  uint16_t page = index / SCHEDULE_PAGE_ENTRIES;
+  dirty_pages[page / 32] |= 1u << (page % 32);
+}
+
+/**
+ * @brief Writes the pages changed since the last save, in one commit.
+ */
+static esp_err_t schedule_save(void) {
+  static schedule_record_t records[SCHEDULE_PAGE_ENTRIES];
+  nvs_handle_t nvs;
+  char key[8];
+
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  esp_err_t err = nvs_open(SCHEDULE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err != ESP_OK) {
+    xSemaphoreGive(schedule_lock);
+    return err;
+  }
+
+  for (uint16_t page = 0; page < SCHEDULE_PAGE_COUNT && err == ESP_OK;
+       page++) {
+    if (!(dirty_pages[page / 32] & 1u << (page % 32))) {
+      continue;
+    }
+
+    bool empty = true;
+    memset(records, 0, sizeof(records));
+    for (uint16_t i = 0; i < SCHEDULE_PAGE_ENTRIES; i++) {
+      uint16_t index = page * SCHEDULE_PAGE_ENTRIES + i;
+      if (index < CONFIG_SCHEDULE_MAX_ENTRIES && entries[index].used &&
+          entries[index].record.spec[0] != '\0') {
+        records[i] = entries[index].record;
+        empty = false;
+      }
+    }
+
+    snprintf(key, sizeof(key), "p%u", (unsigned)page);
+    if (empty) {
+      err = nvs_erase_key(nvs, key);
+      if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = ESP_OK;
+      }
+    } else {
+      err = nvs_set_blob(nvs, key, records, sizeof(records));
+    }
+    if (err == ESP_OK) {
+      dirty_pages[page / 32] &= ~(1u << (page % 32));
+    }
+  }
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  xSemaphoreGive(schedule_lock);
+
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Saving schedules failed: %s", esp_err_to_name(err));
+  }
+  return err;
+}
+
+/**
+ * @brief Reads the persisted entries back. A missing namespace just means
+ * nothing was ever scheduled.
+ */
+static void schedule_load(void) {
+  static schedule_record_t records[SCHEDULE_PAGE_ENTRIES];
+  nvs_handle_t nvs;
+  char key[8];
+  int loaded = 0;
+
+  if (nvs_open(SCHEDULE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+    return;
+  }
+  for (uint16_t page = 0; page < SCHEDULE_PAGE_COUNT; page++) {
+    size_t len = sizeof(records);
+    snprintf(key, sizeof(key), "p%u", (unsigned)page);
+    if (nvs_get_blob(nvs, key, records, &len) != ESP_OK ||
+        len != sizeof(records)) {
+      continue;
+    }
+
+    for (uint16_t i = 0; i < SCHEDULE_PAGE_ENTRIES; i++) {
+      uint16_t index = page * SCHEDULE_PAGE_ENTRIES + i;
+      schedule_record_t *record = &records[i];
+      if (index >= CONFIG_SCHEDULE_MAX_ENTRIES || record->id[0] == '\0') {
+        continue;
+      }
+      record->id[SCHEDULE_ID_MAX_LEN] = '\0';
+      record->spec[SCHEDULE_SPEC_MAX_LEN] = '\0';
+      if (schedule_parse(record->spec, &entries[index].rule) != ESP_OK) {
+        ESP_LOGW(TAG, "Dropping stored schedule %s", record->id);
+        schedule_mark_dirty(index);
+        continue;
+      }
+      entries[index].record = *record;
+      entries[index].used = true;
+      loaded++;
+    }
+  }
+  nvs_close(nvs);
+  ESP_LOGI(TAG, "%d schedules loaded", loaded);
+}
+
+static bool schedule_valid_id(const char *id) {
+  size_t len = strlen(id);
+
+  if (len == 0 || len > SCHEDULE_ID_MAX_LEN) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (!isalnum((unsigned char)id[i]) && id[i] != '_' && id[i] != '-') {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Adds, replaces or, for an empty spec, removes an entry in RAM and
+ * queues it for the shadow report; schedule_save() persists it.
+ */
+static esp_err_t schedule_store(const char *id, const char *spec) {
+  schedule_rule_t rule = {0};
+  time_t next;
+
+  if (!schedule_valid_id(id)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (spec[0] != '\0') {
+    esp_err_t err = schedule_parse(spec, &rule);
+    if (err != ESP_OK) {
+      return err;
+    }
+    /* Reject rules that would never fire, such as the 30th of February */
+    if (rule.kind == SCHEDULE_CRON &&
+        !schedule_cron_next(&rule.cron, time(NULL), &next)) {
+      return ESP_ERR_INVALID_ARG;
+    }
+  }
+
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  int index = -1;
+  int free_index = -1;
+  for (int i = 0; i < CONFIG_SCHEDULE_MAX_ENTRIES; i++) {
+    if (entries[i].used && strcmp(entries[i].record.id, id) == 0) {
+      index = i;
+      break;
+    }
+    if (!entries[i].used && free_index < 0) {
+      free_index = i;
+    }
+  }
+
+  /* A removal of an unknown id still takes a slot until it is reported */
+  if (index < 0) {
+    if (free_index < 0) {
+      xSemaphoreGive(schedule_lock);
+      return ESP_ERR_NO_MEM;
+    }
+    index = free_index;
+    memset(&entries[index].record, 0, sizeof(entries[index].record));
+    strcpy(entries[index].record.id, id);
+    entries[index].used = true;
+  }
+
+  schedule_entry_t *entry = &entries[index];
+  entry->report = true;
+  report_pending = true;
+
+  /* The cloud redelivers a delta until it is reported: leave running
+   * countdowns alone when nothing changed */
+  if (strcmp(entry->record.spec, spec) != 0) {
+    strcpy(entry->record.spec, spec);
+    entry->rule = rule;
+    schedule_mark_dirty(index);
+    schedule_arm(index);
+    ESP_LOGI(TAG, "%s: %s", id, spec[0] != '\0' ? spec : "removed");
+  }
+  xSemaphoreGive(schedule_lock);
+  return ESP_OK;
+}
+
+/**
+ * @brief Adds or replaces a schedule, or removes it when spec is empty, and
+ * persists the change at once.
+ * @param [IN] id: up to SCHEDULE_ID_MAX_LEN letters, digits, '_' or '-'
+ * @param [IN] spec: rule, see schedule_parse(), or "" to remove
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_ERR_INVALID_ARG / ESP_ERR_INVALID_SIZE: malformed id or rule
+ *  - ESP_ERR_NO_MEM: CONFIG_SCHEDULE_MAX_ENTRIES reached
+ */
+esp_err_t schedule_set(const char *id, const char *spec) {
+  esp_err_t err = schedule_store(id, spec);
+  if (err != ESP_OK) {
+    return err;
+  }
+  cloud_connection_notify(CLOUD_EVENT_LOCAL_CHANGE);
+  return schedule_save();
+}
+
+/**
+ * @brief Queues the outcome of a delta member for the reject report: the
+ * reason it was turned down, or ESP_OK to clear an error reported earlier.
+ */
+static void schedule_note_reject(const char *id, esp_err_t err) {
+  schedule_reject_t *slot = NULL;
+
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  for (int i = 0; i < SCHEDULE_MAX_REJECTS; i++) {
+    if (strcmp(rejects[i].id, id) == 0) {
+      slot = &rejects[i];
+      break;
+    }
+    /* One already reported can make room */
+    if (slot == NULL && !rejects[i].report && !rejects[i].inflight) {
+      slot = &rejects[i];
+    }
+  }
+  if (slot != NULL && (err != ESP_OK || strcmp(slot->id, id) == 0)) {
+    strcpy(slot->id, id);
+    slot->reason = err != ESP_OK ? esp_err_to_name(err) : NULL;
+    slot->report = true;
+    reject_pending = true;
+  } else if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Too many rejected schedules, %s not reported", id);
+  }
+  xSemaphoreGive(schedule_lock);
+}
+
+/**
+ * @brief Delta callback for the "schedules" object, e.g.
+ * {"night":"1 off 0 23 * * *","auto2":"2 off +900","old":""}. Every member
+ * is applied on its own; the valid ones are reported back, the others are
+ * cleared from desired with the reason under "schedule_errors".
+ */
+static void schedule_delta_callback(const char *pJsonString,
+                                    uint32_t JsonStringDataLen,
+                                    jsonStruct_t *pContext) {
+  json_lookup_t json;
+  char id[SCHEDULE_ID_MAX_LEN + 1];
+  char spec[SCHEDULE_SPEC_MAX_LEN + 1];
+
+  esp_err_t err = json_lookup_parse_tokens(&json, delta_tokens,
+                                           SCHEDULE_DELTA_TOKENS, pJsonString,
+                                           JsonStringDataLen);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Invalid schedules delta: %s", esp_err_to_name(err));
+    return;
+  }
+
+  int key = JSON_LOOKUP_ROOT + 1;
+  for (int i = 0; i < json.tokens[JSON_LOOKUP_ROOT].size && key + 1 < json.count;
+       i++) {
+    id[0] = '\0';
+    err = json_lookup_string(&json, key, id, sizeof(id));
+    if (err == ESP_OK) {
+      err = json_lookup_string(&json, key + 1, spec, sizeof(spec));
+    }
+    if (err == ESP_OK) {
+      err = schedule_store(id, spec);
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Schedule %.*s rejected: %s",
+               json.tokens[key].end - json.tokens[key].start,
+               json.json + json.tokens[key].start, esp_err_to_name(err));
+    }
+    /* An id that isnt valid cant be named back to the cloud */
+    if (schedule_valid_id(id)) {
+      schedule_note_reject(id, err);
+    }
+    key = json_lookup_skip(&json, key + 1);
+  }
+  schedule_save();
+}
+
+/**
+ * @brief Report ack. Entries the cloud did not take are reported again,
+ * unless it rejected them outright.
+ */
+static void schedule_report_status(const char *pThingName,
+                                   ShadowActions_t action,
+                                   Shadow_Ack_Status_t status,
+                                   const char *pReceivedJsonDocument,
+                                   void *pContextData) {
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  for (int i = 0; i < CONFIG_SCHEDULE_MAX_ENTRIES; i++) {
+    schedule_entry_t *entry = &entries[i];
+    if (!entry->inflight) {
+      continue;
+    }
+    entry->inflight = false;
+    if (status == SHADOW_ACK_TIMEOUT) {
+      entry->report = true;
+      report_pending = true;
+    } else if (!entry->report && entry->record.spec[0] == '\0') {
+      entry->used = false;
+    }
+  }
+  for (int i = 0; i < SCHEDULE_MAX_REJECTS; i++) {
+    schedule_reject_t *reject = &rejects[i];
+    if (!reject->inflight) {
+      continue;
+    }
+    reject->inflight = false;
+    if (status == SHADOW_ACK_TIMEOUT) {
+      reject->report = true;
+      reject_pending = true;
+    } else if (!reject->report && reject->reason == NULL) {
+      reject->id[0] = '\0';
+    }
+  }
+  report_in_progress = false;
+  xSemaphoreGive(schedule_lock);
+
+  if (status == SHADOW_ACK_REJECTED) {
+    ESP_LOGE(TAG, "Schedules report rejected");
+  } else if (status == SHADOW_ACK_TIMEOUT) {
+    ESP_LOGE(TAG, "Schedules report timed out");
+  }
+  if (report_pending || reject_pending) {
+    cloud_connection_notify(CLOUD_EVENT_LOCAL_CHANGE);
+  }
+}
+
+/**
+ * @brief Builds {"state":{"reported":{"schedules":{...}}}} from the entries
+ * waiting to be reported, as many as fit in one document.
+ * @retval number of entries in the document
+ */
+static int schedule_build_report(void) {
+  size_t size = sizeof(report_document) - SCHEDULE_REPORT_TAIL_LEN;
+  int count = 0;
+
+  if (aws_iot_shadow_init_json_document(report_document, size) != SUCCESS) {
+    return 0;
+  }
+  size_t len = strlen(report_document);
+  len += snprintf(report_document + len, size - len,
+                  "\"reported\":{\"" SCHEDULE_SHADOW_KEY "\":{");
+
+  report_pending = false;
+  for (int i = 0; i < CONFIG_SCHEDULE_MAX_ENTRIES; i++) {
+    schedule_entry_t *entry = &entries[i];
+    if (!entry->report) {
+      continue;
+    }
+    int n = snprintf(report_document + len, size - len, "%s\"%s\":\"%s\"",
+                     count == 0 ? "" : ",", entry->record.id,
+                     entry->record.spec);
+    if (n < 0 || (size_t)n >= size - len) {
+      report_document[len] = '\0';
+      report_pending = true;
+      break;
+    }
+    len += n;
+    entry->report = false;
+    entry->inflight = true;
+    count++;
+  }
+
+  snprintf(report_document + len, sizeof(report_document) - len, "}}");
+  if (aws_iot_finalize_json_document(report_document,
+                                     sizeof(report_document)) != SUCCESS) {
+    return 0;
+  }
+  return count;
+}
+
+/**
+ * @brief Builds {"state":{"desired":{"schedules":{"bad":null}},
+ * "reported":{"schedule_errors":{"bad":"ESP_ERR_INVALID_ARG"}}}} from the
+ * rejects waiting to be reported. A cleared error is reported as null and
+ * leaves desired alone.
+ * @retval number of rejects in the document
+ */
+static int schedule_build_reject_report(void) {
+  schedule_reject_t *batch[SCHEDULE_REJECTS_PER_REPORT];
+  size_t size = sizeof(report_document) - SCHEDULE_REPORT_TAIL_LEN;
+  int count = 0;
+  int rejected = 0;
+
+  reject_pending = false;
+  for (int i = 0; i < SCHEDULE_MAX_REJECTS; i++) {
+    if (!rejects[i].report) {
+      continue;
+    }
+    if (count == SCHEDULE_REJECTS_PER_REPORT) {
+      reject_pending = true;
+      break;
+    }
+    rejected += rejects[i].reason != NULL;
+    batch[count++] = &rejects[i];
+  }
+  if (count == 0 ||
+      aws_iot_shadow_init_json_document(report_document, size) != SUCCESS) {
+    return 0;
+  }
+
+  size_t len = strlen(report_document);
+  if (rejected > 0) {
+    len += snprintf(report_document + len, size - len,
+                    "\"desired\":{\"" SCHEDULE_SHADOW_KEY "\":{");
+    for (int i = 0, n = 0; i < count; i++) {
+      if (batch[i]->reason != NULL) {
+        len += snprintf(report_document + len, size - len, "%s\"%s\":null",
+                        n++ == 0 ? "" : ",", batch[i]->id);
+      }
+    }
+    len += snprintf(report_document + len, size - len, "}},");
+  }
+  len += snprintf(report_document + len, size - len,
+                  "\"reported\":{\"" SCHEDULE_ERRORS_KEY "\":{");
+  for (int i = 0; i < count; i++) {
+    if (batch[i]->reason != NULL) {
+      len += snprintf(report_document + len, size - len, "%s\"%s\":\"%s\"",
+                      i == 0 ? "" : ",", batch[i]->id, batch[i]->reason);
+    } else {
+      len += snprintf(report_document + len, size - len, "%s\"%s\":null",
+                      i == 0 ? "" : ",", batch[i]->id);
+    }
+    batch[i]->report = false;
+    batch[i]->inflight = true;
+  }
+
+  snprintf(report_document + len, sizeof(report_document) - len, "}}");
+  if (aws_iot_finalize_json_document(report_document,
+                                     sizeof(report_document)) != SUCCESS) {
+    return 0;
+  }
+  return count;
+}
+
+/**
+ * @brief Registers the schedules delta once the shared connection is up.
+ */
+static IoT_Error_t schedule_connected(AWS_IoT_Client *mqttClient) {
+  schedule_handler.cb = schedule_delta_callback;
+  schedule_handler.pKey = SCHEDULE_SHADOW_KEY;
+  schedule_handler.pData = NULL;
+  schedule_handler.dataLength = 0;
+  schedule_handler.type = SHADOW_JSON_OBJECT;
+
+  IoT_Error_t rc = aws_iot_shadow_register_delta(mqttClient, &schedule_handler);
+  if (SUCCESS != rc) {
+    ESP_LOGE(TAG, "Shadow Register Schedules Delta Error %d", rc);
+  }
+  return rc;
+}
+
+/**
+ * @brief Reports applied entries, and rejected ones first, one document at
+ * a time, so the cloud stops sending their delta.
+ */
+static IoT_Error_t schedule_run(AWS_IoT_Client *mqttClient, uint32_t events,
+                                bool reconnecting) {
+  if (reconnecting || report_in_progress ||
+      (!report_pending && !reject_pending)) {
+    return SUCCESS;
+  }
+
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  int count = reject_pending ? schedule_build_reject_report() : 0;
+  if (count == 0 && report_pending) {
+    count = schedule_build_report();
+  }
+  xSemaphoreGive(schedule_lock);
+  if (count == 0) {
+    ESP_LOGE(TAG, "Schedules report does not fit");
+    return SUCCESS;
+  }
+
+  ESP_LOGI(TAG, "Reporting %d schedules: %s", count, report_document);
+  report_in_progress = true;
+  IoT_Error_t rc = aws_iot_shadow_update(
+      mqttClient, (const char *)deviceid_txt_start, report_document,
+      schedule_report_status, NULL, 4, true);
+  if (SUCCESS != rc) {
+    /* Requeued for the next run; an error here would end the cloud loop */
+    ESP_LOGW(TAG, "Schedules report not sent %d", rc);
+    schedule_report_status(NULL, SHADOW_UPDATE, SHADOW_ACK_TIMEOUT, NULL,
+                           NULL);
+  }
+  return SUCCESS;
+}
+
+static bool schedule_awaiting_ack(void) { return report_in_progress; }
+
+static const cloud_service_t schedule_service = {
+    .name = "schedule",
+    .connected = schedule_connected,
+    .run = schedule_run,
+    .awaiting_ack = schedule_awaiting_ack,
+};
+
+/**
+ * @brief Starts the local scheduler: loads the stored entries, starts SNTP
+ * for the cron rules and registers the shadow side with the cloud
+ * connection. Needs NVS and the network stack.
+ * @retval
+ *  - ESP_OK: succeed
+ *  - ESP_FAIL: failed
+ */
+int schedule_start(void) {
+  const esp_timer_create_args_t timer_args = {
+      .callback = schedule_tick,
+      .name = "schedule",
+  };
+
+  schedule_lock = xSemaphoreCreateMutex();
+  if (schedule_lock == NULL ||
+      esp_timer_create(&timer_args, &wheel_timer) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt create the schedule timer\n");
+    return ESP_FAIL;
+  }
+  for (int i = 0; i < SCHEDULE_WHEEL_SLOTS; i++) {
+    wheel[i] = SCHEDULE_NIL;
+  }
+
+  schedule_load();
+  xSemaphoreTake(schedule_lock, portMAX_DELAY);
+  for (uint16_t i = 0; i < CONFIG_SCHEDULE_MAX_ENTRIES; i++) {
+    if (entries[i].used) {
+      schedule_arm(i);
+    }
+  }
+  xSemaphoreGive(schedule_lock);
+
+  if (app_driver_register_change_cb(schedule_outlets_changed) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the relay change listener\n");
+    return ESP_FAIL;
+  }
+
+  /* Cron rules run on local time */
+  setenv("TZ", CONFIG_SCHEDULE_TIMEZONE, 1);
+  tzset();
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+  esp_sntp_setoperatingmode(ESP_SNTP_OPMODE_POLL);
+  esp_sntp_setservername(0, CONFIG_SCHEDULE_SNTP_SERVER);
+  sntp_set_time_sync_notification_cb(schedule_time_synced);
+  esp_sntp_init();
+#else
+  sntp_setoperatingmode(SNTP_OPMODE_POLL);
+  sntp_setservername(0, CONFIG_SCHEDULE_SNTP_SERVER);
+  sntp_set_time_sync_notification_cb(schedule_time_synced);
+  sntp_init();
+#endif
+
+  if (cloud_connection_register_service(&schedule_service) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the schedule service\n");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "esp_err.h"
+
+/* Longest schedule id (its key in the shadow) and rule, without the NUL */
+#define SCHEDULE_ID_MAX_LEN 7
+#define SCHEDULE_SPEC_MAX_LEN 31
+
+esp_err_t schedule_set(const char *id, const char *spec);
+int schedule_start(void);
@@ -7,63 +7,23 @@
  ******************************************************************************
  */
 /* Header Files */
-#include <ctype.h>
-#include <limits.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
-#include "driver/sdmmc_host.h"
-#include "esp_event.h"
 #include "esp_log.h"
 #include "esp_system.h"
-#include "esp_vfs_fat.h"
-#include "esp_wifi.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/event_groups.h"
-#include "freertos/task.h"
 
-#include "nvs.h"
-#include "nvs_flash.h"
-
-#include "aws_iot_config.h"
-#include "aws_iot_log.h"
 #include "aws_iot_mqtt_client_interface.h"
-#include "aws_iot_version.h"
 
-#include "cJSON.h"
+#include "cloud_connection.h"
+#include "json_lookup.h"
 #include "sub_pub_ota.h"
 #define TAG "subpub"
 
-char *ota_url;
-static bool ota_update_done = false;
+static char ota_url[OTA_URL_MAX_LEN];
 
-/**
- * @brief Device cert and private key
- */
-extern const uint8_t
-    certificate_pem_crt_start[] asm("_binary_device_cert_start");
-extern const uint8_t certificate_pem_crt_end[] asm("_binary_device_cert_end");
-extern const uint8_t private_pem_key_start[] asm("_binary_device_key_start");
-extern const uint8_t private_pem_key_end[] asm("_binary_device_key_end");
-
-/**
- * @brief Root Certificate
- */
-extern const uint8_t aws_root_ca_pem_start[] asm("_binary_server_cert_start");
-extern const uint8_t aws_root_ca_pem_end[] asm("_binary_server_cert_end");
-
-/**
- * @brief AWS IoT Endpoint specific to account and region
- */
-extern const uint8_t endpoint_txt_start[] asm("_binary_endpoint_txt_start");
-extern const uint8_t endpoint_txt_end[] asm("_binary_endpoint_txt_end");
-
-/**
- * @brief Define default AWS MQTT port
- */
-uint32_t port = AWS_IOT_MQTT_PORT;
+/* Topic the firmware URL is published on */
+static const char ota_topic[] = "iotDevice/ota";
 
 int getMessage(char *mPayload, int len);
 
@@ -78,200 +38,58 @@ void iot_subscribe_callback_handler(AWS_IoT_Client *pClient, char *topicName,
   int len = (int)params->payloadLen;
   ESP_LOGI(TAG, "%.*s\t%.*s", topicNameLen, topicName, (int)params->payloadLen,
            (char *)params->payload);
-  /* Get and parses cJSON payload and OTA firmware upgrades */
+  /* Get and parses JSON payload and OTA firmware upgrades */
   getMessage((char *)params->payload, (int)params->payloadLen);
 }
 
 /**
- * @brief Disconnect Callback Handler. It tries to reconnect afetr a disconnection. 
- */
-void disconnectCallbackHandler(AWS_IoT_Client *pClient, void *data) {
-  ESP_LOGW(TAG, "MQTT Disconnect");
-  IoT_Error_t rc = FAILURE;
-
-  if (NULL == pClient) {
-    return;
-  }
-
-  /* Attempt to reconnect*/
-  if (aws_iot_is_autoreconnect_enabled(pClient)) {
-    ESP_LOGI(TAG,
-             "Auto Reconnect is enabled, Reconnecting attempt will start now");
-  } else {
-    ESP_LOGW(TAG, "Auto Reconnect not enabled. Starting manual reconnect...");
-    rc = aws_iot_mqtt_attempt_reconnect(pClient);
-    if (NETWORK_RECONNECTED == rc) {
-      ESP_LOGW(TAG, "Manual Reconnect Successful");
-    } else {
-      ESP_LOGW(TAG, "Manual Reconnect Failed - %d", rc);
-    }
-  }
-}
-
-/**
- * @brief Task handles MQTT initialization, subscribes to a MQTT topic to receive url for OTA.
- */
-static void aws_sub_pub_task(void *param) {
-
-  IoT_Error_t rc = FAILURE;
-
-  /* Initialize MQTT parameter */
-  AWS_IoT_Client client;
-  IoT_Client_Init_Params mqttInitParams = iotClientInitParamsDefault;
-  ESP_LOGI(TAG, "AWS IoT SDK Version %d.%d.%d-%s", VERSION_MAJOR, VERSION_MINOR,
-           VERSION_PATCH, VERSION_TAG);
-  mqttInitParams.enableAutoReconnect = false; // We enable this later below
-  mqttInitParams.pHostURL = (char *)endpoint_txt_start;
-  mqttInitParams.port = port;
-  mqttInitParams.pRootCALocation = (const char *)aws_root_ca_pem_start;
-  mqttInitParams.pDeviceCertLocation = (const char *)certificate_pem_crt_start;
-  mqttInitParams.pDevicePrivateKeyLocation =
-      (const char *)private_pem_key_start;
-  mqttInitParams.mqttCommandTimeout_ms = 20000;
-  mqttInitParams.tlsHandshakeTimeout_ms = 5000;
-  mqttInitParams.isSSLHostnameVerify = true;
-  mqttInitParams.disconnectHandler = disconnectCallbackHandler;
-  mqttInitParams.disconnectHandlerData = NULL;
-
-  /* Intialize MQTT */
-  rc = aws_iot_mqtt_init(&client, &mqttInitParams);
-  if (SUCCESS != rc) {
-    ESP_LOGE(TAG, "aws_iot_mqtt_init returned error : %d ", rc);
-    abort();
-  }
-
-  /* Wait for WiFI to show as connected */
-  //   xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT,
-  //                       false, true, portMAX_DELAY);
-
-  /* Initialize connect parameters */
-  const char *CONFIG_AWS_CLIENT_ID = "ota";
-  IoT_Client_Connect_Params connectParams = iotClientConnectParamsDefault;
-  connectParams.keepAliveIntervalInSec = 10;
-  connectParams.isCleanSession = true;
-  connectParams.MQTTVersion = MQTT_3_1_1;
-  /* Client ID is set in the menuconfig of the example */
-  connectParams.pClientID = CONFIG_AWS_CLIENT_ID;
-  connectParams.clientIDLen = (uint16_t)strlen(CONFIG_AWS_CLIENT_ID);
-  connectParams.isWillMsgPresent = false;
-
-  /* Connect to AWS IOT Core via MQTT */
-  ESP_LOGI(TAG, "Connecting to AWS...");
-  do {
-    rc = aws_iot_mqtt_connect(&client, &connectParams);
-    if (SUCCESS != rc) {
-      ESP_LOGE(TAG, "Error(%d) connecting to %s:%d", rc,
-               mqttInitParams.pHostURL, mqttInitParams.port);
-      vTaskDelay(1000 / portTICK_RATE_MS);
-    }
-  } while (SUCCESS != rc);
-
-  /*
-     Enbable autoreconnect if a disconnection happens
-   * Enable Auto Reconnect functionality. Minimum and Maximum time of
-   Exponential backoff are set in aws_iot_config.h
-   *  #AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL
-   *  #AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL
-   */
-
-  rc = aws_iot_mqtt_autoreconnect_set_status(&client, true);
-  if (SUCCESS != rc) {
-    ESP_LOGE(TAG, "Unable to set Auto Reconnect to true - %d", rc);
-    abort();
-  }
-
-  /* MQTT subscribe and registered MQTT subscribe handler */
-  const char *TOPIC = "iotDevice/ota";
-  const int TOPIC_LEN = strlen(TOPIC);
-
-  ESP_LOGI(TAG, "Subscribing...");
-  rc = aws_iot_mqtt_subscribe(&client, TOPIC, TOPIC_LEN, QOS0,
-                              iot_subscribe_callback_handler, NULL);
-  if (SUCCESS != rc) {
-    ESP_LOGE(TAG, "Error subscribing : %d ", rc);
-    abort();
-  }
-
-  while ((NETWORK_ATTEMPTING_RECONNECT == rc || NETWORK_RECONNECTED == rc ||
-          SUCCESS == rc))
-    {
-    /* Max time the yield function will wait for read messages */
-    rc = aws_iot_mqtt_yield(&client, 100);
-    if (NETWORK_ATTEMPTING_RECONNECT == rc) {
-      /**
-       *  If the client is attempting to reconnect we will skip the rest of the loop.
-       */ 
-      continue;
-    }
-    vTaskDelay(1000);
-  }
-  ESP_LOGE(TAG, "An error occurred in the main loop.");
-  abort();
-}
-
-/**
- * @brief This functions handles parsing cJSON payloads and OTA firmware upgrades. 
+ * @brief This functions handles parsing JSON payloads and starts OTA firmware
+ * upgrades. The download runs on the OTA task, this only hands it the URL.
  * @param [IN] Payload message
  * @param [IN] Length of payload
- * @retval Returns status of cJSON payload and OTA firmware upgrades. -1 for cJSON NULL and 0 for success 
+ * @retval Returns status of JSON payload and OTA firmware upgrades. -1 for an invalid payload and 0 for success 
  */
 int getMessage(char *mPayload, int len)
 {
-    cJSON *url = NULL;
-    /* Parse cJSON payload */
-    cJSON *json = cJSON_ParseWithLength(mPayload, len);
-    int status = 0;
+    json_lookup_t json;
 
-    if (json == NULL)
+    /* Tokenize the payload in place, nothing is allocated */
+    esp_err_t err = json_lookup_parse(&json, mPayload, (size_t)len);
+    if (err != ESP_OK)
     {
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr != NULL)
-        {
-            fprintf(stderr, "Error before: %s\n", error_ptr);
-        }
-        status = -1;
-        goto end;
+        ESP_LOGE(TAG, "Invalid JSON payload: %s", esp_err_to_name(err));
+        return -1;
     }
-    url = cJSON_GetObjectItemCaseSensitive(json, "ota_url");
-    if (!cJSON_IsString(url) && (url->valuestring == NULL))
-    {
-        status = -1;
-        goto end;
-    }
-
-    ota_url = url->valuestring;
 
-    /* Begin firmware upgrade */
-    if (do_firmware_upgrade(ota_url) == ESP_OK)
+    int url = json_lookup_find(&json, JSON_LOOKUP_ROOT, "ota_url");
+    if (json_lookup_string(&json, url, ota_url, sizeof(ota_url)) != ESP_OK)
     {
-        /* Firmware upgrade successful */
-        ota_update_done = true;
+        return -1;
     }
 
-    if (ota_update_done)
+    /* Begin firmware upgrade */
+    err = ota_request(ota_url);
+    if (err != ESP_OK)
     {
-        /* Restart after sucessful firmware download */
-        esp_restart();
+        ESP_LOGE(TAG, "Couldnt start the upgrade: %s", esp_err_to_name(err));
+        return -1;
     }
 
-end:
-    cJSON_Delete(json);
-    return status;
+    return 0;
 }
 
 /**
- * @brief This function handles the creation of aws publish subscribe task. 
+ * @brief Subscribes the OTA topic on the shared cloud connection and starts
+ * the OTA task.
  * @retval 
  *  - ESP_OK: succeed 
  *  - ESP_FAIL: failed  
  */
 int ota_start(void) {
-  /* Task Creation */
-  BaseType_t cloud_begin =
-      xTaskCreate(&aws_sub_pub_task, "aws_sub_pub_task", 9216, NULL, 5, NULL);
-  if (cloud_begin != pdPASS) {
-    ESP_LOGE(TAG, "Couldnt create a cloud task\n");
+  if (cloud_connection_subscribe(ota_topic, iot_subscribe_callback_handler,
+                                 NULL) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldnt register the OTA topic\n");
     return ESP_FAIL;
   }
-  return ESP_OK;
-}
\ No newline at end of file
+  return ota_task_start();
+}
@@ -1,4 +1,11 @@
 #pragma once
 
+#include "esp_err.h"
+
+/* Longest firmware URL accepted on the OTA topic */
+#define OTA_URL_MAX_LEN 256
+
 int ota_start(void);
-esp_err_t do_firmware_upgrade(const char *url);
\ No newline at end of file
+int ota_task_start(void);
+esp_err_t ota_request(const char *url);
+esp_err_t do_firmware_upgrade(const char *url);
@@ -7,6 +7,7 @@
  ******************************************************************************
  */
 /* Header Files */
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
@@ -14,16 +15,146 @@
 #include "esp_netif.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/event_groups.h"
+#include "nvs.h"
 
 #include "output_driver.h"
 
 #define TAG "WIFI"
 
+/* Last access point that gave us an IP, for the next boot */
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_AP_KEY "last_ap"
+
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_ap_cache_t;
+
 esp_netif_t *esp_netif;
 static EventGroupHandle_t wifi_events;
 const uint32_t gotIP = BIT0;
 
+/* Station configuration, changed by the event handler on a fallback scan */
+static wifi_config_t sta_config;
+/* Set from association until the next disconnect */
+static bool sta_associated;
+#if CONFIG_WIFI_FAST_CONNECT
+static atomic_flag ap_remembered = ATOMIC_FLAG_INIT;
+#endif
+
+/**
+ * @brief Lets the driver pick the strongest AP with the SSID on any channel.
+ */
+static void wifi_full_scan_config(wifi_config_t *config)
+{
+    config->sta.bssid_set = false;
+    config->sta.channel = 0;
+    config->sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    config->sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+}
+
+#if CONFIG_WIFI_FAST_CONNECT
+/**
+ * @brief Points the configuration at the AP of the last connection, so the
+ * driver probes a single channel for a single BSSID instead of scanning.
+ * @retval true if an AP with the configured SSID was cached
+ */
+static bool wifi_cache_load(wifi_config_t *config)
+{
+    nvs_handle_t nvs;
+    wifi_ap_cache_t cache;
+    size_t len = sizeof(cache);
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    esp_err_t err = nvs_get_blob(nvs, WIFI_NVS_AP_KEY, &cache, &len);
+    nvs_close(nvs);
+
+    if (err != ESP_OK || len != sizeof(cache) || cache.channel == 0 ||
+        memcmp(cache.ssid, config->sta.ssid, sizeof(cache.ssid)) != 0) {
+        return false;
+    }
+
+    config->sta.bssid_set = true;
+    memcpy(config->sta.bssid, cache.bssid, sizeof(cache.bssid));
+    config->sta.channel = cache.channel;
+    config->sta.scan_method = WIFI_FAST_SCAN;
+    ESP_LOGI(TAG, "Reconnecting to %02x:%02x:%02x:%02x:%02x:%02x on channel %d",
+             cache.bssid[0], cache.bssid[1], cache.bssid[2], cache.bssid[3],
+             cache.bssid[4], cache.bssid[5], cache.channel);
+    return true;
+}
+
+/**
+ * @brief Remembers the AP we are associated with. Only written when it
+ * changed, so a normal boot costs no flash write.
+ */
+static void wifi_cache_store(void)
+{
+    wifi_ap_record_t ap;
+    wifi_ap_cache_t cache, stored;
+    size_t len = sizeof(stored);
+    nvs_handle_t nvs;
+
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+    memset(&cache, 0, sizeof(cache));
+    memcpy(cache.ssid, sta_config.sta.ssid, sizeof(cache.ssid));
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    cache.channel = ap.primary;
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Couldnt open NVS to remember the AP\n");
+        return;
+    }
+    if (nvs_get_blob(nvs, WIFI_NVS_AP_KEY, &stored, &len) != ESP_OK ||
+        len != sizeof(stored) || memcmp(&stored, &cache, sizeof(cache)) != 0) {
+        if (nvs_set_blob(nvs, WIFI_NVS_AP_KEY, &cache, sizeof(cache)) != ESP_OK ||
+            nvs_commit(nvs) != ESP_OK) {
+            ESP_LOGE(TAG, "Couldnt remember the AP\n");
+        }
+    }
+    nvs_close(nvs);
+}
+#endif
+
+#if CONFIG_WIFI_STATIC_IP
+/**
+ * @brief Replaces DHCP with the configured address, so GOT_IP follows
+ * association at once.
+ */
+static esp_err_t wifi_static_ip(esp_netif_t *netif)
+{
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns;
+
+    memset(&ip_info, 0, sizeof(ip_info));
+    memset(&dns, 0, sizeof(dns));
+    if (esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_IP_ADDR, &ip_info.ip) != ESP_OK ||
+        esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_NETMASK, &ip_info.netmask) != ESP_OK ||
+        esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_GATEWAY, &ip_info.gw) != ESP_OK ||
+        esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_DNS, &dns.ip.u_addr.ip4) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+
+    esp_err_t err = esp_netif_dhcpc_stop(netif);
+    if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED) {
+        return err;
+    }
+    err = esp_netif_set_ip_info(netif, &ip_info);
+    if (err == ESP_OK) {
+        err = esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns);
+    }
+    return err;
+}
+#endif
+
 /**
  * @brief This event handles various WiFi and IP events.
  * @param [IN] event_handler_arg: pointer to user defined argument.
@@ -42,17 +173,27 @@ void event_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t
 
     case WIFI_EVENT_STA_CONNECTED:
         ESP_LOGI(TAG, "CONNECTED");
+        sta_associated = true;
         wifi_status(1);
         break;
 
     case WIFI_EVENT_STA_DISCONNECTED:
-        ESP_LOGI(TAG, "DISCONNECTED");
+        ESP_LOGI(TAG, "DISCONNECTED (reason %d)",
+                 ((wifi_event_sta_disconnected_t *)event_data)->reason);
         wifi_status(0);
+        /* Never got to the cached AP: it moved or is gone, so scan for it */
+        if (!sta_associated && sta_config.sta.bssid_set) {
+            ESP_LOGW(TAG, "Cached AP not found, scanning all channels");
+            wifi_full_scan_config(&sta_config);
+            esp_wifi_set_config(ESP_IF_WIFI_STA, &sta_config);
+        }
+        sta_associated = false;
         esp_wifi_connect();
         break;
 
     case IP_EVENT_STA_GOT_IP:
-        ESP_LOGI(TAG, "IP OBTAINED");
+        ESP_LOGI(TAG, "IP OBTAINED %lld ms after boot",
+                 (long long)(esp_timer_get_time() / 1000));
  
         xEventGroupSetBits(wifi_events, gotIP);
         break;
@@ -85,10 +226,14 @@ void wifi_drivers(void)
 }
 
 /** 
- * @brief Setting and connecting up WiFi mode as a station and connecting using ssid and passwd.
+ * @brief Setting up WiFi mode as a station and starting to connect using ssid and passwd.
+ * With CONFIG_WIFI_FAST_CONNECT the AP of the last connection is tried first
+ * on its own channel, falling back to a full scan; lwIP asks the DHCP server
+ * for the previous lease straight away (LWIP_DHCP_RESTORE_LAST_IP) unless a
+ * static IP is configured. Returns without waiting, see wifi_sta_wait_ip().
  * @retval ESP_OK or ESP_FAIL 
 */
-esp_err_t wifi_sta_connect(const char *ssid, const char *password)
+esp_err_t wifi_sta_begin(const char *ssid, const char *password)
 {
     /* Create an event group to manage WiFi events*/
     wifi_events = xEventGroupCreate();
@@ -100,28 +245,65 @@ esp_err_t wifi_sta_connect(const char *ssid, const char *password)
     esp_netif = esp_netif_create_default_wifi_sta();
     if (esp_netif == NULL){
         vEventGroupDelete(wifi_events);
+        wifi_events = NULL;
         return ESP_FAIL;
     }
 
+#if CONFIG_WIFI_STATIC_IP
+    if (wifi_static_ip(esp_netif) != ESP_OK) {
+        ESP_LOGE(TAG, "Couldnt set the static IP, using DHCP\n");
+        esp_netif_dhcpc_start(esp_netif);
+    }
+#endif
+
     /* Initialize WiFi configuration structure */
-    wifi_config_t wifi_config;
-    memset(&wifi_config, 0, sizeof(wifi_config_t));
-    strncpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid) - 1);
-    strncpy((char *)wifi_config.sta.password, password, sizeof(wifi_config.sta.password) - 1);
+    memset(&sta_config, 0, sizeof(wifi_config_t));
+    strncpy((char *)sta_config.sta.ssid, ssid, sizeof(sta_config.sta.ssid) - 1);
+    strncpy((char *)sta_config.sta.password, password, sizeof(sta_config.sta.password) - 1);
+
+    bool cached = false;
+#if CONFIG_WIFI_FAST_CONNECT
+    cached = wifi_cache_load(&sta_config);
+#endif
+    if (!cached) {
+        wifi_full_scan_config(&sta_config);
+    }
     
     /* Set WiFi mode to a station */
     esp_wifi_set_mode(WIFI_MODE_STA);
-    esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &sta_config);
 
     /* Start WiFi */
     esp_wifi_start();
+    return ESP_OK;
+}
+
+/**
+ * @brief Waits for the station to obtain an IP. The first time it does, the
+ * AP is remembered for the next boot. Safe to call from several tasks.
+ * @param [IN] timeout_ms: how long to wait
+ * @retval
+ *  - ESP_OK: the station has an IP
+ *  - ESP_ERR_TIMEOUT: not yet, the driver keeps trying
+ *  - ESP_ERR_INVALID_STATE: wifi_sta_begin() didnt run
+ */
+esp_err_t wifi_sta_wait_ip(uint32_t timeout_ms)
+{
+    if (wifi_events == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
 
     /* Wait for connection event */
-    EventBits_t event_results = xEventGroupWaitBits(wifi_events, gotIP, pdFALSE, pdTRUE, 2000 / portTICK_PERIOD_MS);
-    if (event_results == 0)
+    EventBits_t event_results = xEventGroupWaitBits(wifi_events, gotIP, pdFALSE, pdTRUE, timeout_ms / portTICK_PERIOD_MS);
+    if ((event_results & gotIP) == 0)
     {
-        return ESP_OK;
-    } else {
-        return ESP_FAIL;
+        return ESP_ERR_TIMEOUT;
     }
-}
\ No newline at end of file
+
+#if CONFIG_WIFI_FAST_CONNECT
+    if (!atomic_flag_test_and_set(&ap_remembered)) {
+        wifi_cache_store();
+    }
+#endif
+    return ESP_OK;
+}
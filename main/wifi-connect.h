@@ -1,5 +1,12 @@
 #pragma once 
+#include <stdint.h>
+
 #include "esp_err.h"
+#include "esp_netif.h"
+
+/* Default station interface, set by wifi_sta_begin() */
+extern esp_netif_t *esp_netif;
 
 void wifi_drivers(void);
-esp_err_t wifi_sta_connect(const char* ssid, const char* password);
\ No newline at end of file
+esp_err_t wifi_sta_begin(const char* ssid, const char* password);
+esp_err_t wifi_sta_wait_ip(uint32_t timeout_ms);